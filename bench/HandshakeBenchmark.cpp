@@ -0,0 +1,195 @@
+// TLS handshake load against a running proxy: how many full handshakes per
+// second it completes, and what a burst of them does to the request latency
+// of connections that are already established.
+//
+//   HandshakeBenchmark <host> <port> <server-name> [established] [handshake-threads] [seconds]
+//
+// The established connections send keep-alive GETs back to back throughout.
+// Their latency is measured twice: alone, then while the handshake threads
+// open new connections (full handshakes, no session resumption) as fast as
+// they can.
+#include <boost/asio/connect.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/ssl.hpp>
+#include <openssl/ssl.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace net = boost::asio;
+namespace ssl = net::ssl;
+using tcp = net::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Target {
+    std::string host;
+    std::string port;
+    std::string server_name;
+};
+
+using TlsStream = beast::ssl_stream<beast::tcp_stream>;
+
+// Connect and complete a full handshake
+bool open_connection(const tcp::resolver::results_type& endpoints, const Target& target, TlsStream& stream) {
+    beast::error_code ec;
+    beast::get_lowest_layer(stream).connect(endpoints, ec);
+    if (ec) {
+        return false;
+    }
+    SSL_set_tlsext_host_name(stream.native_handle(), target.server_name.c_str());
+    stream.handshake(ssl::stream_base::client, ec);
+    return !ec;
+}
+
+// Keep-alive GETs on one connection until stop; latencies (us) go to samples
+void run_established(const Target& target, const std::atomic<bool>& stop, const std::atomic<bool>& recording,
+                     std::vector<double>& samples, std::mutex& samples_mutex) {
+    net::io_context ioc;
+    ssl::context ctx(ssl::context::tls_client);
+    ctx.set_verify_mode(ssl::verify_none);
+    auto endpoints = tcp::resolver(ioc).resolve(target.host, target.port);
+
+    auto stream = std::make_unique<TlsStream>(ioc, ctx);
+    if (!open_connection(endpoints, target, *stream)) {
+        std::cerr << "Failed to open an established connection" << std::endl;
+        return;
+    }
+
+    http::request<http::empty_body> req{http::verb::get, "/", 11};
+    req.set(http::field::host, target.server_name);
+    beast::flat_buffer buffer;
+    std::vector<double> local;
+    while (!stop.load(std::memory_order_relaxed)) {
+        // The proxy closes a connection after max_requests_per_connection
+        if (!stream) {
+            stream = std::make_unique<TlsStream>(ioc, ctx);
+            buffer.clear();
+            if (!open_connection(endpoints, target, *stream)) {
+                std::cerr << "Failed to reopen an established connection" << std::endl;
+                break;
+            }
+        }
+
+        auto started = Clock::now();
+        beast::error_code ec;
+        http::write(*stream, req, ec);
+        http::response<http::string_body> res;
+        if (!ec) {
+            http::read(*stream, buffer, res, ec);
+        }
+        if (ec) {
+            std::cerr << "Established connection failed: " << ec.message() << std::endl;
+            break;
+        }
+        if (recording.load(std::memory_order_relaxed)) {
+            local.push_back(std::chrono::duration<double, std::micro>(Clock::now() - started).count());
+        }
+        if (!res.keep_alive()) {
+            stream.reset();
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(samples_mutex);
+    samples.insert(samples.end(), local.begin(), local.end());
+}
+
+// New connections, one full handshake each, until stop
+void run_handshakes(const Target& target, const std::atomic<bool>& stop, std::atomic<std::uint64_t>& completed,
+                    std::atomic<std::uint64_t>& failed) {
+    net::io_context ioc;
+    ssl::context ctx(ssl::context::tls_client);
+    ctx.set_verify_mode(ssl::verify_none);
+    SSL_CTX_set_session_cache_mode(ctx.native_handle(), SSL_SESS_CACHE_OFF);
+    auto endpoints = tcp::resolver(ioc).resolve(target.host, target.port);
+
+    while (!stop.load(std::memory_order_relaxed)) {
+        TlsStream stream(ioc, ctx);
+        if (open_connection(endpoints, target, stream)) {
+            completed.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            failed.fetch_add(1, std::memory_order_relaxed);
+        }
+        beast::error_code ignored;
+        beast::get_lowest_layer(stream).socket().close(ignored);
+    }
+}
+
+double percentile(std::vector<double>& samples, double p) {
+    if (samples.empty()) {
+        return 0;
+    }
+    auto index = static_cast<std::size_t>(p * (samples.size() - 1));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+// Latency of the established connections over one phase, with
+// handshake_threads opening new connections alongside
+void run_phase(const Target& target, int established, int handshake_threads, int seconds) {
+    std::atomic<bool> stop{false};
+    std::atomic<bool> recording{false};
+    std::atomic<std::uint64_t> completed{0};
+    std::atomic<std::uint64_t> failed{0};
+    std::vector<double> samples;
+    std::mutex samples_mutex;
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < established; ++i) {
+        threads.emplace_back(run_established, std::cref(target), std::cref(stop), std::cref(recording),
+                             std::ref(samples), std::ref(samples_mutex));
+    }
+    for (int i = 0; i < handshake_threads; ++i) {
+        threads.emplace_back(run_handshakes, std::cref(target), std::cref(stop), std::ref(completed),
+                             std::ref(failed));
+    }
+
+    // Let connections open before measuring
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    std::uint64_t completed_before = completed.load();
+    recording = true;
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    recording = false;
+    std::uint64_t handshakes = completed.load() - completed_before;
+    stop = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    std::printf("%-22s handshakes/s %8.0f  failed %6llu  requests %8zu  p50 %8.0f us  p99 %8.0f us  max %8.0f us\n",
+                handshake_threads ? "with handshake load" : "established only",
+                static_cast<double>(handshakes) / seconds, static_cast<unsigned long long>(failed.load()),
+                samples.size(), percentile(samples, 0.50), percentile(samples, 0.99),
+                samples.empty() ? 0.0 : *std::max_element(samples.begin(), samples.end()));
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <host> <port> <server-name> [established=8] [handshake-threads=8] [seconds=5]" << std::endl;
+        return 1;
+    }
+    Target target{argv[1], argv[2], argv[3]};
+    int established = argc > 4 ? std::atoi(argv[4]) : 8;
+    int handshake_threads = argc > 5 ? std::atoi(argv[5]) : 8;
+    int seconds = argc > 6 ? std::atoi(argv[6]) : 5;
+
+    run_phase(target, established, 0, seconds);
+    run_phase(target, established, handshake_threads, seconds);
+    return 0;
+}
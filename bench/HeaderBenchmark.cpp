@@ -0,0 +1,204 @@
+// Request header path of an HTTP/1.1 exchange: parsing a browser-sized
+// request, rewriting it for the backend and serializing it again, with the
+// std::allocator fields the proxy used to have and the per-connection
+// HeaderArena it uses now; plus HPACK decoding and encoding for HTTP/2.
+//
+// Every benchmark reports allocs_per_iter from AllocationCounter. With the
+// arena, the steady state of a persistent connection (parse, rewrite,
+// serialize, reset) must stay at 0.
+#include "../src/AllocationCounter.h"
+#include "../src/HeaderArena.h"
+#include "../src/Hpack.h"
+#include "../src/ProxyHeaders.h"
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace net = boost::asio;
+
+namespace {
+
+constexpr std::string_view kRequest =
+    "GET /api/v1/items?page=2&sort=recent HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://www.example.com/items\r\n"
+    "Cookie: session=3f9a1c0e5b7d4e2a8c6b0f1e3d5a7c9b; theme=dark; consent=1\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "X-Forwarded-For: 198.51.100.23\r\n"
+    "\r\n";
+
+const ForwardedInfo kForwarded{"203.0.113.7", "https", "www.example.com"};
+
+// Allocations per iteration, measured over the whole run
+class AllocationScope {
+public:
+    explicit AllocationScope(benchmark::State& state) : state_(state), before_(thread_allocations()) {}
+    ~AllocationScope() {
+        auto allocations = thread_allocations() - before_;
+        state_.counters["allocs_per_iter"] = benchmark::Counter(
+            static_cast<double>(allocations.count), benchmark::Counter::kAvgIterations);
+    }
+
+private:
+    benchmark::State& state_;
+    AllocationStats before_;
+};
+
+template<class Parser>
+void parse(Parser& parser) {
+    beast::error_code ec;
+    parser.eager(true);
+    parser.put(net::buffer(kRequest.data(), kRequest.size()), ec);
+    if (ec || !parser.is_header_done()) {
+        std::abort();
+    }
+}
+
+// Walk the serialized header as async_write_header would, without a socket
+template<class Serializer>
+std::size_t serialize_header(Serializer& serializer) {
+    std::size_t bytes = 0;
+    beast::error_code ec;
+    serializer.split(true);
+    while (!serializer.is_header_done()) {
+        serializer.next(ec, [&](beast::error_code&, const auto& buffers) {
+            std::size_t size = net::buffer_size(buffers);
+            bytes += size;
+            serializer.consume(size);
+        });
+        if (ec) {
+            std::abort();
+        }
+    }
+    return bytes;
+}
+
+void BM_ParseRequest_StdAllocator(benchmark::State& state) {
+    AllocationScope allocations(state);
+    for (auto _ : state) {
+        http::request_parser<http::buffer_body> parser;
+        parse(parser);
+        benchmark::DoNotOptimize(parser.get().target().data());
+    }
+}
+
+void BM_ParseRequest_Arena(benchmark::State& state) {
+    HeaderArena arena;
+    std::optional<http::request_parser<http::buffer_body, ArenaAllocator<char>>> parser;
+    AllocationScope allocations(state);
+    for (auto _ : state) {
+        parser.reset();
+        arena.reset();
+        parser.emplace(std::piecewise_construct, std::make_tuple(), std::make_tuple(ArenaAllocator<char>(arena)));
+        parse(*parser);
+        benchmark::DoNotOptimize(parser->get().target().data());
+    }
+}
+
+// What ConnectionHandler does before async_write_header: parse, strip
+// hop-by-hop fields, add X-Forwarded-*, serialize
+void BM_ProxyRequestHeader_StdAllocator(benchmark::State& state) {
+    AllocationScope allocations(state);
+    for (auto _ : state) {
+        http::request_parser<http::buffer_body> parser;
+        parse(parser);
+        auto& req = parser.get();
+        prepare_upstream_request(req, kForwarded);
+        req.body().data = nullptr;
+        req.body().more = false;
+        http::request_serializer<http::buffer_body> serializer(req);
+        benchmark::DoNotOptimize(serialize_header(serializer));
+    }
+}
+
+void BM_ProxyRequestHeader_Arena(benchmark::State& state) {
+    HeaderArena arena;
+    std::optional<http::request_parser<http::buffer_body, ArenaAllocator<char>>> parser;
+    std::optional<http::request_serializer<http::buffer_body, http::basic_fields<ArenaAllocator<char>>>> serializer;
+    AllocationScope allocations(state);
+    for (auto _ : state) {
+        serializer.reset();
+        parser.reset();
+        arena.reset();
+        parser.emplace(std::piecewise_construct, std::make_tuple(), std::make_tuple(ArenaAllocator<char>(arena)));
+        parse(*parser);
+        auto& req = parser->get();
+        prepare_upstream_request(req, kForwarded);
+        req.body().data = nullptr;
+        req.body().more = false;
+        serializer.emplace(req);
+        benchmark::DoNotOptimize(serialize_header(*serializer));
+    }
+}
+
+// The same request as an HTTP/2 HEADERS block, after the first request on
+// the connection has filled the dynamic table
+std::string encode_request_block(HpackEncoder& encoder) {
+    std::string block;
+    encoder.encode(":method", "GET", block);
+    encoder.encode(":scheme", "https", block);
+    encoder.encode(":authority", "www.example.com", block);
+    encoder.encode(":path", "/api/v1/items?page=2&sort=recent", block);
+    encoder.encode("user-agent", "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+                                 "Chrome/120.0 Safari/537.36", block);
+    encoder.encode("accept", "text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,"
+                             "image/webp,*/*;q=0.8", block);
+    encoder.encode("accept-language", "en-US,en;q=0.9", block);
+    encoder.encode("accept-encoding", "gzip, deflate, br", block);
+    encoder.encode("referer", "https://www.example.com/items", block);
+    encoder.encode("cookie", "session=3f9a1c0e5b7d4e2a8c6b0f1e3d5a7c9b", block);
+    return block;
+}
+
+void BM_HpackDecode(benchmark::State& state) {
+    HpackEncoder encoder;
+    HpackDecoder decoder;
+    std::vector<HpackHeader> headers;
+    std::string first = encode_request_block(encoder);
+    decoder.decode(reinterpret_cast<const std::uint8_t*>(first.data()), first.size(), headers);
+    std::string block = encode_request_block(encoder);
+
+    AllocationScope allocations(state);
+    for (auto _ : state) {
+        headers.clear();
+        if (!decoder.decode(reinterpret_cast<const std::uint8_t*>(block.data()), block.size(), headers)) {
+            std::abort();
+        }
+        benchmark::DoNotOptimize(headers.data());
+    }
+}
+
+void BM_HpackEncodeResponse(benchmark::State& state) {
+    HpackEncoder encoder;
+    std::string block;
+    AllocationScope allocations(state);
+    for (auto _ : state) {
+        block.clear();
+        encoder.encode(":status", "200", block);
+        encoder.encode("content-type", "application/json", block);
+        encoder.encode("content-length", "1834", block);
+        encoder.encode("date", "Fri, 16 Oct 2026 12:00:00 GMT", block);
+        encoder.encode("server", "CppTestBackend", block);
+        encoder.encode("cache-control", "private, max-age=0", block);
+        benchmark::DoNotOptimize(block.data());
+    }
+}
+
+} // namespace
+
+BENCHMARK(BM_ParseRequest_StdAllocator);
+BENCHMARK(BM_ParseRequest_Arena);
+BENCHMARK(BM_ProxyRequestHeader_StdAllocator);
+BENCHMARK(BM_ProxyRequestHeader_Arena);
+BENCHMARK(BM_HpackDecode);
+BENCHMARK(BM_HpackEncodeResponse);
+
+BENCHMARK_MAIN();
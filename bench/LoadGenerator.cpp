@@ -0,0 +1,528 @@
+// HTTP load generator for bench/run_load.py: holds a fixed number of
+// connections open against the proxy, each sending requests back to back, and
+// prints one JSON object with the request rate and latency percentiles.
+//
+//   LoadGenerator --port <port> [--host 127.0.0.1] [--host-header bench.test]
+//                 [--path /] [--connections 100] [--threads N] [--duration 10]
+//                 [--warmup 2] [--keep-alive 1] [--tls 0] [--request-bytes 0]
+//                 [--sources 1]
+//
+// Latency is measured from the first byte of a request to the last byte of its
+// response; connecting (and the TLS handshake) is not included. Without
+// keep-alive every request opens a new connection, resuming the previous TLS
+// session like a browser would. --request-bytes sends a POST body of that
+// size. --sources spreads connections over 127.0.0.1...127.0.0.N so that more
+// than one source port range is available for 100k connections on loopback.
+#include <boost/asio/connect.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/ssl.hpp>
+#include <openssl/ssl.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace net = boost::asio;
+namespace ssl = net::ssl;
+using tcp = net::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+// Connections opening at once per thread, so a large sweep point doesn't
+// overflow the proxy's listen backlog with SYNs
+constexpr int kMaxConnecting = 256;
+
+constexpr std::chrono::seconds kIoTimeout{10};
+constexpr std::chrono::milliseconds kRetryDelay{100};
+
+// How long requests in flight at the end of a run may take to finish; closing
+// them mid-response would show up as client resets in the proxy's log
+constexpr std::chrono::seconds kDrainTimeout{5};
+
+struct Options {
+    std::string host = "127.0.0.1";
+    std::string port;
+    std::string host_header = "bench.test";
+    std::string path = "/";
+    int connections = 100;
+    int threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    int duration = 10;
+    int warmup = 2;
+    bool keep_alive = true;
+    bool tls = false;
+    std::size_t request_bytes = 0;
+    int sources = 1;
+};
+
+struct Counters {
+    std::uint64_t requests = 0;
+    std::uint64_t bytes_received = 0;
+    std::uint64_t connects = 0;
+    std::uint64_t connect_errors = 0;
+    std::uint64_t io_errors = 0;
+    std::uint64_t timeouts = 0;
+    std::uint64_t bad_status = 0;  // anything but 2xx
+};
+
+// One thread's share of the connections, on its own io_context
+struct Worker {
+    net::io_context ioc{1};
+    ssl::context tls_context{ssl::context::tls_client};
+    tcp::endpoint target;
+    const Options* options = nullptr;
+    std::string request;  // serialized once, sent as-is
+
+    int pending = 0;     // connections not started yet
+    int connecting = 0;  // connects in progress
+    std::atomic<int> live{0};  // connections with an operation outstanding
+    Counters counters;
+    std::vector<std::uint32_t> latencies_us;  // while recording
+    const std::atomic<bool>* recording = nullptr;
+    const std::atomic<bool>* stopping = nullptr;
+
+    void start_connections();
+};
+
+// A client connection; TLS or plain is fixed per run
+class ConnectionBase : public std::enable_shared_from_this<ConnectionBase> {
+public:
+    ConnectionBase(Worker& worker, int index) : worker_(worker), index_(index), retry_timer_(worker.ioc) {
+        worker_.live.fetch_add(1, std::memory_order_relaxed);
+    }
+    virtual ~ConnectionBase() {
+        worker_.live.fetch_sub(1, std::memory_order_relaxed);
+    }
+    virtual void start() = 0;
+
+protected:
+    Worker& worker_;
+    int index_;
+    net::steady_timer retry_timer_;
+    bool counted_connect_ = false;  // this connection's first connect finished
+};
+
+template<class Stream>
+class Connection : public ConnectionBase {
+public:
+    using ConnectionBase::ConnectionBase;
+
+    void start() override {
+        connect();
+    }
+
+private:
+    static constexpr bool kTls = !std::is_same_v<Stream, beast::tcp_stream>;
+
+    beast::tcp_stream& tcp_stream() { return beast::get_lowest_layer(*stream_); }
+
+    void connect() {
+        if (worker_.stopping->load(std::memory_order_relaxed)) {
+            return;
+        }
+        if constexpr (kTls) {
+            stream_.emplace(worker_.ioc, worker_.tls_context);
+        } else {
+            stream_.emplace(worker_.ioc);
+        }
+        buffer_.clear();
+
+        beast::error_code ec;
+        auto& socket = tcp_stream().socket();
+        socket.open(tcp::v4(), ec);
+        if (!ec && worker_.options->sources > 1) {
+            // 127.0.0.1 ... 127.0.0.N, each with its own ephemeral port range
+            auto source = net::ip::make_address_v4(0x7f000001u + static_cast<unsigned>(index_ % worker_.options->sources));
+            socket.bind(tcp::endpoint(source, 0), ec);
+        }
+        if (ec) {
+            on_connect(ec);
+            return;
+        }
+        tcp_stream().expires_after(kIoTimeout);
+        tcp_stream().async_connect(worker_.target,
+            [self = shared(), this](beast::error_code ec) { on_connect(ec); });
+    }
+
+    void on_connect(beast::error_code ec) {
+        if (ec) {
+            worker_.counters.connect_errors++;
+            first_connect_done();
+            retry();
+            return;
+        }
+        worker_.counters.connects++;
+        tcp_stream().socket().set_option(tcp::no_delay(true), ec);
+
+        if constexpr (kTls) {
+            SSL* ssl = stream_->native_handle();
+            SSL_set_tlsext_host_name(ssl, worker_.options->host_header.c_str());
+            if (session_) {
+                SSL_set_session(ssl, session_);
+            }
+            stream_->async_handshake(ssl::stream_base::client,
+                [self = shared(), this](beast::error_code ec) {
+                    if (ec) {
+                        worker_.counters.connect_errors++;
+                        first_connect_done();
+                        retry();
+                        return;
+                    }
+                    first_connect_done();
+                    send_request();
+                });
+        } else {
+            first_connect_done();
+            send_request();
+        }
+    }
+
+    // Let the next pending connection start once this one is up (or failed)
+    void first_connect_done() {
+        if (!counted_connect_) {
+            counted_connect_ = true;
+            worker_.connecting--;
+            worker_.start_connections();
+        }
+    }
+
+    void send_request() {
+        if (worker_.stopping->load(std::memory_order_relaxed)) {
+            close();
+            return;
+        }
+        started_ = Clock::now();
+        tcp_stream().expires_after(kIoTimeout);
+        net::async_write(*stream_, net::buffer(worker_.request),
+            [self = shared(), this](beast::error_code ec, std::size_t) {
+                if (ec) {
+                    on_error(ec);
+                    return;
+                }
+                parser_.emplace();
+                parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
+                read_response();
+            });
+    }
+
+    // The body is read into a scratch buffer and thrown away
+    void read_response() {
+        parser_->get().body().data = body_buffer_;
+        parser_->get().body().size = sizeof(body_buffer_);
+        tcp_stream().expires_after(kIoTimeout);
+        http::async_read(*stream_, buffer_, *parser_,
+            [self = shared(), this](beast::error_code ec, std::size_t bytes) {
+                worker_.counters.bytes_received += bytes;
+                if (ec == http::error::need_buffer) {
+                    read_response();
+                    return;
+                }
+                if (ec) {
+                    on_error(ec);
+                    return;
+                }
+                on_response();
+            });
+    }
+
+    void on_response() {
+        auto& res = parser_->get();
+        worker_.counters.requests++;
+        if (res.result_int() / 100 != 2) {
+            worker_.counters.bad_status++;
+        }
+        if (worker_.recording->load(std::memory_order_relaxed)) {
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - started_).count();
+            worker_.latencies_us.push_back(static_cast<std::uint32_t>(std::min<long long>(us, UINT32_MAX)));
+        }
+
+        if (!res.keep_alive()) {
+            // Without keep-alive, or after the proxy's max_requests_per_connection
+            save_session();
+            close();
+            connect();
+            return;
+        }
+        send_request();
+    }
+
+    void on_error(beast::error_code ec) {
+        if (worker_.stopping->load(std::memory_order_relaxed)) {
+            close();
+            return;
+        }
+        if (ec == beast::error::timeout) {
+            worker_.counters.timeouts++;
+        } else {
+            worker_.counters.io_errors++;
+        }
+        close();
+        retry();
+    }
+
+    void retry() {
+        if (worker_.stopping->load(std::memory_order_relaxed)) {
+            return;
+        }
+        retry_timer_.expires_after(kRetryDelay);
+        retry_timer_.async_wait([self = shared(), this](beast::error_code ec) {
+            if (!ec) {
+                connect();
+            }
+        });
+    }
+
+    // TLS 1.3 tickets arrive after the handshake, so the session to resume
+    // is taken once a response has been read. The exchange ended cleanly:
+    // without the shutdown flags OpenSSL would mark the session unresumable
+    // when the connection is closed without a close_notify.
+    void save_session() {
+        if constexpr (kTls) {
+            SSL* ssl = stream_->native_handle();
+            SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+            if (SSL_SESSION* session = SSL_get1_session(ssl)) {
+                if (session_) {
+                    SSL_SESSION_free(session_);
+                }
+                session_ = session;
+            }
+        }
+    }
+
+    void close() {
+        beast::error_code ignored;
+        tcp_stream().socket().close(ignored);
+    }
+
+    std::shared_ptr<Connection> shared() {
+        return std::static_pointer_cast<Connection>(shared_from_this());
+    }
+
+public:
+    ~Connection() override {
+        if (session_) {
+            SSL_SESSION_free(session_);
+        }
+    }
+
+private:
+    std::optional<Stream> stream_;
+    beast::flat_buffer buffer_;
+    std::optional<http::response_parser<http::buffer_body>> parser_;
+    char body_buffer_[16 * 1024];
+    Clock::time_point started_;
+    SSL_SESSION* session_ = nullptr;  // resumed on the next connection
+};
+
+void Worker::start_connections() {
+    while (pending > 0 && connecting < kMaxConnecting) {
+        int index = pending--;
+        connecting++;
+        std::shared_ptr<ConnectionBase> connection;
+        if (options->tls) {
+            connection = std::make_shared<Connection<beast::ssl_stream<beast::tcp_stream>>>(*this, index);
+        } else {
+            connection = std::make_shared<Connection<beast::tcp_stream>>(*this, index);
+        }
+        connection->start();
+    }
+}
+
+std::string make_request(const Options& options) {
+    http::request<http::string_body> req{options.request_bytes ? http::verb::post : http::verb::get,
+                                         options.path, 11};
+    req.set(http::field::host, options.host_header);
+    req.set(http::field::user_agent, "LoadGenerator");
+    req.keep_alive(options.keep_alive);
+    if (options.request_bytes) {
+        req.set(http::field::content_type, "application/octet-stream");
+        req.body().assign(options.request_bytes, 'x');
+    }
+    req.prepare_payload();
+
+    std::ostringstream out;
+    out << req;
+    return out.str();
+}
+
+// Counters of every worker, copied on the worker's own thread
+std::vector<Counters> snapshot(const std::vector<std::unique_ptr<Worker>>& workers) {
+    std::vector<Counters> counters(workers.size());
+    std::vector<std::promise<void>> copied(workers.size());
+    for (std::size_t i = 0; i < workers.size(); ++i) {
+        net::post(workers[i]->ioc, [&, i] {
+            counters[i] = workers[i]->counters;
+            copied[i].set_value();
+        });
+    }
+    for (auto& done : copied) {
+        done.get_future().wait();
+    }
+    return counters;
+}
+
+std::uint32_t percentile(std::vector<std::uint32_t>& samples, double p) {
+    if (samples.empty()) {
+        return 0;
+    }
+    auto index = static_cast<std::size_t>(p * static_cast<double>(samples.size() - 1));
+    std::nth_element(samples.begin(), samples.begin() + static_cast<std::ptrdiff_t>(index), samples.end());
+    return samples[index];
+}
+
+bool parse_options(int argc, char* argv[], Options& options) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string name = argv[i];
+        std::string value = argv[i + 1];
+        if (name == "--host") {
+            options.host = value;
+        } else if (name == "--port") {
+            options.port = value;
+        } else if (name == "--host-header") {
+            options.host_header = value;
+        } else if (name == "--path") {
+            options.path = value;
+        } else if (name == "--connections") {
+            options.connections = std::atoi(value.c_str());
+        } else if (name == "--threads") {
+            options.threads = std::atoi(value.c_str());
+        } else if (name == "--duration") {
+            options.duration = std::atoi(value.c_str());
+        } else if (name == "--warmup") {
+            options.warmup = std::atoi(value.c_str());
+        } else if (name == "--keep-alive") {
+            options.keep_alive = value != "0";
+        } else if (name == "--tls") {
+            options.tls = value != "0";
+        } else if (name == "--request-bytes") {
+            options.request_bytes = std::strtoull(value.c_str(), nullptr, 10);
+        } else if (name == "--sources") {
+            options.sources = std::max(1, std::atoi(value.c_str()));
+        } else {
+            std::cerr << "Unknown option: " << name << std::endl;
+            return false;
+        }
+    }
+    return argc % 2 == 1 && !options.port.empty() && options.connections > 0 &&
+           options.threads > 0 && options.duration > 0;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        std::cerr << "Usage: " << argv[0] << " --port <port> [--host 127.0.0.1] [--host-header bench.test]"
+                  << " [--path /] [--connections 100] [--threads N] [--duration 10] [--warmup 2]"
+                  << " [--keep-alive 1] [--tls 0] [--request-bytes 0] [--sources 1]" << std::endl;
+        return 1;
+    }
+    options.threads = std::min(options.threads, options.connections);
+
+    net::io_context resolver_ioc;
+    auto endpoints = tcp::resolver(resolver_ioc).resolve(options.host, options.port);
+    std::string request = make_request(options);
+
+    std::atomic<bool> recording{false};
+    std::atomic<bool> stopping{false};
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int i = 0; i < options.threads; ++i) {
+        auto worker = std::make_unique<Worker>();
+        worker->tls_context.set_verify_mode(ssl::verify_none);
+        SSL_CTX_set_session_cache_mode(worker->tls_context.native_handle(), SSL_SESS_CACHE_OFF);
+        worker->target = *endpoints.begin();
+        worker->options = &options;
+        worker->request = request;
+        worker->pending = options.connections / options.threads + (i < options.connections % options.threads);
+        worker->recording = &recording;
+        worker->stopping = &stopping;
+        workers.push_back(std::move(worker));
+    }
+
+    std::vector<std::thread> threads;
+    for (auto& worker : workers) {
+        threads.emplace_back([&worker] {
+            auto guard = net::make_work_guard(worker->ioc);
+            worker->start_connections();
+            worker->ioc.run();
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(options.warmup));
+    auto before = snapshot(workers);
+    recording = true;
+    auto started = Clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(options.duration));
+    recording = false;
+    double elapsed = std::chrono::duration<double>(Clock::now() - started).count();
+    auto after = snapshot(workers);
+
+    // No new requests from here on; a connection goes away after its last response
+    stopping = true;
+    auto drain_deadline = Clock::now() + kDrainTimeout;
+    auto live = [&] {
+        int count = 0;
+        for (auto& worker : workers) {
+            count += worker->live.load(std::memory_order_relaxed);
+        }
+        return count;
+    };
+    while (live() > 0 && Clock::now() < drain_deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    for (auto& worker : workers) {
+        worker->ioc.stop();
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    Counters total;
+    std::vector<std::uint32_t> latencies;
+    for (std::size_t i = 0; i < workers.size(); ++i) {
+        total.requests += after[i].requests - before[i].requests;
+        total.bytes_received += after[i].bytes_received - before[i].bytes_received;
+        total.connects += after[i].connects - before[i].connects;
+        total.connect_errors += after[i].connect_errors - before[i].connect_errors;
+        total.io_errors += after[i].io_errors - before[i].io_errors;
+        total.timeouts += after[i].timeouts - before[i].timeouts;
+        total.bad_status += after[i].bad_status - before[i].bad_status;
+        latencies.insert(latencies.end(), workers[i]->latencies_us.begin(), workers[i]->latencies_us.end());
+    }
+    std::uint32_t max = latencies.empty() ? 0 : *std::max_element(latencies.begin(), latencies.end());
+
+    std::printf("{\"connections\":%d,\"threads\":%d,\"keep_alive\":%s,\"tls\":%s,\"path\":\"%s\","
+                "\"request_bytes\":%zu,\"seconds\":%.3f,\"requests\":%llu,\"rps\":%.1f,"
+                "\"received_mb_per_s\":%.2f,\"p50_us\":%u,\"p99_us\":%u,\"p999_us\":%u,\"max_us\":%u,"
+                "\"connects\":%llu,\"connect_errors\":%llu,\"io_errors\":%llu,\"timeouts\":%llu,"
+                "\"bad_status\":%llu}\n",
+                options.connections, options.threads, options.keep_alive ? "true" : "false",
+                options.tls ? "true" : "false", options.path.c_str(), options.request_bytes, elapsed,
+                static_cast<unsigned long long>(total.requests), static_cast<double>(total.requests) / elapsed,
+                static_cast<double>(total.bytes_received) / elapsed / (1024 * 1024),
+                percentile(latencies, 0.50), percentile(latencies, 0.99), percentile(latencies, 0.999), max,
+                static_cast<unsigned long long>(total.connects),
+                static_cast<unsigned long long>(total.connect_errors),
+                static_cast<unsigned long long>(total.io_errors), static_cast<unsigned long long>(total.timeouts),
+                static_cast<unsigned long long>(total.bad_status));
+    return 0;
+}
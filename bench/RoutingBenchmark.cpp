@@ -0,0 +1,112 @@
+// Host routing: RouteTable vs. the previous linear scan over config sites
+// followed by parsing "host:port" on every lookup.
+#include "../src/RouteTable.h"
+#include <benchmark/benchmark.h>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+std::vector<SiteConfig> make_sites(int count) {
+    std::vector<SiteConfig> sites;
+    sites.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        SiteConfig site;
+        site.domain = "site" + std::to_string(i) + ".example.com";
+        site.backend = "10." + std::to_string((i >> 16) & 0xff) + "." + std::to_string((i >> 8) & 0xff) +
+                       "." + std::to_string(i & 0xff) + ":8080";
+        site.tls = "off";
+        sites.push_back(std::move(site));
+    }
+    return sites;
+}
+
+// Hosts to look up, in a fixed random order over all sites
+std::vector<std::string> make_hosts(int count) {
+    std::vector<std::string> hosts;
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> pick(0, count - 1);
+    for (int i = 0; i < 4096; ++i) {
+        hosts.push_back("site" + std::to_string(pick(rng)) + ".example.com");
+    }
+    return hosts;
+}
+
+// ConfigManager::findSiteByDomain + RequestRouter::parseBackendAddress as
+// they were before the routing table
+const SiteConfig* legacy_find_site(const std::vector<SiteConfig>& sites, const std::string& domain) {
+    for (const auto& site : sites) {
+        if (site.domain == domain) {
+            return &site;
+        }
+    }
+    return nullptr;
+}
+
+std::pair<std::string, int> legacy_parse_backend(const std::string& backend) {
+    size_t colon = backend.find_last_of(':');
+    if (colon == std::string::npos) {
+        return {"", 0};
+    }
+    return {backend.substr(0, colon), std::stoi(backend.substr(colon + 1))};
+}
+
+void BM_LinearScan(benchmark::State& state) {
+    auto sites = make_sites(static_cast<int>(state.range(0)));
+    auto hosts = make_hosts(static_cast<int>(state.range(0)));
+    std::size_t i = 0;
+    for (auto _ : state) {
+        const std::string& host = hosts[i++ & 4095];
+        // isWebSocketEnabled, getBackendForDomain and needsTLS each scanned
+        const SiteConfig* site = legacy_find_site(sites, host);
+        benchmark::DoNotOptimize(site && site->websocket);
+        site = legacy_find_site(sites, host);
+        auto backend = legacy_parse_backend(site->backend);
+        benchmark::DoNotOptimize(backend);
+        site = legacy_find_site(sites, host);
+        benchmark::DoNotOptimize(site && site->tls == "auto");
+    }
+}
+
+void BM_RouteTable(benchmark::State& state) {
+    auto sites = make_sites(static_cast<int>(state.range(0)));
+    auto hosts = make_hosts(static_cast<int>(state.range(0)));
+    net::io_context ioc;
+    BackendResolver resolver(ioc, std::chrono::seconds(30));
+    RouteTable routes(sites, resolver);
+    std::size_t i = 0;
+    for (auto _ : state) {
+        const Route* route = routes.find(hosts[i++ & 4095]);
+        benchmark::DoNotOptimize(route->balancer.get());
+        benchmark::DoNotOptimize(route->websocket);
+        benchmark::DoNotOptimize(route->tls);
+    }
+}
+
+void BM_RouteTableWildcard(benchmark::State& state) {
+    auto sites = make_sites(static_cast<int>(state.range(0)));
+    for (auto& site : sites) {
+        site.domain = "*." + site.domain;
+    }
+    auto hosts = make_hosts(static_cast<int>(state.range(0)));
+    for (auto& host : hosts) {
+        host = "www." + host;
+    }
+    net::io_context ioc;
+    BackendResolver resolver(ioc, std::chrono::seconds(30));
+    RouteTable routes(sites, resolver);
+    std::size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(routes.find(hosts[i++ & 4095]));
+    }
+}
+
+} // namespace
+
+BENCHMARK(BM_LinearScan)->Arg(10)->Arg(1000)->Arg(100000);
+BENCHMARK(BM_RouteTable)->Arg(10)->Arg(1000)->Arg(100000);
+BENCHMARK(BM_RouteTableWildcard)->Arg(10)->Arg(1000)->Arg(100000);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,239 @@
+#!/usr/bin/env python3
+"""Load-test sweep: starts TestBackend and the proxy locally, runs
+LoadGenerator once per combination of connection count, keep-alive, response
+body size and TLS, and writes one JSON object per run (JSON lines) with the
+request rate, latency percentiles and the proxy's CPU and memory use.
+
+    bench/run_load.py --build-dir build [--output results.jsonl]
+    bench/run_load.py --build-dir build --quick
+
+Every result line carries the parameters it was measured with, plus:
+  rps, p50_us, p99_us, p999_us, max_us   from LoadGenerator
+  proxy_cpu_percent                      CPU time of the proxy / wall time
+                                         (100 = one core busy)
+  proxy_rss_mb, proxy_peak_rss_mb        resident memory at the end of the
+                                         run, and the highest seen during it
+  connect_errors, io_errors, timeouts, bad_status
+"""
+
+import argparse
+import itertools
+import json
+import os
+import resource
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+CLOCK_TICKS = os.sysconf("SC_CLK_TCK")
+PAGE_SIZE = os.sysconf("SC_PAGE_SIZE")
+
+# Connections per source address on loopback (the default ephemeral range is
+# about 28k ports)
+CONNECTIONS_PER_SOURCE = 20000
+
+
+def parse_list(value, convert=int):
+    return [convert(item) for item in value.split(",") if item]
+
+
+def parse_switch(value):
+    return [item == "on" for item in value.split(",") if item]
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def wait_for_port(port, process, timeout=10.0):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        if process.poll() is not None:
+            raise RuntimeError(f"{process.args[0]} exited with status {process.returncode}")
+        try:
+            with socket.create_connection(("127.0.0.1", port), timeout=0.2):
+                return
+        except OSError:
+            time.sleep(0.05)
+    raise RuntimeError(f"nothing listening on port {port} after {timeout}s")
+
+
+def cpu_seconds(pid):
+    with open(f"/proc/{pid}/stat") as f:
+        fields = f.read().rsplit(")", 1)[1].split()
+    # utime and stime are fields 14 and 15 of stat, 12 and 13 after the name
+    return (int(fields[11]) + int(fields[12])) / CLOCK_TICKS
+
+
+def rss_bytes(pid):
+    with open(f"/proc/{pid}/statm") as f:
+        return int(f.read().split()[1]) * PAGE_SIZE
+
+
+class RssSampler(threading.Thread):
+    """Highest resident set size of a process while running."""
+
+    def __init__(self, pid, interval=0.1):
+        super().__init__(daemon=True)
+        self.pid = pid
+        self.interval = interval
+        self.peak = 0
+        self.stopping = threading.Event()
+
+    def run(self):
+        while not self.stopping.is_set():
+            try:
+                self.peak = max(self.peak, rss_bytes(self.pid))
+            except OSError:
+                return
+            self.stopping.wait(self.interval)
+
+    def stop(self):
+        self.stopping.set()
+        self.join()
+        return self.peak
+
+
+def write_config(directory, http_port, https_port, backend_port, args):
+    config = f"""http_port: {http_port}
+https_port: {https_port}
+max_connections: 0
+worker_threads: {args.proxy_threads}
+thread_per_core: {"true" if args.thread_per_core else "false"}
+cert_dir: "{directory}/certs"
+keep_alive:
+  enabled: true
+  max_requests_per_connection: 1000000000
+sites:
+  - domain: "bench.test"
+    backend: "127.0.0.1:{backend_port}"
+    tls: auto
+    cache: {"true" if args.cache else "false"}
+"""
+    path = os.path.join(directory, "proxy.yaml")
+    with open(path, "w") as f:
+        f.write(config)
+    return path
+
+
+def raise_file_limit(connections):
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft < hard:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+    # The proxy holds a client and (at most) a backend socket per connection
+    needed = 2 * connections + 1024
+    if hard != resource.RLIM_INFINITY and hard < needed:
+        print(f"warning: open file limit {hard} is below the {needed} needed for "
+              f"{connections} connections; raise it with ulimit -n", file=sys.stderr)
+
+
+def run_point(args, ports, proxy_pid, connections, keep_alive, body_bytes, tls):
+    command = [
+        os.path.join(args.build_dir, "LoadGenerator"),
+        "--port", str(ports["https" if tls else "http"]),
+        "--host-header", "bench.test",
+        "--path", f"/bytes/{body_bytes}" + ("?max-age=3600" if args.cache else ""),
+        "--connections", str(connections),
+        "--duration", str(args.duration),
+        "--warmup", str(args.warmup),
+        "--keep-alive", "1" if keep_alive else "0",
+        "--tls", "1" if tls else "0",
+        "--request-bytes", str(args.request_bytes),
+        "--sources", str(max(1, -(-connections // CONNECTIONS_PER_SOURCE))),
+    ]
+    if args.loadgen_threads:
+        command += ["--threads", str(args.loadgen_threads)]
+
+    sampler = RssSampler(proxy_pid)
+    sampler.start()
+    cpu_before = cpu_seconds(proxy_pid)
+    started = time.monotonic()
+    output = subprocess.run(command, capture_output=True, text=True,
+                            timeout=args.warmup + args.duration + 120)
+    wall = time.monotonic() - started
+    cpu = cpu_seconds(proxy_pid) - cpu_before
+    peak = sampler.stop()
+    if output.returncode != 0:
+        raise RuntimeError(f"LoadGenerator failed: {output.stderr.strip()}")
+
+    result = json.loads(output.stdout)
+    result["body_bytes"] = body_bytes
+    result["proxy_threads"] = args.proxy_threads
+    result["cache"] = args.cache
+    # Over the whole run including warmup, when the proxy is equally busy
+    result["proxy_cpu_percent"] = round(100.0 * cpu / wall, 1)
+    result["proxy_rss_mb"] = round(rss_bytes(proxy_pid) / (1024 * 1024), 1)
+    result["proxy_peak_rss_mb"] = round(peak / (1024 * 1024), 1)
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--build-dir", default="build", help="directory with ReverseProxy, TestBackend and LoadGenerator")
+    parser.add_argument("--connections", default="100,1000,10000,100000", help="comma-separated connection counts")
+    parser.add_argument("--keep-alive", default="on,off", help="on, off or on,off")
+    parser.add_argument("--tls", default="off,on", help="on, off or off,on")
+    parser.add_argument("--body-sizes", default="0,1024,65536", help="response body sizes in bytes")
+    parser.add_argument("--request-bytes", type=int, default=0, help="POST body size (0 sends GETs)")
+    parser.add_argument("--duration", type=int, default=10, help="measured seconds per run")
+    parser.add_argument("--warmup", type=int, default=2, help="seconds before measuring")
+    parser.add_argument("--proxy-threads", type=int, default=0, help="worker_threads of the proxy (0 = one per CPU)")
+    parser.add_argument("--thread-per-core", action="store_true", help="run the proxy with thread_per_core")
+    parser.add_argument("--cache", action="store_true", help="make responses cacheable and enable the response cache")
+    parser.add_argument("--loadgen-threads", type=int, default=0, help="LoadGenerator threads (default: one per CPU)")
+    parser.add_argument("--output", help="append results here instead of printing them")
+    parser.add_argument("--quick", action="store_true", help="small sweep: 100 and 1000 connections, 3 s runs")
+    args = parser.parse_args()
+
+    if args.quick:
+        args.connections = "100,1000"
+        args.body_sizes = "0,16384"
+        args.duration = 3
+        args.warmup = 1
+
+    connection_counts = parse_list(args.connections)
+    raise_file_limit(max(connection_counts))
+
+    with tempfile.TemporaryDirectory(prefix="pristine-bench-") as directory:
+        ports = {"http": free_port(), "https": free_port(), "backend": free_port()}
+        config = write_config(directory, ports["http"], ports["https"], ports["backend"], args)
+        environment = dict(os.environ, PRISTINE_LOG_LEVEL="warn")
+        backend = subprocess.Popen([os.path.join(args.build_dir, "TestBackend"), str(ports["backend"])],
+                                   stdout=subprocess.DEVNULL)
+        proxy = subprocess.Popen([os.path.join(args.build_dir, "ReverseProxy"), config],
+                                 stdout=subprocess.DEVNULL, env=environment)
+        output = open(args.output, "a") if args.output else sys.stdout
+        try:
+            wait_for_port(ports["backend"], backend)
+            wait_for_port(ports["http"], proxy)
+            wait_for_port(ports["https"], proxy)
+
+            sweep = itertools.product(connection_counts, parse_switch(args.keep_alive),
+                                      parse_list(args.body_sizes), parse_switch(args.tls))
+            for connections, keep_alive, body_bytes, tls in sweep:
+                result = run_point(args, ports, proxy.pid, connections, keep_alive, body_bytes, tls)
+                output.write(json.dumps(result) + "\n")
+                output.flush()
+                print(f"{connections:>6} conns  keep-alive {'on ' if keep_alive else 'off'}  "
+                      f"tls {'on ' if tls else 'off'}  body {body_bytes:>7}  "
+                      f"{result['rps']:>10.0f} rps  p99 {result['p99_us']:>8} us  "
+                      f"cpu {result['proxy_cpu_percent']:>5}%  rss {result['proxy_peak_rss_mb']} MB",
+                      file=sys.stderr)
+        finally:
+            if output is not sys.stdout:
+                output.close()
+            for process in (proxy, backend):
+                process.terminate()
+                try:
+                    process.wait(timeout=10)
+                except subprocess.TimeoutExpired:
+                    process.kill()
+
+
+if __name__ == "__main__":
+    main()
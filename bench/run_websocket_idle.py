@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+"""Idle WebSocket footprint: starts TestBackend and the proxy locally, opens
+N WebSocket connections through the proxy and leaves them idle, then reports
+how much the proxy's resident memory grew per tunnel. Runs once per
+websocket_mode (raw and frames) and transport (plain TCP and TLS clients),
+each with a fresh proxy, and exits non-zero if a run is over its bound.
+
+    bench/run_websocket_idle.py --build-dir build          # 100k tunnels, 10k over TLS
+    bench/run_websocket_idle.py --build-dir build --tunnels 10000 --modes raw --transports plain
+
+The bounds default to the footprint documented in README.md per idle
+tunnel: raw under 4 KB and frames under 16 KB, or 72 KB and 80 KB for TLS
+clients, whose OpenSSL and asio stream state (record and BIO buffers) is
+most of it. RSS covers the proxy's own memory; kernel socket buffers come on
+top. Each run prints one JSON line:
+  mode, transport, tunnels, opened, failed
+  rss_before_mb, rss_after_mb   proxy RSS after warm-up and with all tunnels open
+  kb_per_tunnel, bound_kb, ok
+"""
+
+import argparse
+import asyncio
+import base64
+import json
+import os
+import socket
+import ssl
+import subprocess
+import sys
+import tempfile
+import time
+
+from run_load import CONNECTIONS_PER_SOURCE, free_port, raise_file_limit, rss_bytes, wait_for_port
+
+BOUNDS_KB = {("raw", "plain"): 4.0, ("frames", "plain"): 16.0,
+             ("raw", "tls"): 72.0, ("frames", "tls"): 80.0}
+
+# Tunnels opened before the baseline is taken, so per-thread state, free
+# lists and allocator arenas that the first connections set up aren't counted
+WARMUP_TUNNELS = 200
+
+# Handshakes in flight at once, to stay within the proxy's listen backlog
+MAX_OPENING = 256
+
+# Linux: leave the port to connect() after binding the source address, so
+# ports still in TIME_WAIT from an earlier mode can be reused
+IP_BIND_ADDRESS_NO_PORT = getattr(socket, "IP_BIND_ADDRESS_NO_PORT", 24)
+
+
+def write_config(directory, http_port, https_port, backend_port, mode, transport, backend_count):
+    # Each proxy-to-backend address pair has one ephemeral port range, so
+    # 100k tunnels need several backend addresses (TestBackend listens on all)
+    backends = "".join(f'\n      - "127.0.0.{i + 1}:{backend_port}"' for i in range(backend_count))
+    config = f"""http_port: {http_port}
+https_port: {https_port}
+max_connections: 0
+cert_dir: "{directory}/certs"
+sites:
+  - domain: "ws.bench.test"
+    backend:{backends}
+    tls: {"auto" if transport == "tls" else "off"}
+    websocket: true
+    websocket_mode: {mode}
+"""
+    path = os.path.join(directory, f"proxy-{mode}-{transport}.yaml")
+    with open(path, "w") as f:
+        f.write(config)
+    return path
+
+
+def client_tls_context():
+    # The proxy serves a self-signed certificate
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+    context.check_hostname = False
+    context.verify_mode = ssl.CERT_NONE
+    return context
+
+
+async def open_tunnel(port, source, semaphore, tls_context):
+    async with semaphore:
+        sock = socket.socket()
+        sock.setsockopt(socket.IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, 1)
+        sock.bind((source, 0))
+        sock.setblocking(False)
+        await asyncio.get_running_loop().sock_connect(sock, ("127.0.0.1", port))
+        reader, writer = await asyncio.open_connection(
+            sock=sock, ssl=tls_context, server_hostname="ws.bench.test" if tls_context else None)
+        key = base64.b64encode(os.urandom(16)).decode()
+        writer.write((f"GET /ws HTTP/1.1\r\nHost: ws.bench.test\r\nUpgrade: websocket\r\n"
+                      f"Connection: Upgrade\r\nSec-WebSocket-Key: {key}\r\n"
+                      f"Sec-WebSocket-Version: 13\r\n\r\n").encode())
+        await writer.drain()
+        response = await asyncio.wait_for(reader.readuntil(b"\r\n\r\n"), timeout=30)
+        if not response.startswith(b"HTTP/1.1 101"):
+            writer.close()
+            raise RuntimeError(response.split(b"\r\n", 1)[0].decode(errors="replace"))
+        return writer
+
+
+async def open_tunnels(port, count, first, tls_context):
+    semaphore = asyncio.Semaphore(MAX_OPENING)
+    tasks = [open_tunnel(port, f"127.0.0.{(first + i) // CONNECTIONS_PER_SOURCE + 1}", semaphore, tls_context)
+             for i in range(count)]
+    results = await asyncio.gather(*tasks, return_exceptions=True)
+    writers = [r for r in results if not isinstance(r, BaseException)]
+    errors = [r for r in results if isinstance(r, BaseException)]
+    if errors:
+        print(f"warning: {len(errors)} tunnels failed, first: {errors[0]!r}", file=sys.stderr)
+    return writers, len(errors)
+
+
+async def measure(args, ports, proxy_pid, mode, transport, count):
+    tls_context = client_tls_context() if transport == "tls" else None
+    port = ports["https"] if tls_context else ports["http"]
+    warm, warm_failed = await open_tunnels(port, WARMUP_TUNNELS, 0, tls_context)
+    if warm_failed:
+        raise RuntimeError(f"{warm_failed} of {WARMUP_TUNNELS} warm-up tunnels failed")
+    await asyncio.sleep(args.settle)
+    before = rss_bytes(proxy_pid)
+
+    tunnels, failed = await open_tunnels(port, count, WARMUP_TUNNELS, tls_context)
+    await asyncio.sleep(args.settle)
+    after = rss_bytes(proxy_pid)
+
+    for writer in warm + tunnels:
+        writer.close()
+
+    per_tunnel_kb = (after - before) / max(1, len(tunnels)) / 1024
+    bound = args.bound_kb if args.bound_kb else BOUNDS_KB[(mode, transport)]
+    return {
+        "mode": mode,
+        "transport": transport,
+        "tunnels": count,
+        "opened": len(tunnels),
+        "failed": failed,
+        "rss_before_mb": round(before / (1024 * 1024), 1),
+        "rss_after_mb": round(after / (1024 * 1024), 1),
+        "kb_per_tunnel": round(per_tunnel_kb, 2),
+        "bound_kb": bound,
+        "ok": failed == 0 and per_tunnel_kb <= bound,
+    }
+
+
+def run_mode(args, directory, mode, transport):
+    count = args.tls_tunnels if transport == "tls" else args.tunnels
+    ports = {"http": free_port(), "https": free_port(), "backend": free_port()}
+    backend_count = -(-(count + WARMUP_TUNNELS) // CONNECTIONS_PER_SOURCE)
+    config = write_config(directory, ports["http"], ports["https"], ports["backend"], mode, transport,
+                          backend_count)
+    environment = dict(os.environ, PRISTINE_LOG_LEVEL="warn")
+    backend = subprocess.Popen([os.path.join(args.build_dir, "TestBackend"), str(ports["backend"])],
+                               stdout=subprocess.DEVNULL)
+    proxy = subprocess.Popen([os.path.join(args.build_dir, "ReverseProxy"), config],
+                             stdout=subprocess.DEVNULL, env=environment)
+    try:
+        wait_for_port(ports["backend"], backend)
+        wait_for_port(ports["https" if transport == "tls" else "http"], proxy)
+        # Let startup work (certificates, cache, threads) finish first
+        time.sleep(1)
+        return asyncio.run(measure(args, ports, proxy.pid, mode, transport, count))
+    finally:
+        for process in (proxy, backend):
+            process.terminate()
+            try:
+                process.wait(timeout=10)
+            except subprocess.TimeoutExpired:
+                process.kill()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--build-dir", default="build", help="directory with ReverseProxy and TestBackend")
+    parser.add_argument("--tunnels", type=int, default=100000, help="idle WebSocket connections per mode")
+    parser.add_argument("--tls-tunnels", type=int, default=10000,
+                        help="idle WebSocket connections per mode over TLS (the client side is heavier)")
+    parser.add_argument("--modes", default="raw,frames", help="websocket_mode values to measure")
+    parser.add_argument("--transports", default="plain,tls", help="client transports to measure: plain, tls")
+    parser.add_argument("--bound-kb", type=float, default=0, help="override the per-tunnel bound for every mode")
+    parser.add_argument("--settle", type=float, default=2.0, help="seconds to wait before reading RSS")
+    args = parser.parse_args()
+
+    transports = [t for t in args.transports.split(",") if t]
+
+    # The client side of every tunnel is held by this process as well
+    raise_file_limit(max(args.tls_tunnels if t == "tls" else args.tunnels for t in transports) + WARMUP_TUNNELS)
+
+    ok = True
+    with tempfile.TemporaryDirectory(prefix="pristine-ws-") as directory:
+        for transport in transports:
+            for mode in [m for m in args.modes.split(",") if m]:
+                result = run_mode(args, directory, mode, transport)
+                print(json.dumps(result), flush=True)
+                print(f"{mode:>6} {transport:>5}  {result['opened']} idle tunnels  {result['kb_per_tunnel']} KB each "
+                      f"(bound {result['bound_kb']} KB)  {'ok' if result['ok'] else 'OVER BOUND'}", file=sys.stderr)
+                ok = ok and result["ok"]
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,44 @@
+#include "AdmissionController.h"
+
+std::atomic<std::uint64_t> AdmissionController::max_connections_{0};
+std::atomic<AdmissionController::OverloadAction> AdmissionController::action_{OverloadAction::reject};
+std::atomic<std::uint64_t> AdmissionController::active_{0};
+std::atomic<std::uint64_t> AdmissionController::rejected_{0};
+
+AdmissionController::Slot& AdmissionController::Slot::operator=(Slot&& other) noexcept {
+    if (this != &other) {
+        reset();
+        held_ = other.held_;
+        other.held_ = false;
+    }
+    return *this;
+}
+
+void AdmissionController::Slot::reset() {
+    if (held_) {
+        active_.fetch_sub(1, std::memory_order_relaxed);
+        held_ = false;
+    }
+}
+
+void AdmissionController::configure(int max_connections, OverloadAction action) {
+    max_connections_.store(max_connections > 0 ? static_cast<std::uint64_t>(max_connections) : 0,
+                           std::memory_order_relaxed);
+    action_.store(action, std::memory_order_relaxed);
+}
+
+AdmissionController::Slot AdmissionController::admit() {
+    std::uint64_t limit = max_connections_.load(std::memory_order_relaxed);
+    std::uint64_t previous = active_.fetch_add(1, std::memory_order_relaxed);
+    if (limit != 0 && previous >= limit) {
+        active_.fetch_sub(1, std::memory_order_relaxed);
+        rejected_.fetch_add(1, std::memory_order_relaxed);
+        return Slot(false);
+    }
+    return Slot(true);
+}
+
+bool AdmissionController::has_capacity() {
+    std::uint64_t limit = max_connections_.load(std::memory_order_relaxed);
+    return limit == 0 || active_.load(std::memory_order_relaxed) < limit;
+}
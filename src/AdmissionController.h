@@ -0,0 +1,56 @@
+#ifndef ADMISSION_CONTROLLER_H
+#define ADMISSION_CONTROLLER_H
+
+#include <atomic>
+#include <cstdint>
+
+// Process-wide limit on open client connections (max_connections).
+// A connection holds a Slot for its whole life; once every slot is taken new
+// connections are either answered with a fast 503 or left in the kernel's
+// accept backlog until a slot frees up (overload_action).
+class AdmissionController {
+public:
+    enum class OverloadAction { reject, pause };
+
+    // Counted connection; releases its slot when destroyed
+    class Slot {
+    public:
+        Slot() = default;
+        Slot(Slot&& other) noexcept : held_(other.held_) { other.held_ = false; }
+        Slot& operator=(Slot&& other) noexcept;
+        ~Slot() { reset(); }
+
+        Slot(const Slot&) = delete;
+        Slot& operator=(const Slot&) = delete;
+
+        explicit operator bool() const { return held_; }
+        void reset();
+
+    private:
+        friend class AdmissionController;
+        explicit Slot(bool held) : held_(held) {}
+
+        bool held_ = false;
+    };
+
+    // Apply limits (at startup and on config reload); 0 means unlimited
+    static void configure(int max_connections, OverloadAction action);
+    static OverloadAction overload_action() { return action_.load(std::memory_order_relaxed); }
+
+    // Take a slot for a new connection; an empty Slot once the limit is reached
+    static Slot admit();
+
+    // Whether a new connection would currently be admitted
+    static bool has_capacity();
+
+    static std::uint64_t active() { return active_.load(std::memory_order_relaxed); }
+    static std::uint64_t rejected() { return rejected_.load(std::memory_order_relaxed); }
+
+private:
+    static std::atomic<std::uint64_t> max_connections_;
+    static std::atomic<OverloadAction> action_;
+    static std::atomic<std::uint64_t> active_;
+    static std::atomic<std::uint64_t> rejected_;
+};
+
+#endif // ADMISSION_CONTROLLER_H
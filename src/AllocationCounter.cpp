@@ -0,0 +1,72 @@
+#include "AllocationCounter.h"
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+// Plain thread_local PODs: no constructor, so they are usable from the very
+// first allocation of every thread
+thread_local std::uint64_t t_allocation_count = 0;
+thread_local std::uint64_t t_allocation_bytes = 0;
+
+void* counted_alloc(std::size_t size) {
+    t_allocation_count++;
+    t_allocation_bytes += size;
+    return std::malloc(size ? size : 1);
+}
+
+void* counted_aligned_alloc(std::size_t size, std::align_val_t alignment) {
+    t_allocation_count++;
+    t_allocation_bytes += size;
+    auto align = static_cast<std::size_t>(alignment);
+    void* p = nullptr;
+    if (posix_memalign(&p, align < sizeof(void*) ? sizeof(void*) : align, size ? size : 1) != 0) {
+        return nullptr;
+    }
+    return p;
+}
+
+} // namespace
+
+AllocationStats thread_allocations() {
+    return {t_allocation_count, t_allocation_bytes};
+}
+
+void* operator new(std::size_t size) {
+    if (void* p = counted_alloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return counted_alloc(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return counted_alloc(size);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    if (void* p = counted_aligned_alloc(size, alignment)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return operator new(size, alignment);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
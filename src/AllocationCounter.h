@@ -0,0 +1,21 @@
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+#include <cstdint>
+
+// Heap allocations made by the calling thread since it started.
+// Counted by the global operator new replacements in AllocationCounter.cpp,
+// so the difference between two readings on one thread is the number of
+// allocations the code in between performed.
+struct AllocationStats {
+    std::uint64_t count = 0;
+    std::uint64_t bytes = 0;
+
+    AllocationStats operator-(const AllocationStats& other) const {
+        return {count - other.count, bytes - other.bytes};
+    }
+};
+
+AllocationStats thread_allocations();
+
+#endif // ALLOCATION_COUNTER_H
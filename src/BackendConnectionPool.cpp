@@ -0,0 +1,144 @@
+#include "BackendConnectionPool.h"
+#include <algorithm>
+#include <cerrno>
+#include <sys/socket.h>
+
+UpstreamPoolConfig BackendConnectionPool::config_;
+std::atomic<std::uint64_t> BackendConnectionPool::hits_{0};
+std::atomic<std::uint64_t> BackendConnectionPool::misses_{0};
+std::atomic<std::uint64_t> BackendConnectionPool::evictions_{0};
+
+BackendConnectionPool& BackendConnectionPool::local() {
+    thread_local BackendConnectionPool pool;
+    return pool;
+}
+
+void BackendConnectionPool::configure(const UpstreamPoolConfig& config) {
+    config_ = config;
+}
+
+BackendPoolStats BackendConnectionPool::stats() {
+    BackendPoolStats stats;
+    stats.hits = hits_.load(std::memory_order_relaxed);
+    stats.misses = misses_.load(std::memory_order_relaxed);
+    stats.evictions = evictions_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+std::unique_ptr<BackendConnection> BackendConnectionPool::acquire(const std::string& backend) {
+    if (config_.enabled) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = idle_.find(backend);
+        if (it != idle_.end()) {
+            auto& conns = it->second;
+            auto now = std::chrono::steady_clock::now();
+
+            // Most recently used connections sit at the back
+            while (!conns.empty()) {
+                std::unique_ptr<BackendConnection> conn = std::move(conns.back());
+                conns.pop_back();
+
+                if (is_reusable(*conn, now)) {
+                    hits_.fetch_add(1, std::memory_order_relaxed);
+                    return conn;
+                }
+
+                evictions_.fetch_add(1, std::memory_order_relaxed);
+                beast::error_code ec;
+                conn->stream.socket().close(ec);
+            }
+        }
+    }
+
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+}
+
+void BackendConnectionPool::release(const std::string& backend, std::unique_ptr<BackendConnection> conn) {
+    beast::error_code ec;
+
+    if (!config_.enabled ||
+        conn->requests_served >= config_.max_requests_per_connection ||
+        !conn->stream.socket().is_open()) {
+        conn->stream.socket().close(ec);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& conns = idle_[backend];
+
+    // Drop the oldest idle connection when the shard is full
+    if (static_cast<int>(conns.size()) >= config_.max_idle_per_backend) {
+        if (conns.empty()) {
+            conn->stream.socket().close(ec);
+            return;
+        }
+        evictions_.fetch_add(1, std::memory_order_relaxed);
+        conns.front()->stream.socket().close(ec);
+        conns.erase(conns.begin());
+    }
+
+    conn->idle_since = std::chrono::steady_clock::now();
+    if (!sweep_scheduled_) {
+        if (!sweep_timer_) {
+            sweep_timer_ = std::make_unique<net::steady_timer>(conn->stream.get_executor());
+        }
+        schedule_sweep(conn->idle_since + std::chrono::seconds(config_.idle_timeout_seconds));
+    }
+    conns.push_back(std::move(conn));
+}
+
+void BackendConnectionPool::sweep() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sweep_scheduled_ = false;
+    auto timeout = std::chrono::seconds(config_.idle_timeout_seconds);
+    auto now = std::chrono::steady_clock::now();
+    auto next = std::chrono::steady_clock::time_point::max();
+
+    for (auto it = idle_.begin(); it != idle_.end();) {
+        // Released in order, so the oldest connections sit at the front
+        auto& conns = it->second;
+        auto fresh = conns.begin();
+        while (fresh != conns.end() && now - (*fresh)->idle_since > timeout) {
+            evictions_.fetch_add(1, std::memory_order_relaxed);
+            beast::error_code ec;
+            (*fresh)->stream.socket().close(ec);
+            ++fresh;
+        }
+        conns.erase(conns.begin(), fresh);
+
+        if (conns.empty()) {
+            it = idle_.erase(it);
+            continue;
+        }
+        next = std::min(next, conns.front()->idle_since + timeout);
+        ++it;
+    }
+
+    if (!idle_.empty()) {
+        schedule_sweep(next);
+    }
+}
+
+void BackendConnectionPool::schedule_sweep(std::chrono::steady_clock::time_point at) {
+    // A moment past the deadline, so the connection due then has expired
+    sweep_scheduled_ = true;
+    sweep_timer_->expires_at(at + std::chrono::milliseconds(10));
+    sweep_timer_->async_wait([this](beast::error_code ec) {
+        if (!ec) {
+            sweep();
+        }
+    });
+}
+
+bool BackendConnectionPool::is_reusable(BackendConnection& conn, std::chrono::steady_clock::time_point now) const {
+    if (now - conn.idle_since > std::chrono::seconds(config_.idle_timeout_seconds)) {
+        return false;
+    }
+
+    // A readable idle socket means the backend closed it (EOF) or sent
+    // unsolicited data; either way it can't carry another request.
+    char byte;
+    ssize_t n = ::recv(conn.stream.socket().native_handle(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
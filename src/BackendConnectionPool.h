@@ -0,0 +1,79 @@
+#ifndef BACKEND_CONNECTION_POOL_H
+#define BACKEND_CONNECTION_POOL_H
+
+#include "ConfigManager.h"
+#include <boost/asio/steady_timer.hpp>
+#include <boost/beast/core.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace beast = boost::beast;
+namespace net = boost::asio;
+
+// Upstream HTTP/1.1 connection that can be reused across requests
+struct BackendConnection {
+    explicit BackendConnection(beast::tcp_stream&& s) : stream(std::move(s)) {}
+
+    beast::tcp_stream stream;
+    int requests_served = 0;
+    std::chrono::steady_clock::time_point idle_since;
+};
+
+struct BackendPoolStats {
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t evictions = 0;
+};
+
+// Keep-alive pool of idle backend connections.
+// Each worker thread owns its own shard, so acquire/release never contend
+// with other threads. A timer on the worker's io_context closes connections
+// left idle past idle_timeout_seconds; with a shared io_context it may fire
+// on another thread, which is what the shard's mutex is for.
+class BackendConnectionPool {
+public:
+    // Pool shard of the calling thread
+    static BackendConnectionPool& local();
+
+    // Apply pool settings (call before worker threads start)
+    static void configure(const UpstreamPoolConfig& config);
+    static const UpstreamPoolConfig& config() { return config_; }
+
+    // Hit/miss counters aggregated over all shards
+    static BackendPoolStats stats();
+
+    // Take an idle connection to backend ("host:port"), or nullptr on a miss
+    std::unique_ptr<BackendConnection> acquire(const std::string& backend);
+
+    // Return a connection after a complete keep-alive exchange
+    void release(const std::string& backend, std::unique_ptr<BackendConnection> conn);
+
+private:
+    BackendConnectionPool() = default;
+
+    // Check that an idle connection is still fresh and was not closed by the backend
+    bool is_reusable(BackendConnection& conn, std::chrono::steady_clock::time_point now) const;
+
+    // Close expired idle connections, then wait for the next one to expire
+    void sweep();
+    void schedule_sweep(std::chrono::steady_clock::time_point at);
+
+private:
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::vector<std::unique_ptr<BackendConnection>>> idle_;
+    std::unique_ptr<net::steady_timer> sweep_timer_;  // on the first released connection's executor
+    bool sweep_scheduled_ = false;
+
+    static UpstreamPoolConfig config_;
+    static std::atomic<std::uint64_t> hits_;
+    static std::atomic<std::uint64_t> misses_;
+    static std::atomic<std::uint64_t> evictions_;
+};
+
+#endif // BACKEND_CONNECTION_POOL_H
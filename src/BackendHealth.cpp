@@ -0,0 +1,71 @@
+#include "BackendHealth.h"
+#include "ConfigManager.h"
+#include <algorithm>
+
+std::atomic<std::uint32_t> BackendHealth::max_failures_{5};
+std::atomic<std::int64_t> BackendHealth::base_ejection_ms_{10000};
+std::atomic<std::int64_t> BackendHealth::max_ejection_ms_{300000};
+
+void BackendHealth::configure(const OutlierDetectionConfig& config) {
+    max_failures_.store(static_cast<std::uint32_t>(std::max(config.consecutive_failures, 0)),
+                        std::memory_order_relaxed);
+    base_ejection_ms_.store(std::max(config.base_ejection_ms, 1), std::memory_order_relaxed);
+    max_ejection_ms_.store(std::max(config.max_ejection_ms, config.base_ejection_ms), std::memory_order_relaxed);
+}
+
+std::int64_t BackendHealth::now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void BackendHealth::record_success() {
+    // Avoid dirtying the cache line on every request
+    if (consecutive_failures_.load(std::memory_order_relaxed) != 0) {
+        consecutive_failures_.store(0, std::memory_order_relaxed);
+    }
+}
+
+std::int64_t BackendHealth::record_failure() {
+    std::uint32_t limit = max_failures_.load(std::memory_order_relaxed);
+    if (limit == 0) {
+        return 0;
+    }
+
+    // Exactly one request sees the count reach the limit and ejects
+    if (consecutive_failures_.fetch_add(1, std::memory_order_relaxed) + 1 != limit) {
+        return 0;
+    }
+
+    std::int64_t now = now_ms();
+    std::int64_t base = base_ejection_ms_.load(std::memory_order_relaxed);
+    std::int64_t max = max_ejection_ms_.load(std::memory_order_relaxed);
+
+    // A backend that stayed in rotation for a full max period starts over
+    // at the base duration
+    if (now - ejected_until_ms_.load(std::memory_order_relaxed) > max) {
+        ejections_.store(0, std::memory_order_relaxed);
+    }
+    std::uint32_t previous = ejections_.fetch_add(1, std::memory_order_relaxed);
+    std::int64_t duration = std::min(base << std::min<std::uint32_t>(previous, 20), max);
+
+    ejected_until_ms_.store(now + duration, std::memory_order_relaxed);
+    down_.fetch_or(kEjected, std::memory_order_relaxed);
+    return duration;
+}
+
+bool BackendHealth::try_readmit() {
+    if (now_ms() < ejected_until_ms_.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    consecutive_failures_.store(0, std::memory_order_relaxed);
+    std::uint8_t previous = down_.fetch_and(static_cast<std::uint8_t>(~kEjected), std::memory_order_relaxed);
+    return (previous & ~kEjected) == 0;
+}
+
+void BackendHealth::set_probe_healthy(bool healthy) {
+    if (healthy) {
+        down_.fetch_and(static_cast<std::uint8_t>(~kProbeFailed), std::memory_order_relaxed);
+    } else {
+        down_.fetch_or(kProbeFailed, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef BACKEND_HEALTH_H
+#define BACKEND_HEALTH_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+struct OutlierDetectionConfig;
+
+// Health of one backend address, shared by every route that uses it.
+// Written by the active health checker and by passive outlier detection on
+// the request path, read by the load balancer. A healthy backend costs the
+// balancer one relaxed load; an ejection expires lazily on the first check
+// after its deadline, so no timer is involved.
+class BackendHealth {
+public:
+    bool available() {
+        std::uint8_t down = down_.load(std::memory_order_relaxed);
+        return down == 0 || (down == kEjected && try_readmit());
+    }
+
+    // Passive outlier detection: outcome of one request. Connect errors,
+    // timeouts and 5xx responses are failures; enough of them in a row
+    // eject the backend for an exponentially growing period.
+    void record_success();
+    // Returns the ejection period in ms if this failure ejected the backend, else 0
+    std::int64_t record_failure();
+
+    // Active health checking: result of the latest threshold decision
+    void set_probe_healthy(bool healthy);
+    bool probe_healthy() const { return (down_.load(std::memory_order_relaxed) & kProbeFailed) == 0; }
+
+    // Apply outlier detection settings (at startup and on config reload)
+    static void configure(const OutlierDetectionConfig& config);
+
+private:
+    static constexpr std::uint8_t kProbeFailed = 1;
+    static constexpr std::uint8_t kEjected = 2;
+
+    static std::int64_t now_ms();
+    bool try_readmit();
+
+private:
+    std::atomic<std::uint8_t> down_{0};
+    std::atomic<std::uint32_t> consecutive_failures_{0};
+    std::atomic<std::uint32_t> ejections_{0};        // in a row, drives the backoff
+    std::atomic<std::int64_t> ejected_until_ms_{0};  // steady clock
+
+    static std::atomic<std::uint32_t> max_failures_;
+    static std::atomic<std::int64_t> base_ejection_ms_;
+    static std::atomic<std::int64_t> max_ejection_ms_;
+};
+
+#endif // BACKEND_HEALTH_H
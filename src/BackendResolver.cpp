@@ -0,0 +1,146 @@
+#include "BackendResolver.h"
+#include "Log.h"
+#include <boost/asio/post.hpp>
+#include <boost/asio/strand.hpp>
+
+namespace {
+
+// Retry interval after a failed lookup (the previous endpoints stay in use)
+constexpr std::chrono::seconds kRetryDelay{5};
+
+} // namespace
+
+BackendResolver::BackendResolver(net::io_context& ioc, std::chrono::seconds ttl)
+    : ioc_(ioc), ttl_(ttl) {
+}
+
+std::shared_ptr<BackendResolver::Target> BackendResolver::add(const std::string& backend) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = targets_.find(backend);
+    if (it != targets_.end()) {
+        return it->second;
+    }
+
+    auto target = std::make_shared<Target>();
+    if (!parse_address(backend, target->host_, target->port_)) {
+        Log::warn() << "Invalid backend format (expected host:port): " << backend;
+        return nullptr;
+    }
+    target->name_ = backend;
+
+    // IP literals never need DNS
+    boost::system::error_code ec;
+    auto address = net::ip::make_address(target->host_, ec);
+    if (!ec) {
+        target->literal_ = true;
+        target->endpoints_.store(
+            std::make_shared<const Endpoints>(Endpoints{tcp::endpoint(address, target->port_)}),
+            std::memory_order_release);
+    } else {
+        target->refresh_timer_ = std::make_unique<net::steady_timer>(net::make_strand(ioc_));
+        resolve(target);
+    }
+
+    targets_.emplace(backend, target);
+    return target;
+}
+
+std::shared_ptr<BackendResolver::Target> BackendResolver::find(const std::string& backend) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = targets_.find(backend);
+    return it != targets_.end() ? it->second : nullptr;
+}
+
+std::size_t BackendResolver::retain(const std::unordered_set<const Target*>& live) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::size_t dropped = 0;
+    for (auto it = targets_.begin(); it != targets_.end();) {
+        auto& target = it->second;
+        if (live.count(target.get())) {
+            ++it;
+            continue;
+        }
+
+        target->retired_ = true;
+        if (target->refresh_timer_) {
+            // The timer is only touched on its strand
+            net::post(target->refresh_timer_->get_executor(), [target] { target->refresh_timer_->cancel(); });
+        }
+        it = targets_.erase(it);
+        dropped++;
+    }
+    return dropped;
+}
+
+void BackendResolver::stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+    for (auto& [name, target] : targets_) {
+        if (target->refresh_timer_) {
+            // On the target's strand, as in retain(); handlers that run
+            // first see stopped_ and don't re-arm
+            net::post(target->refresh_timer_->get_executor(), [target = target] { target->refresh_timer_->cancel(); });
+        }
+    }
+}
+
+bool BackendResolver::parse_address(const std::string& backend, std::string& host, unsigned short& port) {
+    size_t colon_pos = backend.find_last_of(':');
+    if (colon_pos == std::string::npos || colon_pos == 0) {
+        return false;
+    }
+
+    host = backend.substr(0, colon_pos);
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+
+    try {
+        int value = std::stoi(backend.substr(colon_pos + 1));
+        if (value <= 0 || value > 65535) {
+            return false;
+        }
+        port = static_cast<unsigned short>(value);
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+void BackendResolver::resolve(std::shared_ptr<Target> target) {
+    // One resolver per lookup: refreshes for different targets may run on
+    // different worker threads at the same time. Each target's lookups and
+    // timer share its strand, so retain() can cancel the timer safely.
+    auto resolver = std::make_shared<tcp::resolver>(target->refresh_timer_->get_executor());
+    resolver->async_resolve(target->host_, std::to_string(target->port_),
+        [this, target, resolver](boost::system::error_code ec, tcp::resolver::results_type results) {
+            if (stopped_ || target->retired_) {
+                return;
+            }
+
+            if (ec || results.empty()) {
+                Log::warn() << "DNS lookup failed for backend " << target->name_ << ": "
+                            << (ec ? ec.message() : "no addresses");
+                schedule_refresh(target, std::min(ttl_, kRetryDelay));
+                return;
+            }
+
+            auto endpoints = std::make_shared<Endpoints>();
+            endpoints->reserve(results.size());
+            for (const auto& entry : results) {
+                endpoints->push_back(entry.endpoint());
+            }
+            target->endpoints_.store(std::move(endpoints), std::memory_order_release);
+
+            schedule_refresh(target, ttl_);
+        });
+}
+
+void BackendResolver::schedule_refresh(std::shared_ptr<Target> target, std::chrono::seconds delay) {
+    target->refresh_timer_->expires_after(delay);
+    target->refresh_timer_->async_wait([this, target](boost::system::error_code ec) {
+        if (!ec && !stopped_ && !target->retired_) {
+            resolve(target);
+        }
+    });
+}
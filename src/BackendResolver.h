@@ -0,0 +1,111 @@
+#ifndef BACKEND_RESOLVER_H
+#define BACKEND_RESOLVER_H
+
+#include "BackendHealth.h"
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace net = boost::asio;
+using tcp = boost::asio::ip::tcp;
+
+// Shared DNS cache for backend addresses.
+// Each "host:port" backend is parsed once when it is registered and resolved
+// asynchronously in the background, refreshing every TTL. The request path only
+// reads the last published endpoint list and never waits on DNS.
+class BackendResolver {
+public:
+    using Endpoints = std::vector<tcp::endpoint>;
+
+    class Target {
+    public:
+        const std::string& name() const { return name_; }
+        const std::string& host() const { return host_; }
+        unsigned short port() const { return port_; }
+        bool is_literal() const { return literal_; }
+
+        // Active and passive health, consulted by the load balancer
+        BackendHealth& health() { return health_; }
+
+        // Most recently resolved endpoints; nullptr until the first lookup completes
+        std::shared_ptr<const Endpoints> endpoints() const {
+            return endpoints_.load(std::memory_order_acquire);
+        }
+
+    private:
+        friend class BackendResolver;
+
+        std::string name_;
+        std::string host_;
+        unsigned short port_ = 0;
+        bool literal_ = false;
+        std::atomic<std::shared_ptr<const Endpoints>> endpoints_;
+        BackendHealth health_;
+        std::unique_ptr<net::steady_timer> refresh_timer_;  // on its own strand, with its lookups
+        std::atomic<bool> retired_{false};  // dropped by retain(); stops refreshing
+    };
+
+    BackendResolver(net::io_context& ioc, std::chrono::seconds ttl);
+
+    // Register a backend ("host:port"), returns nullptr if the address is malformed.
+    // Targets are registered when a routing table is built (startup and config
+    // reloads); the request path uses the returned Target directly.
+    std::shared_ptr<Target> add(const std::string& backend);
+
+    // Registered target for backend, or nullptr
+    std::shared_ptr<Target> find(const std::string& backend) const;
+
+    // Unregister every target not in live (the ones the newly published
+    // snapshot routes to) and cancel their DNS refreshes. Requests still
+    // running on an older snapshot keep using the targets they hold.
+    // Returns the number of targets dropped.
+    std::size_t retain(const std::unordered_set<const Target*>& live);
+
+    void stop();
+
+    // Split "host:port" (or "[v6]:port"), returns false on malformed input
+    static bool parse_address(const std::string& backend, std::string& host, unsigned short& port);
+
+    // Pass target's endpoints to handler(ec, endpoints). If the background
+    // lookup hasn't completed yet, resolve on the spot without blocking.
+    template<class Executor, class Handler>
+    static void async_endpoints(const Target& target, const Executor& ex, Handler&& handler) {
+        auto endpoints = target.endpoints();
+        if (endpoints && !endpoints->empty()) {
+            handler(boost::system::error_code{}, *endpoints);
+            return;
+        }
+
+        auto resolver = std::make_shared<tcp::resolver>(ex);
+        resolver->async_resolve(target.host(), std::to_string(target.port()),
+            [resolver, handler = std::forward<Handler>(handler)](
+                boost::system::error_code ec, tcp::resolver::results_type results) mutable {
+                Endpoints resolved;
+                for (const auto& entry : results) {
+                    resolved.push_back(entry.endpoint());
+                }
+                handler(ec, resolved);
+            });
+    }
+
+private:
+    void resolve(std::shared_ptr<Target> target);
+    void schedule_refresh(std::shared_ptr<Target> target, std::chrono::seconds delay);
+
+private:
+    net::io_context& ioc_;
+    std::chrono::seconds ttl_;
+    mutable std::mutex mutex_;  // guards targets_
+    std::unordered_map<std::string, std::shared_ptr<Target>> targets_;
+    std::atomic<bool> stopped_{false};
+};
+
+#endif // BACKEND_RESOLVER_H
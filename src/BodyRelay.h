@@ -0,0 +1,282 @@
+#ifndef BODY_RELAY_H
+#define BODY_RELAY_H
+
+#include "Compression.h"
+#include <boost/asio/compose.hpp>
+#include <boost/asio/coroutine.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <sys/sendfile.h>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace net = boost::asio;
+
+namespace detail {
+
+// Arm the deadline of a beast::basic_stream (or a stream layered on one) for
+// the next operation; a zero timeout disables it
+template<class Stream>
+void set_deadline(Stream& stream, std::chrono::steady_clock::duration timeout) {
+    if (timeout.count() > 0) {
+        beast::get_lowest_layer(stream).expires_after(timeout);
+    } else {
+        beast::get_lowest_layer(stream).expires_never();
+    }
+}
+
+// Default for async_relay_body: the body is only passed on
+struct no_tap {
+    void operator()(const char*, std::size_t) const {}
+};
+
+template<class ReadStream, class WriteStream, class Parser, class Serializer, class Tap>
+struct body_relay_op : net::coroutine {
+    ReadStream& input;
+    beast::flat_buffer& input_buffer;
+    Parser& parser;
+    WriteStream& output;
+    Serializer& serializer;
+    char* buffer;
+    std::size_t buffer_size;
+    std::chrono::steady_clock::duration read_timeout;
+    std::chrono::steady_clock::duration write_timeout;
+    Tap tap;
+    Compressor* compressor = nullptr;
+    std::uint64_t relayed = 0;
+    const char* pending = nullptr;  // decoded bytes not yet compressed
+    std::size_t pending_size = 0;
+
+    template<class Self>
+    void operator()(Self& self, beast::error_code ec = {}, std::size_t = 0) {
+        auto& body = parser.get().body();
+
+        BOOST_ASIO_CORO_REENTER(*this) {
+            while (!serializer.is_done()) {
+                if (pending_size == 0 && !parser.is_done()) {
+                    // Take whatever the peer has sent so far (up to one buffer),
+                    // so slow streams such as SSE aren't held back
+                    body.data = buffer;
+                    body.size = buffer_size;
+                    set_deadline(input, read_timeout);
+                    BOOST_ASIO_CORO_YIELD
+                        http::async_read_some(input, input_buffer, parser, std::move(self));
+                    if (ec == http::error::need_buffer) {
+                        ec = {};
+                    }
+                    if (ec) {
+                        break;
+                    }
+                    body.size = buffer_size - body.size;
+                    body.data = buffer;
+                    body.more = !parser.is_done();
+                    pending = buffer;
+                    pending_size = compressor ? body.size : 0;
+
+                    // Nothing decoded yet (e.g. only a chunk header arrived); an
+                    // empty write would end a chunked body early
+                    if (body.size == 0 && body.more) {
+                        continue;
+                    }
+                    if (body.size > 0 && !compressor) {
+                        tap(static_cast<const char*>(body.data), body.size);
+                    }
+                } else {
+                    body.data = nullptr;
+                    body.size = 0;
+                    body.more = false;
+                }
+
+                if (compressor) {
+                    // Compress what was read, a buffer of output at a time;
+                    // the cache keeps the compressed body, as it was sent
+                    auto compressed = compressor->compress(pending, pending_size, parser.is_done());
+                    if (compressor->failed()) {
+                        ec = beast::errc::make_error_code(beast::errc::io_error);
+                        break;
+                    }
+                    body.data = const_cast<char*>(compressed.data());
+                    body.size = compressed.size();
+                    body.more = pending_size > 0 || !compressor->finished();
+                    if (body.size == 0 && body.more) {
+                        continue;
+                    }
+                    if (body.size > 0) {
+                        tap(compressed.data(), compressed.size());
+                    }
+                }
+
+                relayed += body.size;
+                set_deadline(output, write_timeout);
+                BOOST_ASIO_CORO_YIELD
+                    http::async_write(output, serializer, std::move(self));
+                if (ec == http::error::need_buffer) {
+                    ec = {};
+                }
+                if (ec) {
+                    break;
+                }
+            }
+            self.complete(ec, relayed);
+        }
+    }
+};
+
+// Send part of a file to a socket with sendfile() until it is done or the
+// socket buffer is full
+struct send_file_op : net::coroutine {
+    net::ip::tcp::socket& socket;
+    int fd;
+    std::uint64_t offset;
+    std::uint64_t remaining;
+    std::uint64_t& sent;
+
+    template<class Self>
+    void operator()(Self& self, beast::error_code ec = {}) {
+        BOOST_ASIO_CORO_REENTER(*this) {
+            for (;;) {
+                BOOST_ASIO_CORO_YIELD
+                    socket.async_wait(net::socket_base::wait_write, std::move(self));
+                // sendfile() must not block the thread on a full socket buffer
+                if (!ec) {
+                    socket.native_non_blocking(true, ec);
+                }
+                if (!ec) {
+                    ec = send_some();
+                }
+                if (ec != net::error::would_block) {
+                    break;
+                }
+                ec = {};
+            }
+            self.complete(ec);
+        }
+    }
+
+    beast::error_code send_some() {
+        while (remaining > 0) {
+            off_t position = static_cast<off_t>(offset);
+            ssize_t n = ::sendfile(socket.native_handle(), fd, &position,
+                                   static_cast<std::size_t>(std::min<std::uint64_t>(remaining, 1u << 30)));
+            if (n > 0) {
+                offset += static_cast<std::uint64_t>(n);
+                remaining -= static_cast<std::uint64_t>(n);
+                sent += static_cast<std::uint64_t>(n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && errno == EAGAIN) {
+                return net::error::would_block;
+            }
+            return n == 0 ? beast::error_code(net::error::eof)
+                          : beast::error_code(errno, net::error::get_system_category());
+        }
+        return {};
+    }
+};
+
+} // namespace detail
+
+// Stream a message body from `input` to `output` once its header has been read
+// by `parser` and written by `serializer` (both over the same buffer_body
+// message). Body bytes pass through the caller's fixed buffer one chunk at a
+// time: the next read is only issued after the previous chunk was written, so a
+// slow peer on either side applies backpressure to the other. Chunked encoding
+// is decoded by the parser and re-applied by the serializer when the outgoing
+// header asks for it.
+//
+// Each read from `input` and each write to `output` must finish within
+// read_timeout and write_timeout respectively (both streams are layered on
+// beast::basic_stream), so a stalled peer fails the relay with
+// beast::error::timeout instead of holding the connection forever.
+//
+// tap(const char* data, std::size_t size) sees every chunk of the decoded
+// body before it is written, e.g. to keep a copy for the response cache.
+//
+// With a compressor, the decoded body is compressed on its way through and
+// tap sees the compressed bytes; the outgoing header must then be chunked
+// (or close-delimited), as the compressed length isn't known up front.
+//
+// Completes with void(error_code, std::uint64_t body_bytes).
+template<class ReadStream, class WriteStream, class Parser, class Serializer, class Tap, class Handler>
+auto async_relay_body(
+    ReadStream& input,
+    beast::flat_buffer& input_buffer,
+    Parser& parser,
+    WriteStream& output,
+    Serializer& serializer,
+    char* buffer,
+    std::size_t buffer_size,
+    std::chrono::steady_clock::duration read_timeout,
+    std::chrono::steady_clock::duration write_timeout,
+    Compressor* compressor,
+    Tap&& tap,
+    Handler&& handler)
+{
+    return net::async_compose<Handler, void(beast::error_code, std::uint64_t)>(
+        detail::body_relay_op<ReadStream, WriteStream, Parser, Serializer, std::decay_t<Tap>>{
+            {}, input, input_buffer, parser, output, serializer, buffer, buffer_size,
+            read_timeout, write_timeout, std::forward<Tap>(tap), compressor && *compressor ? compressor : nullptr},
+        handler, input, output);
+}
+
+template<class ReadStream, class WriteStream, class Parser, class Serializer, class Tap, class Handler>
+auto async_relay_body(
+    ReadStream& input,
+    beast::flat_buffer& input_buffer,
+    Parser& parser,
+    WriteStream& output,
+    Serializer& serializer,
+    char* buffer,
+    std::size_t buffer_size,
+    std::chrono::steady_clock::duration read_timeout,
+    std::chrono::steady_clock::duration write_timeout,
+    Tap&& tap,
+    Handler&& handler)
+{
+    return async_relay_body(input, input_buffer, parser, output, serializer, buffer, buffer_size,
+                            read_timeout, write_timeout, nullptr, std::forward<Tap>(tap),
+                            std::forward<Handler>(handler));
+}
+
+template<class ReadStream, class WriteStream, class Parser, class Serializer, class Handler>
+auto async_relay_body(
+    ReadStream& input,
+    beast::flat_buffer& input_buffer,
+    Parser& parser,
+    WriteStream& output,
+    Serializer& serializer,
+    char* buffer,
+    std::size_t buffer_size,
+    std::chrono::steady_clock::duration read_timeout,
+    std::chrono::steady_clock::duration write_timeout,
+    Handler&& handler)
+{
+    return async_relay_body(input, input_buffer, parser, output, serializer, buffer, buffer_size,
+                            read_timeout, write_timeout, detail::no_tap{}, std::forward<Handler>(handler));
+}
+
+// Write size bytes of file fd from offset to socket with sendfile(), so they
+// go from the page cache to the socket (and the kernel's TLS, under kTLS)
+// without a copy through user space. sent counts the bytes written so far,
+// so the caller can watch progress; there is no deadline of its own, so
+// cancel the socket to give up.
+//
+// Completes with void(error_code).
+template<class Handler>
+auto async_send_file(net::ip::tcp::socket& socket, int fd, std::uint64_t offset, std::uint64_t size,
+                     std::uint64_t& sent, Handler&& handler) {
+    return net::async_compose<Handler, void(beast::error_code)>(
+        detail::send_file_op{{}, socket, fd, offset, size, sent}, handler, socket);
+}
+
+#endif // BODY_RELAY_H
@@ -1,10 +1,11 @@
 #include "CertificateManager.h"
-#include <iostream>
+#include "Log.h"
+#include "CertificateStore.h"
+#include <set>
 #include <filesystem>
 #include <fstream>
 #include <openssl/x509.h>
 #include <openssl/pem.h>
-#include <openssl/rsa.h>
 #include <openssl/evp.h>
 #include <openssl/x509v3.h>
 
@@ -14,16 +15,16 @@ CertificateManager::CertificateManager(const std::string& cert_dir, const std::s
     // Create certificate directory if it doesn't exist
     std::filesystem::create_directories(cert_dir_);
     
-    std::cout << "Certificate manager initialized with directory: " << cert_dir_ << std::endl;
+    Log::info() << "Certificate manager initialized with directory: " << cert_dir_;
 }
 
 bool CertificateManager::ensure_certificate(const std::string& domain) {
     if (certificate_exists(domain) && is_certificate_valid(domain)) {
-        std::cout << "Valid certificate already exists for domain: " << domain << std::endl;
+        Log::info() << "Valid certificate already exists for domain: " << domain;
         return true;
     }
     
-    std::cout << "Generating certificate for domain: " << domain << std::endl;
+    Log::info() << "Generating certificate for domain: " << domain;
     
     // For now, generate self-signed certificates
     // In production, you would implement ACME protocol here
@@ -31,6 +32,7 @@ bool CertificateManager::ensure_certificate(const std::string& domain) {
 }
 
 CertificateInfo CertificateManager::get_certificate_info(const std::string& domain) const {
+    std::lock_guard<std::mutex> lock(mutex_);
     auto it = certificates_.find(domain);
     if (it != certificates_.end()) {
         return it->second;
@@ -60,18 +62,79 @@ void CertificateManager::setup_ssl_context(boost::asio::ssl::context& ctx, const
         ctx.use_certificate_chain_file(cert_path);
         ctx.use_private_key_file(key_path, boost::asio::ssl::context::pem);
         
-        std::cout << "SSL context configured for domain: " << domain << std::endl;
+        Log::info() << "SSL context configured for domain: " << domain;
     } catch (const std::exception& e) {
-        std::cerr << "Error setting up SSL context for " << domain << ": " << e.what() << std::endl;
+        Log::error() << "Error setting up SSL context for " << domain << ": " << e.what();
         throw;
     }
 }
 
+std::size_t CertificateManager::load_certificates(const std::vector<std::string>& domains, CertificateStore& store) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    std::set<std::string> wanted(domains.begin(), domains.end());
+    std::vector<std::string> removed;
+    for (auto it = certificates_.begin(); it != certificates_.end();) {
+        if (wanted.count(it->first) == 0) {
+            removed.push_back(it->first);
+            it = certificates_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (!removed.empty()) {
+        store.remove(removed);
+    }
+    
+    // All file access happens here, never during a handshake
+    std::vector<CertificateStore::Certificate> changed;
+    std::vector<CertificateInfo> infos;
+    for (const auto& domain : wanted) {
+        if (!certificate_exists(domain) && !ensure_certificate(domain)) {
+            Log::warn() << "No certificate for domain: " << domain;
+            continue;
+        }
+        
+        CertificateInfo info;
+        info.domain = domain;
+        info.cert_path = get_cert_path(domain);
+        info.key_path = get_key_path(domain);
+        info.auto_renew = true;
+        info.expiry_time = 0;
+        std::error_code cert_ec, key_ec;
+        info.modified = std::max(std::filesystem::last_write_time(info.cert_path, cert_ec),
+                                 std::filesystem::last_write_time(info.key_path, key_ec));
+        
+        auto it = certificates_.find(domain);
+        if (it != certificates_.end() && it->second.modified == info.modified) {
+            continue;
+        }
+        changed.push_back({domain, info.cert_path, info.key_path});
+        infos.push_back(std::move(info));
+    }
+    
+    std::size_t loaded = store.load(changed);
+    
+    // A certificate that failed to load is retried once its files change
+    for (auto& info : infos) {
+        certificates_[info.domain] = std::move(info);
+    }
+    
+    if (loaded > 0 || !removed.empty()) {
+        Log::info() << "Certificate store: " << loaded << " loaded, " << removed.size()
+                    << " removed, " << store.size() << " total";
+    }
+    return loaded;
+}
+
 void CertificateManager::check_renewals() {
-    // Check all certificates for renewal
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    // Check all certificates for renewal (the next load_certificates call
+    // picks up the new files)
     for (const auto& [domain, info] : certificates_) {
         if (info.auto_renew && !is_certificate_valid(domain)) {
-            std::cout << "Renewing certificate for domain: " << domain << std::endl;
+            Log::info() << "Renewing certificate for domain: " << domain;
             ensure_certificate(domain);
         }
     }
@@ -80,27 +143,19 @@ void CertificateManager::check_renewals() {
 bool CertificateManager::request_certificate_acme(const std::string& domain) {
     // Placeholder for ACME implementation
     // This would implement the ACME protocol to get certificates from Let's Encrypt
-    std::cout << "ACME certificate request not implemented yet for domain: " << domain << std::endl;
+    Log::info() << "ACME certificate request not implemented yet for domain: " << domain;
     return false;
 }
 
 bool CertificateManager::generate_self_signed(const std::string& domain) {
     try {
-        // Generate RSA key pair
-        EVP_PKEY* pkey = EVP_PKEY_new();
-        RSA* rsa = RSA_new();
-        BIGNUM* bne = BN_new();
-        
-        if (BN_set_word(bne, RSA_F4) != 1) {
-            throw std::runtime_error("Failed to set RSA exponent");
+        // Generate an ECDSA P-256 key pair: signing the handshake with it
+        // costs a fraction of an RSA-2048 signature
+        EVP_PKEY* pkey = EVP_PKEY_Q_keygen(nullptr, nullptr, "EC", "P-256");
+        if (!pkey) {
+            throw std::runtime_error("Failed to generate EC key");
         }
         
-        if (RSA_generate_key_ex(rsa, 2048, bne, nullptr) != 1) {
-            throw std::runtime_error("Failed to generate RSA key");
-        }
-        
-        EVP_PKEY_assign_RSA(pkey, rsa);
-        
         // Create certificate
         X509* x509 = X509_new();
         X509_set_version(x509, 2);
@@ -154,13 +209,12 @@ bool CertificateManager::generate_self_signed(const std::string& domain) {
         // Cleanup
         X509_free(x509);
         EVP_PKEY_free(pkey);
-        BN_free(bne);
         
-        std::cout << "Generated self-signed certificate for domain: " << domain << std::endl;
+        Log::info() << "Generated self-signed certificate for domain: " << domain;
         return true;
         
     } catch (const std::exception& e) {
-        std::cerr << "Error generating self-signed certificate: " << e.what() << std::endl;
+        Log::error() << "Error generating self-signed certificate: " << e.what();
         return false;
     }
 }
@@ -4,14 +4,20 @@
 #include <string>
 #include <memory>
 #include <map>
+#include <mutex>
+#include <vector>
+#include <filesystem>
 #include <boost/asio/ssl/context.hpp>
 
+class CertificateStore;
+
 struct CertificateInfo {
     std::string cert_path;
     std::string key_path;
     std::string domain;
     time_t expiry_time;
     bool auto_renew;
+    std::filesystem::file_time_type modified{};  // newest of the two files when loaded
 };
 
 class CertificateManager {
@@ -27,6 +33,11 @@ public:
     // Setup SSL context with certificates
     void setup_ssl_context(boost::asio::ssl::context& ctx, const std::string& domain);
     
+    // Bring the store in line with domains: missing certificates are
+    // generated, ones whose files changed since the last call are reloaded
+    // and domains no longer listed are removed. Returns the number (re)loaded.
+    std::size_t load_certificates(const std::vector<std::string>& domains, CertificateStore& store);
+    
     // Check and renew certificates
     void check_renewals();
 
@@ -46,7 +57,8 @@ private:
 private:
     std::string cert_dir_;
     std::string email_;
-    std::map<std::string, CertificateInfo> certificates_;
+    std::map<std::string, CertificateInfo> certificates_;  // loaded into the store
+    mutable std::mutex mutex_;
 };
 
 #endif // CERTIFICATE_MANAGER_H
@@ -0,0 +1,193 @@
+#include "CertificateStore.h"
+#include "Log.h"
+#include <algorithm>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+namespace {
+
+inline char to_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+std::string lowercase(std::string_view name) {
+    std::string out(name);
+    std::transform(out.begin(), out.end(), out.begin(), to_lower);
+    if (!out.empty() && out.back() == '.') {
+        out.pop_back();
+    }
+    return out;
+}
+
+} // namespace
+
+std::size_t CertificateStore::load(const std::vector<Certificate>& certificates) {
+    std::vector<std::pair<const Certificate*, Loaded>> built;
+    built.reserve(certificates.size());
+    for (const auto& certificate : certificates) {
+        auto ctx = std::make_shared<ssl::context>(ssl::context::tls_server);
+        try {
+            if (setup_) {
+                setup_(*ctx);
+            }
+            ctx->use_certificate_chain_file(certificate.cert_path);
+            ctx->use_private_key_file(certificate.key_path, ssl::context::pem);
+        } catch (const std::exception& e) {
+            Log::warn() << "Failed to load certificate for " << certificate.name << ": " << e.what();
+            continue;
+        }
+
+        std::vector<std::string> names = certificate_names(*ctx);
+        names.push_back(lowercase(certificate.name));
+        std::sort(names.begin(), names.end());
+        names.erase(std::unique(names.begin(), names.end()), names.end());
+        built.emplace_back(&certificate, Loaded{std::move(ctx), std::move(names)});
+    }
+    if (built.empty()) {
+        return 0;
+    }
+
+    // Copy-on-write: the new table shares every other context with the old one
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    auto next = std::make_shared<Table>(*table());
+    for (auto& [certificate, loaded] : built) {
+        if (auto previous = next->loaded.find(certificate->name); previous != next->loaded.end()) {
+            unpublish(*next, previous->second);
+        }
+        for (const auto& published : loaded.names) {
+            if (published.rfind("*.", 0) == 0) {
+                next->wildcard[published.substr(2)] = loaded.ctx;
+            } else {
+                next->exact[published] = loaded.ctx;
+            }
+        }
+        next->loaded[certificate->name] = std::move(loaded);
+    }
+    publish(std::move(next));
+    return built.size();
+}
+
+void CertificateStore::remove(const std::vector<std::string>& names) {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    auto next = std::make_shared<Table>(*table());
+    std::size_t removed = 0;
+    for (const auto& name : names) {
+        if (auto it = next->loaded.find(name); it != next->loaded.end()) {
+            unpublish(*next, it->second);
+            next->loaded.erase(it);
+            removed++;
+        }
+    }
+    if (removed > 0) {
+        publish(std::move(next));
+    }
+}
+
+std::shared_ptr<ssl::context> CertificateStore::find(std::string_view server_name) const {
+    // DNS names are at most 253 characters
+    char buffer[256];
+    if (server_name.empty() || server_name.size() >= sizeof(buffer)) {
+        return nullptr;
+    }
+    std::size_t size = server_name.size();
+    for (std::size_t i = 0; i < size; ++i) {
+        buffer[i] = to_lower(server_name[i]);
+    }
+    if (buffer[size - 1] == '.') {
+        size--;
+    }
+    std::string_view host(buffer, size);
+
+    auto current = table();
+    if (auto it = current->exact.find(host); it != current->exact.end()) {
+        return it->second;
+    }
+
+    // A wildcard covers exactly one label
+    std::size_t dot = host.find('.');
+    if (dot != std::string_view::npos) {
+        if (auto it = current->wildcard.find(host.substr(dot + 1)); it != current->wildcard.end()) {
+            return it->second;
+        }
+    }
+    return nullptr;
+}
+
+std::size_t CertificateStore::size() const {
+    return table()->loaded.size();
+}
+
+int CertificateStore::on_server_name(SSL* ssl, int* alert, void* arg) {
+    (void)alert;
+    const char* server_name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (!server_name) {
+        return SSL_TLSEXT_ERR_NOACK;  // no SNI: the listener's default certificate
+    }
+
+    auto ctx = static_cast<const CertificateStore*>(arg)->find(server_name);
+    if (!ctx) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    SSL_set_SSL_CTX(ssl, ctx->native_handle());
+    return SSL_TLSEXT_ERR_OK;
+}
+
+std::shared_ptr<const CertificateStore::Table> CertificateStore::table() const {
+    // Each thread keeps the last table it saw and only re-reads the shared
+    // pointer after a change bumps the generation
+    thread_local std::shared_ptr<const Table> cached;
+
+    if (!cached || cached->generation != generation_.load(std::memory_order_acquire)) {
+        cached = current_.load(std::memory_order_acquire);
+    }
+    return cached;
+}
+
+void CertificateStore::publish(std::shared_ptr<Table> table) {
+    table->generation = generation_.load(std::memory_order_relaxed) + 1;
+    current_.store(std::move(table), std::memory_order_release);
+    generation_.fetch_add(1, std::memory_order_release);
+}
+
+void CertificateStore::unpublish(Table& table, const Loaded& loaded) {
+    for (const auto& published : loaded.names) {
+        bool wildcard = published.rfind("*.", 0) == 0;
+        Map& map = wildcard ? table.wildcard : table.exact;
+        auto it = map.find(wildcard ? std::string_view(published).substr(2) : std::string_view(published));
+        if (it != map.end() && it->second == loaded.ctx) {
+            map.erase(it);
+        }
+    }
+}
+
+std::vector<std::string> CertificateStore::certificate_names(ssl::context& ctx) {
+    std::vector<std::string> names;
+    X509* cert = SSL_CTX_get0_certificate(ctx.native_handle());
+    if (!cert) {
+        return names;
+    }
+
+    auto* alt_names = static_cast<GENERAL_NAMES*>(X509_get_ext_d2i(cert, NID_subject_alt_name, nullptr, nullptr));
+    if (alt_names) {
+        for (int i = 0; i < sk_GENERAL_NAME_num(alt_names); ++i) {
+            const GENERAL_NAME* entry = sk_GENERAL_NAME_value(alt_names, i);
+            if (entry->type == GEN_DNS) {
+                const auto* dns = entry->d.dNSName;
+                names.push_back(lowercase(std::string_view(
+                    reinterpret_cast<const char*>(ASN1_STRING_get0_data(dns)), ASN1_STRING_length(dns))));
+            }
+        }
+        GENERAL_NAMES_free(alt_names);
+    }
+
+    // The common name only counts when there are no DNS alternative names
+    if (names.empty()) {
+        char common_name[256];
+        int length = X509_NAME_get_text_by_NID(X509_get_subject_name(cert), NID_commonName,
+                                               common_name, sizeof(common_name));
+        if (length > 0) {
+            names.push_back(lowercase(std::string_view(common_name, length)));
+        }
+    }
+    return names;
+}
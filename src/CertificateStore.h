@@ -0,0 +1,94 @@
+#ifndef CERTIFICATE_STORE_H
+#define CERTIFICATE_STORE_H
+
+#include <boost/asio/ssl/context.hpp>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace ssl = boost::asio::ssl;
+
+// In-memory TLS contexts keyed by hostname, chosen by SNI during the handshake.
+// Certificates are read from disk only when they are loaded; each change is
+// published as a new immutable table with an atomic swap, the same way
+// configuration snapshots are. A handshake does one hash lookup for the exact
+// name and, failing that, one for the wildcard ("*.example.com") covering it.
+// Handshakes that already picked a context keep it (SSL_CTX is refcounted).
+class CertificateStore {
+public:
+    // Applied to every context the store builds (protocol options, ALPN),
+    // since the selected context replaces the listener's for the handshake
+    using ContextSetup = std::function<void(ssl::context&)>;
+
+    struct Certificate {
+        std::string name;
+        std::string cert_path;
+        std::string key_path;
+    };
+
+    explicit CertificateStore(ContextSetup setup) : setup_(std::move(setup)) {}
+
+    // Build contexts from PEM files and publish each under its name and every
+    // DNS name in its certificate, all in one swap. Certificates whose files
+    // can't be loaded are skipped (an earlier version stays published).
+    // Returns the number loaded.
+    std::size_t load(const std::vector<Certificate>& certificates);
+    bool load(const std::string& name, const std::string& cert_path, const std::string& key_path) {
+        return load({Certificate{name, cert_path, key_path}}) == 1;
+    }
+
+    // Remove the names certificates were loaded under
+    void remove(const std::vector<std::string>& names);
+
+    // Context for an SNI server name, or nullptr (handshake path: no disk
+    // access, no allocation)
+    std::shared_ptr<ssl::context> find(std::string_view server_name) const;
+
+    std::size_t size() const;
+
+    // SSL_CTX_set_tlsext_servername_callback hook; arg is the store
+    static int on_server_name(SSL* ssl, int* alert, void* arg);
+
+private:
+    struct StringHash {
+        using is_transparent = void;
+        std::size_t operator()(std::string_view key) const { return std::hash<std::string_view>{}(key); }
+    };
+    using Map = std::unordered_map<std::string, std::shared_ptr<ssl::context>, StringHash, std::equal_to<>>;
+
+    struct Loaded {
+        std::shared_ptr<ssl::context> ctx;
+        std::vector<std::string> names;  // published under these
+    };
+
+    struct Table {
+        std::uint64_t generation = 0;
+        Map exact;      // "www.example.com"
+        Map wildcard;   // "*.example.com" stored as "example.com"
+        std::unordered_map<std::string, Loaded> loaded;  // by load() name
+    };
+
+    std::shared_ptr<const Table> table() const;
+    void publish(std::shared_ptr<Table> table);
+
+    // Take a loaded certificate's names out of table (unless another
+    // certificate has claimed them since)
+    static void unpublish(Table& table, const Loaded& loaded);
+
+    // DNS names (subjectAltName, else CN) of the context's certificate
+    static std::vector<std::string> certificate_names(ssl::context& ctx);
+
+private:
+    ContextSetup setup_;
+    std::mutex write_mutex_;  // serializes load/remove; readers never lock
+    std::atomic<std::shared_ptr<const Table>> current_{std::make_shared<const Table>()};
+    std::atomic<std::uint64_t> generation_{0};
+};
+
+#endif // CERTIFICATE_STORE_H
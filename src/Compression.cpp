@@ -0,0 +1,405 @@
+#include "Compression.h"
+#include "Log.h"
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <zlib.h>
+#ifdef PRISTINE_HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+std::atomic<std::uint64_t> Compression::gzip_{0};
+std::atomic<std::uint64_t> Compression::brotli_{0};
+std::atomic<std::uint64_t> Compression::bytes_in_{0};
+std::atomic<std::uint64_t> Compression::bytes_out_{0};
+
+namespace {
+
+constexpr std::size_t kOutputSize = 16 * 1024;      // compressed bytes per write to the client
+constexpr std::size_t kMaxIdleContexts = 16;         // kept per thread
+constexpr std::size_t kMaxPooledBytes = 32 << 20;    // brotli encoder memory kept per thread
+constexpr int kBrotliWindow = 18;                    // 256 KB, as much as on-the-fly compression gains from
+
+// Codings a cache variant is told apart by, in canonical order
+constexpr std::string_view kCodings[] = {"br", "compress", "deflate", "gzip", "zstd"};
+
+std::string_view trim(std::string_view value) {
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+        value.remove_prefix(1);
+    }
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+        value.remove_suffix(1);
+    }
+    return value;
+}
+
+bool iequals(std::string_view a, std::string_view b) {
+    return a.size() == b.size() &&
+           std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+               return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+           });
+}
+
+bool icontains(std::string_view haystack, std::string_view needle) {
+    return std::search(haystack.begin(), haystack.end(), needle.begin(), needle.end(), [](char x, char y) {
+               return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+           }) != haystack.end();
+}
+
+#ifdef PRISTINE_HAVE_BROTLI
+// Memory blocks freed by brotli encoders on this thread, reused by the next
+// ones (an encoder of the same quality asks for the same sizes)
+struct BrotliBlockPool {
+    std::vector<std::pair<std::size_t, void*>> blocks;
+    std::size_t bytes = 0;
+
+    ~BrotliBlockPool() {
+        for (auto& block : blocks) {
+            std::free(block.second);
+        }
+    }
+};
+
+thread_local BrotliBlockPool t_brotli_blocks;
+
+// Blocks carry their size in front, for brotli_free
+constexpr std::size_t kBlockHeader = alignof(std::max_align_t);
+
+void* brotli_alloc(void*, std::size_t size) {
+    auto& pool = t_brotli_blocks;
+    for (std::size_t i = pool.blocks.size(); i-- > 0;) {
+        if (pool.blocks[i].first == size) {
+            void* block = pool.blocks[i].second;
+            pool.blocks[i] = pool.blocks.back();
+            pool.blocks.pop_back();
+            pool.bytes -= size;
+            return static_cast<char*>(block) + kBlockHeader;
+        }
+    }
+    void* block = std::malloc(size + kBlockHeader);
+    if (!block) {
+        return nullptr;
+    }
+    std::memcpy(block, &size, sizeof(size));
+    return static_cast<char*>(block) + kBlockHeader;
+}
+
+void brotli_free(void*, void* address) {
+    if (!address) {
+        return;
+    }
+    void* block = static_cast<char*>(address) - kBlockHeader;
+    std::size_t size;
+    std::memcpy(&size, block, sizeof(size));
+    auto& pool = t_brotli_blocks;
+    if (pool.bytes + size > kMaxPooledBytes) {
+        std::free(block);
+        return;
+    }
+    pool.blocks.emplace_back(size, block);
+    pool.bytes += size;
+}
+#endif
+
+} // namespace
+
+struct CompressionContext {
+    CompressionContext() : output(std::make_unique_for_overwrite<char[]>(kOutputSize)) {}
+
+    ~CompressionContext() {
+        if (gzip_ready) {
+            deflateEnd(&gzip);
+        }
+#ifdef PRISTINE_HAVE_BROTLI
+        if (brotli) {
+            BrotliEncoderDestroyInstance(brotli);
+        }
+#endif
+    }
+
+    std::unique_ptr<char[]> output;
+    z_stream gzip{};
+    bool gzip_ready = false;  // initialized, reset between responses
+    int gzip_level = 0;
+#ifdef PRISTINE_HAVE_BROTLI
+    BrotliEncoderState* brotli = nullptr;  // per response
+#endif
+};
+
+namespace {
+
+thread_local std::vector<std::unique_ptr<CompressionContext>> t_contexts;
+
+} // namespace
+
+Compressor::Compressor() = default;
+
+Compressor::Compressor(ContentCoding coding, int level, std::optional<std::uint64_t> size_hint) {
+    auto& pool = t_contexts;
+    if (!pool.empty()) {
+        context_ = std::move(pool.back());
+        pool.pop_back();
+    } else {
+        context_ = std::make_unique<CompressionContext>();
+    }
+
+    bool ready = false;
+    if (coding == ContentCoding::gzip) {
+        auto& z = context_->gzip;
+        if (!context_->gzip_ready) {
+            // 15 + 16: largest window, gzip wrapper
+            ready = deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+            context_->gzip_ready = ready;
+        } else {
+            ready = deflateReset(&z) == Z_OK &&
+                    (level == context_->gzip_level || deflateParams(&z, level, Z_DEFAULT_STRATEGY) == Z_OK);
+        }
+        context_->gzip_level = level;
+    }
+#ifdef PRISTINE_HAVE_BROTLI
+    if (coding == ContentCoding::brotli) {
+        auto* state = BrotliEncoderCreateInstance(brotli_alloc, brotli_free, nullptr);
+        if (state) {
+            BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, static_cast<std::uint32_t>(level));
+            BrotliEncoderSetParameter(state, BROTLI_PARAM_LGWIN, kBrotliWindow);
+            if (size_hint) {
+                BrotliEncoderSetParameter(state, BROTLI_PARAM_SIZE_HINT,
+                                          static_cast<std::uint32_t>(std::min<std::uint64_t>(*size_hint, 1u << 30)));
+            }
+            context_->brotli = state;
+            ready = true;
+        }
+    }
+#else
+    (void)size_hint;
+#endif
+    if (!ready) {
+        Log::warn() << "Could not start " << Compression::name(coding) << " compression";
+        release();
+        return;
+    }
+    coding_ = coding;
+    (coding == ContentCoding::gzip ? Compression::gzip_ : Compression::brotli_)
+        .fetch_add(1, std::memory_order_relaxed);
+}
+
+Compressor::~Compressor() {
+    release();
+}
+
+Compressor::Compressor(Compressor&& other) noexcept
+    : coding_(std::exchange(other.coding_, ContentCoding::identity)),
+      context_(std::move(other.context_)),
+      finished_(other.finished_),
+      failed_(other.failed_),
+      bytes_in_(std::exchange(other.bytes_in_, 0)),
+      bytes_out_(std::exchange(other.bytes_out_, 0)) {}
+
+Compressor& Compressor::operator=(Compressor&& other) noexcept {
+    if (this != &other) {
+        release();
+        coding_ = std::exchange(other.coding_, ContentCoding::identity);
+        context_ = std::move(other.context_);
+        finished_ = other.finished_;
+        failed_ = other.failed_;
+        bytes_in_ = std::exchange(other.bytes_in_, 0);
+        bytes_out_ = std::exchange(other.bytes_out_, 0);
+    }
+    return *this;
+}
+
+void Compressor::release() {
+    if (bytes_in_ > 0 || bytes_out_ > 0) {
+        Compression::bytes_in_.fetch_add(bytes_in_, std::memory_order_relaxed);
+        Compression::bytes_out_.fetch_add(bytes_out_, std::memory_order_relaxed);
+        bytes_in_ = 0;
+        bytes_out_ = 0;
+    }
+    coding_ = ContentCoding::identity;
+    finished_ = false;
+    failed_ = false;
+    if (!context_) {
+        return;
+    }
+#ifdef PRISTINE_HAVE_BROTLI
+    if (context_->brotli) {
+        BrotliEncoderDestroyInstance(context_->brotli);
+        context_->brotli = nullptr;
+    }
+#endif
+    auto& pool = t_contexts;
+    if (pool.size() < kMaxIdleContexts) {
+        pool.push_back(std::move(context_));
+    }
+    context_.reset();
+}
+
+std::string_view Compressor::compress(const char*& data, std::size_t& size, bool finish) {
+    char* output = context_->output.get();
+    std::size_t produced = 0;
+    std::size_t consumed = 0;
+
+    if (coding_ == ContentCoding::gzip) {
+        auto& z = context_->gzip;
+        z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        z.avail_in = static_cast<uInt>(size);
+        z.next_out = reinterpret_cast<Bytef*>(output);
+        z.avail_out = static_cast<uInt>(kOutputSize);
+        int result = deflate(&z, finish ? Z_FINISH : Z_NO_FLUSH);
+        consumed = size - z.avail_in;
+        produced = kOutputSize - z.avail_out;
+        // Z_BUF_ERROR only says no progress was possible this time
+        failed_ = result == Z_STREAM_ERROR;
+        finished_ = result == Z_STREAM_END;
+    }
+#ifdef PRISTINE_HAVE_BROTLI
+    if (coding_ == ContentCoding::brotli) {
+        std::size_t available_in = size;
+        const auto* next_in = reinterpret_cast<const std::uint8_t*>(data);
+        std::size_t available_out = kOutputSize;
+        auto* next_out = reinterpret_cast<std::uint8_t*>(output);
+        bool ok = BrotliEncoderCompressStream(context_->brotli,
+                                              finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS,
+                                              &available_in, &next_in, &available_out, &next_out, nullptr);
+        consumed = size - available_in;
+        produced = kOutputSize - available_out;
+        failed_ = !ok;
+        finished_ = ok && BrotliEncoderIsFinished(context_->brotli);
+    }
+#endif
+
+    data += consumed;
+    size -= consumed;
+    bytes_in_ += consumed;
+    bytes_out_ += produced;
+    return std::string_view(output, produced);
+}
+
+Compression::Choice Compression::choose(const CompressionConfig& config, unsigned status,
+                                        std::string_view content_type, std::string_view content_encoding,
+                                        std::string_view cache_control, std::optional<std::uint64_t> content_length,
+                                        std::string_view accept_encoding) {
+    Choice choice;
+    content_encoding = trim(content_encoding);
+    if (status == 206 || (!content_encoding.empty() && !iequals(content_encoding, "identity")) ||
+        (content_length && *content_length < config.min_size) || icontains(cache_control, "no-transform")) {
+        return choice;
+    }
+
+    // An exact type wins over "type/*"
+    auto type = trim(content_type.substr(0, content_type.find(';')));
+    const CompressionType* match = nullptr;
+    for (const auto& entry : config.types) {
+        std::string_view listed = entry.type;
+        if (iequals(listed, type)) {
+            match = &entry;
+            break;
+        }
+        if (!match && listed.size() >= 2 && listed.substr(listed.size() - 2) == "/*" &&
+            type.size() > listed.size() - 1 && iequals(type.substr(0, listed.size() - 1), listed.substr(0, listed.size() - 1))) {
+            match = &entry;
+        }
+    }
+    if (!match) {
+        return choice;
+    }
+
+    choice.varies = true;
+    if (brotli_available() && accepts(accept_encoding, "br")) {
+        choice.coding = ContentCoding::brotli;
+        choice.level = match->brotli;
+    } else if (accepts(accept_encoding, "gzip")) {
+        choice.coding = ContentCoding::gzip;
+        choice.level = match->gzip;
+    }
+    return choice;
+}
+
+bool Compression::accepts(std::string_view accept_encoding, std::string_view coding) {
+    bool named = false;
+    bool accepted = false;
+    bool wildcard = false;
+    while (!accept_encoding.empty()) {
+        auto comma = accept_encoding.find(',');
+        auto element = trim(accept_encoding.substr(0, comma));
+        accept_encoding = comma == std::string_view::npos ? std::string_view{} : accept_encoding.substr(comma + 1);
+
+        auto semicolon = element.find(';');
+        auto name = trim(element.substr(0, semicolon));
+        bool allowed = true;
+        if (semicolon != std::string_view::npos) {
+            // "q=0" (or 0.0, 0.000) refuses the coding
+            auto q = trim(element.substr(semicolon + 1));
+            if (q.size() >= 3 && (q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+                q.remove_prefix(2);
+                allowed = q.find_first_not_of("0.") != std::string_view::npos;
+            }
+        }
+        if (iequals(name, coding)) {
+            named = true;
+            accepted = allowed;
+        } else if (name == "*") {
+            wildcard = allowed;
+        }
+    }
+    return named ? accepted : wildcard;
+}
+
+std::string_view Compression::normalize(std::string_view accept_encoding, char (&out)[64]) {
+    std::size_t size = 0;
+    for (auto coding : kCodings) {
+        if (!accepts(accept_encoding, coding)) {
+            continue;
+        }
+        if (size > 0) {
+            out[size++] = ',';
+        }
+        std::memcpy(out + size, coding.data(), coding.size());
+        size += coding.size();
+    }
+    return std::string_view(out, size);
+}
+
+bool Compression::varies_by_encoding(std::string_view vary) {
+    while (!vary.empty()) {
+        auto comma = vary.find(',');
+        auto name = trim(vary.substr(0, comma));
+        if (name == "*" || iequals(name, "accept-encoding")) {
+            return true;
+        }
+        vary = comma == std::string_view::npos ? std::string_view{} : vary.substr(comma + 1);
+    }
+    return false;
+}
+
+std::string_view Compression::name(ContentCoding coding) {
+    switch (coding) {
+        case ContentCoding::gzip:
+            return "gzip";
+        case ContentCoding::brotli:
+            return "br";
+        default:
+            return "identity";
+    }
+}
+
+bool Compression::brotli_available() {
+#ifdef PRISTINE_HAVE_BROTLI
+    return true;
+#else
+    return false;
+#endif
+}
+
+CompressionStats Compression::stats() {
+    CompressionStats stats;
+    stats.gzip = gzip_.load(std::memory_order_relaxed);
+    stats.brotli = brotli_.load(std::memory_order_relaxed);
+    stats.bytes_in = bytes_in_.load(std::memory_order_relaxed);
+    stats.bytes_out = bytes_out_.load(std::memory_order_relaxed);
+    return stats;
+}
@@ -0,0 +1,109 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include "ConfigManager.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string_view>
+
+enum class ContentCoding : std::uint8_t {
+    identity,
+    gzip,
+    brotli,
+};
+
+struct CompressionStats {
+    std::uint64_t gzip = 0;       // responses compressed, by coding
+    std::uint64_t brotli = 0;
+    std::uint64_t bytes_in = 0;   // body bytes before and after compression
+    std::uint64_t bytes_out = 0;
+};
+
+// Compressor state and output buffer, kept in a per-thread pool between responses
+struct CompressionContext;
+
+// Compresses one response body as it streams to the client. The zlib stream
+// and output buffer come from the thread's pool and go back to it (reset,
+// not freed) when the compressor is destroyed; brotli encoders, which can't
+// be reset, allocate from a per-thread pool of the blocks earlier encoders
+// freed. Move-only; a default-constructed compressor is inactive.
+class Compressor {
+public:
+    Compressor();
+    Compressor(ContentCoding coding, int level, std::optional<std::uint64_t> size_hint);
+    ~Compressor();
+
+    Compressor(Compressor&& other) noexcept;
+    Compressor& operator=(Compressor&& other) noexcept;
+
+    explicit operator bool() const { return coding_ != ContentCoding::identity; }
+    ContentCoding coding() const { return coding_; }
+
+    // Compress from data (advanced past what was consumed) until the input
+    // is used up or the output buffer is full; finish says the input ends
+    // the body. Returns the output produced, valid until the next call.
+    std::string_view compress(const char*& data, std::size_t& size, bool finish);
+
+    // All output has been produced after the input was finished
+    bool finished() const { return finished_; }
+
+    // The encoder reported an error; the body can't be completed
+    bool failed() const { return failed_; }
+
+private:
+    void release();
+
+    ContentCoding coding_ = ContentCoding::identity;
+    std::unique_ptr<CompressionContext> context_;
+    bool finished_ = false;
+    bool failed_ = false;
+    std::uint64_t bytes_in_ = 0;
+    std::uint64_t bytes_out_ = 0;
+};
+
+// Response compression for sites with "compress: true": which coding a
+// response is sent with, from its type and the client's Accept-Encoding.
+class Compression {
+public:
+    struct Choice {
+        bool varies = false;  // the response is compressible: its encoding depends on Accept-Encoding
+        ContentCoding coding = ContentCoding::identity;
+        int level = 0;
+    };
+
+    // Coding for a backend response: listed content type, no encoding yet,
+    // not no-transform, not a partial response and not known to be short
+    static Choice choose(const CompressionConfig& config, unsigned status, std::string_view content_type,
+                         std::string_view content_encoding, std::string_view cache_control,
+                         std::optional<std::uint64_t> content_length, std::string_view accept_encoding);
+
+    // Whether Accept-Encoding allows coding (q > 0, directly or by "*")
+    static bool accepts(std::string_view accept_encoding, std::string_view coding);
+
+    // The registered content codings accept_encoding allows, in a fixed
+    // order ("br,gzip"), written to out; requests that accept the same
+    // codings share cached variants
+    static std::string_view normalize(std::string_view accept_encoding, char (&out)[64]);
+
+    // Whether a Vary value already lists Accept-Encoding (or is "*")
+    static bool varies_by_encoding(std::string_view vary);
+
+    // Content-Encoding value of coding
+    static std::string_view name(ContentCoding coding);
+
+    static bool brotli_available();
+
+    static CompressionStats stats();
+
+private:
+    friend class Compressor;
+
+    static std::atomic<std::uint64_t> gzip_;
+    static std::atomic<std::uint64_t> brotli_;
+    static std::atomic<std::uint64_t> bytes_in_;
+    static std::atomic<std::uint64_t> bytes_out_;
+};
+
+#endif // COMPRESSION_H
@@ -1,6 +1,7 @@
 #include "ConfigManager.h"
+#include "Log.h"
+#include "ConfigSnapshot.h"
 #include <yaml-cpp/yaml.h>
-#include <iostream>
 #include <filesystem>
 
 std::shared_ptr<ConfigManager> ConfigManager::instance_ = nullptr;
@@ -13,72 +14,529 @@ std::shared_ptr<ConfigManager> ConfigManager::getInstance() {
 }
 
 bool ConfigManager::loadConfig(const std::string& configPath) {
+    auto config = parseConfig(configPath);
+    if (!config) {
+        return false;
+    }
+    
+    config_ = std::move(config);
+    configPath_ = configPath;
+    
+    Log::info() << "Configuration loaded successfully from: " << configPath;
+    Log::info() << "Loaded " << config_->sites.size() << " site configurations";
+    
+    return true;
+}
+
+std::shared_ptr<ProxyConfig> ConfigManager::parseConfig(const std::string& configPath) {
     try {
         if (!std::filesystem::exists(configPath)) {
-            std::cerr << "Config file not found: " << configPath << std::endl;
-            return false;
+            Log::error() << "Config file not found: " << configPath;
+            return nullptr;
         }
 
         YAML::Node config = YAML::LoadFile(configPath);
+        auto parsed = std::make_shared<ProxyConfig>();
+        ProxyConfig& proxy = *parsed;
         
         // Load basic settings
         if (config["http_port"]) {
-            config_.http_port = config["http_port"].as<int>();
+            proxy.http_port = config["http_port"].as<int>();
         }
         
         if (config["https_port"]) {
-            config_.https_port = config["https_port"].as<int>();
+            proxy.https_port = config["https_port"].as<int>();
         }
         
         if (config["email"]) {
-            config_.email = config["email"].as<std::string>();
+            proxy.email = config["email"].as<std::string>();
         }
         
         if (config["timeout_seconds"]) {
-            config_.timeout_seconds = config["timeout_seconds"].as<int>();
+            proxy.timeout_seconds = config["timeout_seconds"].as<int>();
+            proxy.timeouts.body_read_seconds = proxy.timeout_seconds;
+            proxy.timeouts.backend_response_seconds = proxy.timeout_seconds;
+        }
+        
+        // Load individual deadlines (override timeout_seconds)
+        if (config["timeouts"]) {
+            const auto& timeouts = config["timeouts"];
+            if (timeouts["header_read_seconds"]) {
+                proxy.timeouts.header_read_seconds = timeouts["header_read_seconds"].as<int>();
+            }
+            if (timeouts["body_read_seconds"]) {
+                proxy.timeouts.body_read_seconds = timeouts["body_read_seconds"].as<int>();
+            }
+            if (timeouts["backend_connect_seconds"]) {
+                proxy.timeouts.backend_connect_seconds = timeouts["backend_connect_seconds"].as<int>();
+            }
+            if (timeouts["backend_response_seconds"]) {
+                proxy.timeouts.backend_response_seconds = timeouts["backend_response_seconds"].as<int>();
+            }
+            if (timeouts["idle_keepalive_seconds"]) {
+                proxy.timeouts.idle_keepalive_seconds = timeouts["idle_keepalive_seconds"].as<int>();
+            }
         }
         
         if (config["max_connections"]) {
-            config_.max_connections = config["max_connections"].as<int>();
+            proxy.max_connections = config["max_connections"].as<int>();
+        }
+        
+        if (config["overload_action"]) {
+            proxy.overload_action = config["overload_action"].as<std::string>();
+            if (proxy.overload_action != "reject" && proxy.overload_action != "pause") {
+                Log::error() << "Invalid overload_action (expected reject or pause): "
+                             << proxy.overload_action;
+                return nullptr;
+            }
+        }
+        
+        if (config["dns_ttl_seconds"]) {
+            proxy.dns_ttl_seconds = config["dns_ttl_seconds"].as<int>();
+        }
+        
+        if (config["worker_threads"]) {
+            proxy.worker_threads = config["worker_threads"].as<int>();
+        }
+        
+        if (config["thread_per_core"]) {
+            proxy.thread_per_core = config["thread_per_core"].as<bool>();
+        }
+        
+        // cpu_affinity is either a bool or an explicit list of CPUs
+        if (config["cpu_affinity"]) {
+            const auto& affinity = config["cpu_affinity"];
+            proxy.cpu_list.clear();
+            if (affinity.IsSequence()) {
+                for (const auto& cpu : affinity) {
+                    proxy.cpu_list.push_back(cpu.as<int>());
+                }
+                proxy.cpu_affinity = !proxy.cpu_list.empty();
+            } else {
+                proxy.cpu_affinity = affinity.as<bool>();
+            }
+        }
+        
+        if (config["ktls"]) {
+            proxy.ktls = config["ktls"].as<bool>();
         }
         
         if (config["cert_dir"]) {
-            config_.cert_dir = config["cert_dir"].as<std::string>();
+            proxy.cert_dir = config["cert_dir"].as<std::string>();
+        }
+        
+        if (config["cache_dir"]) {
+            proxy.cache_dir = config["cache_dir"].as<std::string>();
         }
         
         if (config["acme_server"]) {
-            config_.acme_server = config["acme_server"].as<std::string>();
+            proxy.acme_server = config["acme_server"].as<std::string>();
+        }
+        
+        // Load client keep-alive settings
+        if (config["keep_alive"]) {
+            const auto& keep_alive = config["keep_alive"];
+            if (keep_alive["enabled"]) {
+                proxy.keep_alive.enabled = keep_alive["enabled"].as<bool>();
+            }
+            if (keep_alive["max_requests_per_connection"]) {
+                proxy.keep_alive.max_requests_per_connection = keep_alive["max_requests_per_connection"].as<int>();
+            }
+        }
+        
+        // Load backend connection pool settings
+        if (config["upstream_pool"]) {
+            const auto& pool = config["upstream_pool"];
+            if (pool["enabled"]) {
+                proxy.upstream_pool.enabled = pool["enabled"].as<bool>();
+            }
+            if (pool["max_idle_per_backend"]) {
+                proxy.upstream_pool.max_idle_per_backend = pool["max_idle_per_backend"].as<int>();
+            }
+            if (pool["idle_timeout_seconds"]) {
+                proxy.upstream_pool.idle_timeout_seconds = pool["idle_timeout_seconds"].as<int>();
+            }
+            if (pool["max_requests_per_connection"]) {
+                proxy.upstream_pool.max_requests_per_connection = pool["max_requests_per_connection"].as<int>();
+            }
+        }
+        
+        // Load WebSocket tunnel settings
+        if (config["websocket"]) {
+            const auto& websocket = config["websocket"];
+            if (websocket["splice"]) {
+                proxy.websocket.splice = websocket["splice"].as<bool>();
+            }
+            if (websocket["buffer_size"]) {
+                proxy.websocket.buffer_size = websocket["buffer_size"].as<std::size_t>();
+            }
+            if (websocket["max_message_size"]) {
+                proxy.websocket.max_message_size = websocket["max_message_size"].as<std::size_t>();
+            }
+        }
+        
+        // Load HTTP/2 settings
+        if (config["http2"]) {
+            const auto& h2 = config["http2"];
+            if (h2["enabled"]) {
+                proxy.http2.enabled = h2["enabled"].as<bool>();
+            }
+            if (h2["max_concurrent_streams"]) {
+                proxy.http2.max_concurrent_streams = h2["max_concurrent_streams"].as<int>();
+            }
+            if (h2["initial_window_size"]) {
+                proxy.http2.initial_window_size = h2["initial_window_size"].as<int>();
+            }
+            if (h2["connection_window_size"]) {
+                proxy.http2.connection_window_size = h2["connection_window_size"].as<int>();
+            }
+            if (proxy.http2.max_concurrent_streams < 1 ||
+                proxy.http2.initial_window_size < 65535 ||
+                proxy.http2.connection_window_size < 65535) {
+                Log::error() << "Invalid http2 settings (need max_concurrent_streams >= 1 and "
+                             << "window sizes of at least 65535)";
+                return nullptr;
+            }
+        }
+        
+        // Load TLS session resumption settings
+        if (config["tls_sessions"]) {
+            const auto& sessions = config["tls_sessions"];
+            if (sessions["cache_size"]) {
+                proxy.tls_sessions.cache_size = sessions["cache_size"].as<int>();
+            }
+            if (sessions["cache_timeout_seconds"]) {
+                proxy.tls_sessions.cache_timeout_seconds = sessions["cache_timeout_seconds"].as<int>();
+            }
+            if (sessions["tickets"]) {
+                proxy.tls_sessions.tickets = sessions["tickets"].as<bool>();
+            }
+            if (sessions["ticket_key_rotation_seconds"]) {
+                proxy.tls_sessions.ticket_key_rotation_seconds = sessions["ticket_key_rotation_seconds"].as<int>();
+            }
+            if (proxy.tls_sessions.cache_size < 0 ||
+                proxy.tls_sessions.cache_timeout_seconds < 1 ||
+                proxy.tls_sessions.ticket_key_rotation_seconds < 1) {
+                Log::error() << "Invalid tls_sessions settings (need cache_size >= 0 and "
+                             << "positive cache_timeout_seconds and ticket_key_rotation_seconds)";
+                return nullptr;
+            }
+        }
+        
+        // Load TLS handshake offload settings
+        if (config["tls_handshake"]) {
+            const auto& handshake = config["tls_handshake"];
+            if (handshake["threads"]) {
+                proxy.tls_handshake.threads = handshake["threads"].as<int>();
+            }
+            if (handshake["max_pending"]) {
+                proxy.tls_handshake.max_pending = handshake["max_pending"].as<int>();
+            }
+            if (proxy.tls_handshake.threads < 0 || proxy.tls_handshake.max_pending < 0) {
+                Log::error() << "Invalid tls_handshake settings (threads and max_pending must be >= 0)";
+                return nullptr;
+            }
+        }
+        
+        // Load active health check settings
+        if (config["health_check"]) {
+            const auto& check = config["health_check"];
+            if (check["enabled"]) {
+                proxy.health_check.enabled = check["enabled"].as<bool>();
+            }
+            if (check["type"]) {
+                proxy.health_check.type = check["type"].as<std::string>();
+                if (proxy.health_check.type != "tcp" && proxy.health_check.type != "http") {
+                    Log::error() << "Invalid health_check type (expected tcp or http): "
+                                 << proxy.health_check.type;
+                    return nullptr;
+                }
+            }
+            if (check["path"]) {
+                proxy.health_check.path = check["path"].as<std::string>();
+            }
+            if (check["interval_ms"]) {
+                proxy.health_check.interval_ms = check["interval_ms"].as<int>();
+            }
+            if (check["timeout_ms"]) {
+                proxy.health_check.timeout_ms = check["timeout_ms"].as<int>();
+            }
+            if (check["healthy_threshold"]) {
+                proxy.health_check.healthy_threshold = check["healthy_threshold"].as<int>();
+            }
+            if (check["unhealthy_threshold"]) {
+                proxy.health_check.unhealthy_threshold = check["unhealthy_threshold"].as<int>();
+            }
+        }
+        
+        // Load passive outlier detection settings
+        if (config["outlier_detection"]) {
+            const auto& outlier = config["outlier_detection"];
+            if (outlier["consecutive_failures"]) {
+                proxy.outlier_detection.consecutive_failures = outlier["consecutive_failures"].as<int>();
+            }
+            if (outlier["base_ejection_ms"]) {
+                proxy.outlier_detection.base_ejection_ms = outlier["base_ejection_ms"].as<int>();
+            }
+            if (outlier["max_ejection_ms"]) {
+                proxy.outlier_detection.max_ejection_ms = outlier["max_ejection_ms"].as<int>();
+            }
+        }
+        
+        // Load config reload settings
+        if (config["config_reload"]) {
+            const auto& reload = config["config_reload"];
+            if (reload["watch"]) {
+                proxy.config_reload.watch = reload["watch"].as<bool>();
+            }
+            if (reload["debounce_ms"]) {
+                proxy.config_reload.debounce_ms = reload["debounce_ms"].as<int>();
+            }
+        }
+        
+        // Load metrics endpoint settings
+        if (config["metrics"]) {
+            const auto& metrics = config["metrics"];
+            if (metrics["enabled"]) {
+                proxy.metrics.enabled = metrics["enabled"].as<bool>();
+            }
+            if (metrics["address"]) {
+                proxy.metrics.address = metrics["address"].as<std::string>();
+            }
+            if (metrics["port"]) {
+                proxy.metrics.port = metrics["port"].as<int>();
+            }
+            if (metrics["path"]) {
+                proxy.metrics.path = metrics["path"].as<std::string>();
+            }
+            if (proxy.metrics.port < 1 || proxy.metrics.port > 65535 ||
+                proxy.metrics.path.empty() || proxy.metrics.path[0] != '/') {
+                Log::error() << "Invalid metrics settings (need a port from 1 to 65535 and a path "
+                             << "starting with /)";
+                return nullptr;
+            }
+        }
+        
+        // Load access log settings
+        if (config["access_log"]) {
+            const auto& log = config["access_log"];
+            if (log["enabled"]) {
+                proxy.access_log.enabled = log["enabled"].as<bool>();
+            }
+            if (log["path"]) {
+                proxy.access_log.path = log["path"].as<std::string>();
+            }
+            if (log["format"]) {
+                proxy.access_log.format = log["format"].as<std::string>();
+            }
+            if (log["sample_rate"]) {
+                proxy.access_log.sample_rate = log["sample_rate"].as<double>();
+            }
+            if (log["buffer_size"]) {
+                proxy.access_log.buffer_size = log["buffer_size"].as<std::size_t>();
+            }
+            if (log["max_size_mb"]) {
+                proxy.access_log.max_size_mb = log["max_size_mb"].as<int>();
+            }
+            if (log["max_files"]) {
+                proxy.access_log.max_files = log["max_files"].as<int>();
+            }
+            if (log["flush_interval_ms"]) {
+                proxy.access_log.flush_interval_ms = log["flush_interval_ms"].as<int>();
+            }
+            if (proxy.access_log.format != "json" && proxy.access_log.format != "combined") {
+                Log::error() << "Invalid access_log format (expected json or combined): "
+                             << proxy.access_log.format;
+                return nullptr;
+            }
+            if (proxy.access_log.sample_rate < 0.0 || proxy.access_log.sample_rate > 1.0 ||
+                proxy.access_log.max_size_mb < 0 || proxy.access_log.max_files < 0 ||
+                proxy.access_log.flush_interval_ms < 1) {
+                Log::error() << "Invalid access_log settings (need sample_rate from 0 to 1, "
+                             << "max_size_mb and max_files >= 0 and flush_interval_ms >= 1)";
+                return nullptr;
+            }
+        }
+        
+        // Load response cache settings
+        if (config["response_cache"]) {
+            const auto& cache = config["response_cache"];
+            if (cache["memory_mb"]) {
+                proxy.response_cache.memory_mb = cache["memory_mb"].as<std::size_t>();
+            }
+            if (cache["max_object_size"]) {
+                proxy.response_cache.max_object_size = cache["max_object_size"].as<std::size_t>();
+            }
+            if (cache["collapse_timeout_ms"]) {
+                proxy.response_cache.collapse_timeout_ms = cache["collapse_timeout_ms"].as<int>();
+            }
+            if (cache["disk_mb"]) {
+                proxy.response_cache.disk_mb = cache["disk_mb"].as<std::size_t>();
+            }
+            if (cache["disk_slab_mb"]) {
+                proxy.response_cache.disk_slab_mb = cache["disk_slab_mb"].as<std::size_t>();
+            }
+            if (cache["disk_max_object_size"]) {
+                proxy.response_cache.disk_max_object_size = cache["disk_max_object_size"].as<std::size_t>();
+            }
+            if (proxy.response_cache.disk_mb > 0 &&
+                (proxy.response_cache.disk_slab_mb == 0 ||
+                 proxy.response_cache.disk_slab_mb > proxy.response_cache.disk_mb)) {
+                Log::error() << "response_cache.disk_slab_mb must be between 1 and disk_mb";
+                return nullptr;
+            }
+        }
+        
+        // Load body streaming settings
+        if (config["streaming"]) {
+            const auto& streaming = config["streaming"];
+            if (streaming["buffer_size"]) {
+                proxy.streaming.buffer_size = streaming["buffer_size"].as<std::size_t>();
+            }
+        }
+        
+        // Load static file settings
+        if (config["static_files"]) {
+            const auto& files = config["static_files"];
+            if (files["open_file_cache"]) {
+                proxy.static_files.open_file_cache = files["open_file_cache"].as<std::size_t>();
+            }
+            if (files["open_file_valid_seconds"]) {
+                proxy.static_files.open_file_valid_seconds = files["open_file_valid_seconds"].as<int>();
+            }
+            if (proxy.static_files.open_file_valid_seconds < 0) {
+                Log::error() << "static_files.open_file_valid_seconds must not be negative";
+                return nullptr;
+            }
+        }
+        
+        // Load response compression settings
+        if (config["compression"]) {
+            const auto& compression = config["compression"];
+            if (compression["min_size"]) {
+                proxy.compression.min_size = compression["min_size"].as<std::size_t>();
+            }
+            if (compression["types"]) {
+                proxy.compression.types.clear();
+                for (const auto& entry : compression["types"]) {
+                    CompressionType type;
+                    type.type = entry.first.as<std::string>();
+                    if (entry.second["gzip"]) {
+                        type.gzip = entry.second["gzip"].as<int>();
+                    }
+                    if (entry.second["brotli"]) {
+                        type.brotli = entry.second["brotli"].as<int>();
+                    }
+                    if (type.gzip < 1 || type.gzip > 9 || type.brotli < 0 || type.brotli > 11) {
+                        Log::error() << "Invalid compression levels for " << type.type
+                                     << " (expected gzip 1-9 and brotli 0-11)";
+                        return nullptr;
+                    }
+                    proxy.compression.types.push_back(type);
+                }
+            }
         }
         
         // Load sites
         if (config["sites"]) {
-            config_.sites.clear();
+            proxy.sites.clear();
             for (const auto& site : config["sites"]) {
                 SiteConfig siteConfig;
                 siteConfig.domain = site["domain"].as<std::string>();
-                siteConfig.backend = site["backend"].as<std::string>();
+                
+                // Files served directly, instead of a backend
+                if (site["root"]) {
+                    siteConfig.root = site["root"].as<std::string>();
+                    while (siteConfig.root.size() > 1 && siteConfig.root.back() == '/') {
+                        siteConfig.root.pop_back();
+                    }
+                    if (!std::filesystem::is_directory(siteConfig.root)) {
+                        Log::warn() << "root of " << siteConfig.domain << " is not a directory (yet): "
+                                    << siteConfig.root;
+                    }
+                }
+                
+                // A single "host:port", or a list of upstreams given as
+                // "host:port" or {address, weight}
+                const auto backend = site["backend"] ? site["backend"] : YAML::Node();
+                if (backend.IsSequence()) {
+                    for (const auto& entry : backend) {
+                        UpstreamConfig upstream;
+                        if (entry.IsMap()) {
+                            upstream.address = entry["address"].as<std::string>();
+                            upstream.weight = entry["weight"] ? entry["weight"].as<int>() : 1;
+                        } else {
+                            upstream.address = entry.as<std::string>();
+                        }
+                        if (upstream.weight < 1) {
+                            Log::error() << "Invalid weight for " << upstream.address << " in " << siteConfig.domain
+                                         << ": " << upstream.weight;
+                            return nullptr;
+                        }
+                        siteConfig.upstreams.push_back(upstream);
+                    }
+                } else if (backend.IsScalar()) {
+                    siteConfig.upstreams.push_back(UpstreamConfig{backend.as<std::string>(), 1});
+                }
+                if (siteConfig.upstreams.empty() == siteConfig.root.empty()) {
+                    Log::error() << (siteConfig.root.empty() ? "No backend or root configured for "
+                                                             : "Both backend and root configured for ")
+                                 << siteConfig.domain;
+                    return nullptr;
+                }
+                if (!siteConfig.upstreams.empty()) {
+                    siteConfig.backend = siteConfig.upstreams.front().address;
+                }
+                
+                if (site["load_balancing"]) {
+                    siteConfig.load_balancing = site["load_balancing"].as<std::string>();
+                    if (siteConfig.load_balancing != "round_robin" && siteConfig.load_balancing != "least_conn" &&
+                        siteConfig.load_balancing != "p2c" && siteConfig.load_balancing != "ring_hash") {
+                        Log::error() << "Invalid load_balancing for " << siteConfig.domain
+                                     << " (expected round_robin, least_conn, p2c or ring_hash): "
+                                     << siteConfig.load_balancing;
+                        return nullptr;
+                    }
+                }
+                if (site["hash_key"]) {
+                    siteConfig.hash_key = site["hash_key"].as<std::string>();
+                    if (siteConfig.hash_key != "client_ip" &&
+                        (siteConfig.hash_key.rfind("header:", 0) != 0 || siteConfig.hash_key.size() == 7)) {
+                        Log::error() << "Invalid hash_key for " << siteConfig.domain
+                                     << " (expected client_ip or header:<name>): " << siteConfig.hash_key;
+                        return nullptr;
+                    }
+                }
+                
                 siteConfig.tls = site["tls"] ? site["tls"].as<std::string>() : "off";
                 siteConfig.websocket = site["websocket"] ? site["websocket"].as<bool>() : false;
+                if (site["websocket_mode"]) {
+                    siteConfig.websocket_mode = site["websocket_mode"].as<std::string>();
+                    if (siteConfig.websocket_mode != "raw" && siteConfig.websocket_mode != "frames") {
+                        Log::error() << "Invalid websocket_mode for " << siteConfig.domain
+                                     << " (expected raw or frames): " << siteConfig.websocket_mode;
+                        return nullptr;
+                    }
+                }
+                siteConfig.cache = site["cache"] ? site["cache"].as<bool>() : false;
+                siteConfig.compress = site["compress"] ? site["compress"].as<bool>() : false;
                 
-                config_.sites.push_back(siteConfig);
+                proxy.sites.push_back(siteConfig);
             }
         }
         
         // Create cert directory if it doesn't exist
-        std::filesystem::create_directories(config_.cert_dir);
-        
-        std::cout << "Configuration loaded successfully from: " << configPath << std::endl;
-        std::cout << "Loaded " << config_.sites.size() << " site configurations" << std::endl;
+        std::filesystem::create_directories(proxy.cert_dir);
         
-        return true;
+        return parsed;
     } catch (const std::exception& e) {
-        std::cerr << "Error loading config: " << e.what() << std::endl;
-        return false;
+        Log::error() << "Error loading config: " << e.what();
+        return nullptr;
     }
 }
 
-const SiteConfig* ConfigManager::findSiteByDomain(const std::string& domain) const {
-    for (const auto& site : config_.sites) {
+const SiteConfig* ConfigManager::findSiteByDomain(std::string_view domain) const {
+    for (const auto& site : config_->sites) {
         if (site.domain == domain) {
             return &site;
         }
@@ -86,7 +544,24 @@ const SiteConfig* ConfigManager::findSiteByDomain(const std::string& domain) con
     return nullptr;
 }
 
-bool ConfigManager::needsTLS(const std::string& domain) const {
+bool ConfigManager::needsTLS(std::string_view domain) const {
     const SiteConfig* site = findSiteByDomain(domain);
     return site && (site->tls == "auto" || site->tls == "manual");
 }
+
+void ConfigManager::publish(std::shared_ptr<ConfigSnapshot> snapshot) {
+    // Store the snapshot before bumping the generation, so a reader that sees
+    // the new generation also finds the new snapshot
+    snapshot->generation = generation_.load(std::memory_order_relaxed) + 1;
+    current_.store(std::move(snapshot), std::memory_order_release);
+    generation_.fetch_add(1, std::memory_order_release);
+}
+
+std::shared_ptr<const ConfigSnapshot> ConfigManager::snapshot() const {
+    thread_local std::shared_ptr<const ConfigSnapshot> cached;
+    
+    if (!cached || cached->generation != generation_.load(std::memory_order_acquire)) {
+        cached = current_.load(std::memory_order_acquire);
+    }
+    return cached;
+}
@@ -1,42 +1,227 @@
 #ifndef CONFIG_MANAGER_H
 #define CONFIG_MANAGER_H
 
+#include <atomic>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
 
+struct ConfigSnapshot;
+
+struct UpstreamConfig {
+    std::string address;  // "host:port"
+    int weight = 1;
+};
+
 struct SiteConfig {
     std::string domain;
-    std::string backend;
+    std::string backend;                  // first upstream
+    std::vector<UpstreamConfig> upstreams;
+    std::string load_balancing = "round_robin";  // "round_robin", "least_conn", "p2c" or "ring_hash"
+    std::string hash_key = "client_ip";          // ring_hash: "client_ip" or "header:<name>"
     std::string tls;  // "auto", "manual", or "off"
     bool websocket = false;
+    std::string websocket_mode = "raw";  // "raw" (byte tunnel) or "frames" (frame-aware relay)
+    bool cache = false;  // serve cacheable responses from the response cache
+    std::string root;    // serve files from this directory instead of a backend
+    bool compress = false;  // compress responses for clients that accept it (see CompressionConfig)
+};
+
+struct UpstreamPoolConfig {
+    bool enabled = true;
+    int max_idle_per_backend = 32;       // idle connections kept per backend, per worker thread
+    int idle_timeout_seconds = 60;       // idle connections older than this are closed
+    int max_requests_per_connection = 1000;
+};
+
+struct KeepAliveConfig {
+    bool enabled = true;
+    int max_requests_per_connection = 1000;  // client requests served before closing
+};
+
+struct StreamingConfig {
+    std::size_t buffer_size = 64 * 1024;  // per-connection body relay buffer (bytes)
+};
+
+// Deadlines in seconds; 0 disables one
+struct TimeoutConfig {
+    int header_read_seconds = 10;       // reading a request header
+    int body_read_seconds = 30;         // client body reads and response writes, per operation
+    int backend_connect_seconds = 5;    // establishing a backend connection
+    int backend_response_seconds = 30;  // backend response header, then per body read
+    int idle_keepalive_seconds = 60;    // between requests on a persistent connection
+};
+
+struct WebSocketConfig {
+    bool splice = false;                        // zero-copy splice() for raw tunnels over plain TCP
+    std::size_t buffer_size = 16 * 1024;        // raw tunnel buffer, taken only while data moves
+    std::size_t max_message_size = 1024 * 1024; // frame-aware mode
+};
+
+struct Http2Config {
+    bool enabled = true;                        // ALPN "h2" on TLS, prior-knowledge h2c on plain HTTP
+    int max_concurrent_streams = 100;           // per client connection
+    int initial_window_size = 65535;            // per-stream receive window (request bodies)
+    int connection_window_size = 1024 * 1024;   // receive window shared by all streams
+};
+
+struct TlsSessionConfig {
+    int cache_size = 20480;                  // sessions kept for session-ID resumption (0 = no cache)
+    int cache_timeout_seconds = 7200;        // lifetime of cached sessions and tickets
+    bool tickets = true;                     // stateless session tickets
+    int ticket_key_rotation_seconds = 3600;  // new ticket key; the previous one is accepted until the next
+};
+
+struct TlsHandshakeConfig {
+    int threads = 2;         // dedicated handshake threads (0 = on the worker threads)
+    int max_pending = 1024;  // handshakes in progress before new TLS clients are refused (0 = no limit)
+};
+
+struct HealthCheckConfig {
+    bool enabled = false;
+    std::string type = "tcp";     // "tcp" (connect) or "http" (GET path, 2xx/3xx is healthy)
+    std::string path = "/health";
+    int interval_ms = 5000;
+    int timeout_ms = 2000;
+    int healthy_threshold = 2;    // consecutive passing probes to bring a backend back
+    int unhealthy_threshold = 3;  // consecutive failing probes to take it out
+};
+
+struct OutlierDetectionConfig {
+    int consecutive_failures = 5;  // connect errors/timeouts/5xx in a row before ejecting (0 = off)
+    int base_ejection_ms = 10000;  // first ejection, doubled for each repeat
+    int max_ejection_ms = 300000;
+};
+
+struct ConfigReloadConfig {
+    bool watch = true;     // reload when the config file changes (SIGHUP always reloads)
+    int debounce_ms = 200; // wait for writes to settle before reloading
+};
+
+struct MetricsConfig {
+    bool enabled = false;
+    std::string address = "127.0.0.1";  // admin listener; keep it off public interfaces
+    int port = 9090;
+    std::string path = "/metrics";
+};
+
+struct AccessLogConfig {
+    bool enabled = false;
+    std::string path = "./logs/access.log";
+    std::string format = "json";            // "json" (one object per line) or "combined"
+    double sample_rate = 1.0;               // fraction of requests logged; 5xx responses always are
+    std::size_t buffer_size = 1024 * 1024;  // per-thread queue; records that don't fit are dropped
+    int max_size_mb = 100;                  // rotate once the file reaches this size (0 = never)
+    int max_files = 5;                      // rotated files kept (access.log.1 is the newest)
+    int flush_interval_ms = 100;            // how often queued lines are written out
+};
+
+struct ResponseCacheConfig {
+    std::size_t memory_mb = 256;                 // stored responses, all shards together (0 = no cache)
+    std::size_t max_object_size = 1024 * 1024;   // larger responses go to the disk tier, or pass through uncached (bytes)
+    int collapse_timeout_ms = 5000;              // a miss waits this long for an identical one in flight (0 = never waits)
+    std::size_t disk_mb = 0;                     // disk tier under cache_dir for larger responses (0 = memory only)
+    std::size_t disk_slab_mb = 256;              // each slab file; the tier reuses the oldest one when full
+    std::size_t disk_max_object_size = 64 * 1024 * 1024;  // larger responses aren't stored on disk (bytes)
+};
+
+// Content type compressed for the client, with its levels
+struct CompressionType {
+    std::string type;  // "text/html", or "text/*" for every subtype
+    int gzip = 6;      // 1-9
+    int brotli = 4;    // 0-11
+};
+
+struct CompressionConfig {
+    std::size_t min_size = 256;  // bodies known to be shorter are sent as they are (bytes)
+    std::vector<CompressionType> types = {
+        {"text/html"}, {"text/css"}, {"text/plain"}, {"text/javascript"}, {"text/xml"},
+        {"application/javascript"}, {"application/json"}, {"application/xml"}, {"image/svg+xml"},
+    };
+};
+
+struct StaticFilesConfig {
+    std::size_t open_file_cache = 1024;   // open files and stat() results kept per worker thread (0 = none)
+    int open_file_valid_seconds = 5;      // a cached entry is checked against the file system after this long
 };
 
 struct ProxyConfig {
     int http_port = 80;
     int https_port = 443;
     std::string email;
-    int timeout_seconds = 30;
-    int max_connections = 1000;
+    int timeout_seconds = 30;        // default for body_read and backend_response timeouts
+    int max_connections = 1000;     // open client connections (0 = unlimited)
+    std::string overload_action = "reject";  // at max_connections: "reject" (fast 503) or "pause" accepting
+    int dns_ttl_seconds = 30;  // refresh interval for backend hostnames
+    int worker_threads = 0;        // 0 = one per hardware thread
+    bool thread_per_core = false;  // one io_context and SO_REUSEPORT acceptor per thread
+    bool cpu_affinity = false;     // pin worker threads to CPUs
+    std::vector<int> cpu_list;     // CPUs to pin to (default: worker i -> CPU i)
+    bool ktls = false;             // kernel TLS: the kernel encrypts what HTTPS connections send
+    TimeoutConfig timeouts;
+    KeepAliveConfig keep_alive;
+    UpstreamPoolConfig upstream_pool;
+    StreamingConfig streaming;
+    WebSocketConfig websocket;
+    Http2Config http2;
+    TlsSessionConfig tls_sessions;
+    TlsHandshakeConfig tls_handshake;
+    HealthCheckConfig health_check;
+    OutlierDetectionConfig outlier_detection;
+    ConfigReloadConfig config_reload;
+    MetricsConfig metrics;
+    AccessLogConfig access_log;
+    ResponseCacheConfig response_cache;
+    StaticFilesConfig static_files;
+    CompressionConfig compression;
     std::vector<SiteConfig> sites;
     std::string cert_dir = "./certs";
+    std::string cache_dir = "./cache";
     std::string acme_server = "https://acme-v02.api.letsencrypt.org/directory";
 };
 
+// Loads the YAML configuration and publishes it to the request path.
+// The startup configuration (ports, threads, pools) is fixed for the life of
+// the process; sites and per-request settings can be reloaded, and each reload
+// is published as a new immutable ConfigSnapshot with an atomic swap.
 class ConfigManager {
 public:
     static std::shared_ptr<ConfigManager> getInstance();
+    
+    // Parse a configuration file into a new ProxyConfig, nullptr on error.
+    // Nothing that is already running is touched.
+    static std::shared_ptr<ProxyConfig> parseConfig(const std::string& configPath);
+    
+    // Load the startup configuration and remember its path for reloads
     bool loadConfig(const std::string& configPath);
-    const ProxyConfig& getConfig() const { return config_; }
+    const ProxyConfig& getConfig() const { return *config_; }
+    std::shared_ptr<const ProxyConfig> getConfigPtr() const { return config_; }
+    const std::string& getConfigPath() const { return configPath_; }
+    
+    // Helper methods (startup configuration)
+    const SiteConfig* findSiteByDomain(std::string_view domain) const;
+    bool needsTLS(std::string_view domain) const;
+    
+    // Make snapshot the current one; assigns its generation
+    void publish(std::shared_ptr<ConfigSnapshot> snapshot);
     
-    // Helper methods
-    const SiteConfig* findSiteByDomain(const std::string& domain) const;
-    bool needsTLS(const std::string& domain) const;
+    // Current snapshot. Each thread keeps the last one it saw and only
+    // re-reads the shared pointer after a reload bumps the generation.
+    std::shared_ptr<const ConfigSnapshot> snapshot() const;
+    
+    // Generation of the current snapshot (changes on every publish)
+    std::uint64_t generation() const { return generation_.load(std::memory_order_acquire); }
 
 private:
     ConfigManager() = default;
     static std::shared_ptr<ConfigManager> instance_;
-    ProxyConfig config_;
+    std::shared_ptr<const ProxyConfig> config_ = std::make_shared<ProxyConfig>();
+    std::string configPath_;
+    
+    std::atomic<std::shared_ptr<const ConfigSnapshot>> current_;
+    std::atomic<std::uint64_t> generation_{0};
 };
 
 #endif // CONFIG_MANAGER_H
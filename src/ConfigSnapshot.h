@@ -0,0 +1,25 @@
+#ifndef CONFIG_SNAPSHOT_H
+#define CONFIG_SNAPSHOT_H
+
+#include "ConfigManager.h"
+#include "RouteTable.h"
+#include <cstdint>
+#include <memory>
+
+// Immutable configuration and the routing table compiled from it, published
+// together by ConfigManager. A connection pins the snapshot its current
+// request started with; a reload publishes a new one and the old snapshot is
+// freed when its last reader lets go.
+struct ConfigSnapshot {
+    ConfigSnapshot(std::shared_ptr<const ProxyConfig> cfg, BackendResolver& resolver)
+        : config(std::move(cfg)), routes(config->sites, resolver) {}
+
+    ConfigSnapshot(const ConfigSnapshot&) = delete;
+    ConfigSnapshot& operator=(const ConfigSnapshot&) = delete;
+
+    std::shared_ptr<const ProxyConfig> config;
+    RouteTable routes;          // points into config->sites
+    std::uint64_t generation = 0;  // assigned by ConfigManager::publish
+};
+
+#endif // CONFIG_SNAPSHOT_H
@@ -0,0 +1,85 @@
+#include "ConfigWatcher.h"
+#include "Log.h"
+#include <filesystem>
+#include <cstring>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+ConfigWatcher::ConfigWatcher(net::io_context& ioc, const std::string& path,
+                             std::chrono::milliseconds debounce, std::function<void()> on_change)
+    : descriptor_(ioc), debounce_timer_(ioc), debounce_(debounce), on_change_(std::move(on_change)) {
+    std::filesystem::path file = std::filesystem::absolute(path);
+    directory_ = file.parent_path().string();
+    file_name_ = file.filename().string();
+}
+
+ConfigWatcher::~ConfigWatcher() {
+    stop();
+}
+
+bool ConfigWatcher::start() {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        Log::warn() << "Config watch disabled: inotify_init1: " << std::strerror(errno);
+        return false;
+    }
+
+    if (inotify_add_watch(fd, directory_.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        Log::warn() << "Config watch disabled: cannot watch " << directory_ << ": "
+                    << std::strerror(errno);
+        ::close(fd);
+        return false;
+    }
+
+    descriptor_.assign(fd);
+    do_read();
+
+    Log::info() << "Watching " << directory_ << "/" << file_name_ << " for changes";
+    return true;
+}
+
+void ConfigWatcher::stop() {
+    boost::system::error_code ec;
+    debounce_timer_.cancel();
+    descriptor_.close(ec);
+}
+
+void ConfigWatcher::do_read() {
+    descriptor_.async_read_some(net::buffer(buffer_),
+        [this](boost::system::error_code ec, std::size_t bytes) {
+            on_read(ec, bytes);
+        });
+}
+
+void ConfigWatcher::on_read(boost::system::error_code ec, std::size_t bytes) {
+    if (ec) {
+        if (ec != net::error::operation_aborted) {
+            Log::warn() << "Config watch error: " << ec.message();
+        }
+        return;
+    }
+
+    // Events for other files in the directory are ignored
+    bool changed = false;
+    for (std::size_t offset = 0; offset + sizeof(inotify_event) <= bytes;) {
+        inotify_event event;
+        std::memcpy(&event, buffer_.data() + offset, sizeof(event));
+        if (event.len > 0 && file_name_ == buffer_.data() + offset + sizeof(inotify_event)) {
+            changed = true;
+        }
+        offset += sizeof(inotify_event) + event.len;
+    }
+
+    // Restart the debounce period on every write; a file written in several
+    // steps is reloaded once, after the last one
+    if (changed) {
+        debounce_timer_.expires_after(debounce_);
+        debounce_timer_.async_wait([this](boost::system::error_code ec) {
+            if (!ec) {
+                on_change_();
+            }
+        });
+    }
+
+    do_read();
+}
@@ -0,0 +1,41 @@
+#ifndef CONFIG_WATCHER_H
+#define CONFIG_WATCHER_H
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <array>
+#include <chrono>
+#include <functional>
+#include <string>
+
+namespace net = boost::asio;
+
+// Watches the configuration file with inotify and calls on_change once writes
+// have settled. The directory is watched rather than the file itself so that
+// editors and deploy tools that replace the file by renaming are noticed too.
+class ConfigWatcher {
+public:
+    ConfigWatcher(net::io_context& ioc, const std::string& path,
+                  std::chrono::milliseconds debounce, std::function<void()> on_change);
+    ~ConfigWatcher();
+
+    // Returns false if the watch could not be set up
+    bool start();
+    void stop();
+
+private:
+    void do_read();
+    void on_read(boost::system::error_code ec, std::size_t bytes);
+
+private:
+    net::posix::stream_descriptor descriptor_;
+    net::steady_timer debounce_timer_;
+    std::chrono::milliseconds debounce_;
+    std::string directory_;
+    std::string file_name_;
+    std::function<void()> on_change_;
+    alignas(8) std::array<char, 4096> buffer_;
+};
+
+#endif // CONFIG_WATCHER_H
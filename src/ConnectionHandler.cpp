@@ -1,232 +1,1220 @@
 #include "ConnectionHandler.h"
-#include <iostream>
-#include <boost/asio/connect.hpp>
+#include "DiskCache.h"
+#include "Log.h"
+#include <array>
+#include <charconv>
+#include <cstdio>
+#include <limits>
+#include <tuple>
+#include <vector>
+#include <unistd.h>
+
+namespace {
+
+// Relay buffers kept per thread for reuse by later exchanges
+constexpr std::size_t kMaxFreeRelayBuffers = 64;
+
+struct RelayBufferFreeList {
+    std::size_t buffer_size = 0;
+    std::vector<std::unique_ptr<char[]>> buffers;
+};
+
+thread_local RelayBufferFreeList t_relay_buffers;
+
+// Streamed bodies are never held in memory, so they need no size cap.
+// (boost::none would be the natural value, but Boost 1.74 compares a
+// disengaged limit as smaller than any length.)
+constexpr std::uint64_t kUnlimitedBody = std::numeric_limits<std::uint64_t>::max();
+
+constexpr char kContinueResponse[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+// Read size while waiting for the next request on a persistent connection
+constexpr std::size_t kIdleReadSize = 2048;
+
+std::string_view to_view(beast::string_view value) {
+    return std::string_view(value.data(), value.size());
+}
+
+bool is_idempotent(http::verb method) {
+    switch (method) {
+        case http::verb::get:
+        case http::verb::head:
+        case http::verb::options:
+        case http::verb::put:
+        case http::verb::delete_:
+            return true;
+        default:
+            return false;
+    }
+}
+
+} // namespace
 
 ConnectionHandler::ConnectionHandler(
     tcp::socket&& socket,
     std::shared_ptr<RequestRouter> router,
     bool is_ssl
-) : stream_(std::move(socket)), router_(router), is_ssl_(is_ssl) {
+) : stream_(std::move(socket)), router_(router), snapshot_(router->snapshot()), is_ssl_(is_ssl) {
+    init_client_address();
 }
 
 ConnectionHandler::ConnectionHandler(
     beast::ssl_stream<beast::tcp_stream>&& ssl_socket,
-    std::shared_ptr<RequestRouter> router
-) : stream_(ssl_socket.next_layer().release_socket()),
+    std::shared_ptr<RequestRouter> router,
+    bool ktls_tx
+) : stream_(ssl_socket.get_executor()),
     ssl_stream_(std::make_unique<beast::ssl_stream<beast::tcp_stream>>(std::move(ssl_socket))),
-    router_(router), is_ssl_(true) {
+    router_(router), snapshot_(router->snapshot()), is_ssl_(true), ktls_tx_(ktls_tx) {
+    init_client_address();
+}
+
+ConnectionHandler::~ConnectionHandler() {
+    if (ssl_stream_) {
+        TlsSessionCache::keep_session(ssl_stream_->native_handle());
+    }
 }
 
 void ConnectionHandler::start() {
+    // Plain connections may speak HTTP/2 with prior knowledge (h2c)
+    if (!is_ssl_ && snapshot_->config->http2.enabled) {
+        detect_http2_preface();
+        return;
+    }
     do_read();
 }
 
+void ConnectionHandler::detect_http2_preface() {
+    detail::set_deadline(client_tcp_stream(), timeout(snapshot_->config->timeouts.header_read_seconds));
+    stream_.async_read_some(buffer_.prepare(kIdleReadSize),
+        [self = shared_from_this()](beast::error_code ec, std::size_t bytes_transferred) {
+            if (ec) {
+                self->close_connection();
+                return;
+            }
+            self->buffer_.commit(bytes_transferred);
+            
+            // Compare what has arrived so far; an HTTP/1.1 request line
+            // differs from the preface within its first bytes
+            auto received = std::string_view(static_cast<const char*>(self->buffer_.data().data()),
+                                             self->buffer_.size());
+            auto preface = Http2Handler::kPreface;
+            if (received.substr(0, preface.size()) != preface.substr(0, received.size())) {
+                self->do_read();
+                return;
+            }
+            if (received.size() < preface.size()) {
+                self->detect_http2_preface();
+                return;
+            }
+            
+            auto handler = std::make_shared<Http2Handler>(std::move(self->stream_), self->router_);
+            handler->hold_admission_slot(std::move(self->admission_slot_));
+            handler->start(received);
+        });
+}
+
 void ConnectionHandler::do_read() {
-    req_ = {};
+    // Everything allocated from the arena by the previous exchange goes first
+    res_serializer_.reset();
+    res_parser_.reset();
+    req_serializer_.reset();
+    req_parser_.reset();
+    header_arena_.reset();
+    host_ = {};
+    route_ = nullptr;
+    backend_target_.reset();
+    upgrade_ = Upgrade::none;
+    cache_mode_ = CacheMode::bypass;
+    cached_.reset();
+    cache_fill_.reset();
+    flight_.complete(nullptr);
     
-    if (is_ssl_ && ssl_stream_) {
-        http::async_read(*ssl_stream_, buffer_, req_,
-            beast::bind_front_handler(&ConnectionHandler::on_read, shared_from_this()));
+    // Only the header is read here; the body is streamed to the backend later
+    req_parser_.emplace(std::piecewise_construct, std::make_tuple(),
+                        std::make_tuple(ArenaAllocator<char>(header_arena_)));
+    req_parser_->body_limit(kUnlimitedBody);
+    
+    // A persistent connection waits under the idle deadline for the next
+    // request to start; a pipelined one is already in buffer_
+    if (requests_served_ > 0 && buffer_.size() == 0) {
+        wait_for_request();
     } else {
-        http::async_read(stream_, buffer_, req_,
-            beast::bind_front_handler(&ConnectionHandler::on_read, shared_from_this()));
+        read_request_header();
     }
 }
 
+void ConnectionHandler::wait_for_request() {
+    detail::set_deadline(client_tcp_stream(), timeout(snapshot_->config->timeouts.idle_keepalive_seconds));
+    with_client_stream([this](auto& stream) {
+        stream.async_read_some(buffer_.prepare(kIdleReadSize),
+            [self = shared_from_this()](beast::error_code ec, std::size_t bytes_transferred) {
+                // The client going away (or staying idle too long) between
+                // requests is the normal end of a persistent connection
+                if (ec) {
+                    self->close_connection();
+                    return;
+                }
+                self->buffer_.commit(bytes_transferred);
+                self->read_request_header();
+            });
+    });
+}
+
+void ConnectionHandler::read_request_header() {
+    detail::set_deadline(client_tcp_stream(), timeout(snapshot_->config->timeouts.header_read_seconds));
+    with_client_stream([this](auto& stream) {
+        http::async_read_header(stream, buffer_, *req_parser_,
+            beast::bind_front_handler(&ConnectionHandler::on_read, shared_from_this()));
+    });
+}
+
 void ConnectionHandler::on_read(beast::error_code ec, std::size_t bytes_transferred) {
-    boost::ignore_unused(bytes_transferred);
-    
-    if (ec == http::error::end_of_stream) {
+    if (ec == http::error::end_of_stream || ec == beast::error::timeout) {
         close_connection();
         return;
     }
     
     if (ec) {
-        std::cerr << "Read error: " << ec.message() << std::endl;
+        Log::debug() << "Read error: " << ec.message();
         return;
     }
     
+    // A request runs entirely on the configuration that was current when it
+    // arrived; reloads are picked up between requests
+    if (router_->isStale(*snapshot_)) {
+        snapshot_ = router_->snapshot();
+    }
+    
+    // Remember what the client asked for before the header is rewritten for the backend
+    const auto& req = req_parser_->get();
+    client_version_ = req.version();
+    client_keep_alive_ = req.keep_alive();
+    request_method_ = req.method();
+    request_body_bytes_ = 0;
+    request_header_bytes_ = bytes_transferred;
+    request_started_ = std::chrono::steady_clock::now();
+    
+    requests_served_++;
     handle_request();
 }
 
 void ConnectionHandler::handle_request() {
-    std::string host = extract_host_from_request();
-    if (host.empty()) {
+    host_ = extract_host_from_request();
+    if (host_.empty()) {
         send_error_response(http::status::bad_request, "Missing Host header");
         return;
     }
     
-    // Check if this is a WebSocket upgrade request
-    if (websocket::is_upgrade(req_) && router_->isWebSocketEnabled(host)) {
-        handle_websocket_upgrade();
+    // One routing table lookup serves the rest of the exchange
+    route_ = snapshot_->routes.find(host_);
+    
+    // WebSocket upgrades take the normal path to the backend; what happens
+    // after its 101 depends on the site's websocket_mode
+    if (route_ && route_->websocket && websocket::is_upgrade(req_parser_->get())) {
+        upgrade_ = route_->websocket_frames ? Upgrade::frames : Upgrade::raw;
+    }
+    
+    // The frame relay writes through OpenSSL, which the kernel has taken over
+    // on this connection; a new connection naming this host keeps userspace TLS
+    if (upgrade_ == Upgrade::frames && ktls_tx_) {
+        send_error_response(http::status::misdirected_request, "Reconnect for WebSocket");
+        return;
+    }
+    
+    // Root sites are answered from the file system
+    if (route_ && !route_->root.empty()) {
+        serve_static();
         return;
     }
     
+    // Sites with a response cache may be answered without the backend
+    if (route_ && route_->cache && ResponseCache::enabled() && upgrade_ == Upgrade::none) {
+        const auto& req = req_parser_->get();
+        cache_mode_ = ResponseCache::request_mode(req.method(), to_view(req[http::field::cache_control]),
+                                                  to_view(req[http::field::pragma]),
+                                                  req.find(http::field::authorization) != req.end(),
+                                                  !req_parser_->is_done());
+        if (cache_mode_ != CacheMode::bypass) {
+            ResponseCache::make_key(cache_key_, is_ssl_, host_, to_view(req.target()));
+        }
+        if (cache_mode_ == CacheMode::invalidate) {
+            ResponseCache::invalidate(cache_key_);
+        }
+        if (cache_mode_ == CacheMode::lookup && (serve_from_cache() || join_flight())) {
+            return;
+        }
+    }
+    
     forward_to_backend();
 }
 
-void ConnectionHandler::forward_to_backend() {
-    std::string host = extract_host_from_request();
-    auto [backend_host, backend_port] = router_->getBackendForDomain(host);
+bool ConnectionHandler::serve_from_cache() {
+    cached_ = ResponseCache::lookup(cache_key_, cache_request_field());
+    if (!cached_) {
+        return false;
+    }
+    write_cached_response();
+    return true;
+}
+
+bool ConnectionHandler::join_flight() {
+    if (!ResponseCache::collapsing()) {
+        return false;
+    }
+    
+    // Only a GET leads: its response is the one copied into the cache
+    auto executor = client_tcp_stream().get_executor();
+    std::uint64_t wait = ++flight_wait_;
+    bool waiting = ResponseCache::join(cache_key_, request_method_ == http::verb::get ? &flight_ : nullptr,
+        [self = shared_from_this(), executor, wait](std::shared_ptr<const CachedResponse> response) {
+            net::post(executor, [self, wait, response = std::move(response)]() mutable {
+                self->on_flight_landed(wait, std::move(response));
+            });
+        });
+    if (!waiting) {
+        return false;
+    }
+    
+    if (!wait_timer_) {
+        wait_timer_ = std::make_unique<net::steady_timer>(executor);
+    }
+    wait_timer_->expires_after(ResponseCache::collapse_timeout());
+    wait_timer_->async_wait([self = shared_from_this(), wait](beast::error_code ec) {
+        if (ec || self->flight_wait_ != wait) {
+            return;
+        }
+        // A response landing later is ignored
+        self->flight_wait_++;
+        ResponseCache::record_collapse_fallback();
+        self->forward_to_backend();
+    });
+    return true;
+}
+
+void ConnectionHandler::on_flight_landed(std::uint64_t wait, std::shared_ptr<const CachedResponse> response) {
+    if (flight_wait_ != wait) {
+        return;
+    }
+    flight_wait_++;
+    wait_timer_->cancel();
+    
+    // The leader's response is shared as stored, unless this request asked
+    // for another variant of it
+    if (response && response->fresh(std::chrono::steady_clock::now()) &&
+        response->matches(cache_request_field())) {
+        cached_ = std::move(response);
+        write_cached_response();
+        return;
+    }
+    ResponseCache::record_collapse_fallback();
+    forward_to_backend();
+}
+
+void ConnectionHandler::write_cached_response() {
+    const auto& req = req_parser_->get();
+    bool not_modified = ResponseCache::not_modified(*cached_, to_view(req[http::field::if_none_match]),
+                                                    to_view(req[http::field::if_modified_since]));
+    unsigned status = not_modified ? 304 : cached_->status;
+    bool send_body = !not_modified && request_method_ != http::verb::head;
+    
+    bool keep_open = client_keep_alive();
+    close_after_response_ = !keep_open;
+    const char* connection = "";
+    if (client_version_ >= 11 && !keep_open) {
+        connection = "Connection: close\r\n";
+    } else if (client_version_ < 11 && keep_open) {
+        connection = "Connection: keep-alive\r\n";
+    }
+    auto age = cached_->age(std::chrono::steady_clock::now());
+    int length = std::snprintf(cache_fields_, sizeof(cache_fields_), "Age: %llu\r\n%s\r\n",
+                               static_cast<unsigned long long>(age), connection);
+    
+    // A body in the disk tier goes from the page cache with sendfile() when
+    // the kernel writes the socket (plain TCP, kTLS); through OpenSSL it is
+    // encrypted straight from the slab's mapping
+    const DiskBody* file = send_body ? cached_->disk.get() : nullptr;
+    bool send_file = file && (!is_ssl_ || ktls_tx_);
+    net::const_buffer body;
+    if (send_body && !send_file) {
+        body = file ? net::const_buffer(file->data, file->size) : net::buffer(cached_->body);
+    }
+    
+    // The stored bytes go out as they are; only the version and the fields
+    // above are per connection
+    std::array<net::const_buffer, 4> buffers{
+        net::buffer(client_version_ >= 11 ? "HTTP/1.1" : "HTTP/1.0", 8),
+        net::buffer(not_modified ? cached_->not_modified : cached_->head),
+        net::buffer(cache_fields_, static_cast<std::size_t>(length)),
+        body};
     
-    if (backend_host.empty() || backend_port == 0) {
+    detail::set_deadline(client_tcp_stream(), timeout(snapshot_->config->timeouts.body_read_seconds));
+    with_client_writer([&](auto& stream) {
+        net::async_write(stream, buffers,
+            [self = shared_from_this(), status, send_file](beast::error_code ec, std::size_t bytes_transferred) {
+                if (!ec && send_file) {
+                    const auto& file = *self->cached_->disk;
+                    self->send_file_body(status, bytes_transferred, file.fd, file.offset, file.size);
+                    return;
+                }
+                self->record_request(status, bytes_transferred);
+                self->cached_.reset();
+                if (ec) {
+                    Log::debug() << "Client write error: " << ec.message();
+                    self->close_connection();
+                    return;
+                }
+                self->finish_response();
+            });
+    });
+}
+
+void ConnectionHandler::serve_static() {
+    const auto& req = req_parser_->get();
+    auto response = StaticFiles::respond(to_view(req.method_string()), to_view(req.target()), route_->root,
+                                         cache_request_field(), static_path_);
+    switch (response.status) {
+        case 400:
+            send_error_response(http::status::bad_request, "Invalid path");
+            return;
+        case 404:
+            send_error_response(http::status::not_found, "Not found");
+            return;
+        case 301:
+        case 405: {
+            res_ = {};
+            res_.result(response.status);
+            res_.version(client_version_);
+            res_.set(http::field::server, "ReverseProxy/1.0");
+            if (response.status == 405) {
+                res_.set(http::field::allow, "GET, HEAD");
+            } else {
+                // A directory is served with its index under the name ending in '/'
+                auto target = to_view(req.target());
+                auto query = std::min(target.find('?'), target.size());
+                std::string location(target.substr(0, query));
+                location += '/';
+                location += target.substr(query);
+                res_.set(http::field::location, location);
+            }
+            res_.prepare_payload();
+            write_response();
+            return;
+        }
+        default:
+            break;
+    }
+    
+    static_file_ = response.file;
+    const StaticFile& file = *static_file_;
+    unsigned status = response.status;
+    char number[24];
+    auto append_number = [&](std::uint64_t value) {
+        auto end = std::to_chars(number, number + sizeof(number), value).ptr;
+        static_head_.append(number, end);
+    };
+    
+    static_head_.assign(client_version_ >= 11 ? "HTTP/1.1 " : "HTTP/1.0 ");
+    append_number(status);
+    static_head_ += ' ';
+    static_head_ += to_view(http::obsolete_reason(static_cast<http::status>(status)));
+    static_head_ += "\r\nServer: ReverseProxy/1.0\r\nDate: ";
+    static_head_ += StaticFiles::date();
+    if (status != 304) {
+        static_head_ += "\r\nContent-Type: ";
+        static_head_ += StaticFiles::content_type(static_path_);
+        static_head_ += "\r\nContent-Length: ";
+        append_number(response.length);
+        static_head_ += "\r\nAccept-Ranges: bytes";
+    }
+    if (status == 206 || status == 416) {
+        static_head_ += "\r\nContent-Range: ";
+        static_head_ += StaticFiles::content_range(response);
+    }
+    static_head_ += "\r\nLast-Modified: ";
+    static_head_ += file.last_modified;
+    static_head_ += "\r\nETag: ";
+    static_head_ += file.etag;
+    if (!response.encoding.empty()) {
+        static_head_ += "\r\nContent-Encoding: ";
+        static_head_ += response.encoding;
+    }
+    if (response.vary) {
+        static_head_ += "\r\nVary: Accept-Encoding";
+    }
+    
+    bool keep_open = client_keep_alive();
+    close_after_response_ = !keep_open;
+    if (client_version_ >= 11 && !keep_open) {
+        static_head_ += "\r\nConnection: close";
+    } else if (client_version_ < 11 && keep_open) {
+        static_head_ += "\r\nConnection: keep-alive";
+    }
+    static_head_ += "\r\n\r\n";
+    
+    // The body goes from the page cache with sendfile() when the kernel
+    // writes the socket (plain TCP, kTLS), else through OpenSSL in chunks
+    bool body = response.body;
+    bool send_file = body && (!is_ssl_ || ktls_tx_);
+    std::uint64_t offset = response.offset;
+    std::uint64_t length = response.length;
+    detail::set_deadline(client_tcp_stream(), timeout(snapshot_->config->timeouts.body_read_seconds));
+    with_client_writer([&](auto& stream) {
+        net::async_write(stream, net::buffer(static_head_),
+            [self = shared_from_this(), status, body, send_file, offset, length](
+                beast::error_code ec, std::size_t bytes_transferred) {
+                if (ec || !body) {
+                    self->finish_file_response(status, bytes_transferred, ec);
+                } else if (send_file) {
+                    self->send_file_body(status, bytes_transferred, self->static_file_->fd, offset, length);
+                } else {
+                    self->write_file_chunk(status, bytes_transferred, offset, length);
+                }
+            });
+    });
+}
+
+void ConnectionHandler::send_file_body(unsigned status, std::size_t header_bytes, int fd, std::uint64_t offset,
+                                       std::uint64_t size) {
+    sending_file_ = true;
+    file_sent_ = 0;
+    watch_file_send(0);
+    async_send_file(client_tcp_stream().socket(), fd, offset, size, file_sent_,
+        [self = shared_from_this(), status, header_bytes](beast::error_code ec) {
+            self->sending_file_ = false;
+            if (self->wait_timer_) {
+                self->wait_timer_->cancel();
+            }
+            self->finish_file_response(status, header_bytes + self->file_sent_, ec);
+        });
+}
+
+void ConnectionHandler::watch_file_send(std::uint64_t sent) {
+    auto limit = timeout(snapshot_->config->timeouts.body_read_seconds);
+    if (limit.count() == 0) {
+        return;
+    }
+    if (!wait_timer_) {
+        wait_timer_ = std::make_unique<net::steady_timer>(client_tcp_stream().get_executor());
+    }
+    // Like a write deadline, but a large body only has to keep moving
+    wait_timer_->expires_after(limit);
+    wait_timer_->async_wait([self = shared_from_this(), sent](beast::error_code ec) {
+        if (ec || !self->sending_file_) {
+            return;
+        }
+        if (self->file_sent_ == sent) {
+            beast::error_code ignored;
+            self->client_tcp_stream().socket().cancel(ignored);
+            return;
+        }
+        self->watch_file_send(self->file_sent_);
+    });
+}
+
+void ConnectionHandler::write_file_chunk(unsigned status, std::uint64_t sent, std::uint64_t offset,
+                                         std::uint64_t remaining) {
+    if (remaining == 0) {
+        finish_file_response(status, sent, {});
+        return;
+    }
+    
+    char* buffer = relay_buffer();
+    ssize_t n = ::pread(static_file_->fd, buffer, std::min<std::uint64_t>(remaining, relay_buffer_size_),
+                        static_cast<off_t>(offset));
+    if (n <= 0) {
+        // Truncated since it was opened: the announced length can't be sent
+        Log::warn() << "Static file read failed: " << static_path_;
+        finish_file_response(status, sent, net::error::make_error_code(net::error::eof));
+        return;
+    }
+    
+    auto size = static_cast<std::size_t>(n);
+    detail::set_deadline(client_tcp_stream(), timeout(snapshot_->config->timeouts.body_read_seconds));
+    with_client_stream([&](auto& stream) {
+        net::async_write(stream, net::buffer(buffer, size),
+            [self = shared_from_this(), status, sent, offset, remaining, size](
+                beast::error_code ec, std::size_t bytes_transferred) {
+                if (ec) {
+                    self->finish_file_response(status, sent + bytes_transferred, ec);
+                    return;
+                }
+                self->write_file_chunk(status, sent + size, offset + size, remaining - size);
+            });
+    });
+}
+
+void ConnectionHandler::finish_file_response(unsigned status, std::uint64_t bytes_sent, beast::error_code ec) {
+    release_relay_buffer();
+    record_request(status, bytes_sent);
+    cached_.reset();
+    static_file_.reset();
+    if (ec) {
+        Log::debug() << "Client write error: " << ec.message();
+        close_connection();
+        return;
+    }
+    finish_response();
+}
+
+void ConnectionHandler::forward_to_backend() {
+    if (!route_) {
         send_error_response(http::status::not_found, "No backend configured for domain");
         return;
     }
     
-    // Create backend connection
-    backend_stream_ = std::make_unique<beast::tcp_stream>(stream_.get_executor());
+    upstream_ = route_->balancer->select(upstream_hash_key());
+    if (!upstream_) {
+        send_error_response(http::status::bad_gateway, "No usable backend for domain");
+        return;
+    }
+    backend_target_ = upstream_.target();
+    
+    // The frame relay rewrites its own copy; everything else is rewritten
+    // here, once, however many connections it takes to send it
+    if (upgrade_ != Upgrade::frames) {
+        prepare_backend_request();
+    }
+    
+    // Reuse an idle keep-alive connection when the pool has one
+    backend_conn_ = BackendConnectionPool::local().acquire(backend_target_->name());
+    if (backend_conn_) {
+        backend_reused_ = true;
+        send_to_backend();
+        return;
+    }
     
-    // Resolve backend address
-    tcp::resolver resolver(stream_.get_executor());
-    auto const results = resolver.resolve(backend_host, std::to_string(backend_port));
+    connect_to_backend();
+}
+
+void ConnectionHandler::connect_to_backend() {
+    backend_reused_ = false;
+    backend_started_ = std::chrono::steady_clock::now();
+    
+    // Create backend connection
+    backend_conn_ = std::make_unique<BackendConnection>(beast::tcp_stream(stream_.get_executor()));
     
     // Connect to backend
-    backend_stream_->async_connect(results,
-        [self = shared_from_this()](beast::error_code ec, tcp::endpoint) {
+    resolve_backend([self = shared_from_this()](beast::error_code ec, const BackendResolver::Endpoints& endpoints) {
+        if (ec) {
             self->on_backend_connect(ec);
-        });
+            return;
+        }
+        detail::set_deadline(self->backend_conn_->stream,
+            timeout(self->snapshot_->config->timeouts.backend_connect_seconds));
+        self->backend_conn_->stream.async_connect(endpoints,
+            [self](beast::error_code ec, tcp::endpoint) {
+                if (!ec) {
+                    // Headers and body go out as separate writes
+                    beast::error_code ignored;
+                    self->backend_conn_->stream.socket().set_option(tcp::no_delay(true), ignored);
+                }
+                self->on_backend_connect(ec);
+            });
+    });
+}
+
+template<class Handler>
+void ConnectionHandler::resolve_backend(Handler&& handler) {
+    BackendResolver::async_endpoints(*backend_target_, stream_.get_executor(), std::forward<Handler>(handler));
 }
 
 void ConnectionHandler::on_backend_connect(beast::error_code ec) {
     if (ec) {
-        std::cerr << "Backend connect error: " << ec.message() << std::endl;
+        record_upstream_result(false);
+    }
+    
+    if (ec == beast::error::timeout) {
+        send_error_response(http::status::gateway_timeout, "Backend connection timed out");
+        return;
+    }
+    
+    if (ec) {
+        Log::warn() << "Backend connect error: " << ec.message();
         send_error_response(http::status::bad_gateway, "Backend connection failed");
         return;
     }
     
-    // Prepare request for backend (copy all headers)
-    backend_req_ = req_;
+    Metrics::record_backend_connect(std::chrono::steady_clock::now() - backend_started_);
+    send_to_backend();
+}
+
+void ConnectionHandler::send_to_backend() {
+    if (upgrade_ == Upgrade::frames) {
+        start_websocket_relay();
+        return;
+    }
+    
+    // Serialize the rewritten request as-is; its body is streamed in afterwards
+    auto& req = req_parser_->get();
+    req.body().data = nullptr;
+    req.body().size = 0;
+    req.body().more = !req_parser_->is_done();
+    req_serializer_.emplace(req);
+    
+    backend_started_ = std::chrono::steady_clock::now();
+    detail::set_deadline(backend_conn_->stream, timeout(snapshot_->config->timeouts.backend_response_seconds));
+    http::async_write_header(backend_conn_->stream, *req_serializer_,
+        beast::bind_front_handler(&ConnectionHandler::on_backend_write_header, shared_from_this()));
+}
+
+void ConnectionHandler::prepare_backend_request() {
+    auto& req = req_parser_->get();
+    
+    // Rewrite the header in place: drop hop-by-hop fields, add X-Forwarded-*
+    // and make the upstream request HTTP/1.1 keep-alive so it can be pooled
+    ForwardedInfo forwarded;
+    forwarded.client_ip = std::string_view(client_ip_, client_ip_size_);
+    forwarded.proto = is_ssl_ ? "https" : "http";
+    forwarded.host = host_;
+    prepare_upstream_request(req, forwarded);
     
-    // Forward request to backend
-    http::async_write(*backend_stream_, backend_req_,
-        beast::bind_front_handler(&ConnectionHandler::on_backend_write, shared_from_this()));
+    // The upgrade itself is the one hop-by-hop exchange passed through
+    if (upgrade_ == Upgrade::raw) {
+        req.set(http::field::upgrade, "websocket");
+        req.set(http::field::connection, "Upgrade");
+    }
+    
+    // "Expect: 100-continue" is answered by the proxy itself once the backend
+    // has been reached, so no interim response comes back from upstream
+    expect_continue_ = false;
+    auto expect = req.find(http::field::expect);
+    if (expect != req.end() && beast::iequals(expect->value(), "100-continue")) {
+        expect_continue_ = !req_parser_->is_done();
+        req.erase(http::field::expect);
+    }
 }
 
-void ConnectionHandler::on_backend_write(beast::error_code ec, std::size_t bytes_transferred) {
+void ConnectionHandler::on_backend_write_header(beast::error_code ec, std::size_t bytes_transferred) {
     boost::ignore_unused(bytes_transferred);
     
     if (ec) {
-        std::cerr << "Backend write error: " << ec.message() << std::endl;
+        if (retry_on_fresh_connection()) {
+            return;
+        }
+        Log::warn() << "Backend write error: " << ec.message();
+        record_upstream_result(false);
         send_error_response(http::status::bad_gateway, "Backend write failed");
         return;
     }
     
-    // Read response from backend
-    backend_res_ = {};
-    http::async_read(*backend_stream_, backend_buffer_, backend_res_,
-        beast::bind_front_handler(&ConnectionHandler::on_backend_read, shared_from_this()));
+    auto relay = [self = shared_from_this()] {
+        // Requests without a body never touch the relay buffer
+        char* buffer = self->req_parser_->is_done() ? nullptr : self->relay_buffer();
+        self->with_client_stream([&](auto& stream) {
+            const auto& timeouts = self->snapshot_->config->timeouts;
+            async_relay_body(stream, self->buffer_, *self->req_parser_,
+                self->backend_conn_->stream, *self->req_serializer_,
+                buffer, self->relay_buffer_size_,
+                timeout(timeouts.body_read_seconds), timeout(timeouts.backend_response_seconds),
+                beast::bind_front_handler(&ConnectionHandler::on_request_body_relayed, self));
+        });
+    };
+    
+    if (!expect_continue_) {
+        relay();
+        return;
+    }
+    
+    // The client is waiting for permission to send its body
+    detail::set_deadline(client_tcp_stream(), timeout(snapshot_->config->timeouts.body_read_seconds));
+    with_client_writer([&](auto& stream) {
+        net::async_write(stream, net::buffer(kContinueResponse, sizeof(kContinueResponse) - 1),
+            [self = shared_from_this(), relay](beast::error_code ec, std::size_t) {
+                if (ec) {
+                    Log::debug() << "Client write error: " << ec.message();
+                    self->close_connection();
+                    return;
+                }
+                relay();
+            });
+    });
 }
 
-void ConnectionHandler::on_backend_read(beast::error_code ec, std::size_t bytes_transferred) {
-    boost::ignore_unused(bytes_transferred);
+void ConnectionHandler::on_request_body_relayed(beast::error_code ec, std::uint64_t body_bytes) {
+    request_body_bytes_ = body_bytes;
+    
+    if (ec) {
+        if (retry_on_fresh_connection()) {
+            return;
+        }
+        if (ec == beast::error::timeout) {
+            // A timed-out stream is closed; only a stalled backend leaves the
+            // client able to receive an error
+            if (!client_tcp_stream().socket().is_open()) {
+                finish_backend_exchange(false);
+                close_connection();
+                return;
+            }
+            send_error_response(http::status::gateway_timeout, "Backend timed out reading request body");
+            return;
+        }
+        Log::warn() << "Request body relay error: " << ec.message();
+        send_error_response(http::status::bad_gateway, "Backend write failed");
+        return;
+    }
+    
+    read_backend_response();
+}
+
+void ConnectionHandler::read_backend_response() {
+    // A response to HEAD has no body even when it carries a Content-Length
+    res_parser_.emplace(std::piecewise_construct, std::make_tuple(),
+                        std::make_tuple(ArenaAllocator<char>(header_arena_)));
+    res_parser_->body_limit(kUnlimitedBody);
+    res_parser_->skip(request_method_ == http::verb::head);
+    
+    detail::set_deadline(backend_conn_->stream, timeout(snapshot_->config->timeouts.backend_response_seconds));
+    http::async_read_header(backend_conn_->stream, backend_buffer_, *res_parser_,
+        beast::bind_front_handler(&ConnectionHandler::on_backend_read_header, shared_from_this()));
+}
+
+void ConnectionHandler::on_backend_read_header(beast::error_code ec, std::size_t bytes_transferred) {
+    if (ec == beast::error::timeout) {
+        record_upstream_result(false);
+        send_error_response(http::status::gateway_timeout, "Backend response timed out");
+        return;
+    }
     
     if (ec) {
-        std::cerr << "Backend read error: " << ec.message() << std::endl;
+        if (bytes_transferred == 0 && retry_on_fresh_connection()) {
+            return;
+        }
+        Log::warn() << "Backend read error: " << ec.message();
+        record_upstream_result(false);
         send_error_response(http::status::bad_gateway, "Backend read failed");
         return;
     }
     
-    // Forward response to client
-    res_ = std::move(backend_res_);
+    auto& res = res_parser_->get();
     
-    if (is_ssl_ && ssl_stream_) {
-        http::async_write(*ssl_stream_, res_,
-            [self = shared_from_this()](beast::error_code ec, std::size_t) {
-                if (ec) {
-                    std::cerr << "Client write error: " << ec.message() << std::endl;
+    // The backend accepted the WebSocket upgrade
+    if (upgrade_ == Upgrade::raw && res.result() == http::status::switching_protocols) {
+        upstream_.record_response();
+        Metrics::record_backend_first_byte(std::chrono::steady_clock::now() - backend_started_);
+        record_upstream_result(true);
+        start_websocket_tunnel();
+        return;
+    }
+    
+    // Interim (1xx) responses are not forwarded; wait for the final one
+    if (http::to_status_class(res.result()) == http::status_class::informational) {
+        read_backend_response();
+        return;
+    }
+    upstream_.record_response();
+    Metrics::record_backend_first_byte(std::chrono::steady_clock::now() - backend_started_);
+    record_upstream_result(http::to_status_class(res.result()) != http::status_class::server_error);
+    
+    bool has_body = request_method_ != http::verb::head &&
+                    res.result() != http::status::no_content &&
+                    res.result() != http::status::not_modified;
+    
+    // A body delimited by closing the connection can't be pooled
+    backend_keep_alive_ = res.keep_alive() &&
+                          (!has_body || res.chunked() || res.has_content_length());
+    
+    // Persistence towards the client is decided here (honors HTTP/1.0 and
+    // "Connection: close"), not by the backend's hop-by-hop headers
+    prepare_downstream_response(res);
+    
+    // Compressed before it is stored, so the cache keeps the compressed variant
+    if (has_body && route_ && route_->compress) {
+        start_compression();
+    }
+    
+    // A storable response is copied into the cache as it is relayed
+    if ((cache_mode_ == CacheMode::lookup || cache_mode_ == CacheMode::refresh) &&
+        request_method_ == http::verb::get) {
+        cache_fill_ = ResponseCache::begin(cache_key_, res, cache_request_field());
+    }
+    // Misses waiting for this one needn't wait for a body that won't be
+    // stored; a server error says nothing about whether the URL is cacheable
+    if (!cache_fill_) {
+        flight_.complete(nullptr, res.result_int() < 500);
+    }
+    
+    res.version(client_version_);
+    bool keep_open = client_keep_alive();
+    
+    // Frame a body of unknown length for the client: chunked for HTTP/1.1,
+    // and close-delimited for HTTP/1.0, which has no chunked encoding
+    if (has_body && !res.has_content_length()) {
+        if (client_version_ >= 11) {
+            res.chunked(true);
+        } else {
+            res.chunked(false);
+            keep_open = false;
+        }
+    }
+    res.keep_alive(keep_open);
+    close_after_response_ = !keep_open;
+    
+    res.body().data = nullptr;
+    res.body().size = 0;
+    res.body().more = !res_parser_->is_done();
+    res_serializer_.emplace(res);
+    
+    detail::set_deadline(client_tcp_stream(), timeout(snapshot_->config->timeouts.body_read_seconds));
+    with_client_writer([this](auto& stream) {
+        http::async_write_header(stream, *res_serializer_,
+            beast::bind_front_handler(&ConnectionHandler::on_client_write_header, shared_from_this()));
+    });
+}
+
+void ConnectionHandler::start_compression() {
+    auto& res = res_parser_->get();
+    const auto& req = req_parser_->get();
+    std::optional<std::uint64_t> content_length;
+    if (res.has_content_length()) {
+        content_length = *res_parser_->content_length();
+    }
+    auto choice = Compression::choose(snapshot_->config->compression, res.result_int(),
+                                      to_view(res[http::field::content_type]),
+                                      to_view(res[http::field::content_encoding]),
+                                      to_view(res[http::field::cache_control]), content_length,
+                                      to_view(req[http::field::accept_encoding]));
+    
+    // Clients that don't accept a coding get the response as it is, but
+    // caches must still tell it apart from the compressed one
+    if (choice.varies && !Compression::varies_by_encoding(to_view(res[http::field::vary]))) {
+        auto vary = to_view(res[http::field::vary]);
+        if (vary.empty()) {
+            res.set(http::field::vary, "Accept-Encoding");
+        } else {
+            std::string merged(vary);
+            merged.append(", Accept-Encoding");
+            res.set(http::field::vary, merged);
+        }
+    }
+    if (choice.coding == ContentCoding::identity) {
+        return;
+    }
+    compressor_ = Compressor(choice.coding, choice.level, content_length);
+    if (!compressor_) {
+        return;
+    }
+    
+    // The body is re-encoded: its length isn't known up front (it is sent
+    // chunked), byte ranges no longer apply and a strong validator would
+    // claim byte equality with the backend's representation
+    auto name = Compression::name(choice.coding);
+    res.set(http::field::content_encoding, beast::string_view(name.data(), name.size()));
+    res.erase(http::field::content_length);
+    res.erase(http::field::accept_ranges);
+    auto etag = to_view(res[http::field::etag]);
+    if (!etag.empty() && etag.substr(0, 2) != "W/") {
+        std::string weak("W/");
+        weak.append(etag);
+        res.set(http::field::etag, weak);
+    }
+}
+
+void ConnectionHandler::on_client_write_header(beast::error_code ec, std::size_t bytes_transferred) {
+    response_header_bytes_ = bytes_transferred;
+    
+    if (ec) {
+        Log::debug() << "Client write error: " << ec.message();
+        record_request(res_parser_->get().result_int(), bytes_transferred);
+        finish_backend_exchange(false);
+        close_connection();
+        return;
+    }
+    
+    char* buffer = res_parser_->is_done() ? nullptr : relay_buffer();
+    with_client_writer([this, buffer](auto& stream) {
+        const auto& timeouts = snapshot_->config->timeouts;
+        async_relay_body(backend_conn_->stream, backend_buffer_, *res_parser_,
+            stream, *res_serializer_, buffer, relay_buffer_size_,
+            timeout(timeouts.backend_response_seconds), timeout(timeouts.body_read_seconds),
+            &compressor_,
+            [this](const char* data, std::size_t size) {
+                if (cache_fill_) {
+                    ResponseCache::append(cache_fill_, data, size);
+                    if (!cache_fill_) {
+                        flight_.complete(nullptr, true);
+                    }
                 }
-                self->close_connection();
-            });
+            },
+            beast::bind_front_handler(&ConnectionHandler::on_response_body_relayed, shared_from_this()));
+    });
+}
+
+void ConnectionHandler::on_response_body_relayed(beast::error_code ec, std::uint64_t body_bytes) {
+    record_request(res_parser_->get().result_int(), response_header_bytes_ + body_bytes);
+    
+    // The response header is already on its way to the client, so a failure
+    // here can only be reported by closing the connection
+    if (ec) {
+        Log::warn() << "Response body relay error: " << ec.message();
+        finish_backend_exchange(false);
+        close_connection();
+        return;
+    }
+    
+    if (cache_fill_) {
+        auto stored = ResponseCache::store(std::move(cache_fill_));
+        bool uncacheable = !stored;
+        flight_.complete(std::move(stored), uncacheable);
+    }
+    finish_backend_exchange(backend_keep_alive_ && backend_buffer_.size() == 0);
+    finish_response();
+}
+
+void ConnectionHandler::finish_backend_exchange(bool reusable) {
+    cache_fill_.reset();
+    flight_.complete(nullptr);
+    compressor_ = Compressor();
+    res_serializer_.reset();
+    res_parser_.reset();
+    release_relay_buffer();
+    upstream_.release();
+    
+    if (!backend_conn_) {
+        return;
+    }
+    
+    backend_conn_->requests_served++;
+    if (reusable) {
+        BackendConnectionPool::local().release(backend_target_->name(), std::move(backend_conn_));
     } else {
-        http::async_write(stream_, res_,
-            [self = shared_from_this()](beast::error_code ec, std::size_t) {
+        beast::error_code ec;
+        backend_conn_->stream.socket().shutdown(tcp::socket::shutdown_both, ec);
+        backend_conn_->stream.socket().close(ec);
+        backend_conn_.reset();
+    }
+    backend_buffer_.clear();
+}
+
+void ConnectionHandler::record_upstream_result(bool success) {
+    if (!backend_target_) {
+        return;
+    }
+    
+    auto& health = backend_target_->health();
+    if (success) {
+        health.record_success();
+        return;
+    }
+    if (auto ejected_ms = health.record_failure()) {
+        Log::warn() << "Backend " << backend_target_->name() << " failed repeatedly, ejected for "
+                    << ejected_ms << " ms";
+    }
+}
+
+void ConnectionHandler::record_request(unsigned status, std::uint64_t bytes_sent) {
+    auto elapsed = std::chrono::steady_clock::now() - request_started_;
+    Metrics::record_request(route_ ? route_->metrics_id : Metrics::kUnmatchedSite, status,
+                            request_header_bytes_ + request_body_bytes_, bytes_sent, elapsed);
+    
+    if (Log::access_enabled() && req_parser_) {
+        const auto& req = req_parser_->get();
+        auto view = [](beast::string_view value) { return std::string_view(value.data(), value.size()); };
+        AccessRecord record;
+        record.client_ip = std::string_view(client_ip_, client_ip_size_);
+        record.host = host_;
+        record.method = view(req.method_string());
+        record.target = view(req.target());
+        record.protocol = client_version_ >= 11 ? "HTTP/1.1" : "HTTP/1.0";
+        if (backend_target_) {
+            record.upstream = backend_target_->name();
+        }
+        record.referer = view(req[http::field::referer]);
+        record.user_agent = view(req[http::field::user_agent]);
+        record.status = status;
+        record.bytes_received = request_header_bytes_ + request_body_bytes_;
+        record.bytes_sent = bytes_sent;
+        record.elapsed = elapsed;
+        Log::access(record);
+    }
+}
+
+ResponseCache::RequestField ConnectionHandler::cache_request_field() const {
+    return [this](std::string_view name) {
+        return to_view(req_parser_->get()[beast::string_view(name.data(), name.size())]);
+    };
+}
+
+bool ConnectionHandler::retry_on_fresh_connection() {
+    // Only a reused connection can have been closed by the backend while idle,
+    // and only idempotent requests whose body was not consumed yet can be resent
+    if (!backend_reused_ || !is_idempotent(request_method_) ||
+        !req_parser_->is_done() || request_body_bytes_ > 0) {
+        return false;
+    }
+    
+    beast::error_code ec;
+    backend_conn_->stream.socket().close(ec);
+    backend_buffer_.clear();
+    res_parser_.reset();
+    connect_to_backend();
+    return true;
+}
+
+void ConnectionHandler::start_websocket_tunnel() {
+    // Pass the 101 on as the backend sent it; its Upgrade, Connection and
+    // Sec-WebSocket-* headers complete the client's handshake
+    auto& res = res_parser_->get();
+    res.version(client_version_);
+    res.body().data = nullptr;
+    res.body().size = 0;
+    res.body().more = false;
+    res_serializer_.emplace(res);
+    
+    detail::set_deadline(client_tcp_stream(), timeout(snapshot_->config->timeouts.body_read_seconds));
+    with_client_writer([this](auto& stream) {
+        http::async_write_header(stream, *res_serializer_,
+            [self = shared_from_this()](beast::error_code ec, std::size_t bytes_transferred) {
+                self->record_request(101, bytes_transferred);
                 if (ec) {
-                    std::cerr << "Client write error: " << ec.message() << std::endl;
+                    Log::debug() << "Client write error: " << ec.message();
+                    self->finish_backend_exchange(false);
+                    self->close_connection();
+                    return;
                 }
-                self->close_connection();
+                
+                // Frames either side sent right behind the handshake are
+                // already in our read buffers
+                auto pending = [](beast::flat_buffer& buffer) {
+                    std::string bytes(beast::buffers_to_string(buffer.data()));
+                    buffer.clear();
+                    buffer.shrink_to_fit();
+                    return bytes;
+                };
+                std::string client_pending = pending(self->buffer_);
+                std::string backend_pending = pending(self->backend_buffer_);
+                
+                auto backend = std::move(self->backend_conn_->stream);
+                self->backend_conn_.reset();
+                self->upstream_.release();
+                const auto& config = self->snapshot_->config->websocket;
+                if (self->is_ssl_ && self->ssl_stream_) {
+                    auto tunnel = std::make_shared<WebSocketTunnel<beast::ssl_stream<beast::tcp_stream>>>(
+                        std::move(*self->ssl_stream_), std::move(backend),
+                        std::move(self->admission_slot_), config, self->ktls_tx_);
+                    self->ssl_stream_.reset();
+                    tunnel->start(std::move(client_pending), std::move(backend_pending));
+                } else {
+                    auto tunnel = std::make_shared<WebSocketTunnel<beast::tcp_stream>>(
+                        std::move(self->stream_), std::move(backend),
+                        std::move(self->admission_slot_), config);
+                    tunnel->start(std::move(client_pending), std::move(backend_pending));
+                }
+                
+                // Nothing of the HTTP exchange is needed any more
+                self->res_serializer_.reset();
+                self->res_parser_.reset();
+                self->req_serializer_.reset();
+                self->req_parser_.reset();
+                self->header_arena_.reset();
             });
-    }
+    });
 }
 
-void ConnectionHandler::handle_websocket_upgrade() {
-    std::string host = extract_host_from_request();
-    auto [backend_host, backend_port] = router_->getBackendForDomain(host);
+void ConnectionHandler::start_websocket_relay() {
+    // The relay accepts the client with its original request, so copy that
+    // before the header is rewritten for the backend
+    auto& req = req_parser_->get();
+    http::request<http::empty_body> client_request{req.method(), req.target(), req.version()};
+    for (const auto& field : req) {
+        client_request.insert(field.name_string(), field.value());
+    }
     
-    if (backend_host.empty() || backend_port == 0) {
-        send_error_response(http::status::not_found, "No backend configured for WebSocket");
+    ForwardedInfo forwarded;
+    forwarded.client_ip = std::string_view(client_ip_, client_ip_size_);
+    forwarded.proto = is_ssl_ ? "https" : "http";
+    forwarded.host = host_;
+    prepare_upstream_request(req, forwarded);
+    
+    // A client that pipelined frames behind its upgrade request has broken
+    // the handshake; don't start the relay with them left in buffer_
+    if (buffer_.size() > 0) {
+        send_error_response(http::status::bad_request, "Unexpected data after WebSocket upgrade");
         return;
     }
     
-    // Create WebSocket streams
+    // The relay completes both handshakes itself and reports how they went;
+    // the request is recorded then, and this handler (with the parsed request
+    // the access log reads) lives until that happens
+    auto on_handshake = [self = shared_from_this()](unsigned status, std::size_t bytes_sent) {
+        self->record_request(status, bytes_sent);
+        self->req_parser_.reset();
+        self->header_arena_.reset();
+    };
+    
+    auto backend = std::move(backend_conn_->stream);
+    backend_conn_.reset();
+    upstream_.release();
+    const auto& config = snapshot_->config->websocket;
     if (is_ssl_ && ssl_stream_) {
-        ws_stream_ = std::make_unique<websocket::stream<beast::tcp_stream>>(std::move(stream_));
+        auto relay = std::make_shared<WebSocketFrameRelay<beast::ssl_stream<beast::tcp_stream>>>(
+            std::move(*ssl_stream_), std::move(backend), std::move(admission_slot_), config);
+        ssl_stream_.reset();
+        relay->start(client_request, req, std::move(on_handshake));
     } else {
-        ws_stream_ = std::make_unique<websocket::stream<beast::tcp_stream>>(std::move(stream_));
+        auto relay = std::make_shared<WebSocketFrameRelay<beast::tcp_stream>>(
+            std::move(stream_), std::move(backend), std::move(admission_slot_), config);
+        relay->start(client_request, req, std::move(on_handshake));
     }
-    
-    backend_ws_stream_ = std::make_unique<websocket::stream<beast::tcp_stream>>(
-        beast::tcp_stream(stream_.get_executor()));
-    
-    // Connect to backend and upgrade both connections
-    tcp::resolver resolver(stream_.get_executor());
-    auto const results = resolver.resolve(backend_host, std::to_string(backend_port));
-    
-    boost::asio::async_connect(backend_ws_stream_->next_layer().socket(), results,
-        [self = shared_from_this()](beast::error_code ec, tcp::endpoint) {
-            if (ec) {
-                std::cerr << "WebSocket backend connect error: " << ec.message() << std::endl;
-                return;
-            }
-            
-            // Accept WebSocket on client side and connect to backend
-            self->ws_stream_->async_accept(self->req_,
-                [self](beast::error_code ec) {
-                    if (ec) {
-                        std::cerr << "WebSocket accept error: " << ec.message() << std::endl;
-                        return;
-                    }
-                    
-                    // Upgrade backend connection to WebSocket
-                    self->backend_ws_stream_->async_handshake(
-                        self->extract_host_from_request(),
-                        // self->req_.target().to_string(),
-                        std::string(self->req_.target()),
-                        [self](beast::error_code ec) {
-                            if (ec) {
-                                std::cerr << "WebSocket backend handshake error: " << ec.message() << std::endl;
-                                return;
-                            }
-                            
-                            // Start bidirectional forwarding
-                            // This is a simplified implementation
-                            // In production, you'd want proper bidirectional forwarding
-                            std::cout << "WebSocket connection established" << std::endl;
-                        });
-                });
-        });
 }
 
 void ConnectionHandler::send_error_response(http::status status, const std::string& message) {
+    // Drop a backend exchange that failed half-way
+    finish_backend_exchange(false);
+    
     res_ = {};
     res_.result(status);
-    res_.version(req_.version());
+    res_.version(client_version_);
     res_.set(http::field::server, "ReverseProxy/1.0");
     res_.set(http::field::content_type, "text/plain");
     res_.body() = message;
     res_.prepare_payload();
     
-    if (is_ssl_ && ssl_stream_) {
-        http::async_write(*ssl_stream_, res_,
-            [self = shared_from_this()](beast::error_code ec, std::size_t) {
-                self->close_connection();
-            });
-    } else {
-        http::async_write(stream_, res_,
-            [self = shared_from_this()](beast::error_code ec, std::size_t) {
-                self->close_connection();
-            });
+    write_response();
+}
+
+void ConnectionHandler::write_response() {
+    bool keep_open = client_keep_alive();
+    res_.keep_alive(keep_open);
+    close_after_response_ = !keep_open;
+    
+    detail::set_deadline(client_tcp_stream(), timeout(snapshot_->config->timeouts.body_read_seconds));
+    with_client_writer([this](auto& stream) {
+        http::async_write(stream, res_,
+            beast::bind_front_handler(&ConnectionHandler::on_write, shared_from_this()));
+    });
+}
+
+void ConnectionHandler::on_write(beast::error_code ec, std::size_t bytes_transferred) {
+    record_request(res_.result_int(), bytes_transferred);
+    
+    if (ec) {
+        Log::debug() << "Client write error: " << ec.message();
+        close_connection();
+        return;
     }
+    
+    finish_response();
+}
+
+void ConnectionHandler::finish_response() {
+    if (close_after_response_) {
+        close_connection();
+        return;
+    }
+    
+    // Persistent connection: serve the next request, which may already be
+    // sitting in buffer_ if the client pipelined it
+    do_read();
+}
+
+bool ConnectionHandler::client_keep_alive() const {
+    const auto& keep_alive = snapshot_->config->keep_alive;
+    
+    // A request body left unread on the socket would be parsed as the next request
+    return keep_alive.enabled &&
+           client_keep_alive_ &&
+           requests_served_ < keep_alive.max_requests_per_connection &&
+           req_parser_ && req_parser_->is_done();
 }
 
 void ConnectionHandler::close_connection() {
@@ -238,32 +1226,81 @@ void ConnectionHandler::close_connection() {
         stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
     }
     
-    if (backend_stream_) {
-        backend_stream_->socket().shutdown(tcp::socket::shutdown_send, ec);
+    if (backend_conn_) {
+        backend_conn_->stream.socket().shutdown(tcp::socket::shutdown_send, ec);
     }
+    
+    release_relay_buffer();
 }
 
-std::string ConnectionHandler::extract_host_from_request() {
-    auto host_it = req_.find(http::field::host);
-    if (host_it != req_.end()) {
-        // std::string host = host_it->value().to_string();
-        std::string host = std::string(host_it->value());
-        // Remove port if present
-        size_t colon_pos = host.find(':');
-        if (colon_pos != std::string::npos) {
-            host = host.substr(0, colon_pos);
+char* ConnectionHandler::relay_buffer() {
+    if (!relay_buffer_) {
+        std::size_t size = snapshot_->config->streaming.buffer_size;
+        auto& free_list = t_relay_buffers;
+        if (free_list.buffer_size == size && !free_list.buffers.empty()) {
+            relay_buffer_ = std::move(free_list.buffers.back());
+            free_list.buffers.pop_back();
+        } else {
+            relay_buffer_ = std::make_unique_for_overwrite<char[]>(size);
         }
-        return host;
+        relay_buffer_size_ = size;
     }
-    return "";
+    return relay_buffer_.get();
 }
 
-template<bool isRequest, class Body, class Fields>
-void ConnectionHandler::copy_headers(
-    const http::message<isRequest, Body, Fields>& source,
-    http::message<!isRequest, http::string_body, http::basic_fields<std::allocator<char>>>& target
-) {
-    for (auto const& field : source) {
-        target.set(field.name(), field.value());
+void ConnectionHandler::release_relay_buffer() {
+    if (!relay_buffer_) {
+        return;
+    }
+    
+    auto& free_list = t_relay_buffers;
+    if (free_list.buffer_size != relay_buffer_size_) {
+        free_list.buffers.clear();
+        free_list.buffer_size = relay_buffer_size_;
+    }
+    if (free_list.buffers.size() < kMaxFreeRelayBuffers) {
+        free_list.buffers.push_back(std::move(relay_buffer_));
+    }
+    relay_buffer_.reset();
+}
+
+std::string_view ConnectionHandler::upstream_hash_key() const {
+    const LoadBalancer& balancer = *route_->balancer;
+    if (balancer.policy() != LoadBalancer::Policy::ring_hash) {
+        return {};
+    }
+    
+    // Requests without the affinity header fall back to the client address
+    if (!balancer.hash_header().empty()) {
+        const auto& req = req_parser_->get();
+        auto it = req.find(beast::string_view(balancer.hash_header().data(), balancer.hash_header().size()));
+        if (it != req.end() && !it->value().empty()) {
+            return std::string_view(it->value().data(), it->value().size());
+        }
+    }
+    return std::string_view(client_ip_, client_ip_size_);
+}
+
+std::string_view ConnectionHandler::extract_host_from_request() const {
+    const auto& req = req_parser_->get();
+    auto host_it = req.find(http::field::host);
+    if (host_it == req.end()) {
+        return {};
+    }
+    
+    // Remove port if present
+    std::string_view host(host_it->value().data(), host_it->value().size());
+    size_t colon_pos = host.find(':');
+    if (colon_pos != std::string_view::npos) {
+        host = host.substr(0, colon_pos);
+    }
+    return host;
+}
+
+void ConnectionHandler::init_client_address() {
+    beast::error_code ec;
+    auto endpoint = client_tcp_stream().socket().remote_endpoint(ec);
+    if (!ec) {
+        client_ip_size_ = format_client_address(endpoint, client_ip_, sizeof(client_ip_));
     }
 }
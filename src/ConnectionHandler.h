@@ -2,14 +2,31 @@
 #define CONNECTION_HANDLER_H
 
 #include "RequestRouter.h"
+#include "AdmissionController.h"
+#include "BackendConnectionPool.h"
+#include "BodyRelay.h"
+#include "Compression.h"
+#include "HeaderArena.h"
+#include "ProxyHeaders.h"
+#include "WebSocketHandler.h"
+#include "Http2Handler.h"
+#include "TlsSessionCache.h"
+#include "Metrics.h"
+#include "ResponseCache.h"
+#include "StaticFiles.h"
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/websocket.hpp>
 #include <boost/beast/ssl.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/ssl/stream.hpp>
+#include <chrono>
+#include <cstdint>
 #include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
 
 namespace beast = boost::beast;
 namespace http = beast::http;
@@ -18,6 +35,9 @@ namespace net = boost::asio;
 namespace ssl = boost::asio::ssl;
 using tcp = boost::asio::ip::tcp;
 
+// Header fields of the in-flight exchange live in the connection's arena
+using ProxyFields = http::basic_fields<ArenaAllocator<char>>;
+
 class ConnectionHandler : public std::enable_shared_from_this<ConnectionHandler> {
 public:
     ConnectionHandler(
@@ -26,53 +46,221 @@ public:
         bool is_ssl = false
     );
     
+    // ktls_tx: the kernel already encrypts what is sent on the socket
     ConnectionHandler(
         beast::ssl_stream<beast::tcp_stream>&& ssl_socket,
-        std::shared_ptr<RequestRouter> router
+        std::shared_ptr<RequestRouter> router,
+        bool ktls_tx = false
     );
     
+    ~ConnectionHandler();
+    
     void start();
+    
+    // Keep the connection counted against max_connections while it lives
+    void hold_admission_slot(AdmissionController::Slot slot) { admission_slot_ = std::move(slot); }
+    
+    // Whether the kernel encrypts what this connection sends (kTLS)
+    bool ktls_active() const { return ktls_tx_; }
 
 private:
+    void detect_http2_preface();
     void do_read();
+    void wait_for_request();
+    void read_request_header();
     void on_read(beast::error_code ec, std::size_t bytes_transferred);
     void handle_request();
+    bool serve_from_cache();
+    bool join_flight();
+    void on_flight_landed(std::uint64_t wait, std::shared_ptr<const CachedResponse> response);
+    void write_cached_response();
+    void serve_static();
+    void send_file_body(unsigned status, std::size_t header_bytes, int fd, std::uint64_t offset, std::uint64_t size);
+    void watch_file_send(std::uint64_t sent);
+    void write_file_chunk(unsigned status, std::uint64_t sent, std::uint64_t offset, std::uint64_t remaining);
+    void finish_file_response(unsigned status, std::uint64_t bytes_sent, beast::error_code ec);
     void forward_to_backend();
-    void handle_websocket_upgrade();
+    void connect_to_backend();
+    void start_websocket_tunnel();
+    void start_websocket_relay();
     void on_backend_connect(beast::error_code ec);
-    void on_backend_write(beast::error_code ec, std::size_t bytes_transferred);
-    void on_backend_read(beast::error_code ec, std::size_t bytes_transferred);
+    void prepare_backend_request();
+    void send_to_backend();
+    void on_backend_write_header(beast::error_code ec, std::size_t bytes_transferred);
+    void on_request_body_relayed(beast::error_code ec, std::uint64_t body_bytes);
+    void read_backend_response();
+    void on_backend_read_header(beast::error_code ec, std::size_t bytes_transferred);
+    void start_compression();
+    void on_client_write_header(beast::error_code ec, std::size_t bytes_transferred);
+    void on_response_body_relayed(beast::error_code ec, std::uint64_t body_bytes);
+    void finish_backend_exchange(bool reusable);
     void send_error_response(http::status status, const std::string& message);
+    void write_response();
+    void on_write(beast::error_code ec, std::size_t bytes_transferred);
+    void finish_response();
     void close_connection();
     
-    // Extract host from request
-    std::string extract_host_from_request();
+    // Whether the client connection stays open after the current response
+    bool client_keep_alive() const;
     
-    // Copy headers from source to target
-    template<bool isRequest, class Body, class Fields>
-    void copy_headers(
-        const http::message<isRequest, Body, Fields>& source,
-        http::message<!isRequest, http::string_body, http::basic_fields<std::allocator<char>>>& target
-    );
+    // Invoke f with the client stream (TLS or plain TCP)
+    template<class F>
+    void with_client_stream(F&& f) {
+        if (is_ssl_ && ssl_stream_) {
+            f(*ssl_stream_);
+        } else {
+            f(stream_);
+        }
+    }
+    
+    // Invoke f with the stream responses are written to: the socket itself
+    // once the kernel encrypts for the connection
+    template<class F>
+    void with_client_writer(F&& f) {
+        if (ktls_tx_) {
+            f(client_tcp_stream());
+        } else {
+            with_client_stream(std::forward<F>(f));
+        }
+    }
+    
+    // TCP layer of the client connection, which carries its deadlines
+    beast::tcp_stream& client_tcp_stream() {
+        return is_ssl_ && ssl_stream_ ? ssl_stream_->next_layer() : stream_;
+    }
+    
+    // Configured deadline (0 = none)
+    static std::chrono::steady_clock::duration timeout(int seconds) {
+        return std::chrono::seconds(seconds > 0 ? seconds : 0);
+    }
+    
+    // Fixed relay buffer for streaming bodies, taken from a per-thread free list
+    char* relay_buffer();
+    void release_relay_buffer();
+    
+    // Feed the outcome of a backend exchange to passive outlier detection
+    void record_upstream_result(bool success);
+    
+    // Count the finished exchange in the request metrics
+    void record_request(unsigned status, std::uint64_t bytes_sent);
+    
+    // Fields of the current request by name, for the cache's Vary handling
+    // and static files' conditional and range requests
+    ResponseCache::RequestField cache_request_field() const;
+    
+    // Retry a failed exchange on a fresh connection if a pooled one went stale
+    bool retry_on_fresh_connection();
+    
+    // Pass the backend's endpoints to handler(ec, endpoints)
+    template<class Handler>
+    void resolve_backend(Handler&& handler);
+    
+    // Key that ring_hash balancing maps to an upstream
+    std::string_view upstream_hash_key() const;
+    
+    // Extract host from request (a view into the request header)
+    std::string_view extract_host_from_request() const;
+    
+    // Record the client address for X-Forwarded-For
+    void init_client_address();
 
 private:
     beast::tcp_stream stream_;
     std::unique_ptr<beast::ssl_stream<beast::tcp_stream>> ssl_stream_;
     beast::flat_buffer buffer_;
-    http::request<http::string_body> req_;
-    http::response<http::string_body> res_;
     std::shared_ptr<RequestRouter> router_;
+    std::shared_ptr<const ConfigSnapshot> snapshot_;  // pinned configuration and routes
     bool is_ssl_;
+    bool ktls_tx_ = false;
+    AdmissionController::Slot admission_slot_;
+    int requests_served_ = 0;
+    bool close_after_response_ = false;
+    
+    // Request properties captured before the header is rewritten for the backend
+    unsigned client_version_ = 11;
+    bool client_keep_alive_ = false;
+    http::verb request_method_ = http::verb::unknown;
+    bool expect_continue_ = false;
+    std::uint64_t request_body_bytes_ = 0;
+    
+    // Metrics of the current exchange
+    std::chrono::steady_clock::time_point request_started_;
+    std::chrono::steady_clock::time_point backend_started_;  // connect, then request sent
+    std::uint64_t request_header_bytes_ = 0;
+    std::uint64_t response_header_bytes_ = 0;
+    
+    // Client address, formatted once per connection
+    char client_ip_[64] = {};
+    std::size_t client_ip_size_ = 0;
+    
+    // Storage for the header fields of the current exchange; must outlive
+    // (and is therefore declared before) the parsers that allocate from it
+    HeaderArena header_arena_;
+    
+    // Client request: the header is parsed up front, rewritten in place and
+    // serialized to the backend from the same message; the body is streamed
+    std::optional<http::request_parser<http::buffer_body, ArenaAllocator<char>>> req_parser_;
+    std::optional<http::request_serializer<http::buffer_body, ProxyFields>> req_serializer_;
+    
+    // Locally generated responses (errors, 100 Continue)
+    http::response<http::string_body> res_;
     
-    // Backend connection
-    std::unique_ptr<beast::tcp_stream> backend_stream_;
+    // Routing for the current request
+    std::string_view host_;         // Host header value without port (points into the request)
+    const Route* route_ = nullptr;  // entry for host_ in snapshot_
+    
+    // Response cache: what it may do for the current request and its key,
+    // then either the stored response being written (a hit) or the backend's
+    // response being copied into the cache (a miss)
+    CacheMode cache_mode_ = CacheMode::bypass;
+    std::string cache_key_;  // capacity reused across requests
+    std::shared_ptr<const CachedResponse> cached_;
+    std::unique_ptr<CachedResponse> cache_fill_;
+    char cache_fields_[64];  // Age and Connection written with a hit
+    
+    // Collapsed misses: the flight this request leads, or the wait for
+    // another request's (numbered so a late wake-up or timeout is ignored)
+    ResponseCache::Flight flight_;
+    std::uint64_t flight_wait_ = 0;
+    
+    // Compresses the backend's response body on its way to the client
+    // (inactive unless the site compresses and the client accepts it)
+    Compressor compressor_;
+    
+    // Static file being sent (root sites), its resolved path and the
+    // response header written before it (capacity reused across requests)
+    std::shared_ptr<const StaticFile> static_file_;
+    std::string static_path_;
+    std::string static_head_;
+    
+    // A disk tier hit or static file sent with sendfile(), which the client
+    // stream's deadline doesn't cover, and its progress
+    bool sending_file_ = false;
+    std::uint64_t file_sent_ = 0;
+    
+    // Timeout of a collapsed miss's wait, or of a sendfile() that stopped
+    // making progress (created on first use)
+    std::unique_ptr<net::steady_timer> wait_timer_;
+    
+    // Backend connection (pooled between requests)
+    LoadBalancer::Lease upstream_;  // upstream chosen for the current exchange
+    std::shared_ptr<BackendResolver::Target> backend_target_;
+    std::unique_ptr<BackendConnection> backend_conn_;
+    bool backend_reused_ = false;
+    bool backend_keep_alive_ = false;
     beast::flat_buffer backend_buffer_;
-    http::request<http::string_body> backend_req_;
-    http::response<http::string_body> backend_res_;
+    std::optional<http::response_parser<http::buffer_body, ArenaAllocator<char>>> res_parser_;
+    std::optional<http::response_serializer<http::buffer_body, ProxyFields>> res_serializer_;
+    
+    // Streaming relay buffer (one direction is active at a time)
+    std::unique_ptr<char[]> relay_buffer_;
+    std::size_t relay_buffer_size_ = 0;
     
-    // WebSocket support
-    std::unique_ptr<websocket::stream<beast::tcp_stream>> ws_stream_;
-    std::unique_ptr<websocket::stream<beast::tcp_stream>> backend_ws_stream_;
+    // WebSocket upgrade in progress: once the handshake is through, both
+    // connections are handed to a tunnel (raw) or frame relay and this
+    // handler is released
+    enum class Upgrade { none, raw, frames };
+    Upgrade upgrade_ = Upgrade::none;
 };
 
 #endif // CONNECTION_HANDLER_H
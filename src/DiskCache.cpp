@@ -0,0 +1,480 @@
+#include "DiskCache.h"
+#include "Log.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::vector<std::unique_ptr<DiskCache::Slab>> DiskCache::slabs_;
+std::uint64_t DiskCache::slab_size_ = 0;
+std::uint64_t DiskCache::max_object_size_ = 0;
+std::string DiskCache::boot_id_;
+std::mutex DiskCache::mutex_;
+DiskCache::Index DiskCache::index_;
+std::uint32_t DiskCache::current_ = 0;
+std::uint64_t DiskCache::generation_ = 0;
+std::uint64_t DiskCache::live_bytes_ = 0;
+DiskCacheStats DiskCache::counters_;
+
+namespace {
+
+constexpr std::uint64_t kPage = 4096;
+constexpr char kSlabMagic[8] = {'P', 'R', 'S', 'L', 'A', 'B', '0', '1'};
+constexpr std::uint32_t kRecordMagic = 0x50524331;  // "PRC1"
+
+enum RecordState : std::uint32_t {
+    kReserved = 1,   // body still being written, or abandoned
+    kCommitted = 2,
+    kDead = 3,       // replaced or invalidated
+};
+
+// First page of a slab file
+struct SlabHeader {
+    char magic[8];
+    std::uint64_t generation;  // order in which slabs were (re)started
+    std::uint64_t size;        // a slab of another size starts over
+    std::uint32_t clean;       // everything written reached the disk before the proxy stopped
+    char boot_id[40];          // boot the slab was last opened in
+};
+
+// Start of each record, followed by key, Vary values ("name\0value\0"...),
+// head, 304 head, ETag and Last-Modified, then the body
+struct RecordHeader {
+    std::uint32_t magic;
+    std::uint32_t state;       // not covered by the checksum
+    std::uint64_t generation;  // of the slab when it was written
+    std::uint64_t identity;
+    std::uint64_t size;        // whole record, page aligned
+    std::int64_t stored;       // system clock seconds
+    std::int64_t expires;
+    std::uint64_t body_offset; // from the record start
+    std::uint64_t body_size;
+    std::uint32_t status;
+    std::uint32_t initial_age;
+    std::uint32_t key_size;
+    std::uint32_t vary_size;
+    std::uint32_t head_size;
+    std::uint32_t not_modified_size;
+    std::uint32_t etag_size;
+    std::uint32_t last_modified_size;
+    std::uint64_t checksum;    // of the fields from generation on and the metadata
+};
+
+std::uint64_t align_up(std::uint64_t value, std::uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+std::uint64_t fnv1a(std::uint64_t hash, const char* data, std::size_t size) {
+    for (std::size_t i = 0; i < size; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+std::uint64_t metadata_size(const RecordHeader& header) {
+    return std::uint64_t{header.key_size} + header.vary_size + header.head_size + header.not_modified_size +
+           header.etag_size + header.last_modified_size;
+}
+
+std::uint64_t checksum(const RecordHeader& header) {
+    const char* fields = reinterpret_cast<const char*>(&header.generation);
+    const char* end = reinterpret_cast<const char*>(&header.checksum);
+    std::uint64_t hash = fnv1a(0xcbf29ce484222325ULL, fields, static_cast<std::size_t>(end - fields));
+    return fnv1a(hash, reinterpret_cast<const char*>(&header + 1), metadata_size(header));
+}
+
+std::string_view record_key(const RecordHeader& header) {
+    return {reinterpret_cast<const char*>(&header + 1), header.key_size};
+}
+
+std::int64_t system_seconds() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::uint64_t key_hash(std::string_view key) {
+    return std::hash<std::string_view>{}(key);
+}
+
+} // namespace
+
+DiskBody::DiskBody(std::uint32_t slab, int fd, char* data, std::uint64_t record, std::uint64_t offset,
+                   std::uint64_t size)
+    : slab(slab), fd(fd), data(data), record(record), offset(offset), size(size) {
+    DiskCache::slabs_[slab]->pins.fetch_add(1, std::memory_order_relaxed);
+}
+
+DiskBody::~DiskBody() {
+    DiskCache::slabs_[slab]->pins.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void DiskCache::configure(const ResponseCacheConfig& config, const std::string& dir) {
+    slabs_.clear();
+    index_.clear();
+    if (config.disk_mb == 0) {
+        return;
+    }
+    slab_size_ = static_cast<std::uint64_t>(config.disk_slab_mb) * 1024 * 1024;
+    max_object_size_ = std::min<std::uint64_t>(config.disk_max_object_size, slab_size_ / 2);
+    std::size_t count = std::max<std::size_t>(1, config.disk_mb / config.disk_slab_mb);
+
+    std::ifstream boot("/proc/sys/kernel/random/boot_id");
+    std::getline(boot, boot_id_);
+    boot_id_.resize(std::min<std::size_t>(boot_id_.size(), sizeof(SlabHeader::boot_id) - 1));
+
+    auto started = std::chrono::steady_clock::now();
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    for (std::size_t i = 0; i < count; ++i) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/slab-%03zu.bin", i);
+        auto slab = std::make_unique<Slab>();
+        if (!open_slab(*slab, dir + name)) {
+            Log::error() << "Disk cache disabled: can't open " << dir << name << ": " << std::strerror(errno);
+            slabs_.clear();
+            return;
+        }
+        slabs_.push_back(std::move(slab));
+    }
+
+    // Oldest slab first, so a newer copy of a response replaces an older one
+    std::vector<std::uint32_t> order(slabs_.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [](std::uint32_t a, std::uint32_t b) {
+        return slabs_[a]->generation < slabs_[b]->generation;
+    });
+    for (auto number : order) {
+        scan_slab(number);
+    }
+
+    // Writing resumes after the last record of the newest slab
+    current_ = order.back();
+    generation_ = slabs_[current_]->generation;
+    if (generation_ == 0) {
+        generation_ = 1;
+        slabs_[current_]->generation = 1;
+        reinterpret_cast<SlabHeader*>(slabs_[current_]->data)->generation = 1;
+    }
+    for (auto& slab : slabs_) {
+        auto* header = reinterpret_cast<SlabHeader*>(slab->data);
+        header->clean = 0;
+        std::memset(header->boot_id, 0, sizeof(header->boot_id));
+        std::memcpy(header->boot_id, boot_id_.data(), boot_id_.size());
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - started).count();
+    Log::info() << "Disk cache: " << count << " slabs of " << config.disk_slab_mb << " MB in " << dir << ", "
+                << counters_.recovered << " responses recovered in " << elapsed << " ms";
+}
+
+bool DiskCache::open_slab(Slab& slab, const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st{};
+    bool resized = ::fstat(fd, &st) != 0 || static_cast<std::uint64_t>(st.st_size) != slab_size_;
+    if (resized) {
+        // Reserve the blocks now so writing through the mapping can't hit ENOSPC
+        int err = ::ftruncate(fd, 0) == 0 ? ::posix_fallocate(fd, 0, static_cast<off_t>(slab_size_)) : errno;
+        if (err != 0) {
+            ::close(fd);
+            errno = err;
+            return false;
+        }
+    }
+    void* data = ::mmap(nullptr, slab_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        int err = errno;
+        ::close(fd);
+        errno = err;
+        return false;
+    }
+    slab.fd = fd;
+    slab.data = static_cast<char*>(data);
+    slab.used = kPage;
+
+    auto* header = reinterpret_cast<SlabHeader*>(slab.data);
+    bool valid = !resized && std::memcmp(header->magic, kSlabMagic, sizeof(kSlabMagic)) == 0 &&
+                 header->size == slab_size_;
+    if (valid && !header->clean && (boot_id_.empty() || boot_id_ != header->boot_id)) {
+        Log::warn() << "Disk cache: discarding " << path << ", still open when the machine went down";
+        valid = false;
+    }
+    if (!valid) {
+        std::memset(header, 0, sizeof(SlabHeader));
+        std::memcpy(header->magic, kSlabMagic, sizeof(kSlabMagic));
+        header->size = slab_size_;
+    }
+    slab.generation = header->generation;
+    return true;
+}
+
+void DiskCache::scan_slab(std::uint32_t number) {
+    auto& slab = *slabs_[number];
+    if (slab.generation == 0) {
+        return;
+    }
+
+    // Only the record headers are read; skip read-ahead of the bodies
+    ::madvise(slab.data, slab_size_, MADV_RANDOM);
+    auto now = system_seconds();
+    std::uint64_t offset = kPage;
+    while (offset + sizeof(RecordHeader) <= slab_size_) {
+        const auto* header = reinterpret_cast<const RecordHeader*>(slab.data + offset);
+        bool valid = header->magic == kRecordMagic && header->generation == slab.generation &&
+                     header->size >= kPage && header->size % kPage == 0 &&
+                     header->size <= slab_size_ - offset &&
+                     sizeof(RecordHeader) + metadata_size(*header) <= header->body_offset &&
+                     header->body_offset + header->body_size <= header->size &&
+                     checksum(*header) == header->checksum;
+        if (!valid) {
+            break;
+        }
+        if (header->state == kCommitted && header->expires > now) {
+            add_entry(key_hash(record_key(*header)), header->identity, Entry{number, offset, header->size});
+            counters_.recovered++;
+        }
+        offset += header->size;
+    }
+    ::madvise(slab.data, slab_size_, MADV_NORMAL);
+    slab.used = offset;
+    generation_ = std::max(generation_, slab.generation);
+}
+
+bool DiskCache::recycle() {
+    std::uint32_t next = current_;
+    for (std::uint32_t i = 0; i < slabs_.size(); ++i) {
+        if (i != current_ && (next == current_ || slabs_[i]->generation < slabs_[next]->generation)) {
+            next = i;
+        }
+    }
+    auto& slab = *slabs_[next];
+    if (slab.pins.load(std::memory_order_relaxed) > 0) {
+        return false;
+    }
+
+    for (auto it = index_.begin(); it != index_.end();) {
+        if (it->second.slab == next) {
+            counters_.evictions++;
+            it = erase_entry(it, false);
+        } else {
+            ++it;
+        }
+    }
+    // Records of the old generation no longer count when the slab is scanned
+    slab.generation = ++generation_;
+    slab.used = kPage;
+    reinterpret_cast<SlabHeader*>(slab.data)->generation = slab.generation;
+    current_ = next;
+    return true;
+}
+
+bool DiskCache::open(CachedResponse& response, std::uint64_t body_size) {
+    if (body_size > max_object_size_) {
+        return false;
+    }
+    std::string vary;
+    for (const auto& [name, value] : response.vary) {
+        vary.append(name).push_back('\0');
+        vary.append(value).push_back('\0');
+    }
+    std::uint64_t metadata = response.key.size() + vary.size() + response.head.size() +
+                             response.not_modified.size() + response.etag.size() +
+                             response.last_modified.size();
+    std::uint64_t body_offset = align_up(sizeof(RecordHeader) + metadata, 64);
+    std::uint64_t size = align_up(body_offset + body_size, kPage);
+
+    Slab* slab;
+    std::uint64_t record;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (slabs_[current_]->used + size > slab_size_ && !recycle()) {
+            return false;
+        }
+        slab = slabs_[current_].get();
+        record = slab->used;
+        slab->used += size;
+        response.disk = std::make_shared<DiskBody>(current_, slab->fd, slab->data + record + body_offset,
+                                                   record, record + body_offset, body_size);
+    }
+
+    // The record is this response's alone until it is committed
+    auto* header = reinterpret_cast<RecordHeader*>(slab->data + record);
+    auto now = std::chrono::steady_clock::now();
+    auto system_now = system_seconds();
+    header->magic = kRecordMagic;
+    header->state = kReserved;
+    header->generation = slab->generation;
+    header->identity = response.identity;
+    header->size = size;
+    header->stored = system_now - std::chrono::duration_cast<std::chrono::seconds>(now - response.stored).count();
+    header->expires = system_now + std::chrono::duration_cast<std::chrono::seconds>(response.expires - now).count();
+    header->body_offset = body_offset;
+    header->body_size = body_size;
+    header->status = response.status;
+    header->initial_age = response.initial_age;
+    header->key_size = static_cast<std::uint32_t>(response.key.size());
+    header->vary_size = static_cast<std::uint32_t>(vary.size());
+    header->head_size = static_cast<std::uint32_t>(response.head.size());
+    header->not_modified_size = static_cast<std::uint32_t>(response.not_modified.size());
+    header->etag_size = static_cast<std::uint32_t>(response.etag.size());
+    header->last_modified_size = static_cast<std::uint32_t>(response.last_modified.size());
+
+    char* out = reinterpret_cast<char*>(header + 1);
+    for (std::string_view part : {std::string_view(response.key), std::string_view(vary),
+                                  std::string_view(response.head), std::string_view(response.not_modified),
+                                  std::string_view(response.etag), std::string_view(response.last_modified)}) {
+        std::memcpy(out, part.data(), part.size());
+        out += part.size();
+    }
+    header->checksum = checksum(*header);
+    return true;
+}
+
+bool DiskCache::write(DiskBody& body, const char* data, std::size_t size) {
+    if (body.written + size > body.size) {
+        return false;
+    }
+    std::memcpy(body.data + body.written, data, size);
+    body.written += size;
+    return true;
+}
+
+std::shared_ptr<const CachedResponse> DiskCache::commit(std::unique_ptr<CachedResponse> response) {
+    auto& body = *response->disk;
+    if (body.written != body.size) {
+        return nullptr;
+    }
+    auto* header = reinterpret_cast<RecordHeader*>(slabs_[body.slab]->data + body.record);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    header->state = kCommitted;
+    add_entry(key_hash(response->key), response->identity, Entry{body.slab, body.record, header->size});
+    counters_.stores++;
+    return std::shared_ptr<const CachedResponse>(std::move(response));
+}
+
+void DiskCache::add_entry(std::uint64_t hash, std::uint64_t identity, const Entry& entry) {
+    auto [first, last] = index_.equal_range(hash);
+    for (auto it = first; it != last;) {
+        const auto* stored = reinterpret_cast<const RecordHeader*>(slabs_[it->second.slab]->data + it->second.record);
+        it = stored->identity == identity ? erase_entry(it, true) : std::next(it);
+    }
+    index_.emplace(hash, entry);
+    live_bytes_ += entry.size;
+}
+
+DiskCache::Index::iterator DiskCache::erase_entry(Index::iterator it, bool dead) {
+    if (dead) {
+        // Persisted, so the record isn't recovered at the next start
+        reinterpret_cast<RecordHeader*>(slabs_[it->second.slab]->data + it->second.record)->state = kDead;
+    }
+    live_bytes_ -= it->second.size;
+    return index_.erase(it);
+}
+
+std::shared_ptr<const CachedResponse> DiskCache::lookup(std::string_view key,
+                                                        const ResponseCache::RequestField& request) {
+    auto now = system_seconds();
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto [first, last] = index_.equal_range(key_hash(key));
+    for (auto it = first; it != last;) {
+        const auto* header = reinterpret_cast<const RecordHeader*>(slabs_[it->second.slab]->data + it->second.record);
+        if (record_key(*header) != key) {
+            ++it;
+            continue;
+        }
+        if (header->expires <= now) {
+            counters_.evictions++;
+            it = erase_entry(it, true);
+            continue;
+        }
+        if (auto response = read_record(it->second, key, request)) {
+            counters_.hits++;
+            return response;
+        }
+        ++it;
+    }
+    counters_.misses++;
+    return nullptr;
+}
+
+std::unique_ptr<CachedResponse> DiskCache::read_record(const Entry& entry, std::string_view key,
+                                                       const ResponseCache::RequestField& request) {
+    auto& slab = *slabs_[entry.slab];
+    const auto* header = reinterpret_cast<const RecordHeader*>(slab.data + entry.record);
+    const char* in = reinterpret_cast<const char*>(header + 1) + header->key_size;
+    auto take = [&](std::uint32_t size) {
+        std::string_view part(in, size);
+        in += size;
+        return part;
+    };
+
+    auto response = std::make_unique<CachedResponse>();
+    auto vary = take(header->vary_size);
+    while (!vary.empty()) {
+        auto name = vary.substr(0, vary.find('\0'));
+        vary.remove_prefix(name.size() + 1);
+        auto value = vary.substr(0, vary.find('\0'));
+        vary.remove_prefix(std::min(vary.size(), value.size() + 1));
+        response->vary.emplace_back(name, value);
+    }
+    if (!response->matches(request)) {
+        return nullptr;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    auto system_now = system_seconds();
+    response->key = key;
+    response->identity = header->identity;
+    response->status = header->status;
+    response->head = take(header->head_size);
+    response->not_modified = take(header->not_modified_size);
+    response->etag = take(header->etag_size);
+    response->last_modified = take(header->last_modified_size);
+    response->stored = now - std::chrono::seconds(system_now - header->stored);
+    response->expires = now + std::chrono::seconds(header->expires - system_now);
+    response->initial_age = header->initial_age;
+    response->disk = std::make_shared<DiskBody>(entry.slab, slab.fd, slab.data + entry.record + header->body_offset,
+                                                entry.record, entry.record + header->body_offset,
+                                                header->body_size);
+    return response;
+}
+
+void DiskCache::invalidate(std::string_view key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto [first, last] = index_.equal_range(key_hash(key));
+    for (auto it = first; it != last;) {
+        const auto* header = reinterpret_cast<const RecordHeader*>(slabs_[it->second.slab]->data + it->second.record);
+        it = record_key(*header) == key ? erase_entry(it, true) : std::next(it);
+    }
+}
+
+void DiskCache::close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& slab : slabs_) {
+        if (::msync(slab->data, slab_size_, MS_SYNC) == 0) {
+            reinterpret_cast<SlabHeader*>(slab->data)->clean = 1;
+            ::msync(slab->data, kPage, MS_SYNC);
+        }
+    }
+}
+
+DiskCacheStats DiskCache::stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    DiskCacheStats stats = counters_;
+    stats.entries = index_.size();
+    stats.bytes = live_bytes_;
+    stats.capacity = slabs_.size() * slab_size_;
+    return stats;
+}
@@ -0,0 +1,142 @@
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include "ResponseCache.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct DiskCacheStats {
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t stores = 0;
+    std::uint64_t evictions = 0;  // dropped when their slab was reused, or expired
+    std::uint64_t recovered = 0;  // found in the slab files at startup
+    std::uint64_t entries = 0;
+    std::uint64_t bytes = 0;      // slab space holding live responses
+    std::uint64_t capacity = 0;
+};
+
+// The body of a response in a disk cache slab (CachedResponse::disk). While
+// one exists, its slab is pinned: the body is being written or served and
+// the slab is not reused under it.
+struct DiskBody {
+    DiskBody(std::uint32_t slab, int fd, char* data, std::uint64_t record, std::uint64_t offset,
+             std::uint64_t size);
+    ~DiskBody();
+
+    DiskBody(const DiskBody&) = delete;
+    DiskBody& operator=(const DiskBody&) = delete;
+
+    std::uint32_t slab;
+    int fd;                 // slab file, for sendfile()
+    char* data;             // the body in the slab's mapping
+    std::uint64_t record;   // file offset of the record holding it
+    std::uint64_t offset;   // file offset of the body
+    std::uint64_t size;
+    std::uint64_t written = 0;  // while it is being copied from the backend
+};
+
+// Second cache tier for responses over response_cache.max_object_size that
+// declare a Content-Length, kept in memory-mapped slab files under cache_dir
+// so a large working set fits and survives restarts.
+//
+// The slab files are preallocated and used as a ring: records (metadata,
+// stored header and body, each record page aligned) are appended to the
+// current slab, and when it is full the oldest slab is reused as a whole,
+// dropping what it held. A body is copied from the backend into the mapping as
+// it is relayed; a hit is written from the page cache with sendfile() (plain
+// TCP, kTLS) or from the mapping through OpenSSL, never through a user space
+// buffer. The in-memory index only holds key hash and location per response;
+// the rest is read from the record when it is hit.
+//
+// Each record header carries a checksum, the generation of its slab and
+// whether it is committed, so at startup the index is rebuilt by reading
+// just the headers, one page per response. Slabs the proxy was writing when
+// the machine (not just the process) went down are discarded, since their
+// pages may not have reached the disk.
+class DiskCache {
+public:
+    // Open, create or resize the slab files and rebuild the index from them
+    // (call before worker threads start)
+    static void configure(const ResponseCacheConfig& config, const std::string& dir);
+
+    static bool enabled() { return !slabs_.empty(); }
+    static std::uint64_t max_object_size() { return max_object_size_; }
+
+    // Reserve a record for response, whose head is complete and whose body
+    // of body_size follows, and attach its DiskBody; false when it can't be
+    // stored now
+    static bool open(CachedResponse& response, std::uint64_t body_size);
+
+    // Copy the next body bytes into the record; false when they overrun it
+    static bool write(DiskBody& body, const char* data, std::size_t size);
+
+    // Make a completely written record visible, replacing what was stored
+    // for the same variant; nullptr when the body is incomplete
+    static std::shared_ptr<const CachedResponse> commit(std::unique_ptr<CachedResponse> response);
+
+    // Fresh response stored for key whose Vary fields match the request, or nullptr
+    static std::shared_ptr<const CachedResponse> lookup(std::string_view key, const ResponseCache::RequestField& request);
+
+    // Drop every response stored for key
+    static void invalidate(std::string_view key);
+
+    // Write the slabs back and mark them cleanly closed (at shutdown)
+    static void close();
+
+    static DiskCacheStats stats();
+
+private:
+    struct Slab {
+        int fd = -1;
+        char* data = nullptr;
+        std::uint64_t generation = 0;  // 0: never written
+        std::uint64_t used = 0;        // bytes up to the end of the last record
+        std::atomic<int> pins{0};
+    };
+
+    struct Entry {
+        std::uint32_t slab;
+        std::uint64_t record;  // offset in the slab
+        std::uint64_t size;    // record bytes
+    };
+
+    // Index from key hash to the records stored for it (variants, collisions)
+    using Index = std::unordered_multimap<std::uint64_t, Entry>;
+
+    static bool open_slab(Slab& slab, const std::string& path);
+    static void scan_slab(std::uint32_t number);
+
+    // Next slab to write when the current one is full, emptied; false when
+    // it is still pinned
+    static bool recycle();
+
+    static void add_entry(std::uint64_t hash, std::uint64_t identity, const Entry& entry);
+    static Index::iterator erase_entry(Index::iterator it, bool dead);
+
+    static std::unique_ptr<CachedResponse> read_record(const Entry& entry, std::string_view key,
+                                                       const ResponseCache::RequestField& request);
+
+    friend struct DiskBody;
+
+private:
+    static std::vector<std::unique_ptr<Slab>> slabs_;
+    static std::uint64_t slab_size_;
+    static std::uint64_t max_object_size_;
+    static std::string boot_id_;
+
+    static std::mutex mutex_;  // index, slab ring and counters
+    static Index index_;
+    static std::uint32_t current_;
+    static std::uint64_t generation_;  // highest in use
+    static std::uint64_t live_bytes_;
+    static DiskCacheStats counters_;
+};
+
+#endif // DISK_CACHE_H
@@ -0,0 +1,69 @@
+#include "HandshakePool.h"
+#include <boost/asio/strand.hpp>
+
+HandshakePool::Reservation& HandshakePool::Reservation::operator=(Reservation&& other) noexcept {
+    if (this != &other) {
+        reset();
+        pool_ = other.pool_;
+        other.pool_ = nullptr;
+    }
+    return *this;
+}
+
+void HandshakePool::Reservation::reset() {
+    if (pool_) {
+        pool_->pending_.fetch_sub(1, std::memory_order_relaxed);
+        pool_ = nullptr;
+    }
+}
+
+HandshakePool::HandshakePool(int threads, int max_pending)
+    : thread_count_(threads > 0 ? threads : 0),
+      max_pending_(static_cast<std::uint64_t>(max_pending)),
+      ioc_(thread_count_ > 0 ? thread_count_ : 1) {
+}
+
+HandshakePool::~HandshakePool() {
+    stop();
+}
+
+void HandshakePool::start() {
+    if (thread_count_ == 0 || !threads_.empty()) {
+        return;
+    }
+    work_.emplace(ioc_.get_executor());
+    threads_.reserve(thread_count_);
+    for (int i = 0; i < thread_count_; ++i) {
+        threads_.emplace_back([this] { ioc_.run(); });
+    }
+}
+
+void HandshakePool::stop() {
+    work_.reset();
+    ioc_.stop();
+    for (auto& thread : threads_) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+    threads_.clear();
+}
+
+HandshakePool::Reservation HandshakePool::reserve() {
+    // max_pending 0 means no limit
+    std::uint64_t previous = pending_.fetch_add(1, std::memory_order_relaxed);
+    if (max_pending_ > 0 && previous >= max_pending_) {
+        pending_.fetch_sub(1, std::memory_order_relaxed);
+        refused_.fetch_add(1, std::memory_order_relaxed);
+        return Reservation();
+    }
+    return Reservation(this);
+}
+
+net::any_io_executor HandshakePool::executor(const net::any_io_executor& connection_executor) {
+    // Connection executors already serialize their handlers
+    if (thread_count_ == 0) {
+        return connection_executor;
+    }
+    return net::make_strand(ioc_);
+}
@@ -0,0 +1,77 @@
+#ifndef HANDSHAKE_POOL_H
+#define HANDSHAKE_POOL_H
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace net = boost::asio;
+
+// Threads for the CPU-heavy part of TLS handshakes (key exchange and
+// certificate signatures), so a burst of new clients doesn't delay the
+// workers relaying established connections.
+//
+// A handshake's socket stays with its worker, which does the reads and
+// writes; only the handshake's completion steps (where OpenSSL computes)
+// are bound to a strand of the pool. At most max_pending handshakes run at
+// once; beyond that new TLS connections are closed straight away instead of
+// queueing behind the others.
+class HandshakePool {
+public:
+    // A place among the handshakes in progress, given back when destroyed
+    class Reservation {
+    public:
+        Reservation() = default;
+        Reservation(Reservation&& other) noexcept : pool_(other.pool_) { other.pool_ = nullptr; }
+        Reservation& operator=(Reservation&& other) noexcept;
+        ~Reservation() { reset(); }
+
+        Reservation(const Reservation&) = delete;
+        Reservation& operator=(const Reservation&) = delete;
+
+        explicit operator bool() const { return pool_ != nullptr; }
+        void reset();
+
+    private:
+        friend class HandshakePool;
+        explicit Reservation(HandshakePool* pool) : pool_(pool) {}
+
+        HandshakePool* pool_ = nullptr;
+    };
+
+    // threads = 0 keeps handshakes on the worker threads (still bounded)
+    HandshakePool(int threads, int max_pending);
+    ~HandshakePool();
+
+    void start();
+    void stop();
+
+    // Reserve a place for a new handshake; empty once max_pending are running
+    Reservation reserve();
+
+    // Executor for one handshake's steps: a new strand of the pool, or the
+    // connection's own executor when the pool has no threads
+    net::any_io_executor executor(const net::any_io_executor& connection_executor);
+
+    std::uint64_t pending() const { return pending_.load(std::memory_order_relaxed); }
+    std::uint64_t refused() const { return refused_.load(std::memory_order_relaxed); }
+
+private:
+    int thread_count_;
+    std::uint64_t max_pending_;
+    std::atomic<std::uint64_t> pending_{0};
+    std::atomic<std::uint64_t> refused_{0};
+
+    // Declared after the counters: handshakes still queued when the context
+    // is destroyed give their reservations back
+    net::io_context ioc_;
+    std::optional<net::executor_work_guard<net::io_context::executor_type>> work_;
+    std::vector<std::thread> threads_;
+};
+
+#endif // HANDSHAKE_POOL_H
@@ -0,0 +1,52 @@
+#include "HeaderArena.h"
+#include <algorithm>
+#include <cstdint>
+#include <new>
+
+HeaderArena::~HeaderArena() {
+    while (blocks_) {
+        Block* next = blocks_->next;
+        ::operator delete(blocks_);
+        blocks_ = next;
+    }
+}
+
+void* HeaderArena::allocate(std::size_t size, std::size_t alignment) {
+    for (;;) {
+        auto address = reinterpret_cast<std::uintptr_t>(ptr_);
+        auto aligned = (address + alignment - 1) & ~(static_cast<std::uintptr_t>(alignment) - 1);
+        char* p = reinterpret_cast<char*>(aligned);
+        if (p + size <= end_) {
+            ptr_ = p + size;
+            return p;
+        }
+        next_block(size + alignment);
+    }
+}
+
+void HeaderArena::reset() {
+    current_ = nullptr;
+    ptr_ = inline_;
+    end_ = inline_ + kInlineSize;
+}
+
+void HeaderArena::next_block(std::size_t min_size) {
+    Block* next = current_ ? current_->next : blocks_;
+
+    if (!next || next->size < min_size) {
+        std::size_t size = std::max(kBlockSize, min_size);
+        Block* block = static_cast<Block*>(::operator new(sizeof(Block) + size));
+        block->size = size;
+        block->next = next;
+        if (current_) {
+            current_->next = block;
+        } else {
+            blocks_ = block;
+        }
+        next = block;
+    }
+
+    current_ = next;
+    ptr_ = reinterpret_cast<char*>(next + 1);
+    end_ = ptr_ + next->size;
+}
@@ -0,0 +1,77 @@
+#ifndef HEADER_ARENA_H
+#define HEADER_ARENA_H
+
+#include <cstddef>
+#include <type_traits>
+
+// Bump allocator for the header fields of one connection's current exchange.
+// Allocation is a pointer increment; deallocation is a no-op and everything
+// is released at once by reset() between requests. The first 2KB live inside
+// the arena itself and overflow blocks are kept for later requests, so a
+// persistent connection stops touching the heap after its first exchange.
+class HeaderArena {
+public:
+    HeaderArena() = default;
+    ~HeaderArena();
+
+    HeaderArena(const HeaderArena&) = delete;
+    HeaderArena& operator=(const HeaderArena&) = delete;
+
+    void* allocate(std::size_t size, std::size_t alignment);
+
+    // Forget all allocations (every user of the arena must be gone)
+    void reset();
+
+private:
+    struct Block {
+        Block* next;
+        std::size_t size;
+    };
+
+    static constexpr std::size_t kInlineSize = 2048;
+    static constexpr std::size_t kBlockSize = 8192;
+
+    // Continue in the next retained overflow block, allocating one if needed
+    void next_block(std::size_t min_size);
+
+private:
+    alignas(std::max_align_t) char inline_[kInlineSize];
+    Block* blocks_ = nullptr;   // retained overflow blocks
+    Block* current_ = nullptr;  // overflow block in use, nullptr while in inline_
+    char* ptr_ = inline_;
+    char* end_ = inline_ + kInlineSize;
+};
+
+// Standard allocator over a HeaderArena, used as the basic_fields allocator
+template<class T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    explicit ArenaAllocator(HeaderArena& arena) noexcept : arena_(&arena) {}
+
+    template<class U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept : arena_(other.arena_) {}
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T*, std::size_t) noexcept {}
+
+    template<class U>
+    bool operator==(const ArenaAllocator<U>& other) const noexcept { return arena_ == other.arena_; }
+
+    template<class U>
+    bool operator!=(const ArenaAllocator<U>& other) const noexcept { return arena_ != other.arena_; }
+
+private:
+    template<class> friend class ArenaAllocator;
+
+    HeaderArena* arena_;
+};
+
+#endif // HEADER_ARENA_H
@@ -0,0 +1,161 @@
+#include "HealthChecker.h"
+#include "Log.h"
+#include <boost/asio/post.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <algorithm>
+#include <unordered_set>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+
+HealthChecker::HealthChecker(net::io_context& ioc, std::shared_ptr<RequestRouter> router)
+    : strand_(net::make_strand(ioc)), timer_(strand_), router_(std::move(router)) {
+}
+
+void HealthChecker::configure(const HealthCheckConfig& config) {
+    net::post(strand_, [self = shared_from_this(), config] {
+        self->config_ = config;
+        if (self->stopped_) {
+            return;
+        }
+        if (!config.enabled) {
+            // Nothing will bring a backend back any more, so trust them all
+            for (auto& [target, state] : self->states_) {
+                state.target->health().set_probe_healthy(true);
+            }
+            self->states_.clear();
+            self->timer_.cancel();
+            return;
+        }
+        if (!self->scheduled_) {
+            self->run_round();
+        }
+    });
+}
+
+void HealthChecker::stop() {
+    net::post(strand_, [self = shared_from_this()] {
+        self->stopped_ = true;
+        self->timer_.cancel();
+    });
+}
+
+void HealthChecker::schedule() {
+    scheduled_ = true;
+    timer_.expires_after(std::chrono::milliseconds(std::max(config_.interval_ms, 100)));
+    timer_.async_wait([self = shared_from_this()](beast::error_code ec) {
+        self->scheduled_ = false;
+        if (ec || self->stopped_ || !self->config_.enabled) {
+            return;
+        }
+        self->run_round();
+    });
+}
+
+void HealthChecker::run_round() {
+    // Probe the backends the current configuration routes to
+    auto snapshot = router_->snapshot();
+    std::unordered_set<const BackendResolver::Target*> live;
+    for (const auto& route : snapshot->routes.routes()) {
+        for (std::size_t i = 0; i < route.balancer->size(); ++i) {
+            const auto& target = route.balancer->upstream(i).target;
+            live.insert(target.get());
+            auto& state = states_[target.get()];
+            if (!state.target) {
+                state.target = target;
+            }
+            if (!state.in_progress) {
+                probe(state);
+            }
+        }
+    }
+
+    // Backends dropped by a reload are forgotten once their last probe is back
+    for (auto it = states_.begin(); it != states_.end();) {
+        if (!live.count(it->first) && !it->second.in_progress) {
+            it = states_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    schedule();
+}
+
+void HealthChecker::probe(ProbeState& state) {
+    auto endpoints = state.target->endpoints();
+    if (!endpoints || endpoints->empty()) {
+        on_probe_result(state, false);
+        return;
+    }
+
+    // states_ may be cleared (health checks disabled) while a probe is out,
+    // so its callback looks the state up again by target
+    struct Probe {
+        explicit Probe(net::strand<net::io_context::executor_type> strand) : stream(strand) {}
+        beast::tcp_stream stream;
+        beast::flat_buffer buffer;
+        http::request<http::empty_body> req;
+        http::response_parser<http::empty_body> parser;
+    };
+    auto p = std::make_shared<Probe>(strand_);
+    p->stream.expires_after(std::chrono::milliseconds(std::max(config_.timeout_ms, 1)));
+    state.in_progress = true;
+
+    const auto* key = state.target.get();
+    auto finish = [self = shared_from_this(), key, p](bool healthy) {
+        beast::error_code ignored;
+        p->stream.socket().close(ignored);
+        auto it = self->states_.find(key);
+        if (it != self->states_.end()) {
+            it->second.in_progress = false;
+            self->on_probe_result(it->second, healthy);
+        }
+    };
+
+    bool http_check = config_.type == "http";
+    p->stream.async_connect(*endpoints,
+        [p, finish, http_check, path = config_.path, host = state.target->host()](
+            beast::error_code ec, const tcp::endpoint&) {
+            if (ec || !http_check) {
+                finish(!ec);
+                return;
+            }
+
+            p->req = {http::verb::get, path, 11};
+            p->req.set(http::field::host, host);
+            p->req.set(http::field::user_agent, "ReverseProxy-HealthCheck/1.0");
+            p->req.set(http::field::connection, "close");
+            http::async_write(p->stream, p->req, [p, finish](beast::error_code ec, std::size_t) {
+                if (ec) {
+                    finish(false);
+                    return;
+                }
+                http::async_read_header(p->stream, p->buffer, p->parser,
+                    [p, finish](beast::error_code ec, std::size_t) {
+                        auto status = p->parser.get().result_int();
+                        finish(!ec && status >= 200 && status < 400);
+                    });
+            });
+        });
+}
+
+void HealthChecker::on_probe_result(ProbeState& state, bool healthy) {
+    auto& health = state.target->health();
+    if (healthy) {
+        state.failed = 0;
+        state.passed++;
+        if (!health.probe_healthy() && state.passed >= config_.healthy_threshold) {
+            Log::info() << "Backend " << state.target->name() << " passed health checks, back in rotation";
+            health.set_probe_healthy(true);
+        }
+    } else {
+        state.passed = 0;
+        state.failed++;
+        if (health.probe_healthy() && state.failed >= config_.unhealthy_threshold) {
+            Log::warn() << "Backend " << state.target->name() << " failed " << state.failed
+                        << " health checks, taking it out of rotation";
+            health.set_probe_healthy(false);
+        }
+    }
+}
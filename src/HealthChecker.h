@@ -0,0 +1,52 @@
+#ifndef HEALTH_CHECKER_H
+#define HEALTH_CHECKER_H
+
+#include "ConfigManager.h"
+#include "RequestRouter.h"
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <memory>
+#include <unordered_map>
+
+namespace net = boost::asio;
+
+// Active health checks (health_check).
+// Every interval each backend of the current routing table is probed with a
+// TCP connect or an HTTP GET. After unhealthy_threshold failed probes in a row
+// the backend is taken out of load balancing, and after healthy_threshold
+// passing probes it is put back. Probes run asynchronously on the io_context's
+// timers, serialized on a strand.
+class HealthChecker : public std::enable_shared_from_this<HealthChecker> {
+public:
+    HealthChecker(net::io_context& ioc, std::shared_ptr<RequestRouter> router);
+
+    // Apply settings (at startup and on config reload); starts or stops probing
+    void configure(const HealthCheckConfig& config);
+
+    void stop();
+
+private:
+    struct ProbeState {
+        std::shared_ptr<BackendResolver::Target> target;
+        int passed = 0;  // consecutive
+        int failed = 0;
+        bool in_progress = false;
+    };
+
+    void schedule();
+    void run_round();
+    void probe(ProbeState& state);
+    void on_probe_result(ProbeState& state, bool healthy);
+
+private:
+    net::strand<net::io_context::executor_type> strand_;
+    net::steady_timer timer_;
+    std::shared_ptr<RequestRouter> router_;
+    HealthCheckConfig config_;
+    bool scheduled_ = false;
+    bool stopped_ = false;
+    std::unordered_map<const BackendResolver::Target*, ProbeState> states_;
+};
+
+#endif // HEALTH_CHECKER_H
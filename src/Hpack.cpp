@@ -0,0 +1,552 @@
+#include "Hpack.h"
+#include <array>
+
+namespace {
+
+struct HuffmanCode {
+    std::uint32_t code;
+    std::uint8_t bits;
+};
+
+// Huffman code for each symbol (RFC 7541, Appendix B); 256 is EOS
+constexpr HuffmanCode kHuffmanCodes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+// Static table (RFC 7541, Appendix A), index 1 first
+constexpr std::pair<std::string_view, std::string_view> kStaticTable[61] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+constexpr std::size_t kEntryOverhead = 32;
+
+// Huffman decoding walks the code tree four bits at a time. State n is the
+// n-th internal node of the tree (0 is the root); for every state and nibble
+// the table gives the next state and the symbol completed on the way, if any.
+// The table is built from kHuffmanCodes on first use.
+struct HuffmanTransition {
+    std::uint8_t next = 0;
+    std::uint8_t flags = 0;
+    std::uint8_t symbol = 0;
+};
+
+constexpr std::uint8_t kEmit = 1;     // symbol completed
+constexpr std::uint8_t kFail = 2;     // EOS or invalid code
+constexpr std::uint8_t kAccept = 4;   // next state is valid padding (all ones, < 8 bits)
+
+struct HuffmanDecodeTable {
+    std::array<std::array<HuffmanTransition, 16>, 256> transitions;
+
+    HuffmanDecodeTable() {
+        // Build the code tree: node 0 is the root, leaves hold symbol + 1
+        struct Node {
+            int child[2] = {-1, -1};
+            int symbol = -1;
+        };
+        std::vector<Node> nodes(1);
+        for (int symbol = 0; symbol < 257; ++symbol) {
+            int node = 0;
+            for (int bit = kHuffmanCodes[symbol].bits - 1; bit >= 0; --bit) {
+                int b = (kHuffmanCodes[symbol].code >> bit) & 1;
+                if (nodes[node].child[b] < 0) {
+                    nodes[node].child[b] = static_cast<int>(nodes.size());
+                    nodes.emplace_back();
+                }
+                node = nodes[node].child[b];
+            }
+            nodes[node].symbol = symbol;
+        }
+
+        // Number the internal nodes and find the ones reachable by padding
+        std::vector<int> state_of(nodes.size(), -1);
+        std::vector<int> node_of;
+        std::vector<bool> accepting;
+        for (std::size_t i = 0; i < nodes.size(); ++i) {
+            if (nodes[i].symbol < 0) {
+                state_of[i] = static_cast<int>(node_of.size());
+                node_of.push_back(static_cast<int>(i));
+                accepting.push_back(false);
+            }
+        }
+        int node = 0;
+        for (int depth = 0; depth < 8 && node >= 0 && nodes[node].symbol < 0; ++depth) {
+            accepting[state_of[node]] = true;
+            node = nodes[node].child[1];
+        }
+
+        for (std::size_t state = 0; state < node_of.size(); ++state) {
+            for (int nibble = 0; nibble < 16; ++nibble) {
+                HuffmanTransition t;
+                int n = node_of[state];
+                for (int bit = 3; bit >= 0; --bit) {
+                    n = nodes[n].child[(nibble >> bit) & 1];
+                    if (n < 0 || nodes[n].symbol == 256) {
+                        t.flags = kFail;
+                        break;
+                    }
+                    if (nodes[n].symbol >= 0) {
+                        // Codes are at least five bits, so a nibble ends at most one
+                        t.flags |= kEmit;
+                        t.symbol = static_cast<std::uint8_t>(nodes[n].symbol);
+                        n = 0;
+                    }
+                }
+                if (!(t.flags & kFail)) {
+                    t.next = static_cast<std::uint8_t>(state_of[n]);
+                    if (accepting[state_of[n]]) {
+                        t.flags |= kAccept;
+                    }
+                }
+                transitions[state][nibble] = t;
+            }
+        }
+    }
+};
+
+const HuffmanDecodeTable& huffman_decode_table() {
+    static const HuffmanDecodeTable table;
+    return table;
+}
+
+// Headers whose values rarely repeat; indexing them would only churn the table
+bool worth_indexing(std::string_view name, std::string_view value) {
+    return value.size() < 256 &&
+           name != "content-length" && name != "date" && name != "etag" &&
+           name != "last-modified" && name != "expires" && name != "age" &&
+           name != "location" && name != "set-cookie";
+}
+
+} // namespace
+
+namespace hpack {
+
+void encode_integer(std::uint64_t value, unsigned prefix_bits, std::uint8_t first, std::string& out) {
+    std::uint64_t max_prefix = (1u << prefix_bits) - 1;
+    if (value < max_prefix) {
+        out.push_back(static_cast<char>(first | value));
+        return;
+    }
+    out.push_back(static_cast<char>(first | max_prefix));
+    value -= max_prefix;
+    while (value >= 128) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+bool decode_integer(const std::uint8_t*& p, const std::uint8_t* end, unsigned prefix_bits, std::uint64_t& value) {
+    if (p == end) {
+        return false;
+    }
+    std::uint64_t max_prefix = (1u << prefix_bits) - 1;
+    value = *p++ & max_prefix;
+    if (value < max_prefix) {
+        return true;
+    }
+    for (unsigned shift = 0; p != end; shift += 7) {
+        if (shift > 56) {
+            return false;  // would overflow
+        }
+        std::uint8_t byte = *p++;
+        value += static_cast<std::uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::size_t huffman_encoded_size(std::string_view input) {
+    std::size_t bits = 0;
+    for (unsigned char c : input) {
+        bits += kHuffmanCodes[c].bits;
+    }
+    return (bits + 7) / 8;
+}
+
+void huffman_encode(std::string_view input, std::string& out) {
+    std::uint64_t pending = 0;
+    unsigned pending_bits = 0;
+    for (unsigned char c : input) {
+        const HuffmanCode& code = kHuffmanCodes[c];
+        pending = (pending << code.bits) | code.code;
+        pending_bits += code.bits;
+        while (pending_bits >= 8) {
+            pending_bits -= 8;
+            out.push_back(static_cast<char>(pending >> pending_bits));
+        }
+    }
+    if (pending_bits > 0) {
+        // Pad with the most significant bits of EOS (all ones)
+        out.push_back(static_cast<char>((pending << (8 - pending_bits)) | (0xff >> pending_bits)));
+    }
+}
+
+bool huffman_decode(const std::uint8_t* data, std::size_t size, std::string& out) {
+    const auto& table = huffman_decode_table().transitions;
+    std::uint8_t state = 0;
+    bool accept = true;
+    for (std::size_t i = 0; i < size; ++i) {
+        for (int nibble : {data[i] >> 4, data[i] & 0x0f}) {
+            const HuffmanTransition& t = table[state][nibble];
+            if (t.flags & kFail) {
+                return false;
+            }
+            if (t.flags & kEmit) {
+                out.push_back(static_cast<char>(t.symbol));
+            }
+            state = t.next;
+            accept = t.flags & kAccept;
+        }
+    }
+    return accept;
+}
+
+} // namespace hpack
+
+bool HpackTable::get(std::size_t index, std::string_view& name, std::string_view& value) const {
+    if (index == 0) {
+        return false;
+    }
+    if (index <= std::size(kStaticTable)) {
+        name = kStaticTable[index - 1].first;
+        value = kStaticTable[index - 1].second;
+        return true;
+    }
+    index -= std::size(kStaticTable) + 1;
+    if (index >= entries_.size()) {
+        return false;
+    }
+    name = entries_[index].first;
+    value = entries_[index].second;
+    return true;
+}
+
+void HpackTable::add(std::string name, std::string value) {
+    std::size_t entry_size = name.size() + value.size() + kEntryOverhead;
+    if (entry_size > max_size_) {
+        // An entry larger than the table empties it
+        entries_.clear();
+        size_ = 0;
+        return;
+    }
+    evict(entry_size);
+    entries_.emplace_front(std::move(name), std::move(value));
+    size_ += entry_size;
+}
+
+void HpackTable::set_max_size(std::size_t max_size) {
+    max_size_ = max_size;
+    evict(0);
+}
+
+void HpackTable::evict(std::size_t needed) {
+    while (!entries_.empty() && size_ + needed > max_size_) {
+        const auto& oldest = entries_.back();
+        size_ -= oldest.first.size() + oldest.second.size() + kEntryOverhead;
+        entries_.pop_back();
+    }
+}
+
+std::pair<std::size_t, bool> HpackTable::find(std::string_view name, std::string_view value) const {
+    std::size_t name_index = 0;
+    for (std::size_t i = 0; i < std::size(kStaticTable); ++i) {
+        if (kStaticTable[i].first == name) {
+            if (kStaticTable[i].second == value) {
+                return {i + 1, true};
+            }
+            if (name_index == 0) {
+                name_index = i + 1;
+            }
+        }
+    }
+    for (std::size_t i = 0; i < entries_.size(); ++i) {
+        if (entries_[i].first == name) {
+            std::size_t index = std::size(kStaticTable) + 1 + i;
+            if (entries_[i].second == value) {
+                return {index, true};
+            }
+            if (name_index == 0) {
+                name_index = index;
+            }
+        }
+    }
+    return {name_index, false};
+}
+
+bool HpackDecoder::decode(const std::uint8_t* data, std::size_t size, std::vector<HpackHeader>& headers) {
+    const std::uint8_t* p = data;
+    const std::uint8_t* end = data + size;
+    list_size_ = 0;
+    bool seen_header = false;
+    bool too_large = false;
+
+    // Fields past the limit are counted but not kept, so a block of small
+    // references to a large table entry can't make the list grow
+    auto account = [&](std::size_t name_size, std::size_t value_size) {
+        list_size_ += name_size + value_size + kEntryOverhead;
+        if (!too_large && list_size_ > max_list_size_) {
+            too_large = true;
+            std::vector<HpackHeader>().swap(headers);
+        }
+        return !too_large;
+    };
+
+    auto read_string = [&](std::string& out) {
+        if (p == end) {
+            return false;
+        }
+        bool huffman = *p & 0x80;
+        std::uint64_t length;
+        if (!hpack::decode_integer(p, end, 7, length) || length > static_cast<std::uint64_t>(end - p)) {
+            return false;
+        }
+        out.clear();
+        if (huffman) {
+            if (!hpack::huffman_decode(p, length, out)) {
+                return false;
+            }
+        } else {
+            out.assign(reinterpret_cast<const char*>(p), length);
+        }
+        p += length;
+        return true;
+    };
+
+    while (p != end) {
+        std::uint8_t byte = *p;
+        HpackHeader header;
+
+        if (byte & 0x80) {
+            // Indexed header field
+            std::uint64_t index;
+            if (!hpack::decode_integer(p, end, 7, index)) {
+                return false;
+            }
+            std::string_view name, value;
+            if (!table_.get(index, name, value)) {
+                return false;
+            }
+            seen_header = true;
+            if (account(name.size(), value.size())) {
+                headers.push_back(HpackHeader{std::string(name), std::string(value)});
+            }
+            continue;
+        } else if ((byte & 0xe0) == 0x20) {
+            // Dynamic table size update, only allowed before the first field
+            std::uint64_t max_size;
+            if (seen_header || !hpack::decode_integer(p, end, 5, max_size) || max_size > limit_) {
+                return false;
+            }
+            table_.set_max_size(max_size);
+            continue;
+        } else {
+            // Literal: with incremental indexing (01), without indexing (0000)
+            // or never indexed (0001)
+            bool indexed = (byte & 0xc0) == 0x40;
+            std::uint64_t index;
+            if (!hpack::decode_integer(p, end, indexed ? 6 : 4, index)) {
+                return false;
+            }
+            if (index != 0) {
+                std::string_view name, value;
+                if (!table_.get(index, name, value)) {
+                    return false;
+                }
+                header.name = name;
+            } else if (!read_string(header.name)) {
+                return false;
+            }
+            if (!read_string(header.value)) {
+                return false;
+            }
+            if (indexed) {
+                table_.add(header.name, header.value);
+            }
+        }
+
+        seen_header = true;
+        if (account(header.name.size(), header.value.size())) {
+            headers.push_back(std::move(header));
+        }
+    }
+    return true;
+}
+
+void HpackEncoder::set_max_table_size(std::size_t size) {
+    // Our table never needs to be larger than the default
+    size = std::min<std::size_t>(size, 4096);
+    if (size != table_.max_size()) {
+        pending_size_update_ = std::min(pending_size_update_, size);
+        table_.set_max_size(size);
+    }
+}
+
+void HpackEncoder::encode(std::string_view name, std::string_view value, std::string& out) {
+    if (pending_size_update_ != SIZE_MAX) {
+        hpack::encode_integer(pending_size_update_, 5, 0x20, out);
+        if (pending_size_update_ != table_.max_size()) {
+            hpack::encode_integer(table_.max_size(), 5, 0x20, out);
+        }
+        pending_size_update_ = SIZE_MAX;
+    }
+
+    auto [index, exact] = table_.find(name, value);
+    if (exact) {
+        hpack::encode_integer(index, 7, 0x80, out);
+        return;
+    }
+
+    auto write_string = [&out](std::string_view s) {
+        std::size_t huffman_size = hpack::huffman_encoded_size(s);
+        if (huffman_size < s.size()) {
+            hpack::encode_integer(huffman_size, 7, 0x80, out);
+            hpack::huffman_encode(s, out);
+        } else {
+            hpack::encode_integer(s.size(), 7, 0x00, out);
+            out.append(s);
+        }
+    };
+
+    bool index_it = worth_indexing(name, value);
+    if (name == "set-cookie") {
+        hpack::encode_integer(index, 4, 0x10, out);  // never indexed
+    } else if (index_it) {
+        hpack::encode_integer(index, 6, 0x40, out);
+    } else {
+        hpack::encode_integer(index, 4, 0x00, out);
+    }
+    if (index == 0) {
+        write_string(name);
+    }
+    write_string(value);
+
+    if (index_it) {
+        table_.add(std::string(name), std::string(value));
+    }
+}
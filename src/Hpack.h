@@ -0,0 +1,99 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// HPACK header compression for HTTP/2 (RFC 7541): static and dynamic tables,
+// prefix-coded integers and Huffman-coded strings.
+
+struct HpackHeader {
+    std::string name;
+    std::string value;
+};
+
+// Dynamic table shared by encoder and decoder logic; newest entry first
+class HpackTable {
+public:
+    explicit HpackTable(std::size_t max_size = 4096) : max_size_(max_size) {}
+
+    // Entry for a 1-based HPACK index (static then dynamic); false if out of range
+    bool get(std::size_t index, std::string_view& name, std::string_view& value) const;
+
+    void add(std::string name, std::string value);
+    void set_max_size(std::size_t max_size);
+    std::size_t max_size() const { return max_size_; }
+    std::size_t size() const { return size_; }
+
+    // Best match for name/value: index and whether the value matched too
+    // (index 0 if the name is in neither table)
+    std::pair<std::size_t, bool> find(std::string_view name, std::string_view value) const;
+
+private:
+    void evict(std::size_t needed);
+
+private:
+    std::deque<std::pair<std::string, std::string>> entries_;
+    std::size_t size_ = 0;  // RFC size: name + value + 32 per entry
+    std::size_t max_size_;
+};
+
+class HpackDecoder {
+public:
+    // Decode a complete header block. Returns false on a compression error,
+    // which is fatal for the connection. Once the block passes the maximum
+    // list size, headers is emptied and the rest of the block is only
+    // decoded to keep the dynamic table in step; list_size() then exceeds
+    // the maximum.
+    bool decode(const std::uint8_t* data, std::size_t size, std::vector<HpackHeader>& headers);
+
+    // SETTINGS_HEADER_TABLE_SIZE we advertised; the encoder may not exceed it
+    void set_max_table_size(std::size_t size) { limit_ = size; }
+
+    // SETTINGS_MAX_HEADER_LIST_SIZE we advertised
+    void set_max_list_size(std::size_t size) { max_list_size_ = size; }
+
+    // Total name + value + 32 of the last decoded block
+    std::size_t list_size() const { return list_size_; }
+
+private:
+    HpackTable table_;
+    std::size_t limit_ = 4096;
+    std::size_t max_list_size_ = SIZE_MAX;
+    std::size_t list_size_ = 0;
+};
+
+class HpackEncoder {
+public:
+    // Append the encoded header to out. Values that change on every response
+    // are written without being added to the dynamic table.
+    void encode(std::string_view name, std::string_view value, std::string& out);
+
+    // Peer's SETTINGS_HEADER_TABLE_SIZE; the change is signalled at the start
+    // of the next header block
+    void set_max_table_size(std::size_t size);
+
+private:
+    HpackTable table_;
+    std::size_t pending_size_update_ = SIZE_MAX;
+};
+
+namespace hpack {
+
+// Integer with an N-bit prefix; the first byte's high bits come from `first`
+void encode_integer(std::uint64_t value, unsigned prefix_bits, std::uint8_t first, std::string& out);
+bool decode_integer(const std::uint8_t*& p, const std::uint8_t* end, unsigned prefix_bits, std::uint64_t& value);
+
+// Huffman coding of string literals
+std::size_t huffman_encoded_size(std::string_view input);
+void huffman_encode(std::string_view input, std::string& out);
+bool huffman_decode(const std::uint8_t* data, std::size_t size, std::string& out);
+
+} // namespace hpack
+
+#endif // HPACK_H
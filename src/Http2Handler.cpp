@@ -1,11 +1,1595 @@
 #include "Http2Handler.h"
-#include <iostream>
+#include "Log.h"
+#include "BodyRelay.h"
+#include "ProxyHeaders.h"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include <unistd.h>
 
-Http2Handler::Http2Handler() {
-    // Constructor implementation
+namespace {
+
+// Frame types
+constexpr std::uint8_t kData = 0x0;
+constexpr std::uint8_t kHeaders = 0x1;
+constexpr std::uint8_t kPriority = 0x2;
+constexpr std::uint8_t kRstStream = 0x3;
+constexpr std::uint8_t kSettings = 0x4;
+constexpr std::uint8_t kPushPromise = 0x5;
+constexpr std::uint8_t kPing = 0x6;
+constexpr std::uint8_t kGoaway = 0x7;
+constexpr std::uint8_t kWindowUpdate = 0x8;
+constexpr std::uint8_t kContinuation = 0x9;
+
+// Frame flags
+constexpr std::uint8_t kEndStream = 0x1;
+constexpr std::uint8_t kAck = 0x1;
+constexpr std::uint8_t kEndHeaders = 0x4;
+constexpr std::uint8_t kPadded = 0x8;
+constexpr std::uint8_t kPriorityFlag = 0x20;
+
+// Error codes
+constexpr std::uint32_t kNoError = 0x0;
+constexpr std::uint32_t kProtocolError = 0x1;
+constexpr std::uint32_t kInternalError = 0x2;
+constexpr std::uint32_t kFlowControlError = 0x3;
+constexpr std::uint32_t kStreamClosed = 0x5;
+constexpr std::uint32_t kFrameSizeError = 0x6;
+constexpr std::uint32_t kRefusedStream = 0x7;
+constexpr std::uint32_t kCompressionError = 0x9;
+constexpr std::uint32_t kEnhanceYourCalm = 0xb;
+
+// Settings
+constexpr std::uint16_t kHeaderTableSize = 0x1;
+constexpr std::uint16_t kEnablePush = 0x2;
+constexpr std::uint16_t kMaxConcurrentStreams = 0x3;
+constexpr std::uint16_t kInitialWindowSize = 0x4;
+constexpr std::uint16_t kMaxFrameSize = 0x5;
+constexpr std::uint16_t kMaxHeaderListSize = 0x6;
+
+constexpr std::size_t kFrameHeaderSize = 9;
+constexpr std::size_t kDefaultFrameSize = 16384;   // largest frame we accept
+constexpr std::size_t kMaxHeaderBlock = 256 * 1024;  // HEADERS + CONTINUATION, compressed
+constexpr std::size_t kHeaderListLimit = 64 * 1024;  // decoded, as advertised
+constexpr std::int64_t kDefaultWindow = 65535;
+constexpr std::int64_t kMaxWindow = 0x7fffffff;
+
+constexpr std::size_t kReadSize = 32 * 1024;
+constexpr std::size_t kResponseChunk = 16384;
+// Stop queueing DATA, and stop reading from the client, once this much
+// output is waiting for the socket
+constexpr std::size_t kMaxPendingOutput = 256 * 1024;
+
+// Per connection and second: frames that make us answer (SETTINGS, PING) and
+// streams ended early (reset by the client, or refused or reset by us for a
+// protocol error). Past either, the connection ends with ENHANCE_YOUR_CALM.
+constexpr std::uint32_t kMaxControlFramesPerSecond = 200;
+constexpr std::uint32_t kMaxStreamResetsPerSecond = 200;
+
+constexpr std::uint64_t kUnlimitedBody = std::numeric_limits<std::uint64_t>::max();
+
+std::uint32_t read_u32(const std::uint8_t* p) {
+    return (std::uint32_t(p[0]) << 24) | (std::uint32_t(p[1]) << 16) | (std::uint32_t(p[2]) << 8) | p[3];
+}
+
+void write_u32(std::uint8_t* p, std::uint32_t value) {
+    p[0] = static_cast<std::uint8_t>(value >> 24);
+    p[1] = static_cast<std::uint8_t>(value >> 16);
+    p[2] = static_cast<std::uint8_t>(value >> 8);
+    p[3] = static_cast<std::uint8_t>(value);
+}
+
+bool is_idempotent(http::verb method) {
+    switch (method) {
+        case http::verb::get:
+        case http::verb::head:
+        case http::verb::options:
+        case http::verb::put:
+        case http::verb::delete_:
+        case http::verb::trace:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Headers that only make sense on a single HTTP/1.1 connection (RFC 9113 8.2.2)
+bool is_connection_specific(std::string_view name) {
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+           name == "transfer-encoding" || name == "upgrade";
+}
+
+bool has_uppercase(std::string_view name) {
+    return std::any_of(name.begin(), name.end(), [](char c) { return c >= 'A' && c <= 'Z'; });
+}
+
+// tchar from RFC 9110 5.6.2
+bool is_token_char(unsigned char c) {
+    if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+        return true;
+    }
+    return std::strchr("!#$%&'*+-.^_`|~", c) != nullptr && c != '\0';
+}
+
+bool is_token(std::string_view text) {
+    return !text.empty() &&
+           std::all_of(text.begin(), text.end(), [](char c) { return is_token_char(static_cast<unsigned char>(c)); });
+}
+
+// Field values are copied into the HTTP/1.1 request as they are, so anything
+// that could end the line there is refused (RFC 9113 8.2.1)
+bool is_valid_field_value(std::string_view value) {
+    for (char c : value) {
+        if (c == '\0' || c == '\r' || c == '\n') {
+            return false;
+        }
+    }
+    return value.empty() || (value.front() != ' ' && value.front() != '\t' &&
+                             value.back() != ' ' && value.back() != '\t');
+}
+
+// Pseudo-header values that end up in the request line or Host header: no
+// whitespace or control characters at all
+bool is_visible_text(std::string_view value) {
+    return std::all_of(value.begin(), value.end(), [](char c) {
+        auto u = static_cast<unsigned char>(c);
+        return u > 0x20 && u != 0x7f;
+    });
+}
+
+bool parse_content_length(std::string_view value, std::uint64_t& length) {
+    auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), length);
+    return !value.empty() && ec == std::errc() && end == value.data() + value.size();
+}
+
+} // namespace
+
+Http2Handler::Http2Handler(beast::tcp_stream&& stream, std::shared_ptr<RequestRouter> router)
+    : stream_(std::move(stream)), router_(std::move(router)), snapshot_(router_->snapshot()),
+      settings_(snapshot_->config->http2) {
+    beast::error_code ec;
+    auto endpoint = stream_.socket().remote_endpoint(ec);
+    if (!ec) {
+        client_ip_size_ = format_client_address(endpoint, client_ip_, sizeof(client_ip_));
+    }
+}
+
+Http2Handler::Http2Handler(beast::ssl_stream<beast::tcp_stream>&& ssl_stream, std::shared_ptr<RequestRouter> router,
+                           bool ktls_tx)
+    : stream_(ssl_stream.get_executor()),
+      ssl_stream_(std::make_unique<beast::ssl_stream<beast::tcp_stream>>(std::move(ssl_stream))),
+      ktls_tx_(ktls_tx), router_(std::move(router)), snapshot_(router_->snapshot()),
+      settings_(snapshot_->config->http2) {
+    beast::error_code ec;
+    auto endpoint = ssl_stream_->next_layer().socket().remote_endpoint(ec);
+    if (!ec) {
+        client_ip_size_ = format_client_address(endpoint, client_ip_, sizeof(client_ip_));
+    }
+}
+
+Http2Handler::~Http2Handler() {
+    if (ssl_stream_) {
+        TlsSessionCache::keep_session(ssl_stream_->native_handle());
+    }
+}
+
+void Http2Handler::start(std::string_view received) {
+    if (!received.empty()) {
+        auto buffer = read_buffer_.prepare(received.size());
+        std::memcpy(buffer.data(), received.data(), received.size());
+        read_buffer_.commit(received.size());
+    }
+
+    // Our SETTINGS open the connection, then the connection-level receive
+    // window is raised beyond the protocol default
+    std::uint8_t settings[18];
+    auto put_setting = [&settings](int i, std::uint16_t id, std::uint32_t value) {
+        settings[i * 6] = static_cast<std::uint8_t>(id >> 8);
+        settings[i * 6 + 1] = static_cast<std::uint8_t>(id);
+        write_u32(settings + i * 6 + 2, value);
+    };
+    put_setting(0, kMaxConcurrentStreams, static_cast<std::uint32_t>(settings_.max_concurrent_streams));
+    put_setting(1, kInitialWindowSize, static_cast<std::uint32_t>(settings_.initial_window_size));
+    put_setting(2, kMaxHeaderListSize, static_cast<std::uint32_t>(kHeaderListLimit));
+    decoder_.set_max_list_size(kHeaderListLimit);
+    send_frame(kSettings, 0, 0, settings, sizeof(settings));
+
+    if (settings_.connection_window_size > kDefaultWindow) {
+        send_window_update(0, static_cast<std::uint32_t>(settings_.connection_window_size - kDefaultWindow));
+        conn_recv_window_ = settings_.connection_window_size;
+    }
+
+    bool ok = read_buffer_.size() == 0 || process_frames();
+    flush();
+    if (ok) {
+        do_read();
+    }
+}
+
+void Http2Handler::do_read() {
+    if (closed_) {
+        return;
+    }
+
+    update_client_deadline();
+    with_client_stream([this](auto& stream) {
+        stream.async_read_some(read_buffer_.prepare(kReadSize),
+            beast::bind_front_handler(&Http2Handler::on_read, shared_from_this()));
+    });
+}
+
+void Http2Handler::on_read(beast::error_code ec, std::size_t bytes_transferred) {
+    if (closed_) {
+        return;
+    }
+
+    if (ec) {
+        if (ec != net::error::eof && ec != beast::error::timeout &&
+            ec != net::error::operation_aborted && ec != net::ssl::error::stream_truncated) {
+            Log::debug() << "HTTP/2 read error: " << ec.message();
+        }
+        close();
+        return;
+    }
+
+    read_buffer_.commit(bytes_transferred);
+    bool ok = process_frames();
+    pump_data();
+    flush();
+    if (ok) {
+        resume_read();
+    }
+}
+
+void Http2Handler::resume_read() {
+    // A client that doesn't read what it asks for (PING and SETTINGS ACKs,
+    // resets, window updates) isn't read from either until the output drains
+    if (out_.size() >= kMaxPendingOutput) {
+        read_paused_ = true;
+        return;
+    }
+    read_paused_ = false;
+    do_read();
+}
+
+bool Http2Handler::within_flood_limit(std::uint32_t& counter, std::uint32_t limit) {
+    auto now = std::chrono::steady_clock::now();
+    if (now - flood_window_start_ >= std::chrono::seconds(1)) {
+        flood_window_start_ = now;
+        control_frames_ = 0;
+        stream_resets_ = 0;
+    }
+    if (++counter <= limit) {
+        return true;
+    }
+    Log::debug() << "HTTP/2 client from " << std::string_view(client_ip_, client_ip_size_)
+                 << " exceeded " << limit << (&counter == &control_frames_ ? " control frames" : " stream resets")
+                 << " per second";
+    connection_error(kEnhanceYourCalm);
+    return false;
+}
+
+bool Http2Handler::process_frames() {
+    if (!preface_received_) {
+        if (read_buffer_.size() < kPreface.size()) {
+            return true;
+        }
+        if (std::memcmp(read_buffer_.data().data(), kPreface.data(), kPreface.size()) != 0) {
+            close();
+            return false;
+        }
+        read_buffer_.consume(kPreface.size());
+        preface_received_ = true;
+    }
+
+    while (!closed_ && !goaway_sent_) {
+        const auto* data = static_cast<const std::uint8_t*>(read_buffer_.data().data());
+        std::size_t size = read_buffer_.size();
+        if (size < kFrameHeaderSize) {
+            break;
+        }
+
+        std::size_t length = (std::size_t(data[0]) << 16) | (std::size_t(data[1]) << 8) | data[2];
+        std::uint8_t type = data[3];
+        std::uint8_t flags = data[4];
+        std::uint32_t stream_id = read_u32(data + 5) & 0x7fffffff;
+
+        if (length > kDefaultFrameSize) {
+            connection_error(kFrameSizeError);
+            return false;
+        }
+        if (size < kFrameHeaderSize + length) {
+            break;
+        }
+
+        // The client's SETTINGS come first, and a header block may not be
+        // interleaved with any other frame
+        if ((!settings_received_ && type != kSettings) ||
+            (continuation_stream_ != 0 && type != kContinuation)) {
+            connection_error(kProtocolError);
+            return false;
+        }
+
+        if (!handle_frame(type, flags, stream_id, data + kFrameHeaderSize, length)) {
+            return false;
+        }
+        read_buffer_.consume(kFrameHeaderSize + length);
+    }
+    return !closed_ && !goaway_sent_;
+}
+
+bool Http2Handler::handle_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id,
+                                const std::uint8_t* payload, std::size_t length) {
+    switch (type) {
+        case kData:
+            return on_data(flags, stream_id, payload, length);
+
+        case kHeaders:
+            return on_headers(flags, stream_id, payload, length);
+
+        case kContinuation:
+            return on_continuation(flags, stream_id, payload, length);
+
+        case kSettings:
+            return on_settings(flags, stream_id, payload, length);
+
+        case kWindowUpdate:
+            return on_window_update(stream_id, payload, length);
+
+        case kPriority:
+            // Streams are served round-robin; priority hints are not used
+            if (stream_id == 0) {
+                connection_error(kProtocolError);
+                return false;
+            }
+            return true;
+
+        case kRstStream: {
+            if (stream_id == 0 || stream_id > last_stream_id_) {
+                connection_error(kProtocolError);
+                return false;
+            }
+            if (length != 4) {
+                connection_error(kFrameSizeError);
+                return false;
+            }
+            auto it = streams_.find(stream_id);
+            if (it != streams_.end()) {
+                auto s = it->second;
+                s->closed = true;
+                finish_stream(s, false);
+            }
+            return within_flood_limit(stream_resets_, kMaxStreamResetsPerSecond);
+        }
+
+        case kPing:
+            if (stream_id != 0) {
+                connection_error(kProtocolError);
+                return false;
+            }
+            if (length != 8) {
+                connection_error(kFrameSizeError);
+                return false;
+            }
+            if (!(flags & kAck)) {
+                if (!within_flood_limit(control_frames_, kMaxControlFramesPerSecond)) {
+                    return false;
+                }
+                send_frame(kPing, kAck, 0, payload, length);
+            }
+            return true;
+
+        case kGoaway:
+            if (stream_id != 0) {
+                connection_error(kProtocolError);
+                return false;
+            }
+            // Finish the streams in progress, then close
+            closing_ = true;
+            return true;
+
+        case kPushPromise:
+            // Clients never push
+            connection_error(kProtocolError);
+            return false;
+
+        default:
+            // Unknown frame types are ignored
+            return true;
+    }
+}
+
+bool Http2Handler::on_settings(std::uint8_t flags, std::uint32_t stream_id,
+                               const std::uint8_t* payload, std::size_t length) {
+    if (stream_id != 0) {
+        connection_error(kProtocolError);
+        return false;
+    }
+    if (flags & kAck) {
+        if (length != 0) {
+            connection_error(kFrameSizeError);
+            return false;
+        }
+        return true;
+    }
+    if (length % 6 != 0) {
+        connection_error(kFrameSizeError);
+        return false;
+    }
+
+    for (std::size_t i = 0; i < length; i += 6) {
+        std::uint16_t id = static_cast<std::uint16_t>((payload[i] << 8) | payload[i + 1]);
+        std::uint32_t value = read_u32(payload + i + 2);
+        switch (id) {
+            case kHeaderTableSize:
+                encoder_.set_max_table_size(value);
+                break;
+            case kEnablePush:
+                if (value > 1) {
+                    connection_error(kProtocolError);
+                    return false;
+                }
+                break;
+            case kInitialWindowSize: {
+                if (value > kMaxWindow) {
+                    connection_error(kFlowControlError);
+                    return false;
+                }
+                // The change applies to every open stream's send window
+                std::int64_t delta = std::int64_t(value) - peer_initial_window_;
+                for (auto& [id, s] : streams_) {
+                    s->send_window += delta;
+                    if (s->send_window > kMaxWindow) {
+                        connection_error(kFlowControlError);
+                        return false;
+                    }
+                }
+                peer_initial_window_ = value;
+                break;
+            }
+            case kMaxFrameSize:
+                if (value < kDefaultFrameSize || value > 16777215) {
+                    connection_error(kProtocolError);
+                    return false;
+                }
+                peer_max_frame_size_ = value;
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (!within_flood_limit(control_frames_, kMaxControlFramesPerSecond)) {
+        return false;
+    }
+    settings_received_ = true;
+    send_frame(kSettings, kAck, 0);
+    return true;
+}
+
+bool Http2Handler::on_headers(std::uint8_t flags, std::uint32_t stream_id,
+                              const std::uint8_t* payload, std::size_t length) {
+    if (stream_id == 0) {
+        connection_error(kProtocolError);
+        return false;
+    }
+
+    std::size_t begin = 0;
+    std::size_t padding = 0;
+    if (flags & kPadded) {
+        if (length < 1) {
+            connection_error(kProtocolError);
+            return false;
+        }
+        padding = payload[0];
+        begin = 1;
+    }
+    if (flags & kPriorityFlag) {
+        begin += 5;
+    }
+    if (begin + padding > length) {
+        connection_error(kProtocolError);
+        return false;
+    }
+
+    header_block_.assign(reinterpret_cast<const char*>(payload) + begin, length - begin - padding);
+    header_block_end_stream_ = (flags & kEndStream) != 0;
+    if (!(flags & kEndHeaders)) {
+        continuation_stream_ = stream_id;
+        return true;
+    }
+    return on_header_block(stream_id, header_block_end_stream_);
+}
+
+bool Http2Handler::on_continuation(std::uint8_t flags, std::uint32_t stream_id,
+                                   const std::uint8_t* payload, std::size_t length) {
+    if (continuation_stream_ == 0 || stream_id != continuation_stream_) {
+        connection_error(kProtocolError);
+        return false;
+    }
+
+    header_block_.append(reinterpret_cast<const char*>(payload), length);
+    if (header_block_.size() > kMaxHeaderBlock) {
+        connection_error(kEnhanceYourCalm);
+        return false;
+    }
+    if (!(flags & kEndHeaders)) {
+        return true;
+    }
+    continuation_stream_ = 0;
+    return on_header_block(stream_id, header_block_end_stream_);
+}
+
+bool Http2Handler::on_header_block(std::uint32_t stream_id, bool end_stream) {
+    // Every block goes through the decoder, even for streams that are refused
+    // or already gone, to keep its dynamic table in step with the client's
+    std::vector<HpackHeader> headers;
+    bool decoded = decoder_.decode(reinterpret_cast<const std::uint8_t*>(header_block_.data()),
+                                   header_block_.size(), headers);
+    std::size_t header_bytes = header_block_.size();
+    header_block_.clear();
+    if (!decoded) {
+        connection_error(kCompressionError);
+        return false;
+    }
+
+    // Trailers: they end the request body, which the HTTP/1.1 upstream
+    // receives without them
+    auto it = streams_.find(stream_id);
+    if (it != streams_.end()) {
+        auto s = it->second;
+        if (!end_stream || s->request_complete) {
+            reset_stream(s, kProtocolError);
+            return true;
+        }
+        s->request_complete = true;
+        write_request_body(s);
+        return true;
+    }
+
+    if ((stream_id & 1) == 0) {
+        connection_error(kProtocolError);
+        return false;
+    }
+    if (stream_id <= last_stream_id_) {
+        // A stream we already closed or reset
+        return true;
+    }
+    last_stream_id_ = stream_id;
+
+    if (closing_) {
+        return true;
+    }
+    if (streams_.size() >= static_cast<std::size_t>(settings_.max_concurrent_streams)) {
+        std::uint8_t code[4];
+        write_u32(code, kRefusedStream);
+        send_frame(kRstStream, 0, stream_id, code, sizeof(code));
+        return within_flood_limit(stream_resets_, kMaxStreamResetsPerSecond);
+    }
+
+    open_stream(stream_id, headers, end_stream, header_bytes);
+    return true;
+}
+
+void Http2Handler::open_stream(std::uint32_t stream_id, std::vector<HpackHeader>& headers, bool end_stream,
+                               std::size_t header_bytes) {
+    auto s = std::make_shared<Stream>();
+    s->id = stream_id;
+    s->started = std::chrono::steady_clock::now();
+    s->header_bytes = header_bytes;
+    s->request_complete = end_stream;
+    s->recv_window = settings_.initial_window_size;
+    s->send_window = peer_initial_window_;
+    streams_.emplace(stream_id, s);
+
+    if (decoder_.list_size() > kHeaderListLimit) {
+        respond_local(s, http::status::request_header_fields_too_large, "Request header too large");
+        return;
+    }
+
+    // Pseudo-headers become the request line, :authority the Host header
+    auto& req = s->request;
+    std::string_view method, scheme, path, authority;
+    std::string cookie;
+    bool regular_seen = false;
+    bool malformed = false;
+    for (const auto& header : headers) {
+        std::string_view name = header.name;
+        std::string_view value = header.value;
+        if (!name.empty() && name[0] == ':') {
+            std::string_view* slot = name == ":method" ? &method
+                                   : name == ":scheme" ? &scheme
+                                   : name == ":path" ? &path
+                                   : name == ":authority" ? &authority
+                                   : nullptr;
+            if (regular_seen || !slot || !slot->empty()) {
+                malformed = true;
+                break;
+            }
+            *slot = value;
+            continue;
+        }
+
+        regular_seen = true;
+        if (!is_token(name) || has_uppercase(name) || !is_valid_field_value(value) ||
+            is_connection_specific(name) || (name == "te" && value != "trailers")) {
+            malformed = true;
+            break;
+        }
+        if (name == "te") {
+            continue;
+        }
+        // The declared length is checked against the DATA that follows
+        // (RFC 9113 8.1.1); repeated copies of it must agree
+        if (name == "content-length") {
+            std::uint64_t length = 0;
+            if (!parse_content_length(value, length) ||
+                (s->declared_length && *s->declared_length != length)) {
+                malformed = true;
+                break;
+            }
+            if (s->declared_length) {
+                continue;
+            }
+            s->declared_length = length;
+        }
+        // Split cookie crumbs are joined again for HTTP/1.1
+        if (name == "cookie") {
+            if (!cookie.empty()) {
+                cookie.append("; ");
+            }
+            cookie.append(value);
+            continue;
+        }
+        req.insert(to_field_value(name), to_field_value(value));
+    }
+
+    if (malformed || !is_token(method) || !is_visible_text(authority)) {
+        reset_stream(s, kProtocolError);
+        return;
+    }
+    if (method == "CONNECT") {
+        respond_local(s, http::status::not_implemented, "CONNECT is not supported");
+        return;
+    }
+    if (!is_token(scheme) || path.empty() || !is_visible_text(path) ||
+        (path[0] != '/' && !(path == "*" && method == "OPTIONS"))) {
+        reset_stream(s, kProtocolError);
+        return;
+    }
+    if (s->request_complete && s->declared_length.value_or(0) != 0) {
+        reset_stream(s, kProtocolError);
+        return;
+    }
+
+    req.method_string(to_field_value(method));
+    req.target(to_field_value(path));
+    req.version(11);
+    if (!authority.empty()) {
+        req.set(http::field::host, to_field_value(authority));
+    }
+    if (!cookie.empty()) {
+        req.set(http::field::cookie, cookie);
+    }
+
+    // 100-continue is answered here; the upstream gets the body as it arrives
+    auto expect = req.find(http::field::expect);
+    if (expect != req.end()) {
+        if (!s->request_complete && beast::iequals(expect->value(), "100-continue")) {
+            std::string block;
+            encoder_.encode(":status", "100", block);
+            send_headers(s->id, block, false);
+        }
+        req.erase(http::field::expect);
+    }
+
+    forward_to_backend(s);
 }
 
-void Http2Handler::start() {
-    // Start the HTTP/2 handler
-    std::cout << "HTTP/2 handler started." << std::endl;
+bool Http2Handler::on_data(std::uint8_t flags, std::uint32_t stream_id,
+                           const std::uint8_t* payload, std::size_t length) {
+    if (stream_id == 0 || stream_id > last_stream_id_) {
+        connection_error(kProtocolError);
+        return false;
+    }
+
+    conn_recv_window_ -= static_cast<std::int64_t>(length);
+    if (conn_recv_window_ < 0) {
+        connection_error(kFlowControlError);
+        return false;
+    }
+
+    std::size_t begin = 0;
+    std::size_t padding = 0;
+    if (flags & kPadded) {
+        if (length < 1) {
+            connection_error(kProtocolError);
+            return false;
+        }
+        padding = payload[0];
+        begin = 1;
+    }
+    if (begin + padding > length) {
+        connection_error(kProtocolError);
+        return false;
+    }
+
+    // Data for a stream that is gone only counts against the connection
+    // window, which is reopened right away
+    auto it = streams_.find(stream_id);
+    StreamPtr s = it != streams_.end() ? it->second : nullptr;
+    if (s && s->request_complete) {
+        reset_stream(s, kStreamClosed);
+        s = nullptr;
+    }
+    if (s) {
+        s->recv_window -= static_cast<std::int64_t>(length);
+        if (s->recv_window < 0) {
+            reset_stream(s, kFlowControlError);
+            s = nullptr;
+        }
+    }
+    if (!s) {
+        if (length > 0) {
+            send_window_update(0, static_cast<std::uint32_t>(length));
+            conn_recv_window_ += static_cast<std::int64_t>(length);
+        }
+        return true;
+    }
+
+    // A body that overruns or falls short of its content-length would leave
+    // the upstream connection out of step; the stream is reset instead, which
+    // also keeps that connection out of the pool
+    std::size_t body = length - begin - padding;
+    bool overrun = s->declared_length && s->request_body_bytes + body > *s->declared_length;
+    bool short_end = s->declared_length && (flags & kEndStream) &&
+                     s->request_body_bytes + body < *s->declared_length;
+    if (overrun || short_end) {
+        reset_stream(s, kProtocolError);
+        send_window_update(0, static_cast<std::uint32_t>(length));
+        conn_recv_window_ += static_cast<std::int64_t>(length);
+        return true;
+    }
+    s->request_body.append(reinterpret_cast<const char*>(payload) + begin, body);
+    s->request_body_bytes += body;
+
+    // Padding is returned at once, body bytes once they are written upstream
+    std::size_t overhead = length - body;
+    if (overhead > 0) {
+        send_window_update(0, static_cast<std::uint32_t>(overhead));
+        conn_recv_window_ += static_cast<std::int64_t>(overhead);
+        if (!(flags & kEndStream)) {
+            send_window_update(stream_id, static_cast<std::uint32_t>(overhead));
+            s->recv_window += static_cast<std::int64_t>(overhead);
+        }
+    }
+
+    if (flags & kEndStream) {
+        s->request_complete = true;
+    }
+    write_request_body(s);
+    return true;
+}
+
+bool Http2Handler::on_window_update(std::uint32_t stream_id, const std::uint8_t* payload, std::size_t length) {
+    if (length != 4) {
+        connection_error(kFrameSizeError);
+        return false;
+    }
+    std::int64_t increment = read_u32(payload) & 0x7fffffff;
+
+    if (stream_id == 0) {
+        conn_send_window_ += increment;
+        if (increment == 0 || conn_send_window_ > kMaxWindow) {
+            connection_error(increment == 0 ? kProtocolError : kFlowControlError);
+            return false;
+        }
+        return true;
+    }
+
+    if (stream_id > last_stream_id_) {
+        connection_error(kProtocolError);
+        return false;
+    }
+    auto it = streams_.find(stream_id);
+    if (it == streams_.end()) {
+        return true;
+    }
+    auto s = it->second;
+    s->send_window += increment;
+    if (increment == 0) {
+        reset_stream(s, kProtocolError);
+    } else if (s->send_window > kMaxWindow) {
+        reset_stream(s, kFlowControlError);
+    }
+    return true;
+}
+
+void Http2Handler::forward_to_backend(const StreamPtr& s) {
+    auto& req = s->request;
+
+    auto host_it = req.find(http::field::host);
+    if (host_it == req.end() || host_it->value().empty()) {
+        respond_local(s, http::status::bad_request, "Missing Host header");
+        return;
+    }
+    std::string_view host(host_it->value().data(), host_it->value().size());
+    host = host.substr(0, host.find(':'));
+
+    // A stream runs entirely on the configuration that was current when it
+    // was opened; reloads are picked up by the streams that follow
+    if (router_->isStale(*snapshot_)) {
+        snapshot_ = router_->snapshot();
+    }
+    s->snapshot = snapshot_;
+
+    const Route* route = s->snapshot->routes.find(host);
+    if (!route) {
+        respond_local(s, http::status::not_found, "No backend configured for domain");
+        return;
+    }
+    s->site = route->metrics_id;
+
+    // Root sites are answered from the file system
+    if (!route->root.empty()) {
+        serve_static(s, *route);
+        return;
+    }
+
+    // Frame the body for HTTP/1.1: as announced, or chunked while it is
+    // still arriving
+    if (!s->request_complete) {
+        if (!req.has_content_length()) {
+            req.chunked(true);
+        }
+    } else if (!req.has_content_length() &&
+               (req.method() == http::verb::post || req.method() == http::verb::put ||
+                req.method() == http::verb::patch)) {
+        req.content_length(0);
+    }
+
+    ForwardedInfo forwarded;
+    forwarded.client_ip = std::string_view(client_ip_, client_ip_size_);
+    forwarded.proto = ssl_stream_ ? "https" : "http";
+    forwarded.host = host;
+    prepare_upstream_request(req, forwarded);
+
+    s->upstream = route->balancer->select(upstream_hash_key(*s, *route->balancer));
+    if (!s->upstream) {
+        respond_local(s, http::status::bad_gateway, "No usable backend for domain");
+        return;
+    }
+    s->target = s->upstream.target();
+
+    // Reuse an idle keep-alive connection when the pool has one
+    s->conn = BackendConnectionPool::local().acquire(s->target->name());
+    if (s->conn) {
+        s->reused = true;
+        send_request_header(s);
+        return;
+    }
+    connect_to_backend(s);
+}
+
+void Http2Handler::serve_static(const StreamPtr& s, const Route& route) {
+    const auto& req = s->request;
+    auto view = [](beast::string_view value) { return std::string_view(value.data(), value.size()); };
+    std::string path;
+    auto response = StaticFiles::respond(view(req.method_string()), view(req.target()), route.root,
+        [&](std::string_view name) { return view(req[beast::string_view(name.data(), name.size())]); }, path);
+    if (response.status == 400) {
+        respond_local(s, http::status::bad_request, "Invalid path");
+        return;
+    }
+    if (response.status == 404) {
+        respond_local(s, http::status::not_found, "Not found");
+        return;
+    }
+
+    std::string block;
+    char number[24];
+    auto encode_number = [&](std::string_view name, std::uint64_t value) {
+        auto end = std::to_chars(number, number + sizeof(number), value).ptr;
+        encoder_.encode(name, std::string_view(number, static_cast<std::size_t>(end - number)), block);
+    };
+    unsigned status = response.status;
+    encode_number(":status", status);
+    encoder_.encode("server", "ReverseProxy/1.0", block);
+    encoder_.encode("date", StaticFiles::date(), block);
+    if (status == 405) {
+        encoder_.encode("allow", "GET, HEAD", block);
+        encoder_.encode("content-length", "0", block);
+    } else if (status == 301) {
+        // A directory is served with its index under the name ending in '/'
+        auto target = view(req.target());
+        auto query = std::min(target.find('?'), target.size());
+        std::string location(target.substr(0, query));
+        location += '/';
+        location += target.substr(query);
+        encoder_.encode("location", location, block);
+        encoder_.encode("content-length", "0", block);
+    } else {
+        const StaticFile& file = *response.file;
+        if (status != 304) {
+            encoder_.encode("content-type", StaticFiles::content_type(path), block);
+            encode_number("content-length", response.length);
+            encoder_.encode("accept-ranges", "bytes", block);
+        }
+        if (status == 206 || status == 416) {
+            encoder_.encode("content-range", StaticFiles::content_range(response), block);
+        }
+        encoder_.encode("last-modified", file.last_modified, block);
+        encoder_.encode("etag", file.etag, block);
+        if (!response.encoding.empty()) {
+            encoder_.encode("content-encoding", response.encoding, block);
+        }
+        if (response.vary) {
+            encoder_.encode("vary", "accept-encoding", block);
+        }
+    }
+
+    send_headers(s->id, block, !response.body);
+    s->headers_sent = true;
+    s->status = status;
+    s->bytes_sent += block.size();
+    if (!response.body) {
+        s->response_complete = true;
+        s->end_sent = true;
+        finish_stream(s, true);
+        return;
+    }
+
+    // The body goes out through pump_data like a backend's, within the windows
+    s->file = std::move(response.file);
+    s->file_offset = response.offset;
+    s->file_remaining = response.length;
+    if (!read_file_chunk(s)) {
+        reset_stream(s, kInternalError);
+        return;
+    }
+    pump_data();
+}
+
+bool Http2Handler::read_file_chunk(const StreamPtr& s) {
+    if (!s->chunk) {
+        s->chunk = std::make_unique<char[]>(kResponseChunk);
+    }
+    ssize_t n = ::pread(s->file->fd, s->chunk.get(), std::min<std::uint64_t>(s->file_remaining, kResponseChunk),
+                        static_cast<off_t>(s->file_offset));
+    if (n <= 0) {
+        // Truncated since it was opened: the announced length can't be sent
+        Log::warn() << "Static file read failed for stream " << s->id;
+        return false;
+    }
+    s->chunk_size = static_cast<std::size_t>(n);
+    s->chunk_offset = 0;
+    s->file_offset += s->chunk_size;
+    s->file_remaining -= s->chunk_size;
+    s->response_complete = s->file_remaining == 0;
+    return true;
+}
+
+void Http2Handler::connect_to_backend(const StreamPtr& s) {
+    s->reused = false;
+    s->conn = std::make_unique<BackendConnection>(beast::tcp_stream(client_tcp_stream().get_executor()));
+    s->backend_started = std::chrono::steady_clock::now();
+
+    auto on_connect = [self = shared_from_this(), s](beast::error_code ec) {
+        if (s->detached) {
+            return;
+        }
+        if (ec) {
+            self->record_upstream_result(s, false);
+            if (ec != beast::error::timeout) {
+                Log::warn() << "Backend connect error: " << ec.message();
+            }
+            self->respond_local(s, ec == beast::error::timeout ? http::status::gateway_timeout : http::status::bad_gateway,
+                                ec == beast::error::timeout ? "Backend connection timed out" : "Backend connection failed");
+            self->flush();
+            return;
+        }
+        Metrics::record_backend_connect(std::chrono::steady_clock::now() - s->backend_started);
+        self->send_request_header(s);
+    };
+
+    BackendResolver::async_endpoints(*s->target, client_tcp_stream().get_executor(),
+        [self = shared_from_this(), s, on_connect](beast::error_code ec, const BackendResolver::Endpoints& endpoints) {
+            if (ec || s->detached) {
+                on_connect(ec);
+                return;
+            }
+            detail::set_deadline(s->conn->stream, timeout(s->snapshot->config->timeouts.backend_connect_seconds));
+            s->conn->stream.async_connect(endpoints,
+                [s, on_connect](beast::error_code ec, tcp::endpoint) {
+                    if (!ec) {
+                        beast::error_code ignored;
+                        s->conn->stream.socket().set_option(tcp::no_delay(true), ignored);
+                    }
+                    on_connect(ec);
+                });
+        });
+}
+
+void Http2Handler::send_request_header(const StreamPtr& s) {
+    auto& body = s->request.body();
+    body.data = nullptr;
+    body.size = 0;
+    body.more = true;
+    s->serializer.emplace(s->request);
+
+    s->backend_started = std::chrono::steady_clock::now();
+    detail::set_deadline(s->conn->stream, timeout(s->snapshot->config->timeouts.backend_response_seconds));
+    http::async_write_header(s->conn->stream, *s->serializer,
+        [self = shared_from_this(), s](beast::error_code ec, std::size_t) {
+            if (s->detached) {
+                return;
+            }
+            if (ec) {
+                if (!self->retry_on_fresh_connection(s)) {
+                    self->on_upstream_error(s, ec, "write");
+                }
+                return;
+            }
+
+            // The response is read while the body is still being sent, so a
+            // backend that answers early (or echoes) never stalls the upload
+            s->header_sent = true;
+            self->read_response_header(s);
+            self->write_request_body(s);
+            self->flush();
+        });
+}
+
+void Http2Handler::write_request_body(const StreamPtr& s) {
+    if (s->detached || !s->header_sent || s->upstream_writing || s->serializer->is_done()) {
+        return;
+    }
+    if (s->request_body.empty() && !s->request_complete) {
+        return;
+    }
+
+    s->request_writing.swap(s->request_body);
+    auto& body = s->request.body();
+    body.data = s->request_writing.empty() ? nullptr : s->request_writing.data();
+    body.size = s->request_writing.size();
+    body.more = !s->request_complete;
+
+    s->upstream_writing = true;
+    detail::set_deadline(s->conn->stream, timeout(s->snapshot->config->timeouts.backend_response_seconds));
+    http::async_write(s->conn->stream, *s->serializer,
+        [self = shared_from_this(), s](beast::error_code ec, std::size_t) {
+            s->upstream_writing = false;
+            if (s->detached) {
+                return;
+            }
+            if (ec == http::error::need_buffer) {
+                ec = {};
+            }
+            if (ec) {
+                self->on_upstream_error(s, ec, "write");
+                return;
+            }
+
+            // Written bytes reopen the client's windows
+            auto written = static_cast<std::uint32_t>(s->request_writing.size());
+            s->request_writing.clear();
+            if (written > 0) {
+                self->send_window_update(0, written);
+                self->conn_recv_window_ += written;
+                if (!s->request_complete) {
+                    self->send_window_update(s->id, written);
+                    s->recv_window += written;
+                }
+            }
+            self->write_request_body(s);
+            self->flush();
+        });
+}
+
+void Http2Handler::read_response_header(const StreamPtr& s) {
+    s->parser.emplace();
+    s->parser->body_limit(kUnlimitedBody);
+    s->parser->skip(s->request.method() == http::verb::head);
+
+    s->backend_reading = true;
+    detail::set_deadline(s->conn->stream, timeout(s->snapshot->config->timeouts.backend_response_seconds));
+    http::async_read_header(s->conn->stream, s->backend_buffer, *s->parser,
+        [self = shared_from_this(), s](beast::error_code ec, std::size_t bytes_transferred) {
+            s->backend_reading = false;
+            if (s->detached) {
+                return;
+            }
+            if (ec && ec != beast::error::timeout && bytes_transferred == 0 &&
+                self->retry_on_fresh_connection(s)) {
+                return;
+            }
+            self->on_response_header(s, ec);
+            self->flush();
+        });
+}
+
+void Http2Handler::on_response_header(const StreamPtr& s, beast::error_code ec) {
+    if (ec) {
+        on_upstream_error(s, ec, "read");
+        return;
+    }
+
+    auto& res = s->parser->get();
+
+    // Interim (1xx) responses are not forwarded; wait for the final one
+    if (http::to_status_class(res.result()) == http::status_class::informational) {
+        read_response_header(s);
+        return;
+    }
+    s->upstream.record_response();
+    Metrics::record_backend_first_byte(std::chrono::steady_clock::now() - s->backend_started);
+    record_upstream_result(s, http::to_status_class(res.result()) != http::status_class::server_error);
+
+    bool has_body = s->request.method() != http::verb::head &&
+                    res.result() != http::status::no_content &&
+                    res.result() != http::status::not_modified;
+
+    // A body delimited by closing the connection can't be pooled
+    s->keep_alive = res.keep_alive() && (!has_body || res.chunked() || res.has_content_length());
+
+    // HTTP/2 frames the body itself; names go out lowercase
+    prepare_downstream_response(res);
+    std::string block;
+    char status[4];
+    unsigned code = res.result_int();
+    status[0] = static_cast<char>('0' + code / 100 % 10);
+    status[1] = static_cast<char>('0' + code / 10 % 10);
+    status[2] = static_cast<char>('0' + code % 10);
+    encoder_.encode(":status", std::string_view(status, 3), block);
+
+    std::string name;
+    for (const auto& field : res) {
+        auto field_name = field.name_string();
+        name.assign(field_name.data(), field_name.size());
+        std::transform(name.begin(), name.end(), name.begin(),
+                       [](char c) { return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c; });
+        if (is_connection_specific(name)) {
+            continue;
+        }
+        encoder_.encode(name, std::string_view(field.value().data(), field.value().size()), block);
+    }
+
+    bool end_stream = s->parser->is_done();
+    send_headers(s->id, block, end_stream);
+    s->headers_sent = true;
+    s->status = code;
+    s->bytes_sent += block.size();
+    if (end_stream) {
+        s->response_complete = true;
+        s->end_sent = true;
+        finish_stream(s, true);
+        return;
+    }
+    read_response_body(s);
+}
+
+void Http2Handler::read_response_body(const StreamPtr& s) {
+    if (s->detached || s->backend_reading || s->response_complete || s->chunk_offset < s->chunk_size) {
+        return;
+    }
+
+    if (!s->chunk) {
+        s->chunk = std::make_unique<char[]>(kResponseChunk);
+    }
+    auto& body = s->parser->get().body();
+    body.data = s->chunk.get();
+    body.size = kResponseChunk;
+
+    s->backend_reading = true;
+    detail::set_deadline(s->conn->stream, timeout(s->snapshot->config->timeouts.backend_response_seconds));
+    http::async_read_some(s->conn->stream, s->backend_buffer, *s->parser,
+        [self = shared_from_this(), s](beast::error_code ec, std::size_t) {
+            s->backend_reading = false;
+            if (s->detached) {
+                return;
+            }
+            if (ec == http::error::need_buffer) {
+                ec = {};
+            }
+            if (ec) {
+                self->on_upstream_error(s, ec, "read");
+                self->flush();
+                return;
+            }
+
+            s->chunk_size = kResponseChunk - s->parser->get().body().size;
+            s->chunk_offset = 0;
+            s->response_complete = s->parser->is_done();
+            self->pump_data();
+            self->flush();
+        });
+}
+
+void Http2Handler::on_upstream_error(const StreamPtr& s, beast::error_code ec, const char* what) {
+    record_upstream_result(s, false);
+    if (ec == beast::error::timeout) {
+        respond_local(s, http::status::gateway_timeout, "Backend response timed out");
+        return;
+    }
+    Log::warn() << "Backend " << what << " error: " << ec.message();
+    respond_local(s, http::status::bad_gateway,
+                  std::string_view(what) == "write" ? "Backend write failed" : "Backend read failed");
+}
+
+bool Http2Handler::retry_on_fresh_connection(const StreamPtr& s) {
+    // Only a reused connection can have been closed by the backend while idle,
+    // and only idempotent requests without a body can be resent
+    if (!s->reused || !is_idempotent(s->request.method()) || s->upstream_writing ||
+        !s->request_complete || s->request_body_bytes > 0) {
+        return false;
+    }
+
+    beast::error_code ec;
+    s->conn->stream.socket().close(ec);
+    s->backend_buffer.clear();
+    s->parser.reset();
+    s->serializer.reset();
+    s->header_sent = false;
+    connect_to_backend(s);
+    return true;
+}
+
+void Http2Handler::record_upstream_result(const StreamPtr& s, bool success) {
+    if (!s->target) {
+        return;
+    }
+
+    auto& health = s->target->health();
+    if (success) {
+        health.record_success();
+        return;
+    }
+    if (auto ejected_ms = health.record_failure()) {
+        Log::warn() << "Backend " << s->target->name() << " failed repeatedly, ejected for "
+                    << ejected_ms << " ms";
+    }
+}
+
+void Http2Handler::respond_local(const StreamPtr& s, http::status status, std::string_view message) {
+    if (s->closed) {
+        return;
+    }
+    if (s->headers_sent) {
+        reset_stream(s, kInternalError);
+        return;
+    }
+
+    // The upstream exchange, if any, is abandoned
+    s->detached = true;
+    s->keep_alive = false;
+    if (s->conn) {
+        beast::error_code ec;
+        s->conn->stream.socket().close(ec);
+    }
+
+    std::string block;
+    auto code = std::to_string(static_cast<unsigned>(status));
+    auto length = std::to_string(message.size());
+    encoder_.encode(":status", code, block);
+    encoder_.encode("content-type", "text/plain", block);
+    encoder_.encode("content-length", length, block);
+    encoder_.encode("server", "ReverseProxy/1.0", block);
+    send_headers(s->id, block, false);
+    s->headers_sent = true;
+    s->status = static_cast<unsigned>(status);
+    s->bytes_sent += block.size();
+
+    // The body goes out through pump_data like any other, within the windows
+    s->chunk = std::make_unique<char[]>(std::max<std::size_t>(message.size(), 1));
+    std::memcpy(s->chunk.get(), message.data(), message.size());
+    s->chunk_size = message.size();
+    s->chunk_offset = 0;
+    s->response_complete = true;
+    pump_data();
+}
+
+void Http2Handler::send_headers(std::uint32_t stream_id, const std::string& block, bool end_stream) {
+    // A block larger than the peer's frame size continues in CONTINUATION frames
+    std::size_t offset = 0;
+    std::uint8_t type = kHeaders;
+    do {
+        std::size_t n = std::min(block.size() - offset, peer_max_frame_size_);
+        bool last = offset + n == block.size();
+        std::uint8_t flags = last ? kEndHeaders : 0;
+        if (type == kHeaders && end_stream) {
+            flags |= kEndStream;
+        }
+        send_frame(type, flags, stream_id, block.data() + offset, n);
+        offset += n;
+        type = kContinuation;
+    } while (offset < block.size());
+}
+
+void Http2Handler::send_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id,
+                              const void* payload, std::size_t length) {
+    std::size_t at = out_.size();
+    out_.resize(at + kFrameHeaderSize + length);
+    auto* p = reinterpret_cast<std::uint8_t*>(&out_[at]);
+    p[0] = static_cast<std::uint8_t>(length >> 16);
+    p[1] = static_cast<std::uint8_t>(length >> 8);
+    p[2] = static_cast<std::uint8_t>(length);
+    p[3] = type;
+    p[4] = flags;
+    write_u32(p + 5, stream_id);
+    if (length > 0) {
+        std::memcpy(p + kFrameHeaderSize, payload, length);
+    }
+}
+
+void Http2Handler::send_window_update(std::uint32_t stream_id, std::uint32_t increment) {
+    std::uint8_t payload[4];
+    write_u32(payload, increment);
+    send_frame(kWindowUpdate, 0, stream_id, payload, sizeof(payload));
+}
+
+void Http2Handler::reset_stream(const StreamPtr& s, std::uint32_t error_code) {
+    if (s->closed) {
+        return;
+    }
+    std::uint8_t payload[4];
+    write_u32(payload, error_code);
+    send_frame(kRstStream, 0, s->id, payload, sizeof(payload));
+    s->closed = true;
+    finish_stream(s, false);
+
+    // Malformed requests cost a reset each, like the client's own resets
+    if (error_code == kProtocolError) {
+        within_flood_limit(stream_resets_, kMaxStreamResetsPerSecond);
+    }
+}
+
+void Http2Handler::pump_data() {
+    if (closed_) {
+        return;
+    }
+
+    // Streams take turns at the shared connection window, a frame at a time
+    // while any of them has data that fits
+    std::vector<StreamPtr> finished;
+    std::vector<StreamPtr> failed;
+    bool progress = true;
+    while (progress && out_.size() < kMaxPendingOutput) {
+        progress = false;
+        for (auto& [id, s] : streams_) {
+            if (!s->headers_sent || s->end_sent || out_.size() >= kMaxPendingOutput) {
+                continue;
+            }
+
+            std::size_t remaining = s->chunk_size - s->chunk_offset;
+            std::int64_t window = std::min(conn_send_window_, s->send_window);
+            if (remaining > 0 && window > 0) {
+                std::size_t n = std::min({remaining, static_cast<std::size_t>(window), peer_max_frame_size_});
+                bool last = s->response_complete && n == remaining;
+                send_frame(kData, last ? kEndStream : 0, id, s->chunk.get() + s->chunk_offset, n);
+                s->chunk_offset += n;
+                s->bytes_sent += n;
+                s->send_window -= static_cast<std::int64_t>(n);
+                conn_send_window_ -= static_cast<std::int64_t>(n);
+                s->end_sent = last;
+                remaining -= n;
+                progress = true;
+            }
+
+            // A drained chunk makes room for the next read from the backend
+            // (or the file, which is read right away)
+            if (remaining == 0 && !s->end_sent) {
+                if (s->response_complete) {
+                    send_frame(kData, kEndStream, id);
+                    s->end_sent = true;
+                } else if (s->file) {
+                    if (read_file_chunk(s)) {
+                        progress = true;
+                    } else {
+                        failed.push_back(s);
+                    }
+                } else {
+                    s->chunk_size = 0;
+                    s->chunk_offset = 0;
+                    read_response_body(s);
+                }
+            }
+            if (s->end_sent) {
+                finished.push_back(s);
+            }
+        }
+
+        for (auto& s : finished) {
+            finish_stream(s, true);
+        }
+        finished.clear();
+        for (auto& s : failed) {
+            reset_stream(s, kInternalError);
+        }
+        failed.clear();
+    }
+}
+
+void Http2Handler::finish_stream(const StreamPtr& s, bool reusable) {
+    auto it = streams_.find(s->id);
+    if (it == streams_.end() || it->second != s) {
+        return;
+    }
+    streams_.erase(it);
+
+    if (s->status != 0) {
+        auto elapsed = std::chrono::steady_clock::now() - s->started;
+        Metrics::record_request(s->site, s->status, s->header_bytes + s->request_body_bytes, s->bytes_sent,
+                                elapsed);
+
+        if (Log::access_enabled()) {
+            const auto& req = s->request;
+            auto view = [](beast::string_view value) { return std::string_view(value.data(), value.size()); };
+            AccessRecord record;
+            record.client_ip = std::string_view(client_ip_, client_ip_size_);
+            std::string_view host = view(req[http::field::host]);
+            record.host = host.substr(0, host.find(':'));
+            record.method = view(req.method_string());
+            record.target = view(req.target());
+            record.protocol = "HTTP/2.0";
+            if (s->target) {
+                record.upstream = s->target->name();
+            }
+            record.referer = view(req[http::field::referer]);
+            record.user_agent = view(req[http::field::user_agent]);
+            record.status = s->status;
+            record.bytes_received = s->header_bytes + s->request_body_bytes;
+            record.bytes_sent = s->bytes_sent;
+            record.elapsed = elapsed;
+            Log::access(record);
+        }
+    }
+
+    // A complete response ends the stream even if the client is still
+    // sending; tell it to stop (RFC 9113 8.1)
+    if (!s->closed && !s->request_complete) {
+        std::uint8_t payload[4];
+        write_u32(payload, kNoError);
+        send_frame(kRstStream, 0, s->id, payload, sizeof(payload));
+    }
+    s->closed = true;
+
+    // Body bytes that never made it upstream are returned to the connection window
+    auto unwritten = s->request_body.size() + s->request_writing.size();
+    if (unwritten > 0 && !closing_) {
+        send_window_update(0, static_cast<std::uint32_t>(unwritten));
+        conn_recv_window_ += static_cast<std::int64_t>(unwritten);
+    }
+    s->request_body.clear();
+
+    bool pool = reusable && !s->detached && s->keep_alive && s->conn &&
+                !s->upstream_writing && !s->backend_reading &&
+                s->serializer && s->serializer->is_done() &&
+                s->parser && s->parser->is_done();
+    s->detached = true;
+    s->upstream.release();
+
+    if (s->conn) {
+        s->conn->requests_served++;
+        if (pool) {
+            BackendConnectionPool::local().release(s->target->name(), std::move(s->conn));
+        } else {
+            beast::error_code ec;
+            s->conn->stream.socket().shutdown(tcp::socket::shutdown_both, ec);
+            s->conn->stream.socket().close(ec);
+        }
+    }
+}
+
+void Http2Handler::cancel_streams() {
+    std::vector<StreamPtr> streams;
+    streams.reserve(streams_.size());
+    for (auto& [id, s] : streams_) {
+        streams.push_back(s);
+    }
+    for (auto& s : streams) {
+        s->closed = true;
+        finish_stream(s, false);
+    }
+}
+
+void Http2Handler::connection_error(std::uint32_t error_code) {
+    if (goaway_sent_) {
+        return;
+    }
+
+    std::uint8_t payload[8];
+    write_u32(payload, last_stream_id_);
+    write_u32(payload + 4, error_code);
+    send_frame(kGoaway, 0, 0, payload, sizeof(payload));
+    goaway_sent_ = true;
+    closing_ = true;
+    cancel_streams();
+}
+
+void Http2Handler::flush() {
+    if (closed_ || write_in_progress_) {
+        return;
+    }
+    if (out_.empty()) {
+        if (closing_ && streams_.empty()) {
+            close();
+            return;
+        }
+        update_client_deadline();
+        return;
+    }
+
+    writing_.swap(out_);
+    out_.clear();
+    write_in_progress_ = true;
+    update_client_deadline();
+    with_client_writer([this](auto& stream) {
+        net::async_write(stream, net::buffer(writing_),
+            beast::bind_front_handler(&Http2Handler::on_write, shared_from_this()));
+    });
+}
+
+void Http2Handler::on_write(beast::error_code ec, std::size_t bytes_transferred) {
+    boost::ignore_unused(bytes_transferred);
+    write_in_progress_ = false;
+    if (closed_) {
+        return;
+    }
+    if (ec) {
+        if (ec != beast::error::timeout && ec != net::error::operation_aborted) {
+            Log::debug() << "HTTP/2 write error: " << ec.message();
+        }
+        close();
+        return;
+    }
+
+    writing_.clear();
+    pump_data();
+    flush();
+    if (read_paused_ && !goaway_sent_) {
+        resume_read();
+    }
+}
+
+void Http2Handler::close() {
+    if (closed_) {
+        return;
+    }
+    closed_ = true;
+    closing_ = true;
+    cancel_streams();
+
+    beast::error_code ec;
+    client_tcp_stream().socket().shutdown(tcp::socket::shutdown_both, ec);
+    client_tcp_stream().socket().close(ec);
+}
+
+void Http2Handler::update_client_deadline() {
+    // Writes are bounded like any response write; an idle connection by the
+    // keep-alive timeout; while streams wait on backends, their own deadlines apply
+    const auto& timeouts = snapshot_->config->timeouts;
+    if (write_in_progress_) {
+        detail::set_deadline(client_tcp_stream(), timeout(timeouts.body_read_seconds));
+    } else if (!streams_.empty()) {
+        client_tcp_stream().expires_never();
+    } else {
+        detail::set_deadline(client_tcp_stream(), timeout(settings_received_
+            ? timeouts.idle_keepalive_seconds : timeouts.header_read_seconds));
+    }
+}
+
+std::string_view Http2Handler::upstream_hash_key(const Stream& s, const LoadBalancer& balancer) const {
+    if (balancer.policy() != LoadBalancer::Policy::ring_hash) {
+        return {};
+    }
+
+    // Requests without the affinity header fall back to the client address
+    if (!balancer.hash_header().empty()) {
+        auto it = s.request.find(to_field_value(balancer.hash_header()));
+        if (it != s.request.end() && !it->value().empty()) {
+            return std::string_view(it->value().data(), it->value().size());
+        }
+    }
+    return std::string_view(client_ip_, client_ip_size_);
 }
@@ -1,10 +1,251 @@
 #ifndef HTTP2_HANDLER_H
 #define HTTP2_HANDLER_H
 
-class Http2Handler {
+#include "RequestRouter.h"
+#include "AdmissionController.h"
+#include "BackendConnectionPool.h"
+#include "Hpack.h"
+#include "TlsSessionCache.h"
+#include "Metrics.h"
+#include "StaticFiles.h"
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/ssl.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace net = boost::asio;
+using tcp = boost::asio::ip::tcp;
+
+// HTTP/2 frontend (RFC 9113) for one client connection, negotiated with ALPN
+// "h2" over TLS or by prior knowledge (h2c) on the plain port.
+//
+// All streams share the client connection: frames are parsed from a single
+// read loop and everything sent is queued into one output buffer that goes
+// out in a single write. Each stream is mapped onto its own pooled HTTP/1.1
+// upstream exchange. Request bodies are streamed upstream as DATA arrives and
+// the client's windows are only reopened once the bytes have been written, so
+// a slow backend holds at most a window of data. Response bodies are read from
+// the backend one chunk at a time and only after the previous chunk has been
+// sent within the client's flow-control windows.
+class Http2Handler : public std::enable_shared_from_this<Http2Handler> {
 public:
-    Http2Handler();
-    void start();
+    // Client connection preface, sent before the first frame
+    static constexpr std::string_view kPreface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+    Http2Handler(beast::tcp_stream&& stream, std::shared_ptr<RequestRouter> router);
+    // ktls_tx: the kernel already encrypts what is sent on the socket
+    Http2Handler(beast::ssl_stream<beast::tcp_stream>&& ssl_stream, std::shared_ptr<RequestRouter> router,
+                 bool ktls_tx = false);
+    ~Http2Handler();
+
+    // Start with bytes already read from the client (h2c preface detection)
+    void start(std::string_view received = {});
+
+    // Keep the connection counted against max_connections while it lives
+    void hold_admission_slot(AdmissionController::Slot slot) { admission_slot_ = std::move(slot); }
+
+    // Whether the kernel encrypts what this connection sends (kTLS)
+    bool ktls_active() const { return ktls_tx_; }
+
+private:
+    struct Stream {
+        std::uint32_t id = 0;
+        bool closed = false;    // finished or reset; no more frames for it
+        bool detached = false;  // upstream abandoned; its pending operations are ignored
+        std::shared_ptr<const ConfigSnapshot> snapshot;  // keeps route and lease valid
+
+        // Request, rewritten for the upstream and serialized as DATA arrives
+        http::request<http::buffer_body> request;
+        std::optional<http::request_serializer<http::buffer_body>> serializer;
+        std::string request_body;     // received, not yet written upstream
+        std::string request_writing;  // being written upstream
+        bool request_complete = false;  // END_STREAM received
+        bool header_sent = false;
+        bool upstream_writing = false;
+        std::uint64_t request_body_bytes = 0;
+        std::optional<std::uint64_t> declared_length;  // content-length, if the client sent one
+        std::int64_t recv_window = 0;
+
+        // Upstream exchange
+        LoadBalancer::Lease upstream;
+        std::shared_ptr<BackendResolver::Target> target;
+        std::unique_ptr<BackendConnection> conn;
+        bool reused = false;
+        bool keep_alive = false;  // connection can be pooled once the exchange completes
+        beast::flat_buffer backend_buffer;
+        std::optional<http::response_parser<http::buffer_body>> parser;
+        bool backend_reading = false;
+
+        // Response towards the client: one body chunk at a time, read from
+        // the backend once the previous one has been sent
+        bool headers_sent = false;
+        std::unique_ptr<char[]> chunk;
+        std::size_t chunk_size = 0;
+        std::size_t chunk_offset = 0;
+        bool response_complete = false;  // everything read from the backend
+        bool end_sent = false;
+        std::int64_t send_window = 0;
+
+        // File sent instead of a backend's response (root sites), read a
+        // chunk at a time like one
+        std::shared_ptr<const StaticFile> file;
+        std::uint64_t file_offset = 0;
+        std::uint64_t file_remaining = 0;
+
+        // Metrics
+        std::chrono::steady_clock::time_point started;
+        std::chrono::steady_clock::time_point backend_started;  // connect, then request sent
+        std::uint32_t site = Metrics::kUnmatchedSite;
+        unsigned status = 0;               // of the response sent, 0 until then
+        std::uint64_t header_bytes = 0;    // request header block
+        std::uint64_t bytes_sent = 0;      // response header block and DATA
+    };
+    using StreamPtr = std::shared_ptr<Stream>;
+
+    // Client side
+    void do_read();
+    void on_read(beast::error_code ec, std::size_t bytes_transferred);
+    void resume_read();
+
+    // Count one event against a per-second flood limit; past it the
+    // connection ends with GOAWAY(ENHANCE_YOUR_CALM) and false is returned
+    bool within_flood_limit(std::uint32_t& counter, std::uint32_t limit);
+    bool process_frames();
+    bool handle_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id,
+                      const std::uint8_t* payload, std::size_t length);
+    bool on_settings(std::uint8_t flags, std::uint32_t stream_id, const std::uint8_t* payload, std::size_t length);
+    bool on_headers(std::uint8_t flags, std::uint32_t stream_id, const std::uint8_t* payload, std::size_t length);
+    bool on_continuation(std::uint8_t flags, std::uint32_t stream_id, const std::uint8_t* payload, std::size_t length);
+    bool on_header_block(std::uint32_t stream_id, bool end_stream);
+    bool on_data(std::uint8_t flags, std::uint32_t stream_id, const std::uint8_t* payload, std::size_t length);
+    bool on_window_update(std::uint32_t stream_id, const std::uint8_t* payload, std::size_t length);
+    void open_stream(std::uint32_t stream_id, std::vector<HpackHeader>& headers, bool end_stream,
+                     std::size_t header_bytes);
+
+    // Upstream side, per stream
+    void forward_to_backend(const StreamPtr& s);
+    void serve_static(const StreamPtr& s, const Route& route);
+    bool read_file_chunk(const StreamPtr& s);
+    void connect_to_backend(const StreamPtr& s);
+    void send_request_header(const StreamPtr& s);
+    void write_request_body(const StreamPtr& s);
+    void read_response_header(const StreamPtr& s);
+    void on_response_header(const StreamPtr& s, beast::error_code ec);
+    void read_response_body(const StreamPtr& s);
+    void on_upstream_error(const StreamPtr& s, beast::error_code ec, const char* what);
+    bool retry_on_fresh_connection(const StreamPtr& s);
+    void record_upstream_result(const StreamPtr& s, bool success);
+
+    // Output
+    void respond_local(const StreamPtr& s, http::status status, std::string_view message);
+    void send_headers(std::uint32_t stream_id, const std::string& block, bool end_stream);
+    void send_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id,
+                    const void* payload = nullptr, std::size_t length = 0);
+    void send_window_update(std::uint32_t stream_id, std::uint32_t increment);
+    void reset_stream(const StreamPtr& s, std::uint32_t error_code);
+    void cancel_streams();
+    void pump_data();
+    void flush();
+    void on_write(beast::error_code ec, std::size_t bytes_transferred);
+
+    // Drop a stream that is done or cancelled, pooling its upstream connection if clean
+    void finish_stream(const StreamPtr& s, bool reusable);
+    void connection_error(std::uint32_t error_code);
+    void close();
+    void update_client_deadline();
+
+    // Invoke f with the client stream (TLS or plain TCP)
+    template<class F>
+    void with_client_stream(F&& f) {
+        if (ssl_stream_) {
+            f(*ssl_stream_);
+        } else {
+            f(stream_);
+        }
+    }
+
+    // Invoke f with the stream frames are written to: the socket itself once
+    // the kernel encrypts for the connection
+    template<class F>
+    void with_client_writer(F&& f) {
+        if (ktls_tx_) {
+            f(client_tcp_stream());
+        } else {
+            with_client_stream(std::forward<F>(f));
+        }
+    }
+
+    beast::tcp_stream& client_tcp_stream() {
+        return ssl_stream_ ? ssl_stream_->next_layer() : stream_;
+    }
+
+    // Configured deadline (0 = none)
+    static std::chrono::steady_clock::duration timeout(int seconds) {
+        return std::chrono::seconds(seconds > 0 ? seconds : 0);
+    }
+
+    // Key that ring_hash balancing maps to an upstream
+    std::string_view upstream_hash_key(const Stream& s, const LoadBalancer& balancer) const;
+
+private:
+    beast::tcp_stream stream_;
+    std::unique_ptr<beast::ssl_stream<beast::tcp_stream>> ssl_stream_;
+    bool ktls_tx_ = false;
+    std::shared_ptr<RequestRouter> router_;
+    std::shared_ptr<const ConfigSnapshot> snapshot_;  // refreshed for new streams after a reload
+    AdmissionController::Slot admission_slot_;
+    Http2Config settings_;  // from the snapshot the connection started with
+
+    // Client address, formatted once per connection
+    char client_ip_[64] = {};
+    std::size_t client_ip_size_ = 0;
+
+    beast::flat_buffer read_buffer_;
+    bool preface_received_ = false;
+    bool settings_received_ = false;
+
+    // Output: frames are appended to out_ and written in one go; writing_
+    // holds the buffer of the write in flight
+    std::string out_;
+    std::string writing_;
+    bool write_in_progress_ = false;
+    bool read_paused_ = false;  // until out_ drains below kMaxPendingOutput
+
+    // Flood limits, counted per one-second window
+    std::chrono::steady_clock::time_point flood_window_start_;
+    std::uint32_t control_frames_ = 0;
+    std::uint32_t stream_resets_ = 0;
+
+    HpackDecoder decoder_;
+    HpackEncoder encoder_;
+    std::string header_block_;          // HEADERS + CONTINUATION fragments
+    std::uint32_t continuation_stream_ = 0;  // stream whose header block is incomplete
+    bool header_block_end_stream_ = false;
+
+    std::unordered_map<std::uint32_t, StreamPtr> streams_;
+    std::uint32_t last_stream_id_ = 0;
+
+    // Peer settings and send windows
+    std::size_t peer_max_frame_size_ = 16384;
+    std::int64_t peer_initial_window_ = 65535;
+    std::int64_t conn_send_window_ = 65535;
+
+    // Receive window for the whole connection
+    std::int64_t conn_recv_window_ = 65535;
+
+    bool closing_ = false;      // GOAWAY sent or received; no new streams
+    bool goaway_sent_ = false;  // connection error: the rest of the input is ignored
+    bool closed_ = false;
 };
 
 #endif // HTTP2_HANDLER_H
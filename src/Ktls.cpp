@@ -0,0 +1,302 @@
+#include "Ktls.h"
+#include "Log.h"
+#include <linux/tls.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <cerrno>
+#include <cstring>
+#include <string_view>
+
+std::atomic<bool> Ktls::kernel_supported_{true};
+std::atomic<std::uint64_t> Ktls::offloaded_{0};
+std::atomic<std::uint64_t> Ktls::fallback_{0};
+
+namespace {
+
+// What the handshake leaves behind for enable_tx
+struct HandshakeState {
+    unsigned char server_secret[EVP_MAX_MD_SIZE];  // TLS 1.3 server application traffic secret
+    std::size_t server_secret_length = 0;
+    bool finished_sent = false;       // later records are under the traffic keys
+    std::uint64_t records_after = 0;  // records written since our Finished
+    int offloaded_fd = -1;            // the socket the kernel encrypts for, once offloaded
+};
+
+void destroy(HandshakeState* state) {
+    if (state) {
+        OPENSSL_cleanse(state->server_secret, sizeof(state->server_secret));
+        delete state;
+    }
+}
+
+void free_state(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int index, long argl, void* argp) {
+    (void)parent; (void)ad; (void)index; (void)argl; (void)argp;
+    destroy(static_cast<HandshakeState*>(ptr));
+}
+
+int state_index() {
+    static const int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, &free_state);
+    return index;
+}
+
+HandshakeState* find_state(const SSL* ssl) {
+    return static_cast<HandshakeState*>(SSL_get_ex_data(ssl, state_index()));
+}
+
+HandshakeState* get_state(SSL* ssl) {
+    HandshakeState* state = find_state(ssl);
+    if (!state) {
+        state = new HandshakeState;
+        SSL_set_ex_data(ssl, state_index(), state);
+    }
+    return state;
+}
+
+// Stop watching a connection that stays in userspace
+void drop_state(SSL* ssl) {
+    SSL_set_msg_callback(ssl, nullptr);
+    HandshakeState* state = find_state(ssl);
+    SSL_set_ex_data(ssl, state_index(), nullptr);
+    destroy(state);
+}
+
+bool derive(const char* algorithm, const OSSL_PARAM* params, unsigned char* out, std::size_t length) {
+    EVP_KDF* kdf = EVP_KDF_fetch(nullptr, algorithm, nullptr);
+    EVP_KDF_CTX* ctx = kdf ? EVP_KDF_CTX_new(kdf) : nullptr;
+    bool ok = ctx && EVP_KDF_derive(ctx, out, length, params) == 1;
+    EVP_KDF_CTX_free(ctx);
+    EVP_KDF_free(kdf);
+    return ok;
+}
+
+// TLS 1.3 HKDF-Expand-Label with an empty context (RFC 8446, 7.1)
+bool expand_label(const EVP_MD* md, const unsigned char* secret, std::size_t secret_length,
+                  std::string_view label, unsigned char* out, std::size_t length) {
+    static constexpr std::string_view kPrefix = "tls13 ";
+    unsigned char info[2 + 1 + 255 + 1];
+    std::size_t label_length = kPrefix.size() + label.size();
+    info[0] = static_cast<unsigned char>(length >> 8);
+    info[1] = static_cast<unsigned char>(length);
+    info[2] = static_cast<unsigned char>(label_length);
+    std::memcpy(info + 3, kPrefix.data(), kPrefix.size());
+    std::memcpy(info + 3 + kPrefix.size(), label.data(), label.size());
+    info[3 + label_length] = 0;
+
+    int mode = EVP_KDF_HKDF_MODE_EXPAND_ONLY;
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_int(OSSL_KDF_PARAM_MODE, &mode),
+        OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, const_cast<char*>(EVP_MD_get0_name(md)), 0),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY, const_cast<unsigned char*>(secret), secret_length),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO, info, 4 + label_length),
+        OSSL_PARAM_construct_end()
+    };
+    return derive("HKDF", params, out, length);
+}
+
+// TLS 1.2 key block (RFC 5246, 6.3); AEAD suites have no MAC keys
+bool key_block(SSL* ssl, const EVP_MD* md, unsigned char* out, std::size_t length) {
+    unsigned char master[SSL_MAX_MASTER_KEY_LENGTH];
+    std::size_t master_length = SSL_SESSION_get_master_key(SSL_get_session(ssl), master, sizeof(master));
+    unsigned char server_random[SSL3_RANDOM_SIZE];
+    unsigned char client_random[SSL3_RANDOM_SIZE];
+    SSL_get_server_random(ssl, server_random, sizeof(server_random));
+    SSL_get_client_random(ssl, client_random, sizeof(client_random));
+
+    // The seeds concatenate
+    static char kLabel[] = "key expansion";
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, const_cast<char*>(EVP_MD_get0_name(md)), 0),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SECRET, master, master_length),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SEED, kLabel, sizeof(kLabel) - 1),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SEED, server_random, sizeof(server_random)),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SEED, client_random, sizeof(client_random)),
+        OSSL_PARAM_construct_end()
+    };
+    bool ok = master_length > 0 && derive("TLS1-PRF", params, out, length);
+    OPENSSL_cleanse(master, sizeof(master));
+    return ok;
+}
+
+// AES-GCM crypto_info for the kernel: 4-byte salt (the implicit part of the
+// nonce), 8-byte IV and the sequence number of the next record
+template<class Info>
+bool fill_crypto_info(SSL* ssl, const HandshakeState& state, const EVP_MD* md, int version,
+                      unsigned short cipher_type, Info& info) {
+    constexpr std::size_t kKey = sizeof(info.key);
+    constexpr std::size_t kSalt = sizeof(info.salt);
+    constexpr std::size_t kIv = sizeof(info.iv);
+    std::uint64_t sequence = state.records_after;
+    bool ok = false;
+
+    if (version == TLS1_3_VERSION) {
+        unsigned char iv[kSalt + kIv];
+        ok = state.server_secret_length > 0 &&
+             expand_label(md, state.server_secret, state.server_secret_length, "key", info.key, kKey) &&
+             expand_label(md, state.server_secret, state.server_secret_length, "iv", iv, sizeof(iv));
+        std::memcpy(info.salt, iv, kSalt);
+        std::memcpy(info.iv, iv + kSalt, kIv);
+        info.info.version = TLS_1_3_VERSION;
+    } else {
+        // client key, server key, client IV, server IV
+        unsigned char block[2 * kKey + 2 * kSalt];
+        ok = key_block(ssl, md, block, sizeof(block));
+        std::memcpy(info.key, block + kKey, kKey);
+        std::memcpy(info.salt, block + 2 * kKey + kSalt, kSalt);
+        OPENSSL_cleanse(block, sizeof(block));
+
+        // Our Finished was the first record under these keys
+        sequence++;
+        info.info.version = TLS_1_2_VERSION;
+    }
+    info.info.cipher_type = cipher_type;
+
+    for (std::size_t i = 0; i < sizeof(info.rec_seq); ++i) {
+        info.rec_seq[i] = static_cast<unsigned char>(sequence >> (8 * (sizeof(info.rec_seq) - 1 - i)));
+    }
+    // TLS 1.2 sends the rest of the nonce explicitly; any unique value will
+    // do and the kernel increments it with the sequence number
+    if (version != TLS1_3_VERSION) {
+        std::memcpy(info.iv, info.rec_seq, kIv);
+    }
+    return ok;
+}
+
+template<class Info>
+bool install(int fd, Info& info) {
+    bool ok = setsockopt(fd, SOL_TLS, TLS_TX, &info, sizeof(info)) == 0;
+    OPENSSL_cleanse(&info, sizeof(info));
+    return ok;
+}
+
+} // namespace
+
+void Ktls::configure(SSL_CTX* ctx) {
+    // A renegotiation would change the keys behind the kernel's back
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION);
+    SSL_CTX_set_keylog_callback(ctx, &Ktls::on_keylog);
+    SSL_CTX_set_msg_callback(ctx, &Ktls::on_message);
+}
+
+bool Ktls::enable_tx(SSL* ssl, int fd) {
+    HandshakeState* state = find_state(ssl);
+    auto fall_back = [ssl] {
+        drop_state(ssl);
+        fallback_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    };
+
+    int version = SSL_version(ssl);
+    int cipher = SSL_CIPHER_get_cipher_nid(SSL_get_current_cipher(ssl));
+    const EVP_MD* md = SSL_CIPHER_get_handshake_digest(SSL_get_current_cipher(ssl));
+    if (!kernel_supported_.load(std::memory_order_relaxed) || !state || !state->finished_sent || !md ||
+        (version != TLS1_2_VERSION && version != TLS1_3_VERSION) ||
+        (cipher != NID_aes_128_gcm && cipher != NID_aes_256_gcm)) {
+        return fall_back();
+    }
+
+    if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0) {
+        // Without the module every connection would fail the same way
+        if (errno == ENOENT && kernel_supported_.exchange(false)) {
+            Log::warn() << "Kernel TLS unavailable (no \"tls\" TCP ULP), HTTPS is encrypted in userspace";
+        }
+        return fall_back();
+    }
+
+    bool ok = false;
+    if (cipher == NID_aes_128_gcm) {
+        tls12_crypto_info_aes_gcm_128 info{};
+        ok = fill_crypto_info(ssl, *state, md, version, TLS_CIPHER_AES_GCM_128, info) && install(fd, info);
+    } else {
+        tls12_crypto_info_aes_gcm_256 info{};
+        ok = fill_crypto_info(ssl, *state, md, version, TLS_CIPHER_AES_GCM_256, info) && install(fd, info);
+    }
+    OPENSSL_cleanse(state->server_secret, sizeof(state->server_secret));
+
+    // A socket with the ULP but no TX keys still passes bytes through as is
+    if (!ok) {
+        return fall_back();
+    }
+
+    // The state stays so on_message can catch OpenSSL writing again
+    state->offloaded_fd = fd;
+    offloaded_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void Ktls::skip(SSL* ssl) {
+    drop_state(ssl);
+}
+
+KtlsStats Ktls::stats() {
+    KtlsStats stats;
+    stats.offloaded = offloaded_.load(std::memory_order_relaxed);
+    stats.fallback = fallback_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void Ktls::on_keylog(const SSL* ssl, const char* line) {
+    // "SERVER_TRAFFIC_SECRET_0 <client random> <secret>", in hex
+    static constexpr std::string_view kLabel = "SERVER_TRAFFIC_SECRET_0 ";
+    std::string_view entry(line);
+    if (entry.substr(0, kLabel.size()) != kLabel) {
+        return;
+    }
+    std::string_view hex = entry.substr(entry.rfind(' ') + 1);
+    if (hex.size() % 2 != 0 || hex.size() / 2 > EVP_MAX_MD_SIZE) {
+        return;
+    }
+
+    HandshakeState* state = get_state(const_cast<SSL*>(ssl));
+    for (std::size_t i = 0; i < hex.size() / 2; ++i) {
+        int high = OPENSSL_hexchar2int(static_cast<unsigned char>(hex[2 * i]));
+        int low = OPENSSL_hexchar2int(static_cast<unsigned char>(hex[2 * i + 1]));
+        if (high < 0 || low < 0) {
+            return;
+        }
+        state->server_secret[i] = static_cast<unsigned char>(high << 4 | low);
+    }
+    state->server_secret_length = hex.size() / 2;
+}
+
+void Ktls::on_message(int write_p, int version, int content_type, const void* buf, size_t length,
+                      SSL* ssl, void* arg) {
+    (void)version;
+    (void)arg;
+    const auto* bytes = static_cast<const unsigned char*>(buf);
+    HandshakeState* offloaded = find_state(ssl);
+    if (offloaded && offloaded->offloaded_fd >= 0) {
+        // Anything OpenSSL sends now (an alert, close_notify) would be
+        // sealed with keys the kernel has moved past, and a KeyUpdate that
+        // asks for ours can't be answered: the connection ends instead.
+        // shutdown() keeps the record off the wire; the handler sees the
+        // socket fail and closes it.
+        bool update_requested = !write_p && content_type == SSL3_RT_HANDSHAKE && length >= 5 &&
+                                bytes[0] == SSL3_MT_KEY_UPDATE && bytes[4] == SSL_KEY_UPDATE_REQUESTED;
+        if ((write_p && content_type == SSL3_RT_HEADER) || update_requested) {
+            Log::debug() << "Kernel TLS connection ended: "
+                         << (write_p ? "OpenSSL wrote a record" : "client requested a key update");
+            ::shutdown(offloaded->offloaded_fd, SHUT_RDWR);
+            offloaded->offloaded_fd = -1;
+        }
+        return;
+    }
+    if (!write_p) {
+        return;
+    }
+
+    // Our Finished is reported after the record carrying it, so every record
+    // header seen from then on is under the traffic keys
+    if (content_type == SSL3_RT_HANDSHAKE && length > 0 &&
+        bytes[0] == SSL3_MT_FINISHED) {
+        get_state(ssl)->finished_sent = true;
+    } else if (content_type == SSL3_RT_HEADER) {
+        HandshakeState* state = find_state(ssl);
+        if (state && state->finished_sent) {
+            state->records_after++;
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef KTLS_H
+#define KTLS_H
+
+#include <openssl/ssl.h>
+#include <atomic>
+#include <cstdint>
+
+struct KtlsStats {
+    std::uint64_t offloaded = 0;  // connections whose sends the kernel encrypts
+    std::uint64_t fallback = 0;   // stayed in userspace: kernel, protocol or cipher unsupported
+};
+
+// Kernel TLS for what HTTPS connections send (Linux).
+//
+// asio runs OpenSSL over a memory BIO pair, so OpenSSL never owns the socket
+// and can't move it to the kernel itself (SSL_OP_ENABLE_KTLS only acts on
+// socket BIOs). Instead the handshake records the server's traffic secret and
+// how many records went out under it; once it completes, the write key and
+// record sequence number are installed on the socket with TLS_TX. From then on
+// the connection writes plaintext straight to the TCP socket and the kernel
+// frames and encrypts it, so splice() and sendfile() can carry TLS payloads
+// too. Reading stays with OpenSSL.
+//
+// AES-GCM suites under TLS 1.2 and 1.3 are offloaded; any other suite, or a
+// kernel without the "tls" TCP ULP, keeps encrypting in userspace. Once the
+// kernel has the key OpenSSL must never write again, so renegotiation is
+// refused, and a TLS 1.3 key update that asks for ours (or any other record
+// OpenSSL would send) shuts the socket down and ends the connection.
+class Ktls {
+public:
+    // Prepare a context's handshakes for offloading
+    static void configure(SSL_CTX* ctx);
+
+    // Hand encryption of everything sent on fd to the kernel. Call when the
+    // handshake has completed, before anything else is written. Returns false,
+    // leaving the connection to OpenSSL, when it can't be offloaded.
+    static bool enable_tx(SSL* ssl, int fd);
+
+    // For a completed handshake that won't be offloaded: forget the recorded
+    // secret and stop watching the connection's records
+    static void skip(SSL* ssl);
+
+    static KtlsStats stats();
+
+private:
+    // OpenSSL callbacks
+    static void on_keylog(const SSL* ssl, const char* line);
+    static void on_message(int write_p, int version, int content_type, const void* buf, size_t length,
+                           SSL* ssl, void* arg);
+
+private:
+    static std::atomic<bool> kernel_supported_;  // cleared when the "tls" ULP is missing
+    static std::atomic<std::uint64_t> offloaded_;
+    static std::atomic<std::uint64_t> fallback_;
+};
+
+#endif // KTLS_H
@@ -1,11 +1,285 @@
 #include "LoadBalancer.h"
-#include <iostream>
+#include "Log.h"
+#include <algorithm>
+#include <numeric>
 
-LoadBalancer::LoadBalancer() {
-    // Constructor implementation
+namespace {
+
+// Bounds on the precomputed round-robin cycle and the hash ring
+constexpr std::uint32_t kMaxWeight = 1000;
+constexpr std::size_t kVirtualNodesPerWeight = 40;
+constexpr std::size_t kMaxRingSize = 40000;
+
+// Weight of the latency average given to each new sample (1/8)
+constexpr unsigned kEwmaShift = 3;
+
+std::uint64_t mix(std::uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+std::uint64_t hash_key(std::string_view key, std::uint64_t seed = 0) {
+    std::uint64_t h = 14695981039346656037ull ^ seed;
+    for (char c : key) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 1099511628211ull;
+    }
+    return mix(h);
+}
+
+// Per-thread xorshift generator for p2c
+std::uint64_t next_random() {
+    thread_local std::uint64_t state =
+        mix(reinterpret_cast<std::uintptr_t>(&state) ^
+            static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count()));
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+LoadBalancer::Policy parse_policy(const std::string& name) {
+    if (name == "least_conn") {
+        return LoadBalancer::Policy::least_conn;
+    }
+    if (name == "p2c") {
+        return LoadBalancer::Policy::p2c;
+    }
+    if (name == "ring_hash") {
+        return LoadBalancer::Policy::ring_hash;
+    }
+    return LoadBalancer::Policy::round_robin;
+}
+
+} // namespace
+
+LoadBalancer::Lease::Lease(Upstream* upstream)
+    : upstream_(upstream), started_(std::chrono::steady_clock::now()) {
+    upstream_->in_flight.fetch_add(1, std::memory_order_relaxed);
+}
+
+LoadBalancer::Lease& LoadBalancer::Lease::operator=(Lease&& other) noexcept {
+    if (this != &other) {
+        release();
+        upstream_ = std::exchange(other.upstream_, nullptr);
+        started_ = other.started_;
+    }
+    return *this;
+}
+
+void LoadBalancer::Lease::record_response() {
+    if (!upstream_) {
+        return;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - started_).count();
+    std::uint64_t sample = static_cast<std::uint64_t>(std::max<std::int64_t>(elapsed, 1));
+
+    // Racing updates may drop a sample, never corrupt the average
+    auto& ewma = upstream_->latency_ewma_us;
+    std::uint64_t current = ewma.load(std::memory_order_relaxed);
+    std::uint64_t updated;
+    do {
+        updated = current == 0 ? sample
+                               : current - (current >> kEwmaShift) + (sample >> kEwmaShift);
+    } while (!ewma.compare_exchange_weak(current, updated, std::memory_order_relaxed));
+}
+
+void LoadBalancer::Lease::release() {
+    if (upstream_) {
+        upstream_->in_flight.fetch_sub(1, std::memory_order_relaxed);
+        upstream_ = nullptr;
+    }
+}
+
+LoadBalancer::LoadBalancer(const SiteConfig& site, BackendResolver& resolver)
+    : policy_(parse_policy(site.load_balancing)) {
+    std::vector<UpstreamConfig> configured = site.upstreams;
+    if (configured.empty() && !site.backend.empty()) {
+        configured.push_back(UpstreamConfig{site.backend, 1});
+    }
+
+    upstreams_ = std::make_unique<Upstream[]>(configured.size());
+    for (const auto& upstream : configured) {
+        auto target = resolver.add(upstream.address);
+        if (!target) {
+            Log::warn() << "Invalid backend address for " << site.domain << ": " << upstream.address;
+            continue;
+        }
+        Upstream& slot = upstreams_[count_++];
+        slot.target = std::move(target);
+        slot.weight = static_cast<std::uint32_t>(std::clamp(upstream.weight, 1, static_cast<int>(kMaxWeight)));
+    }
+
+    constexpr std::string_view kHeaderPrefix = "header:";
+    if (std::string_view(site.hash_key).substr(0, kHeaderPrefix.size()) == kHeaderPrefix) {
+        hash_header_ = site.hash_key.substr(kHeaderPrefix.size());
+    }
+
+    if (policy_ == Policy::round_robin) {
+        build_schedule();
+    } else if (policy_ == Policy::ring_hash) {
+        build_ring();
+    }
+}
+
+LoadBalancer::Lease LoadBalancer::select(std::string_view hash_key) {
+    if (count_ == 0) {
+        return Lease();
+    }
+    if (count_ == 1) {
+        return Lease(&upstreams_[0]);  // nowhere else to go, even when unhealthy
+    }
+
+    std::size_t chosen = 0;
+    switch (policy_) {
+        case Policy::round_robin:
+            chosen = select_round_robin();
+            break;
+        case Policy::least_conn:
+            chosen = select_least_conn();
+            break;
+        case Policy::p2c:
+            chosen = select_p2c();
+            break;
+        case Policy::ring_hash:
+            chosen = select_ring_hash(hash_key);
+            break;
+    }
+    return Lease(&upstreams_[chosen]);
+}
+
+bool LoadBalancer::available(std::size_t i) const {
+    return upstreams_[i].target->health().available();
+}
+
+std::size_t LoadBalancer::select_round_robin() {
+    std::uint64_t n = next_.fetch_add(1, std::memory_order_relaxed);
+    std::size_t chosen = schedule_[n % schedule_.size()];
+    if (available(chosen)) {
+        return chosen;
+    }
+
+    // Continue along the cycle to the next upstream still in rotation
+    for (std::size_t step = 1; step < schedule_.size(); ++step) {
+        std::size_t i = schedule_[(n + step) % schedule_.size()];
+        if (available(i)) {
+            return i;
+        }
+    }
+    return chosen;
+}
+
+std::size_t LoadBalancer::select_least_conn() {
+    // Start the scan at a rotating offset so ties are spread evenly
+    std::size_t start = next_.fetch_add(1, std::memory_order_relaxed) % count_;
+    std::size_t best = count_;
+    std::uint64_t best_load = 0;
+    for (std::size_t step = 0; step < count_; ++step) {
+        std::size_t i = (start + step) % count_;
+        if (!available(i)) {
+            continue;
+        }
+        std::uint64_t load = upstreams_[i].in_flight.load(std::memory_order_relaxed);
+        // load / weight < best_load / best_weight, without division
+        if (best == count_ || load * upstreams_[best].weight < best_load * upstreams_[i].weight) {
+            best = i;
+            best_load = load;
+        }
+    }
+    return best == count_ ? start : best;
+}
+
+std::size_t LoadBalancer::select_p2c() {
+    std::uint64_t r = next_random();
+    std::size_t a = r % count_;
+    std::size_t b = (a + 1 + (r >> 32) % (count_ - 1)) % count_;
+
+    // Expected wait: (in flight + 1) x average latency, per unit of weight.
+    // Upstreams without a latency sample yet look as fast as the best one.
+    auto cost = [this](std::size_t i) {
+        const Upstream& u = upstreams_[i];
+        double latency = static_cast<double>(std::max<std::uint64_t>(
+            u.latency_ewma_us.load(std::memory_order_relaxed), 1));
+        return (u.in_flight.load(std::memory_order_relaxed) + 1) * latency / u.weight;
+    };
+    bool a_available = available(a);
+    bool b_available = available(b);
+    if (a_available && b_available) {
+        return cost(a) <= cost(b) ? a : b;
+    }
+    if (a_available || b_available) {
+        return a_available ? a : b;
+    }
+    return select_least_conn();
 }
 
-void LoadBalancer::start() {
-    // Start the load balancer
-    std::cout << "Load balancer started." << std::endl;
+std::size_t LoadBalancer::select_ring_hash(std::string_view key) const {
+    std::uint64_t h = hash_key(key);
+    std::size_t first = std::lower_bound(ring_.begin(), ring_.end(), std::make_pair(h, std::uint32_t{0})) - ring_.begin();
+
+    // Keys of an upstream out of rotation move to the next point on the
+    // ring, and only those keys
+    for (std::size_t step = 0; step < ring_.size(); ++step) {
+        std::size_t i = ring_[(first + step) % ring_.size()].second;
+        if (available(i)) {
+            return i;
+        }
+    }
+    return ring_[first % ring_.size()].second;
+}
+
+void LoadBalancer::build_schedule() {
+    // Reduce the weights by their common divisor to keep the cycle short
+    std::uint32_t divisor = 0;
+    for (std::size_t i = 0; i < count_; ++i) {
+        divisor = std::gcd(divisor, upstreams_[i].weight);
+    }
+    std::uint64_t total = 0;
+    for (std::size_t i = 0; i < count_; ++i) {
+        total += upstreams_[i].weight / divisor;
+    }
+
+    // Nginx's smooth weighted round-robin: each step every upstream gains its
+    // weight, the largest current weight wins and pays back the total
+    std::vector<std::int64_t> current(count_, 0);
+    schedule_.reserve(total);
+    for (std::uint64_t step = 0; step < total; ++step) {
+        std::size_t best = 0;
+        for (std::size_t i = 0; i < count_; ++i) {
+            current[i] += upstreams_[i].weight / divisor;
+            if (current[i] > current[best]) {
+                best = i;
+            }
+        }
+        current[best] -= static_cast<std::int64_t>(total);
+        schedule_.push_back(static_cast<std::uint32_t>(best));
+    }
+    if (schedule_.empty()) {
+        schedule_.push_back(0);
+    }
+}
+
+void LoadBalancer::build_ring() {
+    std::uint64_t total_weight = 0;
+    for (std::size_t i = 0; i < count_; ++i) {
+        total_weight += upstreams_[i].weight;
+    }
+    std::size_t per_weight = std::max<std::size_t>(
+        1, std::min(kVirtualNodesPerWeight, kMaxRingSize / std::max<std::uint64_t>(total_weight, 1)));
+
+    // Points depend only on the upstream's address, so adding or removing
+    // one upstream moves only the keys that hash next to its points
+    for (std::size_t i = 0; i < count_; ++i) {
+        const std::string& name = upstreams_[i].target->name();
+        std::size_t points = per_weight * upstreams_[i].weight;
+        for (std::size_t point = 0; point < points; ++point) {
+            ring_.emplace_back(hash_key(name, point * 0x9e3779b97f4a7c15ull), static_cast<std::uint32_t>(i));
+        }
+    }
+    std::sort(ring_.begin(), ring_.end());
 }
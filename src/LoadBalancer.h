@@ -1,10 +1,112 @@
 #ifndef LOAD_BALANCER_H
 #define LOAD_BALANCER_H
 
+#include "BackendResolver.h"
+#include "ConfigManager.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Picks the upstream for each request to a site with one or more backends.
+// A balancer is built with the routing table and lives as long as its
+// snapshot. All per-upstream state is atomic and selection never takes a
+// lock, so worker threads don't serialize on it. Upstreams failing health
+// checks or ejected as outliers are skipped; if none is left in rotation the
+// policy's first choice is used anyway.
 class LoadBalancer {
 public:
-    LoadBalancer();
-    void start();
+    enum class Policy {
+        round_robin,  // smooth weighted round-robin
+        least_conn,   // fewest in-flight requests per unit of weight
+        p2c,          // better of two random picks by in-flight count x latency
+        ring_hash     // consistent hashing on a header or the client address
+    };
+
+    // Kept on its own cache line; every worker updates the counters
+    struct alignas(64) Upstream {
+        std::shared_ptr<BackendResolver::Target> target;
+        std::uint32_t weight = 1;
+        std::atomic<std::uint32_t> in_flight{0};
+        std::atomic<std::uint64_t> latency_ewma_us{0};  // 0 until the first response
+    };
+
+    // The upstream chosen for one exchange, counted as in flight until released
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(Lease&& other) noexcept
+            : upstream_(std::exchange(other.upstream_, nullptr)), started_(other.started_) {}
+        Lease& operator=(Lease&& other) noexcept;
+        ~Lease() { release(); }
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        explicit operator bool() const { return upstream_ != nullptr; }
+        const std::shared_ptr<BackendResolver::Target>& target() const { return upstream_->target; }
+
+        // Feed the time from selection to the backend's response header into
+        // the upstream's latency average (used by p2c)
+        void record_response();
+
+        void release();
+
+    private:
+        friend class LoadBalancer;
+        explicit Lease(Upstream* upstream);
+
+        Upstream* upstream_ = nullptr;
+        std::chrono::steady_clock::time_point started_;
+    };
+
+    // Build from site.upstreams (or site.backend when no list is given),
+    // registering each address with resolver; malformed ones are skipped
+    LoadBalancer(const SiteConfig& site, BackendResolver& resolver);
+
+    LoadBalancer(const LoadBalancer&) = delete;
+    LoadBalancer& operator=(const LoadBalancer&) = delete;
+
+    bool empty() const { return count_ == 0; }
+    std::size_t size() const { return count_; }
+    Policy policy() const { return policy_; }
+
+    // ring_hash: request header whose value is hashed, empty for the client address
+    const std::string& hash_header() const { return hash_header_; }
+
+    // Choose an upstream; hash_key is only used by ring_hash.
+    // Returns an empty Lease if the site has no usable upstream.
+    Lease select(std::string_view hash_key = {});
+
+    const Upstream& upstream(std::size_t i) const { return upstreams_[i]; }
+
+private:
+    bool available(std::size_t i) const;
+    std::size_t select_round_robin();
+    std::size_t select_least_conn();
+    std::size_t select_p2c();
+    std::size_t select_ring_hash(std::string_view key) const;
+
+    void build_schedule();
+    void build_ring();
+
+private:
+    std::unique_ptr<Upstream[]> upstreams_;
+    std::size_t count_ = 0;
+    Policy policy_ = Policy::round_robin;
+    std::string hash_header_;
+
+    // round_robin: one full cycle of smooth weighted round-robin, computed
+    // up front so that picking is a single atomic increment
+    std::vector<std::uint32_t> schedule_;
+    std::atomic<std::uint64_t> next_{0};
+
+    // ring_hash: virtual nodes sorted by hash
+    std::vector<std::pair<std::uint64_t, std::uint32_t>> ring_;
 };
 
 #endif // LOAD_BALANCER_H
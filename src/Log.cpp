@@ -0,0 +1,553 @@
+#include "Log.h"
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace {
+
+// Diagnostic rings per thread; a burst beyond this is dropped and counted
+constexpr std::size_t kDiagnosticRingSize = 64 * 1024;
+
+// iovecs per writev() call
+constexpr std::size_t kMaxIovecs = IOV_MAX;
+
+Log::Level level_from_env() {
+    const char* value = std::getenv("PRISTINE_LOG_LEVEL");
+    std::string_view level = value ? value : "";
+    if (level == "debug") {
+        return Log::Level::debug;
+    }
+    if (level == "warn" || level == "warning") {
+        return Log::Level::warn;
+    }
+    if (level == "error") {
+        return Log::Level::error;
+    }
+    if (level == "off" || level == "none") {
+        return Log::Level::off;
+    }
+    return Log::Level::info;
+}
+
+// Write all of iov, continuing after short writes
+bool write_all(int fd, iovec* iov, std::size_t count) {
+    while (count > 0) {
+        ssize_t n = ::writev(fd, iov, static_cast<int>(count));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        auto written = static_cast<std::size_t>(n);
+        while (count > 0 && written >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+// Timestamps formatted once per second per thread
+struct TimeCache {
+    std::time_t second = -1;
+    char iso[24] = {};       // 2026-01-31T12:00:00
+    char combined[32] = {};  // 31/Jan/2026:12:00:00 +0000
+};
+
+thread_local TimeCache t_time;
+
+const TimeCache& current_time(std::chrono::system_clock::time_point now) {
+    std::time_t second = std::chrono::system_clock::to_time_t(now);
+    if (second != t_time.second) {
+        std::tm tm{};
+        gmtime_r(&second, &tm);
+        std::strftime(t_time.iso, sizeof(t_time.iso), "%Y-%m-%dT%H:%M:%S", &tm);
+        std::strftime(t_time.combined, sizeof(t_time.combined), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+        t_time.second = second;
+    }
+    return t_time;
+}
+
+void append_number(std::string& out, std::uint64_t value) {
+    char digits[20];
+    auto result = std::to_chars(digits, digits + sizeof(digits), value);
+    out.append(digits, result.ptr);
+}
+
+const char kHex[] = "0123456789abcdef";
+
+void append_json_string(std::string& out, std::string_view value) {
+    out.push_back('"');
+    for (char c : value) {
+        auto byte = static_cast<unsigned char>(c);
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+            out.push_back(c);
+        } else if (byte < 0x20) {
+            out.append("\\u00");
+            out.push_back(kHex[byte >> 4]);
+            out.push_back(kHex[byte & 0xf]);
+        } else {
+            out.push_back(c);
+        }
+    }
+    out.push_back('"');
+}
+
+// Quoted field of the combined format ("-" when empty); quotes and
+// non-printable bytes are escaped so a client can't forge a line
+void append_quoted(std::string& out, std::string_view value) {
+    out.push_back('"');
+    if (value.empty()) {
+        out.push_back('-');
+    }
+    for (char c : value) {
+        auto byte = static_cast<unsigned char>(c);
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+            out.push_back(c);
+        } else if (byte < 0x20 || byte == 0x7f) {
+            out.append("\\x");
+            out.push_back(kHex[byte >> 4]);
+            out.push_back(kHex[byte & 0xf]);
+        } else {
+            out.push_back(c);
+        }
+    }
+    out.push_back('"');
+}
+
+} // namespace
+
+std::atomic<Log::Level> Log::level_{level_from_env()};
+AccessLogConfig Log::config_;
+std::atomic<bool> Log::access_enabled_{false};
+std::atomic<bool> Log::running_{false};
+std::uint64_t Log::sample_threshold_ = UINT64_MAX;
+
+std::mutex Log::threads_mutex_;
+std::vector<std::unique_ptr<Log::ThreadLog>> Log::threads_;
+
+std::thread Log::writer_;
+std::mutex Log::wake_mutex_;
+std::condition_variable Log::wake_cv_;
+std::atomic<bool> Log::wake_requested_{false};
+std::atomic<bool> Log::reopen_requested_{false};
+bool Log::stopping_ = false;
+
+int Log::access_fd_ = -1;
+std::uint64_t Log::access_file_size_ = 0;
+
+Log::Line::Line(Level level) : level_(level) {
+    if (enabled(level)) {
+        stream_.emplace();
+    }
+}
+
+Log::Line::~Line() {
+    if (stream_) {
+        submit(level_, stream_->view());
+    }
+}
+
+Log::Ring::Ring(std::size_t capacity) {
+    capacity = std::bit_ceil(std::max<std::size_t>(capacity, 4096));
+    buffer_ = std::make_unique<char[]>(capacity);
+    mask_ = capacity - 1;
+}
+
+bool Log::Ring::push(std::string_view line) {
+    std::size_t head = head_.load(std::memory_order_relaxed);
+    if (capacity() - (head - cached_tail_) < line.size()) {
+        cached_tail_ = tail_.load(std::memory_order_acquire);
+        if (capacity() - (head - cached_tail_) < line.size()) {
+            return false;
+        }
+    }
+
+    std::size_t offset = head & mask_;
+    std::size_t first = std::min(line.size(), capacity() - offset);
+    std::memcpy(buffer_.get() + offset, line.data(), first);
+    std::memcpy(buffer_.get(), line.data() + first, line.size() - first);
+    head_.store(head + line.size(), std::memory_order_release);
+    return true;
+}
+
+std::size_t Log::Ring::used() const {
+    return head_.load(std::memory_order_relaxed) - cached_tail_;
+}
+
+std::size_t Log::Ring::readable(const char* spans[2], std::size_t sizes[2]) const {
+    std::size_t tail = tail_.load(std::memory_order_relaxed);
+    std::size_t size = head_.load(std::memory_order_acquire) - tail;
+    std::size_t offset = tail & mask_;
+    sizes[0] = std::min(size, capacity() - offset);
+    sizes[1] = size - sizes[0];
+    spans[0] = buffer_.get() + offset;
+    spans[1] = buffer_.get();
+    return size;
+}
+
+void Log::Ring::consume(std::size_t bytes) {
+    tail_.store(tail_.load(std::memory_order_relaxed) + bytes, std::memory_order_release);
+}
+
+Log::ThreadLog::ThreadLog()
+    : out(new Ring(kDiagnosticRingSize)), err(new Ring(kDiagnosticRingSize)) {
+    // Any distinct non-zero seed will do for sampling
+    sample_state = reinterpret_cast<std::uintptr_t>(this) | 1;
+}
+
+Log::ThreadLog::~ThreadLog() {
+    delete out.load(std::memory_order_relaxed);
+    delete err.load(std::memory_order_relaxed);
+    delete access.load(std::memory_order_relaxed);
+}
+
+Log::ThreadLog& Log::local() {
+    thread_local ThreadLog* log = nullptr;
+    if (!log) {
+        auto block = std::make_unique<ThreadLog>();
+        log = block.get();
+        std::lock_guard<std::mutex> lock(threads_mutex_);
+        threads_.push_back(std::move(block));
+    }
+    return *log;
+}
+
+void Log::submit(Level level, std::string_view text) {
+    thread_local std::string line;
+    line.assign(text);
+    line.push_back('\n');
+
+    // No writer yet (or any more): straight to the terminal
+    if (!running_.load(std::memory_order_acquire)) {
+        std::FILE* file = level >= Level::warn ? stderr : stdout;
+        std::fwrite(line.data(), 1, line.size(), file);
+        std::fflush(file);
+        return;
+    }
+
+    auto& log = local();
+    Ring* ring = (level >= Level::warn ? log.err : log.out).load(std::memory_order_relaxed);
+    if (!ring->push(line)) {
+        add(log.diagnostics_dropped, 1);
+        wake_writer();
+        return;
+    }
+    if (ring->used() > ring->capacity() / 2) {
+        wake_writer();
+    }
+}
+
+void Log::wake_writer() {
+    // Only the first producer to ask takes the lock
+    if (wake_requested_.exchange(true, std::memory_order_relaxed)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    wake_cv_.notify_one();
+}
+
+bool Log::start(const AccessLogConfig& config) {
+    if (running_.load(std::memory_order_relaxed)) {
+        return true;
+    }
+    config_ = config;
+
+    if (config_.enabled) {
+        sample_threshold_ = config_.sample_rate >= 1.0
+            ? UINT64_MAX
+            : static_cast<std::uint64_t>(config_.sample_rate * 18446744073709551616.0);
+        if (!open_access_file()) {
+            return false;
+        }
+        access_enabled_.store(true, std::memory_order_relaxed);
+    }
+
+    stopping_ = false;
+    writer_ = std::thread(&Log::run_writer);
+    running_.store(true, std::memory_order_release);
+    return true;
+}
+
+void Log::stop() {
+    if (!running_.load(std::memory_order_relaxed)) {
+        return;
+    }
+    access_enabled_.store(false, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        stopping_ = true;
+    }
+    wake_cv_.notify_one();
+    writer_.join();
+    running_.store(false, std::memory_order_release);
+
+    if (access_fd_ >= 0) {
+        ::close(access_fd_);
+        access_fd_ = -1;
+    }
+}
+
+void Log::reopen() {
+    reopen_requested_.store(true, std::memory_order_relaxed);
+    wake_writer();
+}
+
+void Log::access(const AccessRecord& record) {
+    auto& log = local();
+
+    // Errors are always kept; the rest by chance, at sample_rate
+    if (sample_threshold_ != UINT64_MAX && record.status < 500) {
+        std::uint64_t x = log.sample_state;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        log.sample_state = x;
+        if (x >= sample_threshold_) {
+            add(log.sampled_out, 1);
+            return;
+        }
+    }
+
+    Ring* ring = log.access.load(std::memory_order_relaxed);
+    if (!ring) {
+        ring = new Ring(config_.buffer_size);
+        log.access.store(ring, std::memory_order_release);
+    }
+
+    thread_local std::string line;
+    line.clear();
+    if (config_.format == "combined") {
+        format_combined(line, record);
+    } else {
+        format_json(line, record);
+    }
+
+    if (!ring->push(line)) {
+        add(log.dropped, 1);
+        wake_writer();
+        return;
+    }
+    add(log.logged, 1);
+    if (ring->used() > ring->capacity() / 2) {
+        wake_writer();
+    }
+}
+
+AccessLogStats Log::access_stats() {
+    AccessLogStats stats;
+    std::lock_guard<std::mutex> lock(threads_mutex_);
+    for (const auto& log : threads_) {
+        stats.logged += log->logged.load(std::memory_order_relaxed);
+        stats.dropped += log->dropped.load(std::memory_order_relaxed);
+        stats.sampled_out += log->sampled_out.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+void Log::format_json(std::string& out, const AccessRecord& record) {
+    auto now = std::chrono::system_clock::now();
+    const auto& time = current_time(now);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() % 1000;
+    char fraction[6] = {'.', static_cast<char>('0' + ms / 100), static_cast<char>('0' + ms / 10 % 10),
+                        static_cast<char>('0' + ms % 10), 'Z', '"'};
+
+    out.append("{\"time\":\"").append(time.iso).append(fraction, sizeof(fraction));
+    out.append(",\"client\":");
+    append_json_string(out, record.client_ip);
+    out.append(",\"host\":");
+    append_json_string(out, record.host);
+    out.append(",\"method\":");
+    append_json_string(out, record.method);
+    out.append(",\"target\":");
+    append_json_string(out, record.target);
+    out.append(",\"protocol\":");
+    append_json_string(out, record.protocol);
+    out.append(",\"status\":");
+    append_number(out, record.status);
+    out.append(",\"bytes_received\":");
+    append_number(out, record.bytes_received);
+    out.append(",\"bytes_sent\":");
+    append_number(out, record.bytes_sent);
+    out.append(",\"upstream\":");
+    append_json_string(out, record.upstream);
+    out.append(",\"duration_us\":");
+    append_number(out, static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(record.elapsed).count()));
+    out.append(",\"referer\":");
+    append_json_string(out, record.referer);
+    out.append(",\"user_agent\":");
+    append_json_string(out, record.user_agent);
+    out.append("}\n");
+}
+
+void Log::format_combined(std::string& out, const AccessRecord& record) {
+    const auto& time = current_time(std::chrono::system_clock::now());
+
+    // client - - [time] "request" status bytes "referer" "user agent"
+    out.append(record.client_ip.empty() ? std::string_view("-") : record.client_ip);
+    out.append(" - - [").append(time.combined).append("] ");
+    thread_local std::string request;
+    request.clear();
+    request.append(record.method).append(" ").append(record.target).append(" ").append(record.protocol);
+    append_quoted(out, request);
+    out.push_back(' ');
+    append_number(out, record.status);
+    out.push_back(' ');
+    append_number(out, record.bytes_sent);
+    out.push_back(' ');
+    append_quoted(out, record.referer);
+    out.push_back(' ');
+    append_quoted(out, record.user_agent);
+
+    // followed by the host, the upstream and the duration in seconds
+    out.push_back(' ');
+    append_quoted(out, record.host);
+    out.push_back(' ');
+    append_quoted(out, record.upstream);
+    auto us = static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(record.elapsed).count());
+    char duration[32];
+    int length = std::snprintf(duration, sizeof(duration), " %llu.%06llu\n",
+                               static_cast<unsigned long long>(us / 1000000),
+                               static_cast<unsigned long long>(us % 1000000));
+    out.append(duration, static_cast<std::size_t>(length));
+}
+
+void Log::run_writer() {
+    auto interval = std::chrono::milliseconds(std::max(config_.flush_interval_ms, 1));
+    std::vector<ThreadLog*> threads;
+    for (;;) {
+        bool stopping;
+        {
+            std::unique_lock<std::mutex> lock(wake_mutex_);
+            wake_cv_.wait_for(lock, interval, [] {
+                return stopping_ || wake_requested_.load(std::memory_order_relaxed);
+            });
+            wake_requested_.store(false, std::memory_order_relaxed);
+            stopping = stopping_;
+        }
+
+        threads.clear();
+        {
+            std::lock_guard<std::mutex> lock(threads_mutex_);
+            for (const auto& log : threads_) {
+                threads.push_back(log.get());
+            }
+        }
+
+        if (reopen_requested_.exchange(false, std::memory_order_relaxed) && access_fd_ >= 0) {
+            ::close(access_fd_);
+            open_access_file();
+        }
+
+        drain(STDOUT_FILENO, &ThreadLog::out, threads);
+        drain(STDERR_FILENO, &ThreadLog::err, threads);
+        access_file_size_ += drain(access_fd_, &ThreadLog::access, threads);
+        if (access_fd_ >= 0 && config_.max_size_mb > 0 &&
+            access_file_size_ >= static_cast<std::uint64_t>(config_.max_size_mb) * 1024 * 1024) {
+            rotate_access_file();
+        }
+
+        if (stopping) {
+            return;
+        }
+    }
+}
+
+std::size_t Log::drain(int fd, std::atomic<Ring*> ThreadLog::*member, const std::vector<ThreadLog*>& threads) {
+    thread_local std::vector<iovec> iov;
+    thread_local std::vector<std::pair<Ring*, std::size_t>> taken;
+    std::size_t total = 0;
+
+    auto flush = [&] {
+        // A file that can't be written loses the batch rather than blocking producers
+        if (fd >= 0 && !iov.empty()) {
+            write_all(fd, iov.data(), iov.size());
+        }
+        for (auto& [ring, bytes] : taken) {
+            ring->consume(bytes);
+            total += bytes;
+        }
+        iov.clear();
+        taken.clear();
+    };
+
+    for (auto* log : threads) {
+        Ring* ring = (log->*member).load(std::memory_order_acquire);
+        if (!ring) {
+            continue;
+        }
+        const char* spans[2];
+        std::size_t sizes[2];
+        std::size_t size = ring->readable(spans, sizes);
+        if (size == 0) {
+            continue;
+        }
+        if (iov.size() + 2 > kMaxIovecs) {
+            flush();
+        }
+        for (int i = 0; i < 2; ++i) {
+            if (sizes[i] > 0) {
+                iov.push_back(iovec{const_cast<char*>(spans[i]), sizes[i]});
+            }
+        }
+        taken.emplace_back(ring, size);
+    }
+    flush();
+    return total;
+}
+
+bool Log::open_access_file() {
+    std::error_code ec;
+    auto directory = std::filesystem::path(config_.path).parent_path();
+    if (!directory.empty()) {
+        std::filesystem::create_directories(directory, ec);
+    }
+
+    access_fd_ = ::open(config_.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (access_fd_ < 0) {
+        Log::error() << "Failed to open access log " << config_.path << ": " << std::strerror(errno);
+        return false;
+    }
+    struct stat st{};
+    access_file_size_ = ::fstat(access_fd_, &st) == 0 ? static_cast<std::uint64_t>(st.st_size) : 0;
+    return true;
+}
+
+void Log::rotate_access_file() {
+    ::close(access_fd_);
+    access_fd_ = -1;
+
+    // access.log -> access.log.1 -> access.log.2 ..., the oldest is overwritten
+    const auto& path = config_.path;
+    if (config_.max_files > 0) {
+        for (int i = config_.max_files - 1; i >= 1; --i) {
+            std::rename((path + "." + std::to_string(i)).c_str(),
+                        (path + "." + std::to_string(i + 1)).c_str());
+        }
+        std::rename(path.c_str(), (path + ".1").c_str());
+    } else {
+        ::unlink(path.c_str());
+    }
+    open_access_file();
+}
@@ -0,0 +1,191 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include "ConfigManager.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+struct AccessLogStats {
+    std::uint64_t logged = 0;       // queued for the file
+    std::uint64_t dropped = 0;      // ring full: the writer fell behind the disk
+    std::uint64_t sampled_out = 0;  // skipped by sample_rate
+};
+
+// One finished request, as the access log records it. The views only need to
+// stay valid for the call.
+struct AccessRecord {
+    std::string_view client_ip;
+    std::string_view host;
+    std::string_view method;
+    std::string_view target;
+    std::string_view protocol;  // "HTTP/1.1", "HTTP/2.0"
+    std::string_view upstream;  // empty when no backend was involved
+    std::string_view referer;
+    std::string_view user_agent;
+    unsigned status = 0;
+    std::uint64_t bytes_received = 0;
+    std::uint64_t bytes_sent = 0;
+    std::chrono::steady_clock::duration elapsed{};
+};
+
+// Access log and diagnostics, written off the request path.
+//
+// A thread formats a line into its own single-producer/single-consumer byte
+// ring and returns; a background writer drains every thread's rings in
+// batches, handing the ring memory straight to writev(). Nothing on the
+// request path locks, flushes or waits for the disk: a line that doesn't fit
+// in its ring is dropped and counted. Until start() (and after stop()) lines
+// are written synchronously, so startup and shutdown messages appear in order.
+//
+// Diagnostics go to stdout (debug, info) and stderr (warn, error), filtered by
+// the PRISTINE_LOG_LEVEL environment variable (debug, info, warn, error or
+// off; default info). Access records go to a file that is rotated by size, in
+// JSON lines or the combined log format.
+class Log {
+public:
+    enum class Level { debug, info, warn, error, off };
+
+    // A diagnostic line, submitted when it goes out of scope. Inserting into a
+    // line whose level is filtered out does nothing.
+    class Line {
+    public:
+        explicit Line(Level level);
+        ~Line();
+        Line(const Line&) = delete;
+        Line& operator=(const Line&) = delete;
+
+        template<class T>
+        Line& operator<<(const T& value) {
+            if (stream_) {
+                *stream_ << value;
+            }
+            return *this;
+        }
+
+    private:
+        Level level_;
+        std::optional<std::ostringstream> stream_;
+    };
+
+    static Line debug() { return Line(Level::debug); }
+    static Line info() { return Line(Level::info); }
+    static Line warn() { return Line(Level::warn); }
+    static Line error() { return Line(Level::error); }
+
+    static bool enabled(Level level) { return level >= level_.load(std::memory_order_relaxed); }
+
+    // Open the access log (if enabled) and start the writer thread.
+    // Returns false if the access log file can't be opened.
+    static bool start(const AccessLogConfig& config);
+
+    // Write out everything queued and stop the writer
+    static void stop();
+
+    // Reopen the access log file, e.g. after an external logrotate
+    static void reopen();
+
+    // Whether access records are being kept (cheap check before building one)
+    static bool access_enabled() { return access_enabled_.load(std::memory_order_relaxed); }
+
+    // Queue an access record (request path)
+    static void access(const AccessRecord& record);
+
+    static AccessLogStats access_stats();
+
+private:
+    // Byte ring with one producer (the owning thread) and one consumer (the
+    // writer). Lines are stored back to back, so the readable part is already
+    // the text to write.
+    class Ring {
+    public:
+        explicit Ring(std::size_t capacity);  // rounded up to a power of two
+
+        // Append a whole line, or nothing if it doesn't fit
+        bool push(std::string_view line);
+
+        // Bytes used after a push, for waking the writer early
+        std::size_t used() const;
+        std::size_t capacity() const { return mask_ + 1; }
+
+        // Consumer side: up to two contiguous readable spans, then release them
+        std::size_t readable(const char* spans[2], std::size_t sizes[2]) const;
+        void consume(std::size_t bytes);
+
+    private:
+        std::unique_ptr<char[]> buffer_;
+        std::size_t mask_;
+        alignas(64) std::atomic<std::size_t> head_{0};  // written by the producer
+        std::size_t cached_tail_ = 0;                   // producer's last view of tail_
+        alignas(64) std::atomic<std::size_t> tail_{0};  // written by the consumer
+    };
+
+    // Rings and counters of one thread, registered on first use
+    struct ThreadLog {
+        ThreadLog();
+        ~ThreadLog();
+
+        // Published to the writer once allocated
+        std::atomic<Ring*> out{nullptr};     // debug and info diagnostics
+        std::atomic<Ring*> err{nullptr};     // warnings and errors
+        std::atomic<Ring*> access{nullptr};  // allocated with the first record
+        std::uint64_t sample_state;          // xorshift state for sampling
+        std::atomic<std::uint64_t> logged{0};
+        std::atomic<std::uint64_t> dropped{0};
+        std::atomic<std::uint64_t> sampled_out{0};
+        std::atomic<std::uint64_t> diagnostics_dropped{0};
+    };
+
+    static ThreadLog& local();
+    static void submit(Level level, std::string_view text);
+    static void wake_writer();
+
+    static void run_writer();
+
+    // Write out what all rings of one kind hold; returns bytes written
+    static std::size_t drain(int fd, std::atomic<Ring*> ThreadLog::*ring, const std::vector<ThreadLog*>& threads);
+
+    static bool open_access_file();
+    static void rotate_access_file();
+
+    static void format_json(std::string& out, const AccessRecord& record);
+    static void format_combined(std::string& out, const AccessRecord& record);
+
+    // Only the owning thread writes a thread's counters
+    static void add(std::atomic<std::uint64_t>& counter, std::uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+private:
+    static std::atomic<Level> level_;
+    static AccessLogConfig config_;
+    static std::atomic<bool> access_enabled_;
+    static std::atomic<bool> running_;
+    static std::uint64_t sample_threshold_;  // records kept when a random value is below it
+
+    static std::mutex threads_mutex_;
+    static std::vector<std::unique_ptr<ThreadLog>> threads_;
+
+    // Writer thread and its wake-ups
+    static std::thread writer_;
+    static std::mutex wake_mutex_;
+    static std::condition_variable wake_cv_;
+    static std::atomic<bool> wake_requested_;
+    static std::atomic<bool> reopen_requested_;
+    static bool stopping_;
+
+    // Access log file, owned by the writer while it runs
+    static int access_fd_;
+    static std::uint64_t access_file_size_;
+};
+
+#endif // LOG_H
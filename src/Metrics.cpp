@@ -0,0 +1,251 @@
+#include "Metrics.h"
+#include "Log.h"
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+
+std::mutex Metrics::mutex_;
+std::vector<std::unique_ptr<Metrics::ThreadMetrics>> Metrics::threads_;
+std::vector<std::string> Metrics::site_names_{"_unmatched"};
+std::unordered_map<std::string, std::uint32_t> Metrics::site_ids_;
+
+namespace {
+
+const char* const kStatusClassLabels[] = {"1xx", "2xx", "3xx", "4xx", "5xx"};
+
+// Label values come from the configuration; keep them valid exposition text
+void append_label_value(std::string& out, std::string_view value) {
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            out.push_back('\\');
+            out.push_back(c);
+        } else if (c == '\n') {
+            out.append("\\n");
+        } else {
+            out.push_back(c);
+        }
+    }
+}
+
+void append_header(std::string& out, const char* name, const char* type, const char* help) {
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+void append_seconds(std::string& out, std::uint64_t us) {
+    char text[32];
+    int length = std::snprintf(text, sizeof(text), "%llu.%06llu",
+                               static_cast<unsigned long long>(us / 1000000),
+                               static_cast<unsigned long long>(us % 1000000));
+    out.append(text, static_cast<std::size_t>(length));
+}
+
+} // namespace
+
+Metrics::ThreadMetrics::~ThreadMetrics() {
+    for (auto& chunk : site_chunks) {
+        delete chunk.load(std::memory_order_relaxed);
+    }
+}
+
+Metrics::ThreadMetrics& Metrics::local() {
+    thread_local ThreadMetrics* metrics = nullptr;
+    if (!metrics) {
+        auto block = std::make_unique<ThreadMetrics>();
+        metrics = block.get();
+        std::lock_guard<std::mutex> lock(mutex_);
+        threads_.push_back(std::move(block));
+    }
+    return *metrics;
+}
+
+std::uint32_t Metrics::site_id(std::string_view domain) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = site_ids_.find(std::string(domain));
+    if (it != site_ids_.end()) {
+        return it->second;
+    }
+    if (site_names_.size() >= kMaxSites) {
+        Log::warn() << "Too many sites for per-site metrics, counting " << domain << " as unmatched";
+        return kUnmatchedSite;
+    }
+
+    auto id = static_cast<std::uint32_t>(site_names_.size());
+    site_names_.emplace_back(domain);
+    site_ids_.emplace(std::string(domain), id);
+    return id;
+}
+
+void Metrics::record_request(std::uint32_t site, unsigned status, std::uint64_t bytes_received,
+                             std::uint64_t bytes_sent, Duration elapsed) {
+    auto& metrics = local();
+
+    auto& slot = metrics.site_chunks[site / kSitesPerChunk];
+    SiteChunk* chunk = slot.load(std::memory_order_relaxed);
+    if (!chunk) {
+        chunk = new SiteChunk();
+        slot.store(chunk, std::memory_order_release);
+    }
+    auto& counters = chunk->sites[site % kSitesPerChunk];
+
+    std::size_t status_class = std::clamp(status / 100, 1u, 5u) - 1;
+    add(counters.responses[status_class], 1);
+    add(counters.bytes_received, bytes_received);
+    add(counters.bytes_sent, bytes_sent);
+    observe(metrics.request_duration, elapsed);
+}
+
+void Metrics::record_backend_connect(Duration elapsed) {
+    observe(local().backend_connect, elapsed);
+}
+
+void Metrics::record_backend_first_byte(Duration elapsed) {
+    observe(local().backend_first_byte, elapsed);
+}
+
+void Metrics::record_tls_handshake_error() {
+    add(local().tls_handshake_errors, 1);
+}
+
+void Metrics::observe(Histogram& histogram, Duration elapsed) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    auto value = static_cast<std::uint64_t>(std::max<std::int64_t>(us, 0));
+    add(histogram.buckets[bucket(value)], 1);
+    add(histogram.sum_us, value);
+}
+
+std::size_t Metrics::bucket(std::uint64_t us) {
+    // Shifted by one so that a bucket includes its upper bound, as "le" does
+    std::uint64_t v = us > 0 ? us - 1 : 0;
+    if (v < kSubBuckets) {
+        return static_cast<std::size_t>(v);
+    }
+    auto msb = static_cast<std::size_t>(std::bit_width(v)) - 1;  // >= 2
+    std::size_t index = (msb - 1) * kSubBuckets + ((v >> (msb - 2)) & (kSubBuckets - 1));
+    return std::min(index, kBuckets - 1);
+}
+
+std::uint64_t Metrics::bucket_upper_us(std::size_t index) {
+    if (index < kSubBuckets) {
+        return index + 1;
+    }
+    std::size_t msb = index / kSubBuckets + 1;
+    std::size_t sub = index % kSubBuckets;
+    return static_cast<std::uint64_t>(kSubBuckets + sub + 1) << (msb - 2);
+}
+
+void Metrics::render(std::string& out) {
+    std::vector<ThreadMetrics*> threads;
+    std::vector<std::string> site_names;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        threads.reserve(threads_.size());
+        for (const auto& block : threads_) {
+            threads.push_back(block.get());
+        }
+        site_names = site_names_;
+    }
+
+    // Per-site totals over all threads
+    struct SiteTotals {
+        std::array<std::uint64_t, kStatusClasses> responses{};
+        std::uint64_t bytes_received = 0;
+        std::uint64_t bytes_sent = 0;
+        bool seen = false;
+    };
+    std::vector<SiteTotals> sites(site_names.size());
+    std::uint64_t tls_handshake_errors = 0;
+    for (auto* metrics : threads) {
+        for (std::size_t c = 0; c * kSitesPerChunk < sites.size(); ++c) {
+            const SiteChunk* chunk = metrics->site_chunks[c].load(std::memory_order_acquire);
+            if (!chunk) {
+                continue;
+            }
+            for (std::size_t i = 0; i < kSitesPerChunk && c * kSitesPerChunk + i < sites.size(); ++i) {
+                const auto& counters = chunk->sites[i];
+                auto& totals = sites[c * kSitesPerChunk + i];
+                for (std::size_t s = 0; s < kStatusClasses; ++s) {
+                    totals.responses[s] += counters.responses[s].load(std::memory_order_relaxed);
+                }
+                totals.bytes_received += counters.bytes_received.load(std::memory_order_relaxed);
+                totals.bytes_sent += counters.bytes_sent.load(std::memory_order_relaxed);
+                totals.seen = true;
+            }
+        }
+        tls_handshake_errors += metrics->tls_handshake_errors.load(std::memory_order_relaxed);
+    }
+
+    append_header(out, "pristine_requests_total", "counter", "Responses sent to clients, by site and status class.");
+    for (std::size_t i = 0; i < sites.size(); ++i) {
+        if (!sites[i].seen) {
+            continue;
+        }
+        for (std::size_t s = 0; s < kStatusClasses; ++s) {
+            out.append("pristine_requests_total{site=\"");
+            append_label_value(out, site_names[i]);
+            out.append("\",code=\"").append(kStatusClassLabels[s]).append("\"} ");
+            out.append(std::to_string(sites[i].responses[s])).append("\n");
+        }
+    }
+
+    auto render_bytes = [&](const char* name, const char* help, std::uint64_t SiteTotals::*member) {
+        append_header(out, name, "counter", help);
+        for (std::size_t i = 0; i < sites.size(); ++i) {
+            if (!sites[i].seen) {
+                continue;
+            }
+            out.append(name).append("{site=\"");
+            append_label_value(out, site_names[i]);
+            out.append("\"} ").append(std::to_string(sites[i].*member)).append("\n");
+        }
+    };
+    render_bytes("pristine_received_bytes_total",
+                 "Request bytes received from clients (HTTP/1.1 header and body, HTTP/2 header block and DATA).",
+                 &SiteTotals::bytes_received);
+    render_bytes("pristine_sent_bytes_total",
+                 "Response bytes sent to clients (HTTP/1.1 header and body, HTTP/2 header block and DATA).",
+                 &SiteTotals::bytes_sent);
+
+    render_histogram(out, "pristine_request_duration_seconds",
+                     "Time from a request header being received to its response being sent.",
+                     &ThreadMetrics::request_duration, threads);
+    render_histogram(out, "pristine_backend_connect_seconds",
+                     "Time to resolve and connect to a backend for requests the pool could not serve.",
+                     &ThreadMetrics::backend_connect, threads);
+    render_histogram(out, "pristine_backend_first_byte_seconds",
+                     "Time from sending a request to a backend to receiving its response header.",
+                     &ThreadMetrics::backend_first_byte, threads);
+
+    append_header(out, "pristine_tls_handshake_errors_total", "counter", "TLS handshakes that failed or timed out.");
+    out.append("pristine_tls_handshake_errors_total ").append(std::to_string(tls_handshake_errors)).append("\n");
+}
+
+void Metrics::render_histogram(std::string& out, const char* name, const char* help,
+                               Histogram ThreadMetrics::*member,
+                               const std::vector<ThreadMetrics*>& threads) {
+    std::array<std::uint64_t, kBuckets> counts{};
+    std::uint64_t sum_us = 0;
+    for (auto* metrics : threads) {
+        const auto& histogram = metrics->*member;
+        for (std::size_t i = 0; i < kBuckets; ++i) {
+            counts[i] += histogram.buckets[i].load(std::memory_order_relaxed);
+        }
+        sum_us += histogram.sum_us.load(std::memory_order_relaxed);
+    }
+
+    append_header(out, name, "histogram", help);
+    std::string bucket_name = std::string(name) + "_bucket{le=\"";
+    std::uint64_t cumulative = 0;
+    for (std::size_t i = 0; i + 1 < kBuckets; ++i) {
+        cumulative += counts[i];
+        out.append(bucket_name);
+        append_seconds(out, bucket_upper_us(i));
+        out.append("\"} ").append(std::to_string(cumulative)).append("\n");
+    }
+    cumulative += counts[kBuckets - 1];
+    out.append(bucket_name).append("+Inf\"} ").append(std::to_string(cumulative)).append("\n");
+    out.append(name).append("_sum ");
+    append_seconds(out, sum_us);
+    out.append("\n");
+    out.append(name).append("_count ").append(std::to_string(cumulative)).append("\n");
+}
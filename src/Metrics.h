@@ -0,0 +1,113 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Request counters and latency histograms for the Prometheus endpoint.
+//
+// Every thread that records gets its own block, cache-line aligned and only
+// ever written by that thread, so counting a request is a few plain loads and
+// stores with no locked instruction and no line shared with another core.
+// Scrapes read all blocks and add them up; a block is never freed, so counts
+// of a thread that exits are kept.
+//
+// Latencies go into log-linear (HDR-style) histograms in microseconds: each
+// power of two is split into 4 buckets, which keeps the relative error of any
+// quantile under 25% from 1 us up to a minute with 100 buckets.
+class Metrics {
+public:
+    using Duration = std::chrono::steady_clock::duration;
+
+    // Site for requests that matched no route (or never got that far)
+    static constexpr std::uint32_t kUnmatchedSite = 0;
+
+    // Stable id for a site's counters; the same domain keeps its id across
+    // reloads. Call when routes are built, not per request.
+    static std::uint32_t site_id(std::string_view domain);
+
+    // A response went to the client (request path, no locks)
+    static void record_request(std::uint32_t site, unsigned status, std::uint64_t bytes_received,
+                               std::uint64_t bytes_sent, Duration elapsed);
+
+    // Backend connection established (DNS and TCP connect)
+    static void record_backend_connect(Duration elapsed);
+
+    // Request sent until the backend's response header arrived
+    static void record_backend_first_byte(Duration elapsed);
+
+    static void record_tls_handshake_error();
+
+    // Append the request metrics in Prometheus text format
+    static void render(std::string& out);
+
+private:
+    static constexpr std::size_t kSubBuckets = 4;
+    static constexpr std::size_t kBuckets = 100;      // last one is +Inf (over ~60 s)
+    static constexpr std::size_t kStatusClasses = 5;  // 1xx..5xx
+    static constexpr std::size_t kSitesPerChunk = 64;
+    static constexpr std::size_t kMaxSites = 64 * 1024;
+
+    using Counter = std::atomic<std::uint64_t>;
+
+    struct Histogram {
+        std::array<Counter, kBuckets> buckets{};
+        Counter sum_us{0};
+    };
+
+    struct SiteCounters {
+        std::array<Counter, kStatusClasses> responses{};
+        Counter bytes_received{0};
+        Counter bytes_sent{0};
+    };
+
+    // Counters of kSitesPerChunk sites, allocated the first time a thread
+    // records for one of them
+    struct SiteChunk {
+        std::array<SiteCounters, kSitesPerChunk> sites;
+    };
+
+    struct alignas(64) ThreadMetrics {
+        ~ThreadMetrics();
+
+        std::array<std::atomic<SiteChunk*>, kMaxSites / kSitesPerChunk> site_chunks{};
+        Histogram request_duration;
+        Histogram backend_connect;
+        Histogram backend_first_byte;
+        Counter tls_handshake_errors{0};
+    };
+
+    // Block of the calling thread, registered on first use
+    static ThreadMetrics& local();
+
+    // Only the owning thread writes, so no read-modify-write is needed
+    static void add(Counter& counter, std::uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static void observe(Histogram& histogram, Duration elapsed);
+
+    // Bucket for a value in microseconds; bucket i holds (upper(i - 1), upper(i)]
+    static std::size_t bucket(std::uint64_t us);
+    static std::uint64_t bucket_upper_us(std::size_t index);
+
+    static void render_histogram(std::string& out, const char* name, const char* help,
+                                 Histogram ThreadMetrics::*member,
+                                 const std::vector<ThreadMetrics*>& threads);
+
+private:
+    static std::mutex mutex_;  // guards the two registries below
+    static std::vector<std::unique_ptr<ThreadMetrics>> threads_;
+    static std::vector<std::string> site_names_;
+    static std::unordered_map<std::string, std::uint32_t> site_ids_;
+};
+
+#endif // METRICS_H
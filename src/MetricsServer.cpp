@@ -0,0 +1,239 @@
+#include "MetricsServer.h"
+#include "Metrics.h"
+#include "AdmissionController.h"
+#include "BackendConnectionPool.h"
+#include "TlsSessionCache.h"
+#include "ResponseCache.h"
+#include "DiskCache.h"
+#include "StaticFiles.h"
+#include "Compression.h"
+#include "Ktls.h"
+#include "Log.h"
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <chrono>
+#include <memory>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+
+namespace {
+
+constexpr std::chrono::seconds kScrapeTimeout{10};
+
+// One scrape: read the request, answer, close
+struct Scrape {
+    explicit Scrape(tcp::socket&& socket) : stream(std::move(socket)) {}
+
+    beast::tcp_stream stream;
+    beast::flat_buffer buffer;
+    http::request<http::empty_body> request;
+    http::response<http::string_body> response;
+};
+
+void append_metric(std::string& out, const char* name, const char* type, const char* help,
+                   std::uint64_t value) {
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+    out.append(name).append(" ").append(std::to_string(value)).append("\n");
+}
+
+} // namespace
+
+MetricsServer::MetricsServer(net::io_context& ioc, const MetricsConfig& config, const HandshakePool* handshake_pool)
+    : acceptor_(ioc), path_(config.path), handshake_pool_(handshake_pool) {
+    tcp::endpoint endpoint(net::ip::make_address(config.address), static_cast<unsigned short>(config.port));
+    acceptor_.open(endpoint.protocol());
+    acceptor_.set_option(net::socket_base::reuse_address(true));
+    acceptor_.bind(endpoint);
+    acceptor_.listen(net::socket_base::max_listen_connections);
+}
+
+void MetricsServer::start() {
+    do_accept();
+}
+
+void MetricsServer::stop() {
+    beast::error_code ec;
+    acceptor_.close(ec);
+}
+
+void MetricsServer::do_accept() {
+    acceptor_.async_accept([this](beast::error_code ec, tcp::socket socket) {
+        if (ec == net::error::operation_aborted) {
+            return;
+        }
+        if (!ec) {
+            auto scrape = std::make_shared<Scrape>(std::move(socket));
+            scrape->stream.expires_after(kScrapeTimeout);
+            http::async_read(scrape->stream, scrape->buffer, scrape->request,
+                [this, scrape](beast::error_code ec, std::size_t) {
+                    if (ec) {
+                        return;
+                    }
+                    auto& req = scrape->request;
+                    auto& res = scrape->response;
+                    res.version(req.version());
+                    res.keep_alive(false);
+                    res.set(http::field::server, "ReverseProxy/1.0");
+                    if (req.target() != path_) {
+                        res.result(http::status::not_found);
+                        res.set(http::field::content_type, "text/plain");
+                        res.body() = "Not found";
+                    } else if (req.method() != http::verb::get && req.method() != http::verb::head) {
+                        res.result(http::status::method_not_allowed);
+                        res.set(http::field::allow, "GET, HEAD");
+                        res.set(http::field::content_type, "text/plain");
+                        res.body() = "Method not allowed";
+                    } else {
+                        res.result(http::status::ok);
+                        res.set(http::field::content_type, "text/plain; version=0.0.4; charset=utf-8");
+                        if (req.method() == http::verb::get) {
+                            res.body() = render();
+                        }
+                    }
+                    res.prepare_payload();
+                    http::async_write(scrape->stream, res, [scrape](beast::error_code, std::size_t) {
+                        beast::error_code ignored;
+                        scrape->stream.socket().shutdown(tcp::socket::shutdown_both, ignored);
+                    });
+                });
+        }
+        do_accept();
+    });
+}
+
+std::string MetricsServer::render() const {
+    std::string out;
+    out.reserve(64 * 1024);
+    Metrics::render(out);
+
+    append_metric(out, "pristine_active_connections", "gauge",
+                  "Open client connections.", AdmissionController::active());
+    append_metric(out, "pristine_rejected_connections_total", "counter",
+                  "Client connections turned away at max_connections.", AdmissionController::rejected());
+
+    auto pool = BackendConnectionPool::stats();
+    append_metric(out, "pristine_backend_pool_hits_total", "counter",
+                  "Backend requests sent on an idle pooled connection.", pool.hits);
+    append_metric(out, "pristine_backend_pool_misses_total", "counter",
+                  "Backend requests that needed a new connection.", pool.misses);
+    append_metric(out, "pristine_backend_pool_evictions_total", "counter",
+                  "Idle pooled connections closed as stale or over the limit.", pool.evictions);
+
+    if (ResponseCache::enabled()) {
+        auto cache = ResponseCache::stats();
+        out.append("# HELP pristine_cache_lookups_total Response cache lookups, by result.\n");
+        out.append("# TYPE pristine_cache_lookups_total counter\n");
+        out.append("pristine_cache_lookups_total{result=\"hit\"} ")
+           .append(std::to_string(cache.hits)).append("\n");
+        out.append("pristine_cache_lookups_total{result=\"miss\"} ")
+           .append(std::to_string(cache.misses)).append("\n");
+        append_metric(out, "pristine_cache_not_modified_total", "counter",
+                      "Cache hits answered with 304 Not Modified.", cache.not_modified);
+        append_metric(out, "pristine_cache_stores_total", "counter",
+                      "Responses stored in the response cache.", cache.stores);
+        append_metric(out, "pristine_cache_evictions_total", "counter",
+                      "Responses dropped from the cache for space or because they expired.", cache.evictions);
+        append_metric(out, "pristine_cache_collapsed_total", "counter",
+                      "Cache misses that waited for an identical request already sent to the backend.",
+                      cache.collapsed);
+        append_metric(out, "pristine_cache_collapse_fallbacks_total", "counter",
+                      "Collapsed misses that went to the backend themselves after waiting.",
+                      cache.collapse_fallbacks);
+        append_metric(out, "pristine_cache_entries", "gauge",
+                      "Responses in the response cache.", cache.entries);
+        append_metric(out, "pristine_cache_memory_bytes", "gauge",
+                      "Memory held by the response cache.", cache.bytes);
+        append_metric(out, "pristine_cache_memory_limit_bytes", "gauge",
+                      "Memory budget of the response cache.", cache.capacity);
+    }
+
+    if (DiskCache::enabled()) {
+        auto disk = DiskCache::stats();
+        out.append("# HELP pristine_disk_cache_lookups_total Disk cache tier lookups (after a memory miss), by result.\n");
+        out.append("# TYPE pristine_disk_cache_lookups_total counter\n");
+        out.append("pristine_disk_cache_lookups_total{result=\"hit\"} ")
+           .append(std::to_string(disk.hits)).append("\n");
+        out.append("pristine_disk_cache_lookups_total{result=\"miss\"} ")
+           .append(std::to_string(disk.misses)).append("\n");
+        append_metric(out, "pristine_disk_cache_stores_total", "counter",
+                      "Responses stored in the disk cache tier.", disk.stores);
+        append_metric(out, "pristine_disk_cache_evictions_total", "counter",
+                      "Responses dropped from the disk tier with their slab or because they expired.", disk.evictions);
+        append_metric(out, "pristine_disk_cache_recovered", "gauge",
+                      "Responses found in the slab files at startup.", disk.recovered);
+        append_metric(out, "pristine_disk_cache_entries", "gauge",
+                      "Responses in the disk cache tier.", disk.entries);
+        append_metric(out, "pristine_disk_cache_bytes", "gauge",
+                      "Slab space held by responses in the disk tier.", disk.bytes);
+        append_metric(out, "pristine_disk_cache_limit_bytes", "gauge",
+                      "Size of the disk tier's slab files.", disk.capacity);
+    }
+
+    auto files = StaticFiles::stats();
+    out.append("# HELP pristine_static_open_file_cache_lookups_total Open file cache lookups of root sites, by result.\n");
+    out.append("# TYPE pristine_static_open_file_cache_lookups_total counter\n");
+    out.append("pristine_static_open_file_cache_lookups_total{result=\"hit\"} ")
+       .append(std::to_string(files.hits)).append("\n");
+    out.append("pristine_static_open_file_cache_lookups_total{result=\"miss\"} ")
+       .append(std::to_string(files.misses)).append("\n");
+
+    auto compression = Compression::stats();
+    out.append("# HELP pristine_compressed_responses_total Responses compressed for the client, by coding.\n");
+    out.append("# TYPE pristine_compressed_responses_total counter\n");
+    out.append("pristine_compressed_responses_total{coding=\"gzip\"} ")
+       .append(std::to_string(compression.gzip)).append("\n");
+    out.append("pristine_compressed_responses_total{coding=\"br\"} ")
+       .append(std::to_string(compression.brotli)).append("\n");
+    out.append("# HELP pristine_compression_bytes_total Response body bytes through the compressor, before (in) and after (out).\n");
+    out.append("# TYPE pristine_compression_bytes_total counter\n");
+    out.append("pristine_compression_bytes_total{direction=\"in\"} ")
+       .append(std::to_string(compression.bytes_in)).append("\n");
+    out.append("pristine_compression_bytes_total{direction=\"out\"} ")
+       .append(std::to_string(compression.bytes_out)).append("\n");
+
+    if (Log::access_enabled()) {
+        auto log = Log::access_stats();
+        out.append("# HELP pristine_access_log_records_total Access log records, by what happened to them.\n");
+        out.append("# TYPE pristine_access_log_records_total counter\n");
+        out.append("pristine_access_log_records_total{result=\"logged\"} ")
+           .append(std::to_string(log.logged)).append("\n");
+        out.append("pristine_access_log_records_total{result=\"dropped\"} ")
+           .append(std::to_string(log.dropped)).append("\n");
+        out.append("pristine_access_log_records_total{result=\"sampled_out\"} ")
+           .append(std::to_string(log.sampled_out)).append("\n");
+    }
+
+    if (handshake_pool_) {
+        auto tls = TlsSessionCache::stats();
+        out.append("# HELP pristine_tls_handshakes_total Completed TLS handshakes, by type.\n");
+        out.append("# TYPE pristine_tls_handshakes_total counter\n");
+        out.append("pristine_tls_handshakes_total{type=\"full\"} ")
+           .append(std::to_string(tls.full_handshakes)).append("\n");
+        out.append("pristine_tls_handshakes_total{type=\"resumed\"} ")
+           .append(std::to_string(tls.resumed_handshakes)).append("\n");
+        append_metric(out, "pristine_tls_handshakes_refused_total", "counter",
+                      "TLS connections closed because max_pending handshakes were running.",
+                      handshake_pool_->refused());
+        append_metric(out, "pristine_tls_handshakes_pending", "gauge",
+                      "TLS handshakes in progress.", handshake_pool_->pending());
+        append_metric(out, "pristine_tls_session_cache_hits_total", "counter",
+                      "Session-ID resumptions found in the session cache.", tls.cache_hits);
+        append_metric(out, "pristine_tls_session_cache_misses_total", "counter",
+                      "Session-ID resumptions not found in the session cache.", tls.cache_misses);
+        append_metric(out, "pristine_tls_tickets_accepted_total", "counter",
+                      "Session tickets decrypted with a known key.", tls.tickets_accepted);
+        append_metric(out, "pristine_tls_tickets_rejected_total", "counter",
+                      "Session tickets under an unknown (rotated out) key.", tls.tickets_rejected);
+
+        auto ktls = Ktls::stats();
+        out.append("# HELP pristine_ktls_connections_total TLS connections by who encrypts what they send.\n");
+        out.append("# TYPE pristine_ktls_connections_total counter\n");
+        out.append("pristine_ktls_connections_total{mode=\"kernel\"} ")
+           .append(std::to_string(ktls.offloaded)).append("\n");
+        out.append("pristine_ktls_connections_total{mode=\"userspace\"} ")
+           .append(std::to_string(ktls.fallback)).append("\n");
+    }
+    return out;
+}
@@ -0,0 +1,40 @@
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+
+#include "ConfigManager.h"
+#include "HandshakePool.h"
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <string>
+
+namespace net = boost::asio;
+using tcp = boost::asio::ip::tcp;
+
+// Admin listener for the Prometheus scrape endpoint (metrics).
+//
+// It runs on the control thread, away from the workers, and answers GET on
+// the configured path with the request metrics plus the counters of the
+// connection pool, admission control and TLS components, all collected at
+// scrape time. One request per connection, as scrapers send.
+class MetricsServer {
+public:
+    // Binds the listener; throws if the address can't be used.
+    // handshake_pool is null when no site is served over TLS.
+    MetricsServer(net::io_context& ioc, const MetricsConfig& config, const HandshakePool* handshake_pool);
+
+    void start();
+    void stop();
+
+    // The exposition as served
+    std::string render() const;
+
+private:
+    void do_accept();
+
+private:
+    tcp::acceptor acceptor_;
+    std::string path_;
+    const HandshakePool* handshake_pool_;
+};
+
+#endif // METRICS_SERVER_H
@@ -0,0 +1,108 @@
+#ifndef PROXY_HEADERS_H
+#define PROXY_HEADERS_H
+
+#include <boost/beast/http.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <arpa/inet.h>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+
+// Connection details added to forwarded requests
+struct ForwardedInfo {
+    std::string_view client_ip;
+    std::string_view proto;  // "http" or "https"
+    std::string_view host;
+};
+
+// Write the address of a client endpoint to out, returning its length.
+// inet_ntop writes into the caller's buffer, unlike address::to_string().
+inline std::size_t format_client_address(const boost::asio::ip::tcp::endpoint& endpoint,
+                                         char* out, std::size_t size) {
+    auto address = endpoint.address();
+    const char* result = nullptr;
+    if (address.is_v4()) {
+        auto bytes = address.to_v4().to_bytes();
+        result = inet_ntop(AF_INET, bytes.data(), out, size);
+    } else {
+        auto bytes = address.to_v6().to_bytes();
+        result = inet_ntop(AF_INET6, bytes.data(), out, size);
+    }
+    return result ? std::strlen(out) : 0;
+}
+
+// Beast (Boost 1.74) uses boost::string_view for field values
+inline beast::string_view to_field_value(std::string_view value) {
+    return beast::string_view(value.data(), value.size());
+}
+
+// Remove hop-by-hop headers, including any the sender listed in Connection.
+// Transfer-Encoding stays: the serializer re-frames the body to match it.
+template<class Fields>
+void strip_hop_by_hop(Fields& fields) {
+    auto connection = fields.find(http::field::connection);
+    if (connection != fields.end()) {
+        for (auto token : http::token_list{connection->value()}) {
+            if (!beast::iequals(token, "connection") &&
+                !beast::iequals(token, "transfer-encoding")) {
+                fields.erase(token);
+            }
+        }
+        fields.erase(http::field::connection);
+    }
+
+    fields.erase(http::field::keep_alive);
+    fields.erase(http::field::proxy_connection);
+    fields.erase(http::field::proxy_authorization);
+    fields.erase(http::field::te);
+    fields.erase(http::field::trailer);
+    fields.erase(http::field::upgrade);
+}
+
+// Rewrite a client request in place for an upstream HTTP/1.1 keep-alive
+// connection. Nothing is copied: the message is serialized to the backend
+// as it stands once this returns.
+template<class Body, class Fields>
+void prepare_upstream_request(http::request<Body, Fields>& req, const ForwardedInfo& info) {
+    strip_hop_by_hop(req);
+
+    req.version(11);
+    req.keep_alive(true);
+
+    // Append the client to X-Forwarded-For, building the value on the stack
+    auto forwarded_for = req.find("X-Forwarded-For");
+    if (forwarded_for == req.end()) {
+        req.set("X-Forwarded-For", to_field_value(info.client_ip));
+    } else {
+        auto prior = forwarded_for->value();
+        std::size_t length = prior.size() + 2 + info.client_ip.size();
+        char value[512];
+        if (length <= sizeof(value)) {
+            std::memcpy(value, prior.data(), prior.size());
+            std::memcpy(value + prior.size(), ", ", 2);
+            std::memcpy(value + prior.size() + 2, info.client_ip.data(), info.client_ip.size());
+            req.set("X-Forwarded-For", beast::string_view(value, length));
+        } else {
+            std::string combined(prior.data(), prior.size());
+            combined.append(", ").append(info.client_ip);
+            req.set("X-Forwarded-For", combined);
+        }
+    }
+
+    req.set("X-Forwarded-Proto", to_field_value(info.proto));
+    if (req.find("X-Forwarded-Host") == req.end() && !info.host.empty()) {
+        req.set("X-Forwarded-Host", to_field_value(info.host));
+    }
+}
+
+// Strip a backend response of its hop-by-hop headers; framing and persistence
+// towards the client are decided by the caller
+template<class Body, class Fields>
+void prepare_downstream_response(http::response<Body, Fields>& res) {
+    strip_hop_by_hop(res);
+}
+
+#endif // PROXY_HEADERS_H
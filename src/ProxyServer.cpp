@@ -1,5 +1,5 @@
 #include "ProxyServer.h"
-#include <iostream>
+#include "Log.h"
 
 ProxyServer::ProxyServer() {
     // Constructor implementation
@@ -7,5 +7,5 @@ ProxyServer::ProxyServer() {
 
 void ProxyServer::start() {
     // Start the proxy server
-    std::cout << "Proxy server started." << std::endl;
+    Log::info() << "Proxy server started.";
 }
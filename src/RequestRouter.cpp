@@ -1,45 +1,39 @@
 #include "RequestRouter.h"
-#include <sstream>
-#include <iostream>
+#include "Log.h"
+#include <unordered_set>
 
-RequestRouter::RequestRouter(std::shared_ptr<ConfigManager> configManager)
-    : configManager_(configManager) {
+RequestRouter::RequestRouter(std::shared_ptr<ConfigManager> configManager,
+                             std::shared_ptr<BackendResolver> resolver)
+    : configManager_(configManager), resolver_(resolver) {
+    reload(configManager_->getConfigPtr());
 }
 
-std::pair<std::string, int> RequestRouter::getBackendForDomain(const std::string& domain) const {
-    const SiteConfig* site = configManager_->findSiteByDomain(domain);
-    if (!site) {
-        std::cerr << "No backend configured for domain: " << domain << std::endl;
-        return {"", 0};
-    }
-    
-    return parseBackendAddress(site->backend);
-}
+std::shared_ptr<const ConfigSnapshot> RequestRouter::reload(std::shared_ptr<const ProxyConfig> config) {
+    auto snapshot = std::make_shared<ConfigSnapshot>(std::move(config), *resolver_);
+    configManager_->publish(snapshot);
 
-bool RequestRouter::isWebSocketEnabled(const std::string& domain) const {
-    const SiteConfig* site = configManager_->findSiteByDomain(domain);
-    return site && site->websocket;
+    // Backends the new configuration no longer routes to stop being
+    // resolved; snapshots still pinned by connections hold on to theirs
+    std::unordered_set<const BackendResolver::Target*> live;
+    for (const auto& route : snapshot->routes.routes()) {
+        for (std::size_t i = 0; i < route.balancer->size(); ++i) {
+            live.insert(route.balancer->upstream(i).target.get());
+        }
+    }
+    if (auto dropped = resolver_->retain(live)) {
+        Log::info() << "Dropped " << dropped << " backend(s) no longer in the configuration";
+    }
+    return snapshot;
 }
 
-bool RequestRouter::requiresTLS(const std::string& domain) const {
-    return configManager_->needsTLS(domain);
+bool RequestRouter::isWebSocketEnabled(std::string_view domain) const {
+    auto current = snapshot();
+    const Route* route = current->routes.find(domain);
+    return route && route->websocket;
 }
 
-std::pair<std::string, int> RequestRouter::parseBackendAddress(const std::string& backend) const {
-    size_t colonPos = backend.find_last_of(':');
-    if (colonPos == std::string::npos) {
-        std::cerr << "Invalid backend format (expected host:port): " << backend << std::endl;
-        return {"", 0};
-    }
-    
-    std::string host = backend.substr(0, colonPos);
-    std::string portStr = backend.substr(colonPos + 1);
-    
-    try {
-        int port = std::stoi(portStr);
-        return {host, port};
-    } catch (const std::exception& e) {
-        std::cerr << "Invalid port in backend: " << backend << std::endl;
-        return {"", 0};
-    }
+bool RequestRouter::requiresTLS(std::string_view domain) const {
+    auto current = snapshot();
+    const Route* route = current->routes.find(domain);
+    return route && route->tls;
 }
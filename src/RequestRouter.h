@@ -2,27 +2,39 @@
 #define REQUEST_ROUTER_H
 
 #include "ConfigManager.h"
+#include "ConfigSnapshot.h"
+#include "BackendResolver.h"
+#include "RouteTable.h"
 #include <string>
+#include <string_view>
 #include <memory>
 
 class RequestRouter {
 public:
-    RequestRouter(std::shared_ptr<ConfigManager> configManager);
+    RequestRouter(std::shared_ptr<ConfigManager> configManager,
+                  std::shared_ptr<BackendResolver> resolver);
     
-    // Parse backend address from domain
-    std::pair<std::string, int> getBackendForDomain(const std::string& domain) const;
+    // Compile config into a routing table and publish it as the current
+    // snapshot. Runs off the request path (startup and config reloads).
+    std::shared_ptr<const ConfigSnapshot> reload(std::shared_ptr<const ProxyConfig> config);
+    
+    // Current configuration snapshot, to be pinned by a connection
+    std::shared_ptr<const ConfigSnapshot> snapshot() const { return configManager_->snapshot(); }
+    
+    // True once a newer snapshot than pinned has been published
+    bool isStale(const ConfigSnapshot& pinned) const {
+        return pinned.generation != configManager_->generation();
+    }
     
     // Check if domain supports WebSocket
-    bool isWebSocketEnabled(const std::string& domain) const;
+    bool isWebSocketEnabled(std::string_view domain) const;
     
     // Check if domain needs TLS
-    bool requiresTLS(const std::string& domain) const;
+    bool requiresTLS(std::string_view domain) const;
 
 private:
     std::shared_ptr<ConfigManager> configManager_;
-    
-    // Helper to parse "host:port" format
-    std::pair<std::string, int> parseBackendAddress(const std::string& backend) const;
+    std::shared_ptr<BackendResolver> resolver_;
 };
 
 #endif // REQUEST_ROUTER_H
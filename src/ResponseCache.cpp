@@ -0,0 +1,579 @@
+#include "ResponseCache.h"
+#include "Compression.h"
+#include "DiskCache.h"
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <cstring>
+#include <ctime>
+#include <optional>
+
+std::unique_ptr<ResponseCache::Shard[]> ResponseCache::shards_;
+std::size_t ResponseCache::shard_count_ = 0;
+std::size_t ResponseCache::shard_capacity_ = 0;
+std::size_t ResponseCache::capacity_ = 0;
+std::size_t ResponseCache::max_object_size_ = 0;
+std::uint64_t ResponseCache::disk_max_object_size_ = 0;
+std::chrono::milliseconds ResponseCache::collapse_timeout_{0};
+std::atomic<std::uint64_t> ResponseCache::not_modified_{0};
+std::atomic<std::uint64_t> ResponseCache::collapse_fallbacks_{0};
+
+namespace {
+
+// Shards per worker thread: enough that two workers rarely want the same lock
+constexpr std::size_t kShardsPerThread = 4;
+
+// Bookkeeping per stored response besides its strings (node, index slot, control block)
+constexpr std::size_t kEntryOverhead = 256;
+
+// The small FIFO holds up to 1/kSmallFraction of a shard's bytes
+constexpr std::size_t kSmallFraction = 10;
+
+constexpr std::uint8_t kMaxFreq = 3;
+
+// How long misses for a key whose response couldn't be stored go to the
+// backend side by side, and how many such keys a shard tracks
+constexpr std::chrono::seconds kUncacheableFor{10};
+constexpr std::size_t kMaxUncacheable = 1024;
+
+std::string_view trim(std::string_view value) {
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+        value.remove_prefix(1);
+    }
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+        value.remove_suffix(1);
+    }
+    return value;
+}
+
+bool iequals(std::string_view a, std::string_view b) {
+    return a.size() == b.size() &&
+           std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+               return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+           });
+}
+
+// Call f(name, value) for each directive of a Cache-Control (or Pragma) value
+template<class F>
+void for_each_directive(std::string_view header, F&& f) {
+    while (!header.empty()) {
+        auto comma = header.find(',');
+        auto directive = trim(header.substr(0, comma));
+        header = comma == std::string_view::npos ? std::string_view{} : header.substr(comma + 1);
+        if (directive.empty()) {
+            continue;
+        }
+        auto equals = directive.find('=');
+        auto name = trim(directive.substr(0, equals));
+        std::string_view value;
+        if (equals != std::string_view::npos) {
+            value = trim(directive.substr(equals + 1));
+            if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+                value = value.substr(1, value.size() - 2);
+            }
+        }
+        f(name, value);
+    }
+}
+
+// Delta-seconds, or nullopt when malformed
+std::optional<std::int64_t> parse_seconds(std::string_view value) {
+    if (value.empty()) {
+        return std::nullopt;
+    }
+    std::int64_t seconds = 0;
+    for (char c : value) {
+        if (c < '0' || c > '9') {
+            return std::nullopt;
+        }
+        // Larger than any useful lifetime; RFC 9111 caps it at 2^31
+        seconds = std::min<std::int64_t>(seconds * 10 + (c - '0'), INT32_MAX);
+    }
+    return seconds;
+}
+
+// IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"), the only format senders
+// may generate; anything else counts as invalid
+std::optional<std::time_t> parse_http_date(std::string_view value) {
+    char text[64];
+    if (value.empty() || value.size() >= sizeof(text)) {
+        return std::nullopt;
+    }
+    std::memcpy(text, value.data(), value.size());
+    text[value.size()] = '\0';
+    std::tm tm{};
+    const char* end = strptime(text, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end != '\0') {
+        return std::nullopt;
+    }
+    return timegm(&tm);
+}
+
+// Statuses a cache may store without the response saying so (RFC 9110 15.1),
+// except 206, which needs range assembly
+bool cacheable_status(unsigned status) {
+    switch (status) {
+        case 200: case 203: case 204: case 300: case 301: case 308:
+        case 404: case 405: case 410: case 414: case 501:
+            return true;
+        default:
+            return false;
+    }
+}
+
+std::uint64_t fnv1a(std::uint64_t hash, std::string_view data) {
+    for (unsigned char c : data) {
+        hash = (hash ^ c) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Request value a variant is stored for and matched by. Accept-Encoding is
+// reduced to the codings it accepts, so "gzip, br" and "br;q=1, gzip" share
+// the variant a compressing site stored for either.
+std::string_view vary_value(std::string_view name, std::string_view value, char (&buffer)[64]) {
+    if (name == "accept-encoding") {
+        return Compression::normalize(value, buffer);
+    }
+    return trim(value);
+}
+
+} // namespace
+
+std::size_t CachedResponse::size() const {
+    std::size_t bytes = sizeof(CachedResponse) + kEntryOverhead + key.size() + head.size() +
+                        not_modified.size() + body.capacity() + etag.size() + last_modified.size();
+    for (const auto& [name, value] : vary) {
+        bytes += name.size() + value.size() + sizeof(std::pair<std::string, std::string>);
+    }
+    return bytes;
+}
+
+bool CachedResponse::matches(const std::function<std::string_view(std::string_view)>& request) const {
+    return std::all_of(vary.begin(), vary.end(), [&](const auto& field) {
+        char buffer[64];
+        return vary_value(field.first, request(field.first), buffer) == field.second;
+    });
+}
+
+void ResponseCache::configure(const ResponseCacheConfig& config, int threads) {
+    capacity_ = config.memory_mb * 1024 * 1024;
+    max_object_size_ = config.max_object_size;
+    collapse_timeout_ = std::chrono::milliseconds(std::max(0, config.collapse_timeout_ms));
+    shard_count_ = std::bit_ceil(static_cast<std::size_t>(std::max(1, threads)) * kShardsPerThread);
+    shard_capacity_ = capacity_ / shard_count_;
+    shards_ = capacity_ > 0 ? std::make_unique<Shard[]>(shard_count_) : nullptr;
+    disk_max_object_size_ = capacity_ > 0 && DiskCache::enabled() ? DiskCache::max_object_size() : 0;
+}
+
+CacheMode ResponseCache::request_mode(http::verb method, std::string_view cache_control,
+                                      std::string_view pragma, bool has_authorization, bool has_body) {
+    if (method != http::verb::get && method != http::verb::head) {
+        // RFC 9111 4.4: a successful unsafe request makes what is stored stale
+        bool unsafe = method != http::verb::options && method != http::verb::trace &&
+                      method != http::verb::connect;
+        return unsafe ? CacheMode::invalidate : CacheMode::bypass;
+    }
+    // Responses to authenticated requests are per user
+    if (has_authorization || has_body) {
+        return CacheMode::bypass;
+    }
+
+    CacheMode mode = CacheMode::lookup;
+    for_each_directive(cache_control, [&](std::string_view name, std::string_view value) {
+        if (iequals(name, "no-store")) {
+            mode = CacheMode::bypass;
+        } else if (mode != CacheMode::bypass &&
+                   (iequals(name, "no-cache") || (iequals(name, "max-age") && value == "0"))) {
+            mode = CacheMode::refresh;
+        }
+    });
+    if (mode == CacheMode::lookup && cache_control.empty()) {
+        for_each_directive(pragma, [&](std::string_view name, std::string_view) {
+            if (iequals(name, "no-cache")) {
+                mode = CacheMode::refresh;
+            }
+        });
+    }
+    return mode;
+}
+
+void ResponseCache::make_key(std::string& out, bool https, std::string_view host, std::string_view target) {
+    out.assign(https ? "https://" : "http://");
+    for (char c : host) {
+        out.push_back(static_cast<char>(std::tolower(static_cast<unsigned char>(c))));
+    }
+    out.append(target);
+}
+
+ResponseCache::Freshness ResponseCache::freshness(unsigned status, std::string_view cache_control,
+                                                  std::string_view expires, std::string_view date,
+                                                  std::string_view age) {
+    Freshness result;
+    if (!cacheable_status(status)) {
+        return result;
+    }
+
+    bool forbidden = false;
+    std::optional<std::int64_t> max_age;
+    std::optional<std::int64_t> s_maxage;
+    for_each_directive(cache_control, [&](std::string_view name, std::string_view value) {
+        // no-cache would need revalidation on every request, which this cache
+        // doesn't do; treat it like no-store
+        if (iequals(name, "no-store") || iequals(name, "private") || iequals(name, "no-cache")) {
+            forbidden = true;
+        } else if (iequals(name, "s-maxage")) {
+            s_maxage = parse_seconds(value);
+        } else if (iequals(name, "max-age")) {
+            max_age = parse_seconds(value);
+        }
+    });
+    if (forbidden) {
+        return result;
+    }
+
+    std::int64_t lifetime = 0;
+    if (s_maxage) {
+        lifetime = *s_maxage;
+    } else if (max_age) {
+        lifetime = *max_age;
+    } else if (!expires.empty()) {
+        // An invalid Expires means already expired; Date (or our clock) is the base
+        auto expires_at = parse_http_date(expires);
+        auto base = parse_http_date(date);
+        if (expires_at) {
+            lifetime = *expires_at - (base ? *base : std::time(nullptr));
+        }
+    }
+
+    std::int64_t initial_age = parse_seconds(trim(age)).value_or(0);
+    if (lifetime <= initial_age) {
+        return result;
+    }
+    result.storable = true;
+    result.lifetime = std::chrono::seconds(lifetime - initial_age);
+    result.age = static_cast<std::uint32_t>(initial_age);
+    return result;
+}
+
+bool ResponseCache::set_vary(CachedResponse& response, std::string_view key, std::string_view vary,
+                             const RequestField& request) {
+    response.key = key;
+    std::uint64_t identity = fnv1a(0xcbf29ce484222325ULL, key);
+    bool wildcard = false;
+    for_each_directive(vary, [&](std::string_view name, std::string_view) {
+        if (name == "*") {
+            wildcard = true;
+            return;
+        }
+        std::string lower(name);
+        std::transform(lower.begin(), lower.end(), lower.begin(),
+                       [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        char buffer[64];
+        std::string value(vary_value(lower, request(lower), buffer));
+        identity = fnv1a(fnv1a(identity, lower), value);
+        response.vary.emplace_back(std::move(lower), std::move(value));
+    });
+    response.identity = identity;
+    return !wildcard;
+}
+
+void ResponseCache::append_field(std::string& out, std::string_view name, std::string_view value) {
+    out.append(name).append(": ").append(value).append("\r\n");
+}
+
+bool ResponseCache::open_on_disk(CachedResponse& response, std::uint64_t body_size) {
+    return DiskCache::open(response, body_size);
+}
+
+ResponseCache::Shard& ResponseCache::shard_for(std::string_view key) {
+    // The index hashes the same key; take the shard from other bits
+    std::size_t hash = std::hash<std::string_view>{}(key);
+    return shards_[(hash >> 32) & (shard_count_ - 1)];
+}
+
+std::shared_ptr<const CachedResponse> ResponseCache::lookup(std::string_view key, const RequestField& request) {
+    auto& shard = shard_for(key);
+    auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            for (auto node : it->second) {
+                const auto& response = *node->response;
+                if (!response.matches(request)) {
+                    continue;
+                }
+                if (!response.fresh(now)) {
+                    shard.evictions++;
+                    shard.erase(node);
+                    break;
+                }
+                node->freq = std::min<std::uint8_t>(node->freq + 1, kMaxFreq);
+                shard.hits++;
+                return node->response;
+            }
+        }
+        shard.misses++;
+    }
+    // Responses too large for memory may be in the disk tier
+    return disk_max_object_size_ > 0 ? DiskCache::lookup(key, request) : nullptr;
+}
+
+bool ResponseCache::not_modified(const CachedResponse& response, std::string_view if_none_match,
+                                 std::string_view if_modified_since) {
+    bool satisfied = false;
+    if (!if_none_match.empty()) {
+        // Weak comparison: W/"x" and "x" name the same representation
+        auto opaque = [](std::string_view tag) {
+            tag = trim(tag);
+            if (tag.substr(0, 2) == "W/") {
+                tag.remove_prefix(2);
+            }
+            return tag;
+        };
+        if (!response.etag.empty()) {
+            for_each_directive(if_none_match, [&](std::string_view tag, std::string_view) {
+                satisfied = satisfied || tag == "*" || opaque(tag) == opaque(response.etag);
+            });
+        }
+    } else if (!if_modified_since.empty() && !response.last_modified.empty()) {
+        // If-Modified-Since only counts without If-None-Match
+        auto since = parse_http_date(trim(if_modified_since));
+        auto modified = parse_http_date(response.last_modified);
+        satisfied = since && modified && *modified <= *since;
+    }
+    if (satisfied) {
+        not_modified_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return satisfied;
+}
+
+void ResponseCache::invalidate(std::string_view key) {
+    if (disk_max_object_size_ > 0) {
+        DiskCache::invalidate(key);
+    }
+    auto& shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+        return;
+    }
+    auto variants = it->second;
+    for (auto node : variants) {
+        shard.erase(node);
+    }
+}
+
+void ResponseCache::append(std::unique_ptr<CachedResponse>& response, const char* data, std::size_t size) {
+    if (response->disk) {
+        if (!DiskCache::write(*response->disk, data, size)) {
+            response.reset();
+        }
+        return;
+    }
+    if (response->body.size() + size > max_object_size_) {
+        response.reset();
+        return;
+    }
+    response->body.append(data, size);
+}
+
+std::shared_ptr<const CachedResponse> ResponseCache::store(std::unique_ptr<CachedResponse> response) {
+    if (response->disk) {
+        return DiskCache::commit(std::move(response));
+    }
+    response->head.append("Content-Length: ").append(std::to_string(response->body.size())).append("\r\n");
+    response->body.shrink_to_fit();
+
+    std::size_t bytes = response->size();
+    if (bytes > shard_capacity_ / 2) {
+        return nullptr;
+    }
+
+    auto& shard = shard_for(response->key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    // The new response replaces the variant it matches, and all variants if
+    // the resource changed its Vary fields
+    auto it = shard.index.find(response->key);
+    if (it != shard.index.end()) {
+        auto same_fields = [&](const CachedResponse& stored) {
+            return std::equal(stored.vary.begin(), stored.vary.end(), response->vary.begin(), response->vary.end(),
+                              [](const auto& a, const auto& b) { return a.first == b.first; });
+        };
+        auto variants = it->second;
+        for (auto node : variants) {
+            if (!same_fields(*node->response) || node->response->vary == response->vary) {
+                shard.erase(node);
+            }
+        }
+        it = shard.index.find(response->key);
+        if (it != shard.index.end() && it->second.size() >= kMaxVariants) {
+            shard.erase(it->second.front());
+        }
+    }
+
+    shard.evict(bytes, shard_capacity_);
+
+    // A response dropped from the small FIFO and asked for again has shown
+    // it is reused
+    bool main = shard.ghost_set.erase(response->identity) > 0;
+    auto& queue = main ? shard.main : shard.small;
+    queue.push_back(Node{std::shared_ptr<const CachedResponse>(std::move(response)), bytes, 0, main});
+    auto node = std::prev(queue.end());
+    shard.index[node->response->key].push_back(node);
+    shard.bytes += bytes;
+    if (!main) {
+        shard.small_bytes += bytes;
+    }
+    shard.stores++;
+    return node->response;
+}
+
+bool ResponseCache::join(std::string_view key, Flight* leader, Waiter waiter) {
+    if (leader) {
+        leader->complete(nullptr);
+    }
+    auto& shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto flight = shard.flights.find(key);
+    if (flight != shard.flights.end()) {
+        flight->second.push_back(std::move(waiter));
+        shard.collapsed++;
+        return true;
+    }
+    auto pass = shard.uncacheable.find(key);
+    if (pass != shard.uncacheable.end()) {
+        if (std::chrono::steady_clock::now() < pass->second) {
+            return false;
+        }
+        shard.uncacheable.erase(pass);
+    }
+    if (leader) {
+        leader->key_ = key;
+        shard.flights.emplace(leader->key_, std::vector<Waiter>{});
+    }
+    return false;
+}
+
+ResponseCache::Flight& ResponseCache::Flight::operator=(Flight&& other) noexcept {
+    if (this != &other) {
+        complete(nullptr);
+        key_ = std::move(other.key_);
+        other.key_.clear();
+    }
+    return *this;
+}
+
+void ResponseCache::Flight::complete(std::shared_ptr<const CachedResponse> response, bool uncacheable) {
+    if (key_.empty()) {
+        return;
+    }
+    std::vector<Waiter> waiters;
+    {
+        auto& shard = shard_for(key_);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto flight = shard.flights.find(key_);
+        if (flight != shard.flights.end()) {
+            waiters = std::move(flight->second);
+            shard.flights.erase(flight);
+        }
+        if (uncacheable) {
+            auto now = std::chrono::steady_clock::now();
+            if (shard.uncacheable.size() >= kMaxUncacheable) {
+                std::erase_if(shard.uncacheable, [&](const auto& entry) { return entry.second <= now; });
+                if (shard.uncacheable.size() >= kMaxUncacheable) {
+                    shard.uncacheable.clear();
+                }
+            }
+            shard.uncacheable.insert_or_assign(key_, now + kUncacheableFor);
+        }
+    }
+    key_.clear();
+
+    // Waiters only post to their own connection, so calling them unlocked
+    // and from here is cheap
+    for (auto& waiter : waiters) {
+        waiter(response);
+    }
+}
+
+void ResponseCache::Shard::evict(std::size_t needed, std::size_t capacity) {
+    auto now = std::chrono::steady_clock::now();
+    while (bytes + needed > capacity && (!small.empty() || !main.empty())) {
+        if (!small.empty() && (small_bytes > capacity / kSmallFraction || main.empty())) {
+            auto node = small.begin();
+            if (node->freq > 0 && node->response->fresh(now)) {
+                node->freq = 0;
+                node->main = true;
+                small_bytes -= node->bytes;
+                main.splice(main.end(), small, node);
+            } else {
+                remember(node->response->identity);
+                evictions++;
+                erase(node);
+            }
+        } else {
+            auto node = main.begin();
+            if (node->freq > 0 && node->response->fresh(now)) {
+                node->freq--;
+                main.splice(main.end(), main, node);
+            } else {
+                evictions++;
+                erase(node);
+            }
+        }
+    }
+}
+
+void ResponseCache::Shard::erase(Queue::iterator node) {
+    auto it = index.find(node->response->key);
+    if (it != index.end()) {
+        auto& variants = it->second;
+        variants.erase(std::remove(variants.begin(), variants.end(), node), variants.end());
+        if (variants.empty()) {
+            index.erase(it);
+        }
+    }
+    bytes -= node->bytes;
+    if (node->main) {
+        main.erase(node);
+    } else {
+        small_bytes -= node->bytes;
+        small.erase(node);
+    }
+}
+
+void ResponseCache::Shard::remember(std::uint64_t identity) {
+    if (ghost_set.insert(identity).second) {
+        ghost.push_back(identity);
+    }
+    // About as many keys as are stored
+    std::size_t limit = std::max<std::size_t>(64, small.size() + main.size());
+    while (ghost.size() > limit) {
+        ghost_set.erase(ghost.front());
+        ghost.pop_front();
+    }
+}
+
+ResponseCacheStats ResponseCache::stats() {
+    ResponseCacheStats stats;
+    stats.capacity = capacity_;
+    stats.not_modified = not_modified_.load(std::memory_order_relaxed);
+    stats.collapse_fallbacks = collapse_fallbacks_.load(std::memory_order_relaxed);
+    for (std::size_t i = 0; shards_ && i < shard_count_; ++i) {
+        auto& shard = shards_[i];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        stats.hits += shard.hits;
+        stats.misses += shard.misses;
+        stats.stores += shard.stores;
+        stats.evictions += shard.evictions;
+        stats.collapsed += shard.collapsed;
+        stats.entries += shard.small.size() + shard.main.size();
+        stats.bytes += shard.bytes;
+    }
+    return stats;
+}
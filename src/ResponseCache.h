@@ -0,0 +1,356 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include "ConfigManager.h"
+#include <boost/beast/http.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+
+struct DiskBody;
+
+// A response as the cache keeps it: serialized once when it is stored, then
+// shared by every connection that serves it and never modified again
+struct CachedResponse {
+    std::string key;  // "scheme://host/target"
+    std::vector<std::pair<std::string, std::string>> vary;  // request field (lowercase) -> value stored for
+    std::uint64_t identity = 0;  // hash of key and vary values
+
+    // Status line after the version (" 200 OK\r\n") and header fields,
+    // Content-Length included; the connection adds the version, its own
+    // fields and the final CRLF
+    unsigned status = 200;
+    std::string head;
+    std::string not_modified;  // the same for a 304 answer to a conditional request
+    std::string body;
+    std::shared_ptr<DiskBody> disk;  // set when the body is in a disk cache slab instead
+    std::string etag;
+    std::string last_modified;
+
+    std::chrono::steady_clock::time_point stored;
+    std::chrono::steady_clock::time_point expires;
+    std::uint32_t initial_age = 0;  // Age of the response when it was stored, in seconds
+
+    bool fresh(std::chrono::steady_clock::time_point now) const { return now < expires; }
+
+    // Value of the Age header when served at now
+    std::uint64_t age(std::chrono::steady_clock::time_point now) const {
+        return initial_age + std::chrono::duration_cast<std::chrono::seconds>(now - stored).count();
+    }
+
+    // Bytes charged against the memory budget
+    std::size_t size() const;
+
+    // Whether the request's values of the Vary fields are the stored ones
+    bool matches(const std::function<std::string_view(std::string_view)>& request) const;
+};
+
+// What the cache may do for a request
+enum class CacheMode {
+    bypass,      // neither served from nor stored in the cache
+    lookup,      // served from the cache when a fresh response is stored, stored otherwise
+    refresh,     // the client asked for a fresh copy: always fetched, may be stored
+    invalidate,  // unsafe method: what is stored for the target is dropped
+};
+
+struct ResponseCacheStats {
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t not_modified = 0;  // hits answered with 304
+    std::uint64_t stores = 0;
+    std::uint64_t evictions = 0;     // dropped for space or because they expired
+    std::uint64_t collapsed = 0;     // misses that waited for an identical request in flight
+    std::uint64_t collapse_fallbacks = 0;  // of those, the ones that went to the backend after all
+    std::uint64_t entries = 0;
+    std::uint64_t bytes = 0;
+    std::uint64_t capacity = 0;
+
+    double hit_ratio() const {
+        std::uint64_t lookups = hits + misses;
+        return lookups ? static_cast<double>(hits) / lookups : 0.0;
+    }
+};
+
+// In-memory cache of backend responses for sites with "cache: true".
+//
+// Responses are stored when the backend gives them an explicit lifetime
+// (Cache-Control s-maxage or max-age, or Expires) and nothing forbids a
+// shared cache to keep them (no-store, no-cache, private, Set-Cookie,
+// Vary: *). Stale responses are never served; they are dropped when found.
+// Conditional requests (If-None-Match, If-Modified-Since) against a fresh
+// response are answered with 304 from the cache.
+//
+// The key is scheme, host and target; a response with Vary is stored per
+// value of the request fields it names (a few variants per target). The cache
+// is split into shards by key, a few per worker thread, each with its own
+// lock that is held only for the index update. Stored responses are immutable
+// and reference counted, so a hit is written to the client after the lock is
+// released, straight from the stored bytes, and eviction never waits for it.
+//
+// Each shard evicts by bytes with S3-FIFO: new responses enter a small FIFO
+// (a tenth of the shard's budget) and are dropped from it unless they were
+// hit while there, which moves them to the main FIFO; a response whose key
+// was recently dropped from the small FIFO goes straight to the main one.
+// The main FIFO gives a hit response another pass instead of dropping it.
+// A hit only bumps a counter, so reads never reorder a list, and one-off
+// responses (crawlers, scans) can't push out the ones that are reused.
+//
+// Misses are collapsed: while one request for a key is on its way to the
+// backend, identical misses wait for it instead of sending their own. When
+// its response is stored, every waiter is handed the same reference-counted
+// response; a waiter whose Vary fields don't match it, or whose wait
+// outlasts collapse_timeout_ms, or whose leader got nothing storable, goes to
+// the backend itself. Keys whose last response couldn't be stored aren't
+// collapsed for a while, so uncacheable URLs don't queue behind each other.
+class ResponseCache {
+public:
+    // Read a request field by lowercase name ("" when absent)
+    using RequestField = std::function<std::string_view(std::string_view)>;
+
+    // Called (on the leader's thread) with the response a collapsed miss
+    // waited for, or nullptr when none was stored
+    using Waiter = std::function<void(std::shared_ptr<const CachedResponse>)>;
+
+    // The one request for a key currently fetching it from the backend;
+    // completing it, or dropping it unfinished, wakes the misses waiting
+    class Flight {
+    public:
+        Flight() = default;
+        Flight(Flight&& other) noexcept : key_(std::move(other.key_)) { other.key_.clear(); }
+        Flight& operator=(Flight&& other) noexcept;
+        ~Flight() { complete(nullptr); }
+
+        Flight(const Flight&) = delete;
+        Flight& operator=(const Flight&) = delete;
+
+        explicit operator bool() const { return !key_.empty(); }
+
+        // Hand the stored response (nullptr if none) to the waiters;
+        // uncacheable: the backend's response can't be stored, so the next
+        // misses for the key don't wait for each other
+        void complete(std::shared_ptr<const CachedResponse> response, bool uncacheable = false);
+
+    private:
+        friend class ResponseCache;
+        std::string key_;
+    };
+
+    // Size the cache (call before worker threads start)
+    static void configure(const ResponseCacheConfig& config, int threads);
+
+    static bool enabled() { return capacity_ > 0; }
+
+    static bool collapsing() { return collapse_timeout_.count() > 0; }
+    static std::chrono::milliseconds collapse_timeout() { return collapse_timeout_; }
+
+    // Collapse a miss for key: true when an identical request is already on
+    // its way to the backend, and waiter will be called with its outcome.
+    // Otherwise the caller fetches the response itself, and if leader is
+    // given it becomes the flight the next misses wait for
+    static bool join(std::string_view key, Flight* leader, Waiter waiter);
+
+    // A collapsed miss that gave up waiting and went to the backend
+    static void record_collapse_fallback() { collapse_fallbacks_.fetch_add(1, std::memory_order_relaxed); }
+
+    // How the cache treats a request, from its method and header
+    static CacheMode request_mode(http::verb method, std::string_view cache_control,
+                                  std::string_view pragma, bool has_authorization, bool has_body);
+
+    // Write the key for a request to out (reusing its capacity)
+    static void make_key(std::string& out, bool https, std::string_view host, std::string_view target);
+
+    // Fresh response stored for key whose Vary fields match the request, in
+    // memory or else on disk, or nullptr
+    static std::shared_ptr<const CachedResponse> lookup(std::string_view key, const RequestField& request);
+
+    // Whether a conditional request is satisfied by response (answer 304)
+    static bool not_modified(const CachedResponse& response, std::string_view if_none_match,
+                             std::string_view if_modified_since);
+
+    // Drop every response stored for key
+    static void invalidate(std::string_view key);
+
+    // Start copying a response for key whose header (hop-by-hop fields
+    // already removed) has just arrived; nullptr when it can't be stored.
+    // One over max_object_size goes to the disk tier if it has a
+    // Content-Length that fits there
+    template<class Fields>
+    static std::unique_ptr<CachedResponse> begin(std::string_view key, const http::response_header<Fields>& res,
+                                                 const RequestField& request);
+
+    // Add body bytes to a response being copied; drops it once it grows over
+    // max_object_size
+    static void append(std::unique_ptr<CachedResponse>& response, const char* data, std::size_t size);
+
+    // Store a completely copied response; returns it, or nullptr when it's
+    // too large to keep
+    static std::shared_ptr<const CachedResponse> store(std::unique_ptr<CachedResponse> response);
+
+    static ResponseCacheStats stats();
+
+private:
+    // Cache-Control (and Expires) of a response, as far as a shared cache cares
+    struct Freshness {
+        bool storable = false;
+        std::chrono::seconds lifetime{0};
+        std::uint32_t age = 0;
+    };
+
+    static Freshness freshness(unsigned status, std::string_view cache_control, std::string_view expires,
+                               std::string_view date, std::string_view age);
+
+    // Set up key, vary and identity; false for Vary: *
+    static bool set_vary(CachedResponse& response, std::string_view key, std::string_view vary,
+                         const RequestField& request);
+
+    static void append_field(std::string& out, std::string_view name, std::string_view value);
+
+    // Hand a response whose header is complete to the disk tier (DiskCache::open)
+    static bool open_on_disk(CachedResponse& response, std::uint64_t body_size);
+
+    struct Node {
+        std::shared_ptr<const CachedResponse> response;
+        std::size_t bytes = 0;
+        std::uint8_t freq = 0;  // hits since it was queued, up to 3
+        bool main = false;      // in the main FIFO (else the small one)
+    };
+    using Queue = std::list<Node>;
+
+    struct StringHash {
+        using is_transparent = void;
+        std::size_t operator()(std::string_view key) const { return std::hash<std::string_view>{}(key); }
+    };
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        // Variants stored under each key, oldest first
+        std::unordered_map<std::string, std::vector<Queue::iterator>, StringHash, std::equal_to<>> index;
+        Queue small;
+        Queue main;
+        std::size_t small_bytes = 0;
+        std::size_t bytes = 0;
+        std::deque<std::uint64_t> ghost;  // identities recently dropped from small, oldest first
+        std::unordered_set<std::uint64_t> ghost_set;
+
+        // Keys being fetched by a leader, with the misses waiting for it
+        std::unordered_map<std::string, std::vector<Waiter>, StringHash, std::equal_to<>> flights;
+        // Keys whose last response couldn't be stored, until when they aren't collapsed
+        std::unordered_map<std::string, std::chrono::steady_clock::time_point, StringHash, std::equal_to<>> uncacheable;
+
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t stores = 0;
+        std::uint64_t evictions = 0;
+        std::uint64_t collapsed = 0;
+
+        // Make room for bytes more
+        void evict(std::size_t bytes, std::size_t capacity);
+        void erase(Queue::iterator node);
+        void remember(std::uint64_t identity);
+    };
+
+    static Shard& shard_for(std::string_view key);
+
+private:
+    static constexpr std::size_t kMaxVariants = 8;
+
+    static std::unique_ptr<Shard[]> shards_;
+    static std::size_t shard_count_;
+    static std::size_t shard_capacity_;  // bytes per shard
+    static std::size_t capacity_;
+    static std::size_t max_object_size_;
+    static std::uint64_t disk_max_object_size_;  // 0 without a disk tier
+    static std::chrono::milliseconds collapse_timeout_;
+    static std::atomic<std::uint64_t> not_modified_;
+    static std::atomic<std::uint64_t> collapse_fallbacks_;
+};
+
+template<class Fields>
+std::unique_ptr<CachedResponse> ResponseCache::begin(std::string_view key, const http::response_header<Fields>& res,
+                                                     const RequestField& request) {
+    auto view = [](beast::string_view value) { return std::string_view(value.data(), value.size()); };
+    if (res.find(http::field::set_cookie) != res.end()) {
+        return nullptr;
+    }
+    auto fresh = freshness(res.result_int(), view(res[http::field::cache_control]), view(res[http::field::expires]),
+                           view(res[http::field::date]), view(res[http::field::age]));
+    if (!fresh.storable) {
+        return nullptr;
+    }
+
+    std::uint64_t content_length = 0;
+    bool to_disk = false;
+    auto length = res.find(http::field::content_length);
+    if (length != res.end()) {
+        content_length = std::strtoull(std::string(view(length->value())).c_str(), nullptr, 10);
+        if (content_length > max_object_size_) {
+            if (content_length > disk_max_object_size_) {
+                return nullptr;
+            }
+            to_disk = true;
+        }
+    }
+
+    auto response = std::make_unique<CachedResponse>();
+    if (!set_vary(*response, key, view(res[http::field::vary]), request)) {
+        return nullptr;
+    }
+    response->status = res.result_int();
+    response->stored = std::chrono::steady_clock::now();
+    response->expires = response->stored + fresh.lifetime;
+    response->initial_age = fresh.age;
+    response->etag = view(res[http::field::etag]);
+    response->last_modified = view(res[http::field::last_modified]);
+    if (!to_disk) {
+        response->body.reserve(content_length);
+    }
+
+    // Framing is recomputed from the stored body and Age when served
+    response->head.append(" ").append(std::to_string(response->status)).append(" ")
+                  .append(view(res.reason())).append("\r\n");
+    response->not_modified.append(" 304 Not Modified\r\n");
+    for (const auto& field : res) {
+        switch (field.name()) {
+            case http::field::content_length:
+            case http::field::transfer_encoding:
+            case http::field::age:
+                break;
+            case http::field::cache_control:
+            case http::field::content_location:
+            case http::field::date:
+            case http::field::etag:
+            case http::field::expires:
+            case http::field::last_modified:
+            case http::field::vary:
+                // What RFC 9110 has a 304 repeat from the full response
+                append_field(response->not_modified, view(field.name_string()), view(field.value()));
+                [[fallthrough]];
+            default:
+                append_field(response->head, view(field.name_string()), view(field.value()));
+                break;
+        }
+    }
+    if (to_disk) {
+        append_field(response->head, "Content-Length", std::to_string(content_length));
+        if (!open_on_disk(*response, content_length)) {
+            return nullptr;
+        }
+    }
+    return response;
+}
+
+#endif // RESPONSE_CACHE_H
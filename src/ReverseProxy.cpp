@@ -1,12 +1,43 @@
 #include "ReverseProxy.h"
-#include <iostream>
+#include "Log.h"
+#include "AllocationCounter.h"
+#include <cstring>
 #include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+
+namespace {
+
+// Answer to connections over max_connections in "reject" mode
+constexpr char kOverloadedResponse[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Length: 0\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+// How often a paused accept loop checks for a free slot
+constexpr std::chrono::milliseconds kAcceptResumeInterval{10};
+
+// Domains of the sites served over TLS
+std::vector<std::string> tls_domains(const ProxyConfig& config) {
+    std::vector<std::string> domains;
+    for (const auto& site : config.sites) {
+        if (site.tls == "auto" || site.tls == "manual") {
+            domains.push_back(site.domain);
+        }
+    }
+    return domains;
+}
+
+} // namespace
 
 ReverseProxy::ReverseProxy() : running_(false) {
 }
 
 ReverseProxy::~ReverseProxy() {
     stop();
+    Log::stop();
 }
 
 bool ReverseProxy::initialize(const std::string& configPath) {
@@ -14,45 +45,104 @@ bool ReverseProxy::initialize(const std::string& configPath) {
         // Initialize configuration manager
         config_manager_ = ConfigManager::getInstance();
         if (!config_manager_->loadConfig(configPath)) {
-            std::cerr << "Failed to load configuration from: " << configPath << std::endl;
+            Log::error() << "Failed to load configuration from: " << configPath;
             return false;
         }
         
         const auto& config = config_manager_->getConfig();
         
-        // Initialize request router
-        router_ = std::make_shared<RequestRouter>(config_manager_);
+        // Create io_contexts: one shared by all threads, or one per thread
+        thread_count_ = config.worker_threads > 0
+            ? config.worker_threads
+            : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        thread_per_core_ = config.thread_per_core;
+        
+        int worker_count = thread_per_core_ ? thread_count_ : 1;
+        for (int i = 0; i < worker_count; ++i) {
+            auto worker = std::make_unique<Worker>();
+            worker->ioc = std::make_unique<net::io_context>(thread_per_core_ ? 1 : thread_count_);
+            workers_.push_back(std::move(worker));
+        }
+        
+        // Backends are parsed once and resolved in the background
+        resolver_ = std::make_shared<BackendResolver>(*workers_[0]->ioc, std::chrono::seconds(config.dns_ttl_seconds));
+        
+        // Initialize request router (builds the routing table and registers backends)
+        router_ = std::make_shared<RequestRouter>(config_manager_, resolver_);
+        
+        // Configure backend keep-alive connection pool
+        BackendConnectionPool::configure(config.upstream_pool);
+        
+        // Response cache shards, a few per worker thread, and the disk tier
+        // they pass large responses to
+        if (config.response_cache.memory_mb > 0) {
+            DiskCache::configure(config.response_cache, config.cache_dir);
+        }
+        ResponseCache::configure(config.response_cache, thread_count_);
+        
+        // Per-thread open file caches of root sites
+        StaticFiles::configure(config.static_files);
+        
+        // Limit open client connections
+        configure_admission(config);
+        
+        // Backend health checks run on the first worker's timers
+        health_checker_ = std::make_shared<HealthChecker>(*workers_[0]->ioc, router_);
+        configure_health(config);
         
         // Initialize certificate manager
         cert_manager_ = std::make_shared<CertificateManager>(config.cert_dir, config.email);
         
-        // Setup HTTP acceptor
-        http_acceptor_ = std::make_unique<tcp::acceptor>(ioc_, tcp::endpoint(tcp::v4(), config.http_port));
+        // TLS handshakes run on their own threads
+        handshake_pool_ = std::make_unique<HandshakePool>(config.tls_handshake.threads,
+                                                          config.tls_handshake.max_pending);
         
-        // Setup HTTPS acceptor if needed
-        bool needs_https = false;
-        for (const auto& site : config.sites) {
-            if (site.tls == "auto" || site.tls == "manual") {
-                needs_https = true;
-                break;
-            }
+        // Setup HTTP acceptors
+        for (auto& worker : workers_) {
+            worker->http_acceptor = make_acceptor(*worker->ioc, config.http_port, thread_per_core_);
+            worker->http_resume_timer = std::make_unique<net::steady_timer>(*worker->ioc);
         }
         
+        // Setup HTTPS acceptors if needed
+        bool needs_https = !tls_domains(config).empty();
+        
         if (needs_https) {
-            https_acceptor_ = std::make_unique<tcp::acceptor>(ioc_, tcp::endpoint(tcp::v4(), config.https_port));
+            for (auto& worker : workers_) {
+                worker->https_acceptor = make_acceptor(*worker->ioc, config.https_port, thread_per_core_);
+                worker->https_resume_timer = std::make_unique<net::steady_timer>(*worker->ioc);
+            }
             setup_ssl_context();
         }
         
-        std::cout << "Reverse proxy initialized successfully" << std::endl;
-        std::cout << "HTTP server listening on port: " << config.http_port << std::endl;
+        // Prometheus endpoint, served from the control thread
+        if (config.metrics.enabled) {
+            metrics_server_ = std::make_unique<MetricsServer>(control_ioc_, config.metrics,
+                                                              ssl_ctx_ ? handshake_pool_.get() : nullptr);
+        }
+        
+        // Access log and diagnostics are written by a background thread from here on
+        if (!Log::start(config.access_log)) {
+            return false;
+        }
+        
+        Log::info() << "Reverse proxy initialized successfully";
+        Log::info() << "HTTP server listening on port: " << config.http_port;
         if (needs_https) {
-            std::cout << "HTTPS server listening on port: " << config.https_port << std::endl;
+            Log::info() << "HTTPS server listening on port: " << config.https_port;
+        }
+        if (metrics_server_) {
+            Log::info() << "Metrics served at http://" << config.metrics.address << ":"
+                        << config.metrics.port << config.metrics.path;
+        }
+        if (config.access_log.enabled) {
+            Log::info() << "Access log written to " << config.access_log.path
+                        << " (" << config.access_log.format << ")";
         }
         
         return true;
         
     } catch (const std::exception& e) {
-        std::cerr << "Error initializing reverse proxy: " << e.what() << std::endl;
+        Log::error() << "Error initializing reverse proxy: " << e.what();
         return false;
     }
 }
@@ -65,25 +155,48 @@ void ReverseProxy::run() {
     running_ = true;
     
     // Start accepting connections
-    start_http_server();
-    if (https_acceptor_) {
-        start_https_server();
+    for (auto& worker : workers_) {
+        start_http_server(*worker);
+        if (worker->https_acceptor) {
+            start_https_server(*worker);
+        }
     }
     
     // Create worker threads
-    const auto& config = config_manager_->getConfig();
-    int thread_count = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
-    
-    std::cout << "Starting " << thread_count << " worker threads" << std::endl;
+    Log::info() << "Starting " << thread_count_ << " worker threads"
+                << (thread_per_core_ ? " (one io_context per thread)" : "");
     
-    threads_.reserve(thread_count);
-    for (int i = 0; i < thread_count; ++i) {
-        threads_.emplace_back([this] {
-            ioc_.run();
+    threads_.reserve(thread_count_);
+    for (int i = 0; i < thread_count_; ++i) {
+        net::io_context& ioc = *workers_[thread_per_core_ ? i : 0]->ioc;
+        threads_.emplace_back([this, i, &ioc] {
+            pin_thread(i);
+            ioc.run();
         });
     }
     
-    std::cout << "Reverse proxy is running..." << std::endl;
+    Log::info() << "Reverse proxy is running...";
+    
+    // Handle signals and config changes on this thread until stop()
+    const auto& config = config_manager_->getConfig();
+    signals_ = std::make_unique<net::signal_set>(control_ioc_, SIGINT, SIGTERM, SIGHUP);
+    wait_for_signal();
+    if (config.config_reload.watch) {
+        config_watcher_ = std::make_unique<ConfigWatcher>(control_ioc_, config_manager_->getConfigPath(),
+            std::chrono::milliseconds(config.config_reload.debounce_ms), [this] { reload_config(); });
+        config_watcher_->start();
+    }
+    if (ssl_ctx_) {
+        handshake_pool_->start();
+    }
+    if (ssl_ctx_ && config.tls_sessions.tickets) {
+        ticket_key_timer_ = std::make_unique<net::steady_timer>(control_ioc_);
+        schedule_ticket_key_rotation();
+    }
+    if (metrics_server_) {
+        metrics_server_->start();
+    }
+    control_ioc_.run();
     
     // Wait for all threads to complete
     for (auto& thread : threads_) {
@@ -100,18 +213,30 @@ void ReverseProxy::stop() {
     
     running_ = false;
     
-    std::cout << "Stopping reverse proxy..." << std::endl;
+    Log::info() << "Stopping reverse proxy...";
     
     // Stop acceptors
-    if (http_acceptor_) {
-        http_acceptor_->close();
+    for (auto& worker : workers_) {
+        beast::error_code ec;
+        if (worker->http_acceptor) {
+            worker->http_acceptor->close(ec);
+        }
+        if (worker->https_acceptor) {
+            worker->https_acceptor->close(ec);
+        }
+    }
+    
+    if (resolver_) {
+        resolver_->stop();
     }
-    if (https_acceptor_) {
-        https_acceptor_->close();
+    if (health_checker_) {
+        health_checker_->stop();
     }
     
-    // Stop IO context
-    ioc_.stop();
+    // Stop IO contexts
+    for (auto& worker : workers_) {
+        worker->ioc->stop();
+    }
     
     // Wait for threads to finish
     for (auto& thread : threads_) {
@@ -121,93 +246,525 @@ void ReverseProxy::stop() {
     }
     
     threads_.clear();
+    if (handshake_pool_) {
+        handshake_pool_->stop();
+    }
+    DiskCache::close();
     
-    std::cout << "Reverse proxy stopped" << std::endl;
+    // Let run() return
+    if (signals_) {
+        beast::error_code ec;
+        signals_->cancel(ec);
+    }
+    if (config_watcher_) {
+        config_watcher_->stop();
+    }
+    if (metrics_server_) {
+        metrics_server_->stop();
+    }
+    control_ioc_.stop();
+    
+    auto pool_stats = BackendConnectionPool::stats();
+    Log::info() << "Backend pool: " << pool_stats.hits << " hits, "
+                << pool_stats.misses << " misses, "
+                << pool_stats.evictions << " evictions";
+    Log::info() << "Connections over max_connections: " << AdmissionController::rejected();
+    if (ResponseCache::enabled()) {
+        auto cache_stats = ResponseCache::stats();
+        Log::info() << "Response cache: " << cache_stats.hits << " hits ("
+                    << cache_stats.not_modified << " answered 304), " << cache_stats.misses << " misses ("
+                    << static_cast<int>(cache_stats.hit_ratio() * 100) << "% hit ratio), "
+                    << cache_stats.stores << " stored, " << cache_stats.evictions << " evicted, "
+                    << cache_stats.collapsed << " collapsed (" << cache_stats.collapse_fallbacks
+                    << " fell back)";
+    }
+    if (DiskCache::enabled()) {
+        auto disk_stats = DiskCache::stats();
+        Log::info() << "Disk cache: " << disk_stats.hits << " hits, " << disk_stats.misses << " misses, "
+                    << disk_stats.stores << " stored, " << disk_stats.evictions << " evicted, "
+                    << disk_stats.entries << " kept";
+    }
+    if (ssl_ctx_) {
+        auto tls_stats = TlsSessionCache::stats();
+        Log::info() << "TLS handshakes: " << tls_stats.full_handshakes << " full, "
+                    << tls_stats.resumed_handshakes << " resumed ("
+                    << static_cast<int>(tls_stats.resumption_rate() * 100) << "%); session cache "
+                    << tls_stats.cache_hits << " hits, " << tls_stats.cache_misses << " misses; tickets "
+                    << tls_stats.tickets_accepted << " accepted, " << tls_stats.tickets_rejected
+                    << " rejected";
+        Log::info() << "TLS handshakes refused over max_pending: " << handshake_pool_->refused();
+        if (ktls_) {
+            auto ktls_stats = Ktls::stats();
+            Log::info() << "Kernel TLS: " << ktls_stats.offloaded << " connections offloaded, "
+                        << ktls_stats.fallback << " encrypted in userspace";
+        }
+    }
+    if (config_manager_->getConfig().access_log.enabled) {
+        auto log_stats = Log::access_stats();
+        Log::info() << "Access log: " << log_stats.logged << " logged, " << log_stats.dropped
+                    << " dropped, " << log_stats.sampled_out << " sampled out";
+    }
+    
+    Log::info() << "Reverse proxy stopped";
+    
+    // Write out what is still queued; later messages are written directly
+    Log::stop();
 }
 
-void ReverseProxy::start_http_server() {
-    accept_http_connections();
+void ReverseProxy::reload_config() {
+    auto started = std::chrono::steady_clock::now();
+    auto allocations_before = thread_allocations();
+    
+    // Parse and compile the new configuration on this thread; workers keep
+    // serving from the current snapshot until the swap
+    auto config = ConfigManager::parseConfig(config_manager_->getConfigPath());
+    if (!config) {
+        Log::warn() << "Config reload failed, keeping the current configuration";
+        return;
+    }
+    warn_restart_required(*config);
+    configure_admission(*config);
+    auto snapshot = router_->reload(config);
+    configure_health(*config);
+    reload_certificates(*config);
+    
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - started);
+    auto allocations = thread_allocations() - allocations_before;
+    Log::info() << "Configuration reloaded (generation " << snapshot->generation << ", "
+                << snapshot->routes.size() << " sites) in " << elapsed.count() << " us, "
+                << allocations.count << " allocations, " << allocations.bytes << " bytes";
 }
 
-void ReverseProxy::start_https_server() {
-    accept_https_connections();
+void ReverseProxy::reload_certificates(const ProxyConfig& config) {
+    auto domains = tls_domains(config);
+    if (!cert_store_) {
+        if (!domains.empty()) {
+            Log::warn() << "Config reload: TLS sites are served after a restart (no HTTPS listener)";
+        }
+        return;
+    }
+    
+    // Certificates for new sites, and changed certificate files, are loaded
+    // here and swapped in; handshakes in progress keep the context they chose
+    cert_manager_->load_certificates(domains, *cert_store_);
+}
+
+void ReverseProxy::schedule_ticket_key_rotation() {
+    int interval = config_manager_->getConfig().tls_sessions.ticket_key_rotation_seconds;
+    ticket_key_timer_->expires_after(std::chrono::seconds(interval));
+    ticket_key_timer_->async_wait([this](beast::error_code ec) {
+        if (ec) {
+            return;
+        }
+        TlsSessionCache::rotate_ticket_keys();
+        schedule_ticket_key_rotation();
+    });
+}
+
+void ReverseProxy::wait_for_signal() {
+    signals_->async_wait([this](beast::error_code ec, int signal) {
+        if (ec) {
+            return;
+        }
+        
+        if (signal == SIGHUP) {
+            Log::info() << "Received SIGHUP, reloading configuration...";
+            Log::reopen();
+            reload_config();
+            wait_for_signal();
+            return;
+        }
+        
+        Log::info() << "Received signal " << signal << ", shutting down...";
+        stop();
+    });
+}
+
+void ReverseProxy::warn_restart_required(const ProxyConfig& reloaded) const {
+    const auto& current = config_manager_->getConfig();
+    auto warn = [](const char* setting) {
+        Log::warn() << "Config reload: change to " << setting << " takes effect after a restart";
+    };
+    
+    if (reloaded.http_port != current.http_port || reloaded.https_port != current.https_port) {
+        warn("http_port/https_port");
+    }
+    if (reloaded.worker_threads != current.worker_threads ||
+        reloaded.thread_per_core != current.thread_per_core ||
+        reloaded.cpu_affinity != current.cpu_affinity ||
+        reloaded.cpu_list != current.cpu_list) {
+        warn("threading");
+    }
+    if (reloaded.upstream_pool.enabled != current.upstream_pool.enabled ||
+        reloaded.upstream_pool.max_idle_per_backend != current.upstream_pool.max_idle_per_backend ||
+        reloaded.upstream_pool.idle_timeout_seconds != current.upstream_pool.idle_timeout_seconds ||
+        reloaded.upstream_pool.max_requests_per_connection != current.upstream_pool.max_requests_per_connection) {
+        warn("upstream_pool");
+    }
+    if (reloaded.dns_ttl_seconds != current.dns_ttl_seconds) {
+        warn("dns_ttl_seconds");
+    }
+    if (reloaded.cert_dir != current.cert_dir || reloaded.email != current.email) {
+        warn("cert_dir/email");
+    }
+    if (reloaded.tls_handshake.threads != current.tls_handshake.threads ||
+        reloaded.tls_handshake.max_pending != current.tls_handshake.max_pending) {
+        warn("tls_handshake");
+    }
+    if (reloaded.ktls != current.ktls) {
+        warn("ktls");
+    }
+    if (reloaded.tls_sessions.cache_size != current.tls_sessions.cache_size ||
+        reloaded.tls_sessions.cache_timeout_seconds != current.tls_sessions.cache_timeout_seconds ||
+        reloaded.tls_sessions.tickets != current.tls_sessions.tickets ||
+        reloaded.tls_sessions.ticket_key_rotation_seconds != current.tls_sessions.ticket_key_rotation_seconds) {
+        warn("tls_sessions");
+    }
+    if (reloaded.metrics.enabled != current.metrics.enabled ||
+        reloaded.metrics.address != current.metrics.address ||
+        reloaded.metrics.port != current.metrics.port ||
+        reloaded.metrics.path != current.metrics.path) {
+        warn("metrics");
+    }
+    if (reloaded.access_log.enabled != current.access_log.enabled ||
+        reloaded.access_log.path != current.access_log.path ||
+        reloaded.access_log.format != current.access_log.format ||
+        reloaded.access_log.sample_rate != current.access_log.sample_rate ||
+        reloaded.access_log.buffer_size != current.access_log.buffer_size ||
+        reloaded.access_log.max_size_mb != current.access_log.max_size_mb ||
+        reloaded.access_log.max_files != current.access_log.max_files ||
+        reloaded.access_log.flush_interval_ms != current.access_log.flush_interval_ms) {
+        warn("access_log");
+    }
+    if (reloaded.response_cache.memory_mb != current.response_cache.memory_mb ||
+        reloaded.response_cache.max_object_size != current.response_cache.max_object_size ||
+        reloaded.response_cache.collapse_timeout_ms != current.response_cache.collapse_timeout_ms ||
+        reloaded.response_cache.disk_mb != current.response_cache.disk_mb ||
+        reloaded.response_cache.disk_slab_mb != current.response_cache.disk_slab_mb ||
+        reloaded.response_cache.disk_max_object_size != current.response_cache.disk_max_object_size ||
+        reloaded.cache_dir != current.cache_dir) {
+        warn("response_cache/cache_dir");
+    }
+    if (reloaded.static_files.open_file_cache != current.static_files.open_file_cache ||
+        reloaded.static_files.open_file_valid_seconds != current.static_files.open_file_valid_seconds) {
+        warn("static_files");
+    }
 }
 
-void ReverseProxy::accept_http_connections() {
-    http_acceptor_->async_accept(
-        [this](beast::error_code ec, tcp::socket socket) {
-            on_http_accept(ec, std::move(socket));
+void ReverseProxy::start_http_server(Worker& worker) {
+    accept_http_connections(worker);
+}
+
+void ReverseProxy::start_https_server(Worker& worker) {
+    accept_https_connections(worker);
+}
+
+void ReverseProxy::accept_http_connections(Worker& worker) {
+    worker.http_acceptor->async_accept(connection_executor(worker),
+        [this, &worker](beast::error_code ec, tcp::socket socket) {
+            on_http_accept(worker, ec, std::move(socket));
         });
 }
 
-void ReverseProxy::accept_https_connections() {
-    https_acceptor_->async_accept(
-        [this](beast::error_code ec, tcp::socket socket) {
-            on_https_accept(ec, std::move(socket));
+void ReverseProxy::accept_https_connections(Worker& worker) {
+    worker.https_acceptor->async_accept(connection_executor(worker),
+        [this, &worker](beast::error_code ec, tcp::socket socket) {
+            on_https_accept(worker, ec, std::move(socket));
         });
 }
 
-void ReverseProxy::on_http_accept(beast::error_code ec, tcp::socket socket) {
+void ReverseProxy::on_http_accept(Worker& worker, beast::error_code ec, tcp::socket socket) {
     if (ec) {
-        std::cerr << "HTTP accept error: " << ec.message() << std::endl;
-    } else {
+        if (ec != net::error::operation_aborted) {
+            Log::warn() << "HTTP accept error: " << ec.message();
+        }
+    } else if (auto slot = AdmissionController::admit()) {
         // Create connection handler for HTTP
         auto handler = std::make_shared<ConnectionHandler>(std::move(socket), router_, false);
+        handler->hold_admission_slot(std::move(slot));
         handler->start();
+    } else {
+        reject_connection(std::move(socket), false);
     }
     
     // Continue accepting connections
-    if (running_) {
-        accept_http_connections();
-    }
+    continue_accepting(worker, false);
 }
 
-void ReverseProxy::on_https_accept(beast::error_code ec, tcp::socket socket) {
+void ReverseProxy::on_https_accept(Worker& worker, beast::error_code ec, tcp::socket socket) {
     if (ec) {
-        std::cerr << "HTTPS accept error: " << ec.message() << std::endl;
+        if (ec != net::error::operation_aborted) {
+            Log::warn() << "HTTPS accept error: " << ec.message();
+        }
+    } else if (auto slot = AdmissionController::admit()) {
+        // Past max_pending handshakes the client is turned away at once
+        if (auto reservation = handshake_pool_->reserve()) {
+            start_handshake(std::move(socket), std::move(slot), std::move(reservation));
+        } else {
+            beast::error_code ignored;
+            socket.close(ignored);
+        }
     } else {
-        // Create SSL stream and connection handler for HTTPS
-        beast::ssl_stream<beast::tcp_stream> ssl_stream(std::move(socket), *ssl_ctx_);
-        
-        // Perform SSL handshake
-        ssl_stream.async_handshake(ssl::stream_base::server,
-            [this, ssl_stream = std::move(ssl_stream)](beast::error_code ec) mutable {
-                if (ec) {
-                    std::cerr << "SSL handshake error: " << ec.message() << std::endl;
+        reject_connection(std::move(socket), true);
+    }
+    
+    // Continue accepting connections
+    continue_accepting(worker, true);
+}
+
+void ReverseProxy::start_handshake(tcp::socket socket, AdmissionController::Slot slot,
+                                   HandshakePool::Reservation reservation) {
+    // Everything the handshake needs, kept in one place while it runs
+    struct Handshake {
+        Handshake(tcp::socket&& socket, ssl::context& ctx, const net::any_io_executor& executor)
+            : stream(std::move(socket), ctx), deadline(executor) {}
+        
+        beast::ssl_stream<beast::tcp_stream> stream;
+        net::steady_timer deadline;
+        AdmissionController::Slot slot;
+        HandshakePool::Reservation reservation;
+        bool done = false;
+    };
+    
+    // The handshake's steps (and its deadline) run on a strand of the
+    // handshake pool; the socket itself stays with the worker
+    auto executor = handshake_pool_->executor(socket.get_executor());
+    auto handshake = std::make_shared<Handshake>(std::move(socket), *ssl_ctx_, executor);
+    handshake->slot = std::move(slot);
+    handshake->reservation = std::move(reservation);
+    
+    // Bounded like a request header read
+    int handshake_timeout = router_->snapshot()->config->timeouts.header_read_seconds;
+    if (handshake_timeout > 0) {
+        handshake->deadline.expires_after(std::chrono::seconds(handshake_timeout));
+        handshake->deadline.async_wait([handshake](beast::error_code ec) {
+            if (!ec && !handshake->done) {
+                beast::error_code ignored;
+                beast::get_lowest_layer(handshake->stream).socket().close(ignored);
+            }
+        });
+    }
+    
+    handshake->stream.async_handshake(ssl::stream_base::server, net::bind_executor(executor,
+        [this, handshake](beast::error_code ec) {
+            handshake->done = true;
+            handshake->deadline.cancel();
+            handshake->reservation.reset();
+            if (ec) {
+                Log::debug() << "SSL handshake error: " << ec.message();
+                Metrics::record_tls_handshake_error();
+                return;
+            }
+            TlsSessionCache::record_handshake(handshake->stream.native_handle());
+            
+            // The kernel takes the key before anything is written. Frame
+            // relays write through OpenSSL, so their sites stay in userspace.
+            SSL* ssl = handshake->stream.native_handle();
+            bool ktls = false;
+            if (ktls_ && serves_websocket_frames(ssl)) {
+                Ktls::skip(ssl);
+            } else if (ktls_) {
+                ktls = Ktls::enable_tx(ssl, beast::get_lowest_layer(handshake->stream).socket().native_handle());
+            }
+            
+            // Serve the connection back on its worker
+            auto connection_executor = handshake->stream.get_executor();
+            net::post(connection_executor, [this, handshake, ktls] {
+                // ALPN picked the protocol during the handshake
+                const unsigned char* protocol = nullptr;
+                unsigned int protocol_length = 0;
+                SSL_get0_alpn_selected(handshake->stream.native_handle(), &protocol, &protocol_length);
+                if (protocol_length == 2 && std::memcmp(protocol, "h2", 2) == 0) {
+                    auto handler = std::make_shared<Http2Handler>(std::move(handshake->stream), router_, ktls);
+                    handler->hold_admission_slot(std::move(handshake->slot));
+                    handler->start();
                     return;
                 }
                 
-                auto handler = std::make_shared<ConnectionHandler>(std::move(ssl_stream), router_);
+                auto handler = std::make_shared<ConnectionHandler>(std::move(handshake->stream), router_, ktls);
+                handler->hold_admission_slot(std::move(handshake->slot));
                 handler->start();
             });
+        }));
+}
+
+void ReverseProxy::continue_accepting(Worker& worker, bool https) {
+    if (!running_) {
+        return;
     }
     
-    // Continue accepting connections
-    if (running_) {
-        accept_https_connections();
+    // In "pause" mode new connections wait in the listen backlog until a
+    // slot frees up, instead of being accepted only to be turned away
+    if (AdmissionController::overload_action() == AdmissionController::OverloadAction::pause &&
+        !AdmissionController::has_capacity()) {
+        auto& timer = https ? *worker.https_resume_timer : *worker.http_resume_timer;
+        timer.expires_after(kAcceptResumeInterval);
+        timer.async_wait([this, &worker, https](beast::error_code ec) {
+            if (!ec) {
+                continue_accepting(worker, https);
+            }
+        });
+        return;
+    }
+    
+    if (https) {
+        accept_https_connections(worker);
+    } else {
+        accept_http_connections(worker);
     }
 }
 
-void ReverseProxy::setup_ssl_context() {
-    ssl_ctx_ = std::make_unique<ssl::context>(ssl::context::tlsv12);
+void ReverseProxy::reject_connection(tcp::socket socket, bool https) {
+    beast::error_code ec;
     
-    ssl_ctx_->set_options(
+    // A TLS client can't read a plain-text 503, and in "pause" mode (when
+    // several acceptors raced for the last slot) the peer is simply closed
+    if (https || AdmissionController::overload_action() == AdmissionController::OverloadAction::pause) {
+        socket.close(ec);
+        return;
+    }
+    
+    auto rejected = std::make_shared<tcp::socket>(std::move(socket));
+    net::async_write(*rejected, net::buffer(kOverloadedResponse, sizeof(kOverloadedResponse) - 1),
+        [rejected](beast::error_code ec, std::size_t) {
+            rejected->shutdown(tcp::socket::shutdown_both, ec);
+            rejected->close(ec);
+        });
+}
+
+void ReverseProxy::configure_admission(const ProxyConfig& config) {
+    AdmissionController::configure(config.max_connections,
+        config.overload_action == "pause" ? AdmissionController::OverloadAction::pause
+                                          : AdmissionController::OverloadAction::reject);
+}
+
+void ReverseProxy::configure_health(const ProxyConfig& config) {
+    BackendHealth::configure(config.outlier_detection);
+    health_checker_->configure(config.health_check);
+}
+
+std::unique_ptr<tcp::acceptor> ReverseProxy::make_acceptor(net::io_context& ioc, int port, bool reuse_port) {
+    tcp::endpoint endpoint(tcp::v4(), static_cast<unsigned short>(port));
+    auto acceptor = std::make_unique<tcp::acceptor>(ioc);
+    
+    acceptor->open(endpoint.protocol());
+    acceptor->set_option(net::socket_base::reuse_address(true));
+    if (reuse_port) {
+        acceptor->set_option(net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+    }
+    
+    // Accepted sockets inherit TCP_NODELAY (Linux): a response header and
+    // its body are separate writes and must not wait for the client's ACK
+    acceptor->set_option(tcp::no_delay(true));
+    acceptor->bind(endpoint);
+    acceptor->listen(net::socket_base::max_listen_connections);
+    
+    return acceptor;
+}
+
+net::any_io_executor ReverseProxy::connection_executor(Worker& worker) {
+    // With one thread per io_context every handler is already serialized;
+    // shared contexts need a strand so a connection's handlers never overlap
+    if (thread_per_core_) {
+        return worker.ioc->get_executor();
+    }
+    return net::make_strand(*worker.ioc);
+}
+
+void ReverseProxy::pin_thread(int index) {
+    const auto& config = config_manager_->getConfig();
+    if (!config.cpu_affinity) {
+        return;
+    }
+    
+    int cpu = config.cpu_list.empty()
+        ? index % std::max(1, static_cast<int>(std::thread::hardware_concurrency()))
+        : config.cpu_list[index % config.cpu_list.size()];
+    
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (rc != 0) {
+        Log::warn() << "Failed to pin worker thread " << index << " to CPU " << cpu;
+    }
+}
+
+int ReverseProxy::select_alpn_protocol(SSL*, const unsigned char** out, unsigned char* out_length,
+                                       const unsigned char* in, unsigned int in_length, void* arg) {
+    static constexpr unsigned char kWithHttp2[] = "\x02h2\x08http/1.1";
+    static constexpr unsigned char kHttp1Only[] = "\x08http/1.1";
+    
+    auto* router = static_cast<RequestRouter*>(arg);
+    bool http2 = router->snapshot()->config->http2.enabled;
+    const unsigned char* server = http2 ? kWithHttp2 : kHttp1Only;
+    unsigned int server_length = http2 ? sizeof(kWithHttp2) - 1 : sizeof(kHttp1Only) - 1;
+    
+    // Our preference order wins; without a common protocol the handshake
+    // goes ahead without ALPN (HTTP/1.1)
+    unsigned char* selected = nullptr;
+    if (SSL_select_next_proto(&selected, out_length, server, server_length, in, in_length) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+void ReverseProxy::configure_ssl_context(ssl::context& ctx) {
+    // TLS 1.2 and 1.3
+    ctx.set_options(
         ssl::context::default_workarounds |
         ssl::context::no_sslv2 |
         ssl::context::no_sslv3 |
+        ssl::context::no_tlsv1 |
+        ssl::context::no_tlsv1_1 |
         ssl::context::single_dh_use);
     
-    // For now, use a default certificate
-    // In production, you would set up SNI callback to select appropriate certificate
-    const auto& config = config_manager_->getConfig();
-    if (!config.sites.empty()) {
-        const auto& first_site = config.sites[0];
-        if (first_site.tls == "auto" || first_site.tls == "manual") {
-            try {
-                cert_manager_->setup_ssl_context(*ssl_ctx_, first_site.domain);
-            } catch (const std::exception& e) {
-                std::cerr << "Warning: Failed to setup SSL context: " << e.what() << std::endl;
-            }
+    // Sessions are resumable whichever site's context SNI selected
+    static constexpr unsigned char kSessionIdContext[] = "pristine";
+    SSL_CTX_set_session_id_context(ctx.native_handle(), kSessionIdContext, sizeof(kSessionIdContext) - 1);
+    
+    // Offer HTTP/2 through ALPN while it is enabled (checked per handshake,
+    // so a reload can switch it off)
+    SSL_CTX_set_alpn_select_cb(ctx.native_handle(), &ReverseProxy::select_alpn_protocol, router_.get());
+    
+    if (ktls_) {
+        Ktls::configure(ctx.native_handle());
+    }
+}
+
+bool ReverseProxy::serves_websocket_frames(SSL* ssl) const {
+    const char* server_name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (!server_name) {
+        return false;
+    }
+    const Route* route = router_->snapshot()->routes.find(server_name);
+    return route && route->websocket_frames;
+}
+
+void ReverseProxy::setup_ssl_context() {
+    ktls_ = config_manager_->getConfig().ktls;
+    ssl_ctx_ = std::make_unique<ssl::context>(ssl::context::tls_server);
+    configure_ssl_context(*ssl_ctx_);
+    
+    // Session cache and tickets live on the listener's context
+    TlsSessionCache::configure(ssl_ctx_->native_handle(), config_manager_->getConfig().tls_sessions);
+    
+    // Every TLS site's certificate is loaded into the store up front; the
+    // SNI callback switches the handshake to the matching site's context
+    cert_store_ = std::make_unique<CertificateStore>([this](ssl::context& ctx) { configure_ssl_context(ctx); });
+    auto domains = tls_domains(config_manager_->getConfig());
+    cert_manager_->load_certificates(domains, *cert_store_);
+    SSL_CTX_set_tlsext_servername_callback(ssl_ctx_->native_handle(), &CertificateStore::on_server_name);
+    SSL_CTX_set_tlsext_servername_arg(ssl_ctx_->native_handle(), cert_store_.get());
+    
+    // Clients without SNI (or with an unknown name) get the first TLS site's certificate
+    if (!domains.empty()) {
+        try {
+            cert_manager_->setup_ssl_context(*ssl_ctx_, domains.front());
+        } catch (const std::exception& e) {
+            Log::warn() << "Warning: Failed to setup SSL context: " << e.what();
         }
     }
 }
@@ -5,10 +5,26 @@
 #include "RequestRouter.h"
 #include "ConnectionHandler.h"
 #include "CertificateManager.h"
+#include "CertificateStore.h"
+#include "TlsSessionCache.h"
+#include "HandshakePool.h"
+#include "Ktls.h"
+#include "ConfigWatcher.h"
+#include "HealthChecker.h"
+#include "AdmissionController.h"
+#include "MetricsServer.h"
+#include "Metrics.h"
+#include "ResponseCache.h"
+#include "DiskCache.h"
+#include "StaticFiles.h"
 #include <boost/beast/core.hpp>
 #include <boost/beast/ssl.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/signal_set.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/ssl/context.hpp>
+#include <boost/asio/strand.hpp>
+#include <atomic>
 #include <memory>
 #include <thread>
 #include <vector>
@@ -24,37 +40,112 @@ public:
     ~ReverseProxy();
     
     bool initialize(const std::string& configPath);
+    
+    // Serve until SIGINT/SIGTERM; the calling thread handles signals and
+    // configuration reloads while the worker threads serve connections
     void run();
     void stop();
+    
+    // Re-read the configuration file and publish it to new requests
+    void reload_config();
 
 private:
-    void start_http_server();
-    void start_https_server();
-    void accept_http_connections();
-    void accept_https_connections();
-    void on_http_accept(beast::error_code ec, tcp::socket socket);
-    void on_https_accept(beast::error_code ec, tcp::socket socket);
+    // An io_context with its own acceptors. In the default mode a single worker
+    // is shared by all threads; with thread_per_core each thread owns one worker
+    // and the kernel spreads connections over its SO_REUSEPORT acceptors.
+    struct Worker {
+        std::unique_ptr<net::io_context> ioc;
+        std::unique_ptr<tcp::acceptor> http_acceptor;
+        std::unique_ptr<tcp::acceptor> https_acceptor;
+        
+        // Re-check capacity while accepting is paused at max_connections
+        std::unique_ptr<net::steady_timer> http_resume_timer;
+        std::unique_ptr<net::steady_timer> https_resume_timer;
+    };
+    
+    void start_http_server(Worker& worker);
+    void start_https_server(Worker& worker);
+    void accept_http_connections(Worker& worker);
+    void accept_https_connections(Worker& worker);
+    void on_http_accept(Worker& worker, beast::error_code ec, tcp::socket socket);
+    void on_https_accept(Worker& worker, beast::error_code ec, tcp::socket socket);
+    
+    // Re-arm an accept loop, or pause it while max_connections are open
+    void continue_accepting(Worker& worker, bool https);
+    
+    // Turn away a connection over max_connections
+    void reject_connection(tcp::socket socket, bool https);
+    
+    // Apply max_connections and overload_action
+    static void configure_admission(const ProxyConfig& config);
+    
+    // Apply health_check and outlier_detection
+    void configure_health(const ProxyConfig& config);
+    
+    // Listening socket, optionally sharing its port with other workers
+    std::unique_ptr<tcp::acceptor> make_acceptor(net::io_context& ioc, int port, bool reuse_port);
+    
+    // Executor for a new connection; shared contexts need a strand per connection
+    net::any_io_executor connection_executor(Worker& worker);
+    
+    // Pin the calling thread to a CPU
+    void pin_thread(int index);
+    
+    // TLS handshake of an accepted HTTPS connection, on the handshake pool
+    void start_handshake(tcp::socket socket, AdmissionController::Slot slot,
+                         HandshakePool::Reservation reservation);
     
     // SSL context setup
     void setup_ssl_context();
+    
+    // Options and ALPN shared by the listener's context and every site's
+    void configure_ssl_context(ssl::context& ctx);
+    
+    // Whether the SNI name belongs to a site relaying WebSocket frames
+    bool serves_websocket_frames(SSL* ssl) const;
+    
+    // Load certificates for the TLS sites of a reloaded config
+    void reload_certificates(const ProxyConfig& config);
+    
+    // Replace the session ticket key every ticket_key_rotation_seconds
+    void schedule_ticket_key_rotation();
+    
+    // ALPN: "h2" when HTTP/2 is enabled in the current config, else "http/1.1"
+    static int select_alpn_protocol(SSL* ssl, const unsigned char** out, unsigned char* out_length,
+                                    const unsigned char* in, unsigned int in_length, void* arg);
+    
+    void wait_for_signal();
+    
+    // Report settings in a reloaded config that only apply after a restart
+    void warn_restart_required(const ProxyConfig& reloaded) const;
 
 private:
-    net::io_context ioc_;
+    std::vector<std::unique_ptr<Worker>> workers_;
     std::vector<std::thread> threads_;
-    
-    // HTTP server
-    std::unique_ptr<tcp::acceptor> http_acceptor_;
+    int thread_count_ = 1;
+    bool thread_per_core_ = false;
     
     // HTTPS server
-    std::unique_ptr<tcp::acceptor> https_acceptor_;
     std::unique_ptr<ssl::context> ssl_ctx_;
+    std::unique_ptr<CertificateStore> cert_store_;  // per-site contexts, selected by SNI
+    std::unique_ptr<HandshakePool> handshake_pool_;
+    bool ktls_ = false;  // offer kernel TLS to new connections
     
     // Core components
     std::shared_ptr<ConfigManager> config_manager_;
+    std::shared_ptr<BackendResolver> resolver_;
     std::shared_ptr<RequestRouter> router_;
     std::shared_ptr<CertificateManager> cert_manager_;
+    std::shared_ptr<HealthChecker> health_checker_;
+    
+    // Signals and configuration reloads, handled by the thread in run()
+    net::io_context control_ioc_;
+    std::unique_ptr<net::signal_set> signals_;
+    std::unique_ptr<ConfigWatcher> config_watcher_;
+    std::unique_ptr<net::steady_timer> ticket_key_timer_;
+    std::unique_ptr<MetricsServer> metrics_server_;  // Prometheus endpoint, when enabled
     
-    bool running_;
+    std::atomic<bool> running_;
 };
 
 #endif // REVERSE_PROXY_H
@@ -0,0 +1,149 @@
+#include "RouteTable.h"
+#include "Log.h"
+#include <algorithm>
+#include <bit>
+
+namespace {
+
+inline char to_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+// Compare host against a key that is already lowercase
+inline bool equals_lowercase(std::string_view host, std::string_view key) {
+    if (host.size() != key.size()) {
+        return false;
+    }
+    for (std::size_t i = 0; i < host.size(); ++i) {
+        if (to_lower(host[i]) != key[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+RouteTable::RouteTable(const std::vector<SiteConfig>& sites, BackendResolver& resolver) {
+    // Slots keep views into the route domains, so routes_ must not reallocate
+    routes_.reserve(sites.size());
+
+    std::size_t wildcards = 0;
+    for (const auto& site : sites) {
+        Route route;
+        route.domain.reserve(site.domain.size());
+        for (char c : site.domain) {
+            route.domain.push_back(to_lower(c));
+        }
+        if (!route.domain.empty() && route.domain.back() == '.') {
+            route.domain.pop_back();
+        }
+        if (route.domain.empty()) {
+            continue;
+        }
+
+        route.site = &site;
+        route.balancer = std::make_unique<LoadBalancer>(site, resolver);
+        route.websocket = site.websocket;
+        route.websocket_frames = site.websocket_mode == "frames";
+        route.tls = site.tls == "auto" || site.tls == "manual";
+        route.cache = site.cache;
+        route.compress = site.compress;
+        route.root = site.root;
+        route.metrics_id = Metrics::site_id(route.domain);
+
+        if (route.domain.rfind("*.", 0) == 0) {
+            wildcards++;
+        }
+        routes_.push_back(std::move(route));
+    }
+
+    exact_.reserve(routes_.size() - wildcards);
+    wildcard_.reserve(wildcards);
+
+    for (std::uint32_t i = 0; i < routes_.size(); ++i) {
+        std::string_view domain = routes_[i].domain;
+        bool inserted = domain.rfind("*.", 0) == 0
+            ? wildcard_.insert(domain.substr(2), i)
+            : exact_.insert(domain, i);
+        if (!inserted) {
+            Log::warn() << "Duplicate site for domain " << domain << ", using the first one";
+        }
+    }
+}
+
+const Route* RouteTable::find(std::string_view host) const {
+    if (!host.empty() && host.back() == '.') {
+        host.remove_suffix(1);
+    }
+    if (host.empty()) {
+        return nullptr;
+    }
+
+    std::uint32_t route = exact_.find(host, hash(host));
+    if (route != kEmpty) {
+        return &routes_[route];
+    }
+
+    // "*.example.com" matches "a.example.com" and "a.b.example.com"; try the
+    // longest suffix first so the most specific wildcard wins
+    if (!wildcard_.slots.empty()) {
+        for (std::size_t dot = host.find('.'); dot != std::string_view::npos; dot = host.find('.', dot + 1)) {
+            std::string_view suffix = host.substr(dot + 1);
+            route = wildcard_.find(suffix, hash(suffix));
+            if (route != kEmpty) {
+                return &routes_[route];
+            }
+        }
+    }
+    return nullptr;
+}
+
+std::uint64_t RouteTable::hash(std::string_view key) {
+    std::uint64_t h = 14695981039346656037ull;
+    for (char c : key) {
+        h ^= static_cast<unsigned char>(to_lower(c));
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+void RouteTable::Index::reserve(std::size_t count) {
+    if (count == 0) {
+        return;
+    }
+    std::size_t capacity = std::bit_ceil(std::max<std::size_t>(count * 2, 8));
+    slots.assign(capacity, Slot{});
+    mask = capacity - 1;
+}
+
+bool RouteTable::Index::insert(std::string_view key, std::uint32_t route) {
+    std::uint64_t h = hash(key);
+    for (std::size_t i = h & mask;; i = (i + 1) & mask) {
+        Slot& slot = slots[i];
+        if (slot.route == kEmpty) {
+            slot.hash = h;
+            slot.route = route;
+            slot.key = key;
+            return true;
+        }
+        if (slot.hash == h && slot.key == key) {
+            return false;
+        }
+    }
+}
+
+std::uint32_t RouteTable::Index::find(std::string_view key, std::uint64_t h) const {
+    if (slots.empty()) {
+        return kEmpty;
+    }
+    for (std::size_t i = h & mask;; i = (i + 1) & mask) {
+        const Slot& slot = slots[i];
+        if (slot.route == kEmpty) {
+            return kEmpty;
+        }
+        if (slot.hash == h && equals_lowercase(key, slot.key)) {
+            return slot.route;
+        }
+    }
+}
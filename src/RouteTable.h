@@ -0,0 +1,82 @@
+#ifndef ROUTE_TABLE_H
+#define ROUTE_TABLE_H
+
+#include "ConfigManager.h"
+#include "BackendResolver.h"
+#include "LoadBalancer.h"
+#include "Metrics.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Everything the request path needs to know about a site, resolved once
+// when the table is built
+struct Route {
+    std::string domain;  // lowercased, "*.example.com" for wildcard sites
+    const SiteConfig* site = nullptr;
+    std::unique_ptr<LoadBalancer> balancer;  // picks the upstream per request
+    bool websocket = false;
+    bool websocket_frames = false;  // frame-aware relay instead of a raw tunnel
+    bool tls = false;
+    bool cache = false;  // responses may be served from the response cache
+    bool compress = false;  // responses are compressed for clients that accept it
+    std::string_view root;  // files are served from this directory, there is no backend
+    std::uint32_t metrics_id = Metrics::kUnmatchedSite;  // per-site request counters
+};
+
+// Immutable host -> route map built at config load time.
+// Exact domains live in a flat open-addressing table; wildcard sites
+// ("*.example.com", matching any subdomain) live in a second table keyed by
+// their suffix and are probed once per label of the host, most specific
+// first. Lookups are case-insensitive, ignore a trailing dot and never
+// allocate.
+class RouteTable {
+public:
+    RouteTable() = default;
+
+    // Build routes for sites, registering their backends with resolver.
+    // The first site wins when a domain is listed twice.
+    RouteTable(const std::vector<SiteConfig>& sites, BackendResolver& resolver);
+
+    RouteTable(const RouteTable&) = delete;
+    RouteTable& operator=(const RouteTable&) = delete;
+    RouteTable(RouteTable&&) = default;
+    RouteTable& operator=(RouteTable&&) = default;
+
+    // Route for host (without port), or nullptr
+    const Route* find(std::string_view host) const;
+
+    std::size_t size() const { return routes_.size(); }
+    const std::vector<Route>& routes() const { return routes_; }
+
+private:
+    static constexpr std::uint32_t kEmpty = UINT32_MAX;
+
+    struct Slot {
+        std::uint64_t hash = 0;
+        std::uint32_t route = kEmpty;
+        std::string_view key;  // lowercased, points into routes_
+    };
+
+    // Open-addressing index with linear probing, at most half full
+    struct Index {
+        std::vector<Slot> slots;
+        std::size_t mask = 0;
+
+        void reserve(std::size_t count);
+        bool insert(std::string_view key, std::uint32_t route);
+        std::uint32_t find(std::string_view key, std::uint64_t hash) const;
+    };
+
+    // Case-insensitive FNV-1a
+    static std::uint64_t hash(std::string_view key);
+
+private:
+    std::vector<Route> routes_;
+    Index exact_;
+    Index wildcard_;
+};
+
+#endif // ROUTE_TABLE_H
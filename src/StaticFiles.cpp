@@ -0,0 +1,456 @@
+#include "StaticFiles.h"
+#include "Compression.h"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::size_t StaticFiles::cache_size_ = 1024;
+std::chrono::steady_clock::duration StaticFiles::valid_ = std::chrono::seconds(5);
+std::atomic<std::uint64_t> StaticFiles::hits_{0};
+std::atomic<std::uint64_t> StaticFiles::misses_{0};
+
+namespace {
+
+// Open file cache of one worker thread, most recently used first
+struct OpenFileCache {
+    using Entry = std::pair<std::string, std::shared_ptr<const StaticFile>>;
+
+    std::list<Entry> lru;
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index;  // keys point into lru
+};
+
+thread_local OpenFileCache t_open_files;
+
+std::string_view trim(std::string_view value) {
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+        value.remove_prefix(1);
+    }
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+        value.remove_suffix(1);
+    }
+    return value;
+}
+
+bool iequals(std::string_view a, std::string_view b) {
+    return a.size() == b.size() &&
+           std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+               return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+           });
+}
+
+// Call f(element) for each element of a comma-separated header value
+template<class F>
+void for_each_element(std::string_view header, F&& f) {
+    while (!header.empty()) {
+        auto comma = header.find(',');
+        auto element = trim(header.substr(0, comma));
+        header = comma == std::string_view::npos ? std::string_view{} : header.substr(comma + 1);
+        if (!element.empty()) {
+            f(element);
+        }
+    }
+}
+
+void format_http_date(std::time_t time, std::string& out) {
+    std::tm tm{};
+    gmtime_r(&time, &tm);
+    char text[32];
+    std::size_t size = std::strftime(text, sizeof(text), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    out.assign(text, size);
+}
+
+// IMF-fixdate, or nullopt when it is in any other format
+std::optional<std::time_t> parse_http_date(std::string_view value) {
+    char text[64];
+    if (value.empty() || value.size() >= sizeof(text)) {
+        return std::nullopt;
+    }
+    std::memcpy(text, value.data(), value.size());
+    text[value.size()] = '\0';
+    std::tm tm{};
+    const char* end = strptime(text, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end != '\0') {
+        return std::nullopt;
+    }
+    return timegm(&tm);
+}
+
+std::optional<std::uint64_t> parse_digits(std::string_view value) {
+    std::uint64_t number = 0;
+    auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), number);
+    if (value.empty() || ec != std::errc() || end != value.data() + value.size()) {
+        return std::nullopt;
+    }
+    return number;
+}
+
+int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+std::shared_ptr<StaticFile> open_file(const std::string& path) {
+    auto file = std::make_shared<StaticFile>();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return file;
+    }
+    struct stat st{};
+    if (::fstat(fd, &st) != 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+        ::close(fd);
+        return file;
+    }
+    file->device = st.st_dev;
+    file->inode = st.st_ino;
+    file->mtime = st.st_mtime;
+    if (S_ISDIR(st.st_mode)) {
+        file->directory = true;
+        ::close(fd);
+        return file;
+    }
+    file->fd = fd;
+    file->size = static_cast<std::uint64_t>(st.st_size);
+    char etag[48];
+    int size = std::snprintf(etag, sizeof(etag), "\"%llx-%llx\"", static_cast<unsigned long long>(st.st_mtime),
+                             static_cast<unsigned long long>(st.st_size));
+    file->etag.assign(etag, static_cast<std::size_t>(size));
+    format_http_date(st.st_mtime, file->last_modified);
+    return file;
+}
+
+// Whether what stat() now says about path is what file was opened as
+bool unchanged(const StaticFile& file, const std::string& path) {
+    struct stat st{};
+    if (::stat(path.c_str(), &st) != 0) {
+        return !file.regular() && !file.directory;
+    }
+    if (!file.regular() && !file.directory) {
+        return false;
+    }
+    return st.st_dev == file.device && st.st_ino == file.inode && st.st_mtime == file.mtime &&
+           (file.directory || static_cast<std::uint64_t>(st.st_size) == file.size);
+}
+
+} // namespace
+
+StaticFile::~StaticFile() {
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+void StaticFiles::configure(const StaticFilesConfig& config) {
+    cache_size_ = config.open_file_cache;
+    valid_ = std::chrono::seconds(std::max(config.open_file_valid_seconds, 0));
+}
+
+StaticFiles::Response StaticFiles::respond(std::string_view method, std::string_view target, std::string_view root,
+                                           const RequestField& request, std::string& path) {
+    Response response;
+    if (method != "GET" && method != "HEAD") {
+        response.status = 405;
+        return response;
+    }
+    if (!resolve(path, root, target)) {
+        response.status = 400;
+        return response;
+    }
+    auto file = open(path);
+    if (file->directory) {
+        response.status = 301;
+        return response;
+    }
+    if (!file->regular()) {
+        response.status = 404;
+        return response;
+    }
+
+    // Precompressed siblings, preferring brotli
+    static constexpr std::pair<std::string_view, std::string_view> kSiblings[] = {{".br", "br"}, {".gz", "gzip"}};
+    std::string_view accept_encoding = request("Accept-Encoding");
+    const std::size_t size = path.size();
+    for (const auto& [suffix, coding] : kSiblings) {
+        path += suffix;
+        auto sibling = open(path);
+        path.resize(size);
+        if (!sibling->regular()) {
+            continue;
+        }
+        response.vary = true;
+        if (Compression::accepts(accept_encoding, coding)) {
+            response.file = std::move(sibling);
+            response.encoding = coding;
+            break;
+        }
+    }
+    if (!response.file) {
+        response.file = std::move(file);
+    }
+    const StaticFile& sent = *response.file;
+
+    if (not_modified(sent, request("If-None-Match"), request("If-Modified-Since"))) {
+        response.status = 304;
+        return response;
+    }
+    response.status = 200;
+    response.length = sent.size;
+    std::string_view range = request("Range");
+    if (!range.empty() && method == "GET") {
+        Range bytes;
+        switch (parse_range(range, request("If-Range"), sent, bytes)) {
+            case RangeResult::satisfiable:
+                response.status = 206;
+                response.offset = bytes.offset;
+                response.length = bytes.length;
+                break;
+            case RangeResult::unsatisfiable:
+                response.status = 416;
+                response.length = 0;
+                return response;
+            case RangeResult::none:
+                break;
+        }
+    }
+    response.body = method == "GET" && response.length > 0;
+    return response;
+}
+
+std::string StaticFiles::content_range(const Response& response) {
+    char text[64];
+    int size = response.status == 416
+        ? std::snprintf(text, sizeof(text), "bytes */%llu", static_cast<unsigned long long>(response.file->size))
+        : std::snprintf(text, sizeof(text), "bytes %llu-%llu/%llu", static_cast<unsigned long long>(response.offset),
+                        static_cast<unsigned long long>(response.offset + response.length - 1),
+                        static_cast<unsigned long long>(response.file->size));
+    return std::string(text, static_cast<std::size_t>(size));
+}
+
+bool StaticFiles::resolve(std::string& path, std::string_view root, std::string_view target) {
+    target = target.substr(0, target.find_first_of("?#"));
+    // Absolute form, as sent to proxies: the path starts after the authority
+    if (target.substr(0, 7) == "http://" || target.substr(0, 8) == "https://") {
+        auto slash = target.find('/', target.find("//") + 2);
+        target = slash == std::string_view::npos ? std::string_view("/") : target.substr(slash);
+    }
+    if (target.empty() || target.front() != '/') {
+        return false;
+    }
+
+    path.assign(root);
+    const std::size_t base = path.size();
+    std::size_t segment = base;  // where the segment being decoded starts
+    bool dots = false;           // the last segment was "." or ".."
+    for (std::size_t i = 0; i <= target.size(); ++i) {
+        char c = i < target.size() ? target[i] : '/';
+        if (c == '%') {
+            if (i + 2 >= target.size() || hex_value(target[i + 1]) < 0 || hex_value(target[i + 2]) < 0) {
+                return false;
+            }
+            c = static_cast<char>(hex_value(target[i + 1]) * 16 + hex_value(target[i + 2]));
+            i += 2;
+            if (c == '\0') {
+                return false;
+            }
+        }
+        if (c != '/') {
+            if (path.size() == segment) {
+                path.push_back('/');
+            }
+            path.push_back(c);
+            continue;
+        }
+        std::string_view name(path.data() + segment, path.size() - segment);
+        if (name == "/.") {
+            path.resize(segment);
+            dots = true;
+        } else if (name == "/..") {
+            path.resize(segment);
+            if (path.size() == base) {
+                return false;
+            }
+            path.resize(path.rfind('/'));
+            dots = true;
+        } else if (!name.empty()) {
+            dots = false;
+        }
+        segment = path.size();
+    }
+    if (target.back() == '/' || dots) {
+        path += "/index.html";
+    }
+    return true;
+}
+
+std::shared_ptr<const StaticFile> StaticFiles::open(const std::string& path) {
+    if (cache_size_ == 0) {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return open_file(path);
+    }
+    auto& cache = t_open_files;
+    auto now = std::chrono::steady_clock::now();
+    auto it = cache.index.find(path);
+    if (it != cache.index.end()) {
+        auto node = it->second;
+        auto& file = node->second;
+        if (now - file->checked < valid_ || unchanged(*file, path)) {
+            // The entry is only shared with responses, which don't read checked
+            const_cast<StaticFile&>(*file).checked = now;
+            cache.lru.splice(cache.lru.begin(), cache.lru, node);
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return file;
+        }
+        cache.index.erase(it);
+        cache.lru.erase(node);
+    }
+    misses_.fetch_add(1, std::memory_order_relaxed);
+
+    std::shared_ptr<StaticFile> file = open_file(path);
+    file->checked = now;
+    cache.lru.emplace_front(path, file);
+    cache.index.emplace(cache.lru.front().first, cache.lru.begin());
+    while (cache.lru.size() > cache_size_) {
+        cache.index.erase(cache.lru.back().first);
+        cache.lru.pop_back();
+    }
+    return file;
+}
+
+std::string_view StaticFiles::content_type(std::string_view path) {
+    static constexpr std::array<std::pair<std::string_view, std::string_view>, 28> types{{
+        {"html", "text/html; charset=utf-8"},
+        {"htm", "text/html; charset=utf-8"},
+        {"css", "text/css; charset=utf-8"},
+        {"js", "text/javascript; charset=utf-8"},
+        {"mjs", "text/javascript; charset=utf-8"},
+        {"json", "application/json"},
+        {"map", "application/json"},
+        {"txt", "text/plain; charset=utf-8"},
+        {"xml", "application/xml"},
+        {"svg", "image/svg+xml"},
+        {"png", "image/png"},
+        {"jpg", "image/jpeg"},
+        {"jpeg", "image/jpeg"},
+        {"gif", "image/gif"},
+        {"webp", "image/webp"},
+        {"avif", "image/avif"},
+        {"ico", "image/x-icon"},
+        {"woff", "font/woff"},
+        {"woff2", "font/woff2"},
+        {"ttf", "font/ttf"},
+        {"otf", "font/otf"},
+        {"wasm", "application/wasm"},
+        {"pdf", "application/pdf"},
+        {"mp4", "video/mp4"},
+        {"webm", "video/webm"},
+        {"mp3", "audio/mpeg"},
+        {"ogg", "audio/ogg"},
+        {"zip", "application/zip"},
+    }};
+    auto slash = path.rfind('/');
+    auto dot = path.rfind('.');
+    if (dot != std::string_view::npos && (slash == std::string_view::npos || dot > slash)) {
+        auto extension = path.substr(dot + 1);
+        for (const auto& [name, type] : types) {
+            if (iequals(extension, name)) {
+                return type;
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+bool StaticFiles::not_modified(const StaticFile& file, std::string_view if_none_match,
+                               std::string_view if_modified_since) {
+    if (!if_none_match.empty()) {
+        // Weak comparison: W/"x" and "x" name the same representation
+        bool satisfied = false;
+        for_each_element(if_none_match, [&](std::string_view tag) {
+            if (tag.substr(0, 2) == "W/") {
+                tag.remove_prefix(2);
+            }
+            satisfied = satisfied || tag == "*" || tag == file.etag;
+        });
+        return satisfied;
+    }
+    // If-Modified-Since only counts without If-None-Match
+    auto since = parse_http_date(trim(if_modified_since));
+    return since && file.mtime <= *since;
+}
+
+StaticFiles::RangeResult StaticFiles::parse_range(std::string_view range, std::string_view if_range,
+                                                  const StaticFile& file, Range& out) {
+    range = trim(range);
+    if (range.substr(0, 6) != "bytes=") {
+        return RangeResult::none;
+    }
+    // If-Range: the range only applies to the representation named, by
+    // strong validator; otherwise the whole file is sent
+    if_range = trim(if_range);
+    if (!if_range.empty() && if_range != file.etag && if_range != file.last_modified) {
+        return RangeResult::none;
+    }
+    auto spec = trim(range.substr(6));
+    auto dash = spec.find('-');
+    // Several ranges would need multipart/byteranges; the whole file is a
+    // valid answer to them as well
+    if (dash == std::string_view::npos || spec.find(',') != std::string_view::npos) {
+        return RangeResult::none;
+    }
+    auto first = parse_digits(trim(spec.substr(0, dash)));
+    auto last = parse_digits(trim(spec.substr(dash + 1)));
+    if (!first) {
+        // Suffix range: the last N bytes
+        if (!last || trim(spec.substr(0, dash)).size() != 0) {
+            return RangeResult::none;
+        }
+        if (*last == 0 || file.size == 0) {
+            return RangeResult::unsatisfiable;
+        }
+        out.length = std::min(*last, file.size);
+        out.offset = file.size - out.length;
+        return RangeResult::satisfiable;
+    }
+    if (!last && !trim(spec.substr(dash + 1)).empty()) {
+        return RangeResult::none;
+    }
+    if (last && *last < *first) {
+        return RangeResult::none;
+    }
+    if (*first >= file.size) {
+        return RangeResult::unsatisfiable;
+    }
+    out.offset = *first;
+    out.length = (last ? std::min(*last, file.size - 1) : file.size - 1) - *first + 1;
+    return RangeResult::satisfiable;
+}
+
+std::string_view StaticFiles::date() {
+    thread_local std::time_t formatted = 0;
+    thread_local std::string text;
+    std::time_t now = std::time(nullptr);
+    if (now != formatted) {
+        formatted = now;
+        format_http_date(now, text);
+    }
+    return text;
+}
+
+StaticFileStats StaticFiles::stats() {
+    StaticFileStats stats;
+    stats.hits = hits_.load(std::memory_order_relaxed);
+    stats.misses = misses_.load(std::memory_order_relaxed);
+    return stats;
+}
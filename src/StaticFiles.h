@@ -0,0 +1,120 @@
+#ifndef STATIC_FILES_H
+#define STATIC_FILES_H
+
+#include "ConfigManager.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+
+// A file opened for serving (or the result of failing to), shared by the
+// open file cache and the responses still sending it
+struct StaticFile {
+    StaticFile() = default;
+    ~StaticFile();
+
+    StaticFile(const StaticFile&) = delete;
+    StaticFile& operator=(const StaticFile&) = delete;
+
+    bool regular() const { return fd >= 0; }
+
+    int fd = -1;             // open regular file, else -1
+    bool directory = false;
+    std::uint64_t size = 0;
+    std::time_t mtime = 0;
+    dev_t device = 0;        // identify the file, to notice it was replaced
+    ino_t inode = 0;
+    std::string etag;           // "<mtime>-<size>" in hex
+    std::string last_modified;  // IMF-fixdate
+    std::chrono::steady_clock::time_point checked;  // when stat() last confirmed it
+};
+
+struct StaticFileStats {
+    std::uint64_t hits = 0;    // open file cache lookups answered without open()
+    std::uint64_t misses = 0;
+};
+
+// Files for sites with "root:", served by ConnectionHandler without a backend.
+//
+// Each worker thread keeps an LRU cache of open descriptors and their stat()
+// results (and of paths that don't exist), so a hot file costs no open() or
+// stat() per request; an entry is checked against the file system again once
+// it is older than open_file_valid_seconds, and reopened if the file changed.
+// The descriptor is shared with the responses sending it, so an evicted or
+// replaced file stays open until they are done.
+class StaticFiles {
+public:
+    // Value of a request header field, empty when absent
+    using RequestField = std::function<std::string_view(std::string_view)>;
+
+    // What to answer a request to a root site
+    struct Response {
+        unsigned status = 0;  // 200, 206, 304, 416, or 301 (directory), 400, 404, 405 without a file
+        std::shared_ptr<const StaticFile> file;  // the file sent, or its precompressed sibling
+        std::string_view encoding;  // Content-Encoding of a sibling ("br", "gzip")
+        bool vary = false;          // siblings exist, so the answer depends on Accept-Encoding
+        std::uint64_t offset = 0;   // body: file bytes from offset
+        std::uint64_t length = 0;   // Content-Length
+        bool body = false;          // false for HEAD, 304 and 416
+    };
+
+    // Single byte range of a file
+    struct Range {
+        std::uint64_t offset = 0;
+        std::uint64_t length = 0;
+    };
+
+    enum class RangeResult {
+        none,           // no usable Range: send the whole file
+        satisfiable,
+        unsatisfiable,  // answer 416
+    };
+
+    static void configure(const StaticFilesConfig& config);
+
+    // Answer a request for target below root: GET and HEAD, conditional
+    // requests, a single byte range and precompressed ".br"/".gz" siblings.
+    // path is left holding the file name resolved (without the sibling's suffix).
+    static Response respond(std::string_view method, std::string_view target, std::string_view root,
+                            const RequestField& request, std::string& path);
+
+    // Content-Range of a 206 or 416 response
+    static std::string content_range(const Response& response);
+
+    // Map a request target to a file below root: query dropped, percent
+    // decoded, "." and ".." resolved (never above root), "index.html" for a
+    // directory. false when the target is malformed or leaves root.
+    static bool resolve(std::string& path, std::string_view root, std::string_view target);
+
+    // The file at path, from this thread's cache or freshly opened
+    static std::shared_ptr<const StaticFile> open(const std::string& path);
+
+    // MIME type by extension
+    static std::string_view content_type(std::string_view path);
+
+    // Whether a conditional request is satisfied by file (answer 304)
+    static bool not_modified(const StaticFile& file, std::string_view if_none_match,
+                             std::string_view if_modified_since);
+
+    // Range header against a file of size, honoring If-Range
+    static RangeResult parse_range(std::string_view range, std::string_view if_range, const StaticFile& file,
+                                   Range& out);
+
+    // Current time as an IMF-fixdate, formatted once per second per thread
+    static std::string_view date();
+
+    static StaticFileStats stats();
+
+private:
+    static std::size_t cache_size_;
+    static std::chrono::steady_clock::duration valid_;
+    static std::atomic<std::uint64_t> hits_;
+    static std::atomic<std::uint64_t> misses_;
+};
+
+#endif // STATIC_FILES_H
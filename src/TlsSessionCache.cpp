@@ -0,0 +1,241 @@
+#include "TlsSessionCache.h"
+#include "Log.h"
+#include <openssl/core_names.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <cstring>
+
+TlsSessionCache::Shard TlsSessionCache::shards_[TlsSessionCache::kShards];
+std::size_t TlsSessionCache::shard_capacity_ = 0;
+std::chrono::seconds TlsSessionCache::timeout_{300};
+
+std::mutex TlsSessionCache::rotate_mutex_;
+std::atomic<std::shared_ptr<const TlsSessionCache::TicketKeys>> TlsSessionCache::ticket_keys_{
+    std::make_shared<const TicketKeys>()};
+std::atomic<std::uint64_t> TlsSessionCache::ticket_generation_{0};
+
+std::atomic<std::uint64_t> TlsSessionCache::full_handshakes_{0};
+std::atomic<std::uint64_t> TlsSessionCache::resumed_handshakes_{0};
+std::atomic<std::uint64_t> TlsSessionCache::cache_hits_{0};
+std::atomic<std::uint64_t> TlsSessionCache::cache_misses_{0};
+std::atomic<std::uint64_t> TlsSessionCache::tickets_accepted_{0};
+std::atomic<std::uint64_t> TlsSessionCache::tickets_rejected_{0};
+
+namespace {
+
+// Keys kept for decrypting tickets: the current one and its predecessor
+constexpr std::size_t kTicketKeysKept = 2;
+
+// Digest for ticket HMACs (OSSL_PARAM wants a mutable string)
+char kTicketDigest[] = "SHA256";
+
+} // namespace
+
+void TlsSessionCache::configure(SSL_CTX* ctx, const TlsSessionConfig& config) {
+    timeout_ = std::chrono::seconds(config.cache_timeout_seconds);
+    shard_capacity_ = (static_cast<std::size_t>(config.cache_size) + kShards - 1) / kShards;
+
+    // Lifetime of cached sessions and of tickets
+    SSL_CTX_set_timeout(ctx, config.cache_timeout_seconds);
+
+    if (config.cache_size > 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_sess_set_new_cb(ctx, &TlsSessionCache::on_new_session);
+        SSL_CTX_sess_set_get_cb(ctx, &TlsSessionCache::on_get_session);
+        SSL_CTX_sess_set_remove_cb(ctx, &TlsSessionCache::on_remove_session);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+
+    if (config.tickets) {
+        rotate_ticket_keys();
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, &TlsSessionCache::on_ticket_key);
+    } else {
+        // TLS 1.3 then issues stateful tickets backed by the session cache
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    }
+}
+
+void TlsSessionCache::rotate_ticket_keys() {
+    TicketKey key;
+    if (RAND_bytes(key.name, sizeof(key.name)) != 1 ||
+        RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1 ||
+        RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1) {
+        Log::warn() << "Failed to generate a session ticket key, keeping the current one";
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(rotate_mutex_);
+    auto current = ticket_keys_.load(std::memory_order_acquire);
+    auto next = std::make_shared<TicketKeys>();
+    next->keys.push_back(key);
+    for (const auto& previous : current->keys) {
+        if (next->keys.size() == kTicketKeysKept) {
+            break;
+        }
+        next->keys.push_back(previous);
+    }
+
+    next->generation = ticket_generation_.load(std::memory_order_relaxed) + 1;
+    ticket_keys_.store(std::move(next), std::memory_order_release);
+    ticket_generation_.fetch_add(1, std::memory_order_release);
+}
+
+void TlsSessionCache::record_handshake(SSL* ssl) {
+    if (SSL_session_reused(ssl)) {
+        resumed_handshakes_.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        full_handshakes_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void TlsSessionCache::keep_session(SSL* ssl) {
+    // OpenSSL treats a connection freed without close_notify as broken and
+    // evicts its session; fatal alerts still evict theirs when sent
+    if (ssl && !SSL_in_init(ssl)) {
+        SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    }
+}
+
+TlsSessionStats TlsSessionCache::stats() {
+    TlsSessionStats stats;
+    stats.full_handshakes = full_handshakes_.load(std::memory_order_relaxed);
+    stats.resumed_handshakes = resumed_handshakes_.load(std::memory_order_relaxed);
+    stats.cache_hits = cache_hits_.load(std::memory_order_relaxed);
+    stats.cache_misses = cache_misses_.load(std::memory_order_relaxed);
+    stats.tickets_accepted = tickets_accepted_.load(std::memory_order_relaxed);
+    stats.tickets_rejected = tickets_rejected_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+TlsSessionCache::Shard& TlsSessionCache::shard_for(const unsigned char* id, unsigned int length) {
+    // Session IDs are random, so their first bytes spread evenly
+    std::size_t hash = 0;
+    for (unsigned int i = 0; i < length && i < sizeof(hash); ++i) {
+        hash = (hash << 8) | id[i];
+    }
+    return shards_[hash % kShards];
+}
+
+std::shared_ptr<const TlsSessionCache::TicketKeys> TlsSessionCache::ticket_keys() {
+    // Same scheme as config snapshots: re-read the shared pointer only after
+    // a rotation bumps the generation
+    thread_local std::shared_ptr<const TicketKeys> cached;
+
+    if (!cached || cached->generation != ticket_generation_.load(std::memory_order_acquire)) {
+        cached = ticket_keys_.load(std::memory_order_acquire);
+    }
+    return cached;
+}
+
+int TlsSessionCache::on_new_session(SSL* ssl, SSL_SESSION* session) {
+    (void)ssl;
+    unsigned int id_length = 0;
+    const unsigned char* id = SSL_SESSION_get_id(session, &id_length);
+
+    int size = i2d_SSL_SESSION(session, nullptr);
+    if (size <= 0 || id_length == 0) {
+        return 0;
+    }
+    Shard::Entry entry;
+    entry.session.resize(static_cast<std::size_t>(size));
+    unsigned char* out = entry.session.data();
+    i2d_SSL_SESSION(session, &out);
+    entry.expires = std::chrono::steady_clock::now() + timeout_;
+
+    std::string key(reinterpret_cast<const char*>(id), id_length);
+    Shard& shard = shard_for(id, id_length);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    // Removed sessions leave stale keys in the order, so it is bounded too
+    while ((shard.sessions.size() >= shard_capacity_ || shard.order.size() >= 2 * shard_capacity_) &&
+           !shard.order.empty()) {
+        shard.sessions.erase(shard.order.front());
+        shard.order.pop_front();
+    }
+    if (shard.sessions.insert_or_assign(key, std::move(entry)).second) {
+        shard.order.push_back(std::move(key));
+    }
+
+    // The session was copied out; OpenSSL keeps its own reference
+    return 0;
+}
+
+SSL_SESSION* TlsSessionCache::on_get_session(SSL* ssl, const unsigned char* id, int length, int* copy) {
+    (void)ssl;
+    *copy = 0;  // the caller owns the returned session
+
+    std::vector<unsigned char> encoded;
+    {
+        Shard& shard = shard_for(id, static_cast<unsigned int>(length));
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.sessions.find(std::string(reinterpret_cast<const char*>(id), length));
+        if (it == shard.sessions.end() || it->second.expires <= std::chrono::steady_clock::now()) {
+            cache_misses_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        encoded = it->second.session;
+    }
+
+    cache_hits_.fetch_add(1, std::memory_order_relaxed);
+    const unsigned char* in = encoded.data();
+    return d2i_SSL_SESSION(nullptr, &in, static_cast<long>(encoded.size()));
+}
+
+void TlsSessionCache::on_remove_session(SSL_CTX* ctx, SSL_SESSION* session) {
+    (void)ctx;
+    unsigned int id_length = 0;
+    const unsigned char* id = SSL_SESSION_get_id(session, &id_length);
+
+    // Its entry in the insertion order goes when it reaches the front
+    Shard& shard = shard_for(id, id_length);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.sessions.erase(std::string(reinterpret_cast<const char*>(id), id_length));
+}
+
+int TlsSessionCache::on_ticket_key(SSL* ssl, unsigned char key_name[16], unsigned char* iv,
+                                   EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac, int encrypt) {
+    (void)ssl;
+    auto keys = ticket_keys();
+    if (keys->keys.empty()) {
+        return encrypt ? -1 : 0;
+    }
+
+    auto init_mac = [mac](const TicketKey& key) {
+        OSSL_PARAM params[] = {
+            OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                const_cast<unsigned char*>(key.hmac_key), sizeof(key.hmac_key)),
+            OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, kTicketDigest, 0),
+            OSSL_PARAM_construct_end()
+        };
+        return EVP_MAC_CTX_set_params(mac, params) == 1;
+    };
+
+    if (encrypt) {
+        const TicketKey& key = keys->keys.front();
+        std::memcpy(key_name, key.name, sizeof(key.name));
+        if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1 ||
+            EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) != 1 ||
+            !init_mac(key)) {
+            return -1;
+        }
+        return 1;
+    }
+
+    for (std::size_t i = 0; i < keys->keys.size(); ++i) {
+        const TicketKey& key = keys->keys[i];
+        if (std::memcmp(key_name, key.name, sizeof(key.name)) != 0) {
+            continue;
+        }
+        if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) != 1 || !init_mac(key)) {
+            return -1;
+        }
+        tickets_accepted_.fetch_add(1, std::memory_order_relaxed);
+
+        // A ticket under the previous key is honoured and replaced
+        return i == 0 ? 1 : 2;
+    }
+
+    // Unknown key: full handshake and a new ticket
+    tickets_rejected_.fetch_add(1, std::memory_order_relaxed);
+    return 0;
+}
@@ -0,0 +1,111 @@
+#ifndef TLS_SESSION_CACHE_H
+#define TLS_SESSION_CACHE_H
+
+#include "ConfigManager.h"
+#include <openssl/ssl.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct TlsSessionStats {
+    std::uint64_t full_handshakes = 0;
+    std::uint64_t resumed_handshakes = 0;  // abbreviated: session ID or ticket
+    std::uint64_t cache_hits = 0;
+    std::uint64_t cache_misses = 0;
+    std::uint64_t tickets_accepted = 0;
+    std::uint64_t tickets_rejected = 0;    // unknown (rotated out) key
+
+    // Fraction of handshakes that were abbreviated
+    double resumption_rate() const {
+        std::uint64_t total = full_handshakes + resumed_handshakes;
+        return total ? static_cast<double>(resumed_handshakes) / total : 0.0;
+    }
+};
+
+// TLS session resumption for the HTTPS listener.
+//
+// Sessions for session-ID resumption live in a cache split into shards, each
+// with its own lock, so concurrent handshakes on different workers rarely
+// contend. Session tickets are encrypted with keys held only in memory: a new
+// key is made on every rotation and the previous one is still accepted (the
+// client gets a fresh ticket) until the next rotation. The handshake reads the
+// keys from an immutable snapshot without locking.
+//
+// OpenSSL consults the context a connection was accepted on for both, so only
+// the listener's context is configured, whichever site's context SNI picks.
+class TlsSessionCache {
+public:
+    // Install the cache and ticket callbacks on the listener's context
+    static void configure(SSL_CTX* ctx, const TlsSessionConfig& config);
+
+    // Start encrypting new tickets with a fresh key
+    static void rotate_ticket_keys();
+
+    // Count a completed handshake as full or resumed
+    static void record_handshake(SSL* ssl);
+
+    // Call as a TLS connection is destroyed, so its session stays resumable
+    // even though no close_notify was exchanged
+    static void keep_session(SSL* ssl);
+
+    static TlsSessionStats stats();
+
+private:
+    static constexpr std::size_t kShards = 16;
+
+    struct Shard {
+        struct Entry {
+            std::vector<unsigned char> session;  // DER encoded
+            std::chrono::steady_clock::time_point expires;
+        };
+
+        std::mutex mutex;
+        std::unordered_map<std::string, Entry> sessions;
+        std::deque<std::string> order;  // insertion order, oldest evicted first
+    };
+
+    struct TicketKey {
+        unsigned char name[16];
+        unsigned char aes_key[32];
+        unsigned char hmac_key[32];
+    };
+
+    struct TicketKeys {
+        std::uint64_t generation = 0;
+        std::vector<TicketKey> keys;  // [0] encrypts, the rest still decrypt
+    };
+
+    static Shard& shard_for(const unsigned char* id, unsigned int length);
+    static std::shared_ptr<const TicketKeys> ticket_keys();
+
+    // OpenSSL callbacks
+    static int on_new_session(SSL* ssl, SSL_SESSION* session);
+    static SSL_SESSION* on_get_session(SSL* ssl, const unsigned char* id, int length, int* copy);
+    static void on_remove_session(SSL_CTX* ctx, SSL_SESSION* session);
+    static int on_ticket_key(SSL* ssl, unsigned char key_name[16], unsigned char* iv,
+                             EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac, int encrypt);
+
+private:
+    static Shard shards_[kShards];
+    static std::size_t shard_capacity_;
+    static std::chrono::seconds timeout_;
+
+    static std::mutex rotate_mutex_;
+    static std::atomic<std::shared_ptr<const TicketKeys>> ticket_keys_;
+    static std::atomic<std::uint64_t> ticket_generation_;
+
+    static std::atomic<std::uint64_t> full_handshakes_;
+    static std::atomic<std::uint64_t> resumed_handshakes_;
+    static std::atomic<std::uint64_t> cache_hits_;
+    static std::atomic<std::uint64_t> cache_misses_;
+    static std::atomic<std::uint64_t> tickets_accepted_;
+    static std::atomic<std::uint64_t> tickets_rejected_;
+};
+
+#endif // TLS_SESSION_CACHE_H
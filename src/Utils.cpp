@@ -1,8 +1,8 @@
 #include "Utils.h"
-#include <iostream>
+#include "Log.h"
 
 void Utils::loadConfig(const std::string& configPath) {
     // Load configuration from the specified path
-    std::cout << "Loading configuration from: " << configPath << std::endl;
+    Log::info() << "Loading configuration from: " << configPath;
     // Implementation for loading the configuration will go here
 }
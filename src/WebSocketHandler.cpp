@@ -1,11 +1,102 @@
 #include "WebSocketHandler.h"
-#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <vector>
 
-WebSocketHandler::WebSocketHandler() {
-    // Constructor implementation
+namespace {
+
+// Free buffers kept per thread; beyond this they are returned to the heap
+constexpr std::size_t kMaxPooledBuffers = 64;
+
+struct BufferPool {
+    std::size_t size = 0;
+    std::vector<std::unique_ptr<char[]>> free;
+};
+
+thread_local BufferPool buffer_pool;
+
+} // namespace
+
+std::unique_ptr<char[]> acquire_tunnel_buffer(std::size_t size) {
+    if (buffer_pool.size == size && !buffer_pool.free.empty()) {
+        auto buffer = std::move(buffer_pool.free.back());
+        buffer_pool.free.pop_back();
+        return buffer;
+    }
+    return std::unique_ptr<char[]>(new char[size]);
+}
+
+void release_tunnel_buffer(std::unique_ptr<char[]> buffer, std::size_t size) {
+    // A reload may change buffer_size; keep only buffers of the current size
+    if (buffer_pool.size != size) {
+        buffer_pool.free.clear();
+        buffer_pool.size = size;
+    }
+    if (buffer_pool.free.size() < kMaxPooledBuffers) {
+        buffer_pool.free.push_back(std::move(buffer));
+    }
 }
 
-void WebSocketHandler::start() {
-    // Start the WebSocket handler
-    std::cout << "WebSocket handler started." << std::endl;
+TunnelPipe::~TunnelPipe() {
+    if (fds_[0] >= 0) {
+        ::close(fds_[0]);
+        ::close(fds_[1]);
+    }
 }
+
+bool TunnelPipe::open() {
+    if (fds_[0] >= 0) {
+        return true;
+    }
+    return ::pipe2(fds_, O_NONBLOCK | O_CLOEXEC) == 0;
+}
+
+namespace detail {
+
+beast::error_code splice_pump_op::fill_pipe() {
+    if (!pipe.open()) {
+        return beast::error_code(errno, net::error::get_system_category());
+    }
+    for (;;) {
+        ssize_t n = ::splice(from.native_handle(), nullptr, pipe.write_fd(), nullptr,
+                             chunk_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            in_pipe += static_cast<std::size_t>(n);
+            return {};
+        }
+        if (n == 0) {
+            return net::error::eof;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN) {
+            return net::error::would_block;
+        }
+        return beast::error_code(errno, net::error::get_system_category());
+    }
+}
+
+beast::error_code splice_pump_op::drain_pipe() {
+    while (in_pipe > 0) {
+        ssize_t n = ::splice(pipe.read_fd(), nullptr, to.native_handle(), nullptr,
+                             in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            in_pipe -= static_cast<std::size_t>(n);
+            relayed += static_cast<std::uint64_t>(n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            return net::error::would_block;
+        }
+        return n == 0 ? beast::error_code(net::error::broken_pipe)
+                      : beast::error_code(errno, net::error::get_system_category());
+    }
+    return {};
+}
+
+} // namespace detail
@@ -1,10 +1,493 @@
 #ifndef WEBSOCKET_HANDLER_H
 #define WEBSOCKET_HANDLER_H
 
-class WebSocketHandler {
+#include "AdmissionController.h"
+#include "ConfigManager.h"
+#include "TlsSessionCache.h"
+#include <boost/asio/compose.hpp>
+#include <boost/asio/coroutine.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/ssl.hpp>
+#include <boost/beast/websocket.hpp>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <type_traits>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace websocket = beast::websocket;
+namespace net = boost::asio;
+using tcp = boost::asio::ip::tcp;
+
+// Relay buffers for raw tunnels, recycled through a per-thread free list.
+// A tunnel only holds one while bytes are in flight, so idle tunnels cost no
+// buffer memory at all.
+std::unique_ptr<char[]> acquire_tunnel_buffer(std::size_t size);
+void release_tunnel_buffer(std::unique_ptr<char[]> buffer, std::size_t size);
+
+// Pipe used to splice() one direction of a tunnel, created on first use
+class TunnelPipe {
+public:
+    TunnelPipe() = default;
+    ~TunnelPipe();
+
+    TunnelPipe(const TunnelPipe&) = delete;
+    TunnelPipe& operator=(const TunnelPipe&) = delete;
+
+    // Create the pipe if needed, returns false on failure (errno is set)
+    bool open();
+    int read_fd() const { return fds_[0]; }
+    int write_fd() const { return fds_[1]; }
+
+private:
+    int fds_[2] = {-1, -1};
+};
+
+namespace detail {
+
+// Bytes decrypted or buffered inside a TLS stream are invisible to a
+// readiness wait on its socket, so only plain TCP reads wait without a buffer
+template<class Stream>
+constexpr bool waits_before_read = std::is_same_v<Stream, beast::tcp_stream>;
+
+// Decrypted bytes a TLS stream can return without reading more
+template<class Stream>
+std::size_t tls_pending(Stream& stream) {
+    if constexpr (waits_before_read<Stream>) {
+        (void)stream;
+        return 0;
+    } else {
+        return static_cast<std::size_t>(SSL_pending(stream.native_handle()));
+    }
+}
+
+// Copy bytes from one stream to the other until EOF or an error. An idle TLS
+// stream is waited on by reading a single byte (kept for the pump's lifetime,
+// since the op moves between handlers); the rest of that record is then read
+// into a borrowed buffer.
+template<class From, class To>
+struct tunnel_pump_op : net::coroutine {
+    From& from;
+    To& to;
+    std::size_t buffer_size;
+    std::unique_ptr<char[]> buffer;
+    std::size_t pending = 0;
+    std::uint64_t relayed = 0;
+    std::unique_ptr<char> first = nullptr;
+
+    template<class Self>
+    void operator()(Self& self, beast::error_code ec = {}, std::size_t bytes = 0) {
+        BOOST_ASIO_CORO_REENTER(*this) {
+            for (;;) {
+                if (waits_before_read<From>) {
+                    BOOST_ASIO_CORO_YIELD
+                        beast::get_lowest_layer(from).socket().async_wait(
+                            tcp::socket::wait_read, std::move(self));
+                } else {
+                    if (!first) {
+                        first = std::make_unique<char>();
+                    }
+                    BOOST_ASIO_CORO_YIELD
+                        from.async_read_some(net::buffer(first.get(), 1), std::move(self));
+                }
+                if (ec) {
+                    break;
+                }
+
+                buffer = acquire_tunnel_buffer(buffer_size);
+                pending = 0;
+                if (!waits_before_read<From>) {
+                    buffer[pending++] = *first;
+                }
+                if (waits_before_read<From> || tls_pending(from) > 0) {
+                    BOOST_ASIO_CORO_YIELD
+                        from.async_read_some(net::buffer(buffer.get() + pending, buffer_size - pending),
+                                             std::move(self));
+                    if (ec) {
+                        break;
+                    }
+                    pending += bytes;
+                }
+
+                BOOST_ASIO_CORO_YIELD
+                    net::async_write(to, net::buffer(buffer.get(), pending), std::move(self));
+                if (ec) {
+                    break;
+                }
+                relayed += pending;
+                release_tunnel_buffer(std::move(buffer), buffer_size);
+            }
+
+            if (buffer) {
+                release_tunnel_buffer(std::move(buffer), buffer_size);
+            }
+            self.complete(ec, relayed);
+        }
+    }
+};
+
+// Move bytes between two TCP sockets through a pipe with splice(), so they
+// never enter user space
+struct splice_pump_op : net::coroutine {
+    tcp::socket& from;
+    tcp::socket& to;
+    TunnelPipe& pipe;
+    std::size_t chunk_size;
+    std::size_t in_pipe = 0;
+    std::uint64_t relayed = 0;
+
+    template<class Self>
+    void operator()(Self& self, beast::error_code ec = {}) {
+        BOOST_ASIO_CORO_REENTER(*this) {
+            while (!ec) {
+                BOOST_ASIO_CORO_YIELD
+                    from.async_wait(tcp::socket::wait_read, std::move(self));
+                if (ec) {
+                    break;
+                }
+
+                ec = fill_pipe();
+                if (ec == net::error::would_block) {
+                    ec = {};
+                    continue;
+                }
+
+                while (!ec && in_pipe > 0) {
+                    ec = drain_pipe();
+                    if (ec == net::error::would_block) {
+                        ec = {};
+                        BOOST_ASIO_CORO_YIELD
+                            to.async_wait(tcp::socket::wait_write, std::move(self));
+                    }
+                }
+            }
+            self.complete(ec, relayed);
+        }
+    }
+
+    beast::error_code fill_pipe();
+    beast::error_code drain_pipe();
+};
+
+} // namespace detail
+
+// Relay bytes from `from` to `to` until EOF (net::error::eof) or an error.
+// Completes with void(error_code, std::uint64_t bytes).
+template<class From, class To, class Handler>
+auto async_tunnel_pump(From& from, To& to, std::size_t buffer_size, Handler&& handler) {
+    return net::async_compose<Handler, void(beast::error_code, std::uint64_t)>(
+        detail::tunnel_pump_op<From, To>{{}, from, to, buffer_size, nullptr},
+        handler, from, to);
+}
+
+template<class Handler>
+auto async_splice_pump(tcp::socket& from, tcp::socket& to, TunnelPipe& pipe,
+                       std::size_t chunk_size, Handler&& handler) {
+    return net::async_compose<Handler, void(beast::error_code, std::uint64_t)>(
+        detail::splice_pump_op{{}, from, to, pipe, chunk_size},
+        handler, from, to);
+}
+
+// Byte tunnel between an upgraded client connection and its backend, started
+// once the backend's 101 response has been forwarded. Frames pass through
+// untouched. The tunnel owns both connections and the client's admission
+// slot; the ConnectionHandler that set it up is released, so an idle tunnel
+// costs sizeof(WebSocketTunnel) plus two pending waits.
+//
+// With kernel TLS (ktls_tx) bytes for a TLS client go to its socket as they
+// are, so that direction can be spliced too.
+template<class ClientStream>
+class WebSocketTunnel : public std::enable_shared_from_this<WebSocketTunnel<ClientStream>> {
+public:
+    WebSocketTunnel(ClientStream&& client, beast::tcp_stream&& backend,
+                    AdmissionController::Slot slot, const WebSocketConfig& config, bool ktls_tx = false)
+        : client_(std::move(client)), backend_(std::move(backend)), slot_(std::move(slot)),
+          buffer_size_(config.buffer_size),
+          ktls_tx_(ktls_tx && !std::is_same_v<ClientStream, beast::tcp_stream>),
+          splice_to_backend_(config.splice && std::is_same_v<ClientStream, beast::tcp_stream>),
+          splice_to_client_(config.splice && (std::is_same_v<ClientStream, beast::tcp_stream> || ktls_tx_)) {
+        beast::get_lowest_layer(client_).expires_never();
+        backend_.expires_never();
+    }
+
+    ~WebSocketTunnel() {
+        if constexpr (!std::is_same_v<ClientStream, beast::tcp_stream>) {
+            TlsSessionCache::keep_session(client_.native_handle());
+        }
+    }
+
+    // Start relaying. Bytes already read past the handshake on either side
+    // are delivered first.
+    void start(std::string client_pending, std::string backend_pending) {
+        auto self = this->shared_from_this();
+        if (splice_to_backend_ || splice_to_client_) {
+            // splice() must not block on the sockets either
+            beast::error_code ignored;
+            beast::get_lowest_layer(client_).socket().non_blocking(true, ignored);
+            backend_.socket().non_blocking(true, ignored);
+        }
+        if (client_pending.empty()) {
+            pump_to_backend();
+        } else {
+            auto data = std::make_shared<std::string>(std::move(client_pending));
+            net::async_write(backend_, net::buffer(*data),
+                [self, data](beast::error_code ec, std::size_t) {
+                    ec ? self->on_pump_done(ec, true) : self->pump_to_backend();
+                });
+        }
+        if (backend_pending.empty()) {
+            pump_to_client();
+        } else {
+            auto data = std::make_shared<std::string>(std::move(backend_pending));
+            with_client_writer([&](auto& to) {
+                net::async_write(to, net::buffer(*data),
+                    [self, data](beast::error_code ec, std::size_t) {
+                        ec ? self->on_pump_done(ec, false) : self->pump_to_client();
+                    });
+            });
+        }
+    }
+
+private:
+    void pump_to_backend() {
+        auto handler = [self = this->shared_from_this()](beast::error_code ec, std::uint64_t) {
+            self->on_pump_done(ec, true);
+        };
+        if constexpr (std::is_same_v<ClientStream, beast::tcp_stream>) {
+            if (splice_to_backend_) {
+                async_splice_pump(client_.socket(), backend_.socket(), pipes_[0], buffer_size_, handler);
+                return;
+            }
+        }
+        async_tunnel_pump(client_, backend_, buffer_size_, handler);
+    }
+
+    void pump_to_client() {
+        auto handler = [self = this->shared_from_this()](beast::error_code ec, std::uint64_t) {
+            self->on_pump_done(ec, false);
+        };
+        if (splice_to_client_) {
+            async_splice_pump(backend_.socket(), beast::get_lowest_layer(client_).socket(), pipes_[1],
+                              buffer_size_, handler);
+            return;
+        }
+        with_client_writer([&](auto& to) {
+            async_tunnel_pump(backend_, to, buffer_size_, handler);
+        });
+    }
+
+    // Invoke f with the stream bytes for the client are written to
+    template<class F>
+    void with_client_writer(F&& f) {
+        if constexpr (!std::is_same_v<ClientStream, beast::tcp_stream>) {
+            if (ktls_tx_) {
+                f(beast::get_lowest_layer(client_));
+                return;
+            }
+        }
+        f(client_);
+    }
+
+    void on_pump_done(beast::error_code ec, bool to_backend) {
+        beast::error_code ignored;
+        open_pumps_--;
+
+        // A clean EOF is passed on as a half-close so the other direction can
+        // finish; anything else (or a TLS peer, which can't half-close) ends
+        // the tunnel
+        bool half_close = ec == net::error::eof && open_pumps_ > 0 &&
+                          std::is_same_v<ClientStream, beast::tcp_stream>;
+        if (half_close) {
+            auto& peer = to_backend ? backend_.socket() : beast::get_lowest_layer(client_).socket();
+            peer.shutdown(tcp::socket::shutdown_send, ignored);
+            return;
+        }
+
+        beast::get_lowest_layer(client_).socket().close(ignored);
+        backend_.socket().close(ignored);
+    }
+
+private:
+    ClientStream client_;
+    beast::tcp_stream backend_;
+    AdmissionController::Slot slot_;
+    std::size_t buffer_size_;
+    bool ktls_tx_;  // the kernel encrypts what is sent to a TLS client
+    bool splice_to_backend_;
+    bool splice_to_client_;
+    int open_pumps_ = 2;
+    TunnelPipe pipes_[2];  // client->backend, backend->client (splice mode only)
+};
+
+// Frame-aware relay ("frames" websocket_mode). The proxy terminates the
+// WebSocket handshake on both sides and relays whole messages, answering
+// pings itself, keeping idle connections alive with its own pings and passing
+// close frames (with their code and reason) on to the other side.
+template<class ClientStream>
+class WebSocketFrameRelay : public std::enable_shared_from_this<WebSocketFrameRelay<ClientStream>> {
 public:
-    WebSocketHandler();
-    void start();
+    WebSocketFrameRelay(ClientStream&& client, beast::tcp_stream&& backend,
+                        AdmissionController::Slot slot, const WebSocketConfig& config)
+        : client_(std::move(client)), backend_(std::move(backend)), slot_(std::move(slot)),
+          buffer_size_(config.buffer_size) {
+        beast::get_lowest_layer(client_).expires_never();
+        beast::get_lowest_layer(backend_).expires_never();
+        client_.set_option(websocket::stream_base::timeout::suggested(beast::role_type::server));
+        backend_.set_option(websocket::stream_base::timeout::suggested(beast::role_type::client));
+        client_.read_message_max(config.max_message_size);
+        backend_.read_message_max(config.max_message_size);
+    }
+
+    ~WebSocketFrameRelay() {
+        if constexpr (!std::is_same_v<ClientStream, beast::tcp_stream>) {
+            TlsSessionCache::keep_session(client_.next_layer().native_handle());
+        }
+    }
+
+    // Called once with the status the client got: 101 when both handshakes
+    // succeeded, 502 when the backend refused; not at all when the client's
+    // own handshake fails
+    using HandshakeHandler = std::function<void(unsigned status, std::size_t bytes_sent)>;
+
+    // Handshake with the backend using the client's upgrade request (already
+    // rewritten for upstream), then accept the client with its original one
+    template<class UpstreamRequest>
+    void start(const http::request<http::empty_body>& client_request,
+               const UpstreamRequest& upstream_request, HandshakeHandler on_handshake) {
+        client_request_ = client_request;
+        on_handshake_ = std::move(on_handshake);
+
+        // Carry the client's end-to-end headers (cookies, auth, subprotocols,
+        // X-Forwarded-*) over to the backend handshake
+        auto forwarded = std::make_shared<http::fields>();
+        for (const auto& field : upstream_request) {
+            if (field.name() != http::field::host &&
+                field.name() != http::field::sec_websocket_key &&
+                field.name() != http::field::sec_websocket_version &&
+                field.name() != http::field::sec_websocket_extensions) {
+                forwarded->insert(field.name_string(), field.value());
+            }
+        }
+        backend_.set_option(websocket::stream_base::decorator(
+            [forwarded](websocket::request_type& req) {
+                for (const auto& field : *forwarded) {
+                    req.set(field.name_string(), field.value());
+                }
+            }));
+
+        std::string host(upstream_request[http::field::host]);
+        std::string target(upstream_request.target());
+        backend_.async_handshake(backend_response_, host, target,
+            [self = this->shared_from_this()](beast::error_code ec) {
+                self->on_backend_handshake(ec);
+            });
+    }
+
+private:
+    void on_backend_handshake(beast::error_code ec) {
+        if (ec) {
+            // The client is still speaking HTTP; refuse its upgrade
+            http::response<http::string_body> res{http::status::bad_gateway, client_request_.version()};
+            res.set(http::field::server, "ReverseProxy/1.0");
+            res.set(http::field::content_type, "text/plain");
+            res.body() = "WebSocket backend handshake failed";
+            res.keep_alive(false);
+            res.prepare_payload();
+            auto response = std::make_shared<http::response<http::string_body>>(std::move(res));
+            http::async_write(client_.next_layer(), *response,
+                [self = this->shared_from_this(), response](beast::error_code, std::size_t bytes_transferred) {
+                    self->handshake_done(502, bytes_transferred);
+                    self->close();
+                });
+            return;
+        }
+
+        // Agree on whatever subprotocol the backend picked
+        std::string protocol(backend_response_[http::field::sec_websocket_protocol]);
+        client_.set_option(websocket::stream_base::decorator(
+            [protocol](websocket::response_type& res) {
+                res.set(http::field::server, "ReverseProxy/1.0");
+                if (!protocol.empty()) {
+                    res.set(http::field::sec_websocket_protocol, protocol);
+                }
+            }));
+
+        client_.async_accept(client_request_,
+            [self = this->shared_from_this()](beast::error_code ec) {
+                if (ec) {
+                    self->on_handshake_ = nullptr;
+                    self->close();
+                    return;
+                }
+                self->handshake_done(101, 0);
+                self->client_request_ = {};
+                self->relay(self->client_, self->backend_, self->to_backend_);
+                self->relay(self->backend_, self->client_, self->to_client_);
+            });
+    }
+
+    template<class From, class To>
+    void relay(From& from, To& to, beast::flat_buffer& buffer) {
+        from.async_read(buffer,
+            [self = this->shared_from_this(), &from, &to, &buffer](beast::error_code ec, std::size_t) {
+                if (ec == websocket::error::closed) {
+                    // Pass the close handshake on with the peer's code and reason
+                    to.async_close(from.reason(), [self](beast::error_code) {
+                        self->close();
+                    });
+                    return;
+                }
+                if (ec) {
+                    self->close();
+                    return;
+                }
+
+                to.binary(from.got_binary());
+                to.async_write(buffer.data(),
+                    [self, &from, &to, &buffer](beast::error_code ec, std::size_t) {
+                        buffer.consume(buffer.size());
+                        if (ec) {
+                            self->close();
+                            return;
+                        }
+                        // Don't let one large message pin its buffer forever
+                        if (buffer.capacity() > self->buffer_size_) {
+                            buffer.shrink_to_fit();
+                        }
+                        self->relay(from, to, buffer);
+                    });
+            });
+    }
+
+    void handshake_done(unsigned status, std::size_t bytes_sent) {
+        auto handler = std::move(on_handshake_);
+        on_handshake_ = nullptr;
+        if (handler) {
+            handler(status, bytes_sent);
+        }
+    }
+
+    void close() {
+        beast::error_code ignored;
+        beast::get_lowest_layer(client_).socket().close(ignored);
+        beast::get_lowest_layer(backend_).socket().close(ignored);
+    }
+
+private:
+    websocket::stream<ClientStream> client_;
+    websocket::stream<beast::tcp_stream> backend_;
+    AdmissionController::Slot slot_;
+    std::size_t buffer_size_;
+    http::request<http::empty_body> client_request_;
+    HandshakeHandler on_handshake_;
+    websocket::response_type backend_response_;
+    beast::flat_buffer to_backend_;
+    beast::flat_buffer to_client_;
 };
 
 #endif // WEBSOCKET_HANDLER_H
@@ -1,15 +1,5 @@
 #include "ReverseProxy.h"
-#include <iostream>
-#include <signal.h>
-
-ReverseProxy* g_proxy = nullptr;
-
-void signal_handler(int signal) {
-    if (g_proxy) {
-        std::cout << "\nReceived signal " << signal << ", shutting down..." << std::endl;
-        g_proxy->stop();
-    }
-}
+#include "Log.h"
 
 int main(int argc, char* argv[]) {
     std::string config_file = "config/proxy.yaml";
@@ -21,29 +11,24 @@ int main(int argc, char* argv[]) {
     try {
         // Create reverse proxy
         ReverseProxy proxy;
-        g_proxy = &proxy;
-        
-        // Setup signal handlers
-        signal(SIGINT, signal_handler);
-        signal(SIGTERM, signal_handler);
         
         // Initialize with configuration
         if (!proxy.initialize(config_file)) {
-            std::cerr << "Failed to initialize reverse proxy with config: " << config_file << std::endl;
+            Log::error() << "Failed to initialize reverse proxy with config: " << config_file;
             return 1;
         }
         
-        std::cout << "Reverse proxy initialized successfully" << std::endl;
-        std::cout << "Starting reverse proxy..." << std::endl;
+        Log::info() << "Reverse proxy initialized successfully";
+        Log::info() << "Starting reverse proxy...";
         
-        // Run the proxy (this will block until stopped)
+        // Run the proxy (blocks until SIGINT/SIGTERM; SIGHUP reloads the config)
         proxy.run();
         
     } catch (const std::exception& e) {
-        std::cerr << "Error: " << e.what() << std::endl;
+        Log::error() << "Error: " << e.what();
         return 1;
     }
     
-    std::cout << "Reverse proxy shutdown complete" << std::endl;
+    Log::info() << "Reverse proxy shutdown complete";
     return 0;
 }
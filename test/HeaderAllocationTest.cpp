@@ -0,0 +1,160 @@
+// Proves that the header path of a persistent connection stops touching the
+// heap: after a warm-up exchange, parsing a request, rewriting it for the
+// backend, serializing it, doing the same for the response and resetting the
+// HeaderArena must leave the thread's allocation count unchanged. Run by
+// ctest; exits non-zero on failure.
+#include "../src/AllocationCounter.h"
+#include "../src/HeaderArena.h"
+#include "../src/ProxyHeaders.h"
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace net = boost::asio;
+
+namespace {
+
+constexpr int kWarmup = 3;
+constexpr int kRequests = 10000;
+
+constexpr std::string_view kRequest =
+    "GET /api/v1/items?page=2&sort=recent HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://www.example.com/items\r\n"
+    "Cookie: session=3f9a1c0e5b7d4e2a8c6b0f1e3d5a7c9b; theme=dark; consent=1\r\n"
+    "Connection: keep-alive, X-Trace\r\n"
+    "X-Trace: 1\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "X-Forwarded-For: 198.51.100.23\r\n"
+    "\r\n";
+
+constexpr std::string_view kResponse =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 1834\r\n"
+    "Date: Fri, 16 Oct 2026 12:00:00 GMT\r\n"
+    "Server: CppTestBackend\r\n"
+    "Cache-Control: private, max-age=0\r\n"
+    "Connection: keep-alive\r\n"
+    "Keep-Alive: timeout=60\r\n"
+    "\r\n";
+
+const ForwardedInfo kForwarded{"203.0.113.7", "https", "www.example.com"};
+
+using ArenaFields = http::basic_fields<ArenaAllocator<char>>;
+
+// One connection's header state, as ConnectionHandler keeps it
+struct Exchange {
+    HeaderArena arena;
+    std::optional<http::request_parser<http::buffer_body, ArenaAllocator<char>>> request_parser;
+    std::optional<http::request_serializer<http::buffer_body, ArenaFields>> request_serializer;
+    std::optional<http::response_parser<http::buffer_body, ArenaAllocator<char>>> response_parser;
+    std::optional<http::response_serializer<http::buffer_body, ArenaFields>> response_serializer;
+};
+
+template<class Parser>
+bool parse(Parser& parser, std::string_view text) {
+    beast::error_code ec;
+    parser.eager(true);
+    parser.put(net::buffer(text.data(), text.size()), ec);
+    return !ec && parser.is_header_done();
+}
+
+// Walk the serialized header as async_write_header would, without a socket
+template<class Serializer>
+bool serialize_header(Serializer& serializer, std::size_t& bytes) {
+    beast::error_code ec;
+    serializer.split(true);
+    while (!serializer.is_header_done()) {
+        serializer.next(ec, [&](beast::error_code&, const auto& buffers) {
+            std::size_t size = net::buffer_size(buffers);
+            bytes += size;
+            serializer.consume(size);
+        });
+        if (ec) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool run_exchange(Exchange& ex, std::string_view request, std::size_t& bytes) {
+    ex.response_serializer.reset();
+    ex.response_parser.reset();
+    ex.request_serializer.reset();
+    ex.request_parser.reset();
+    ex.arena.reset();
+
+    ex.request_parser.emplace(std::piecewise_construct, std::make_tuple(),
+                              std::make_tuple(ArenaAllocator<char>(ex.arena)));
+    if (!parse(*ex.request_parser, request)) {
+        return false;
+    }
+    auto& req = ex.request_parser->get();
+    prepare_upstream_request(req, kForwarded);
+    req.body().data = nullptr;
+    req.body().more = false;
+    ex.request_serializer.emplace(req);
+    if (!serialize_header(*ex.request_serializer, bytes)) {
+        return false;
+    }
+
+    ex.response_parser.emplace(std::piecewise_construct, std::make_tuple(),
+                               std::make_tuple(ArenaAllocator<char>(ex.arena)));
+    if (!parse(*ex.response_parser, kResponse)) {
+        return false;
+    }
+    auto& res = ex.response_parser->get();
+    prepare_downstream_response(res);
+    res.body().data = nullptr;
+    res.body().more = true;
+    ex.response_serializer.emplace(res);
+    return serialize_header(*ex.response_serializer, bytes);
+}
+
+bool check(const char* name, std::string_view request) {
+    Exchange ex;
+    std::size_t bytes = 0;
+    for (int i = 0; i < kWarmup; ++i) {
+        if (!run_exchange(ex, request, bytes)) {
+            std::fprintf(stderr, "%s: warm-up exchange failed\n", name);
+            return false;
+        }
+    }
+
+    auto before = thread_allocations();
+    for (int i = 0; i < kRequests; ++i) {
+        if (!run_exchange(ex, request, bytes)) {
+            std::fprintf(stderr, "%s: exchange %d failed\n", name, i);
+            return false;
+        }
+    }
+    auto allocations = thread_allocations() - before;
+
+    if (allocations.count != 0) {
+        std::fprintf(stderr, "%s: %llu heap allocations (%llu bytes) in %d requests, expected 0\n", name,
+                     static_cast<unsigned long long>(allocations.count),
+                     static_cast<unsigned long long>(allocations.bytes), kRequests);
+        return false;
+    }
+    std::printf("%s: 0 heap allocations in %d requests\n", name, kRequests);
+    return true;
+}
+
+} // namespace
+
+int main() {
+    // A header bigger than the arena's inline buffer runs on retained
+    // overflow blocks and must not allocate either
+    std::string large(kRequest.substr(0, kRequest.size() - 2));
+    large.append("X-Padding: ").append(4096, 'p').append("\r\n\r\n");
+
+    bool ok = check("inline", kRequest);
+    ok = check("overflow", large) && ok;
+    return ok ? 0 : 1;
+}
@@ -1,54 +1,184 @@
+#include <utility>
 #include <boost/asio.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
+#include <boost/beast/websocket.hpp>
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
 #include <thread>
+#include <vector>
 
-using tcp = boost::asio::ip::tcp;
-namespace http = boost::beast::http;
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace websocket = beast::websocket;
+namespace net = boost::asio;
+using tcp = net::ip::tcp;
 
-void handle_session(tcp::socket socket) {
-    try {
-        boost::beast::flat_buffer buffer;
-        http::request<http::string_body> req;
-        http::read(socket, buffer, req);
-
-        http::response<http::string_body> res{http::status::ok, req.version()};
-        res.set(http::field::server, "CppTestBackend");
-        res.set(http::field::content_type, "text/plain");
-        res.body() = "OK from C++ backend";
-        res.prepare_payload();
-
-        http::write(socket, res);
-        socket.shutdown(tcp::socket::shutdown_send);
-    } catch (const std::exception& e) {
-        std::cerr << "Backend session error: " << e.what() << std::endl;
+// An upgraded connection: echoes every message back until the peer closes.
+// Idle sessions just wait in async_read, for WebSocket footprint benchmarks.
+class WebSocketSession : public std::enable_shared_from_this<WebSocketSession> {
+public:
+    explicit WebSocketSession(beast::tcp_stream&& stream) : ws_(std::move(stream)) {}
+
+    void start(http::request<http::string_body> req) {
+        ws_.set_option(websocket::stream_base::timeout::suggested(beast::role_type::server));
+        ws_.async_accept(req, beast::bind_front_handler(&WebSocketSession::on_accept, shared_from_this()));
+    }
+
+private:
+    void on_accept(beast::error_code ec) {
+        if (!ec) {
+            read();
+        }
+    }
+
+    void read() {
+        ws_.async_read(buffer_, beast::bind_front_handler(&WebSocketSession::on_read, shared_from_this()));
+    }
+
+    void on_read(beast::error_code ec, std::size_t) {
+        if (ec) {
+            return;
+        }
+        ws_.text(ws_.got_text());
+        ws_.async_write(buffer_.data(), beast::bind_front_handler(&WebSocketSession::on_write, shared_from_this()));
     }
+
+    void on_write(beast::error_code ec, std::size_t) {
+        if (ec) {
+            return;
+        }
+        buffer_.consume(buffer_.size());
+        read();
+    }
+
+    websocket::stream<beast::tcp_stream> ws_;
+    beast::flat_buffer buffer_;
+};
+
+// One backend connection, serving requests until the client (or the proxy's
+// pool) closes it. Asynchronous, so a load test holding 100k requests in
+// flight doesn't need 100k threads here.
+class Session : public std::enable_shared_from_this<Session> {
+public:
+    explicit Session(tcp::socket socket) : stream_(std::move(socket)) {}
+
+    void start() { read(); }
+
+private:
+    void read() {
+        req_ = {};
+        http::async_read(stream_, buffer_, req_, beast::bind_front_handler(&Session::on_read, shared_from_this()));
+    }
+
+    void on_read(beast::error_code ec, std::size_t) {
+        if (ec == http::error::end_of_stream) {
+            beast::error_code ignored;
+            stream_.socket().shutdown(tcp::socket::shutdown_send, ignored);
+            return;
+        }
+        if (ec) {
+            if (ec != net::error::connection_reset) {
+                std::cerr << "Backend session error: " << ec.message() << std::endl;
+            }
+            return;
+        }
+
+        // WebSocket upgrades are accepted and the connection becomes an echo session
+        if (websocket::is_upgrade(req_)) {
+            std::make_shared<WebSocketSession>(std::move(stream_))->start(std::move(req_));
+            return;
+        }
+
+        res_ = {http::status::ok, req_.version()};
+        res_.set(http::field::server, "CppTestBackend");
+        res_.set(http::field::content_type, "text/plain");
+        res_.keep_alive(req_.keep_alive());
+        // "/bytes/<n>" answers with n bytes, for body size sweeps
+        std::string_view target(req_.target().data(), req_.target().size());
+        std::string_view path = target.substr(0, target.find('?'));
+        if (path.substr(0, 7) == "/bytes/") {
+            res_.body().assign(std::strtoul(std::string(path.substr(7)).c_str(), nullptr, 10), 'x');
+        } else {
+            res_.body() = "OK from C++ backend";
+        }
+        
+        // "?max-age=<seconds>" makes the response cacheable, with a validator
+        auto max_age = target.find("max-age=");
+        if (max_age != std::string_view::npos) {
+            res_.set(http::field::cache_control, "public, max-age=" + std::string(target.substr(max_age + 8, target.find('&', max_age) - max_age - 8)));
+            res_.set(http::field::etag, "\"" + std::to_string(std::hash<std::string_view>{}(path)) + "\"");
+            res_.set(http::field::last_modified, "Fri, 16 Oct 2026 12:00:00 GMT");
+        }
+        res_.prepare_payload();
+
+        http::async_write(stream_, res_, beast::bind_front_handler(&Session::on_write, shared_from_this()));
+    }
+
+    void on_write(beast::error_code ec, std::size_t) {
+        if (ec) {
+            return;
+        }
+        if (!res_.keep_alive()) {
+            beast::error_code ignored;
+            stream_.socket().shutdown(tcp::socket::shutdown_send, ignored);
+            return;
+        }
+        read();
+    }
+
+    beast::tcp_stream stream_;
+    beast::flat_buffer buffer_;
+    http::request<http::string_body> req_;
+    http::response<http::string_body> res_;
+};
+
+void accept(tcp::acceptor& acceptor) {
+    acceptor.async_accept([&acceptor](beast::error_code ec, tcp::socket socket) {
+        if (ec == net::error::operation_aborted) {
+            return;
+        }
+        if (ec) {
+            std::cerr << "Backend accept error: " << ec.message() << std::endl;
+        } else {
+            std::make_shared<Session>(std::move(socket))->start();
+        }
+        accept(acceptor);
+    });
 }
 
+// TestBackend [port=9999] [threads=hardware threads]
 int main(int argc, char* argv[]) {
     unsigned short port = 9999;
     if (argc >= 2) {
         port = static_cast<unsigned short>(std::stoi(argv[1]));
     }
+    int thread_count = argc >= 3 ? std::stoi(argv[2])
+                                 : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
 
     try {
-        boost::asio::io_context ioc;
-        tcp::acceptor acceptor{ioc, tcp::endpoint(tcp::v4(), port)};
+        net::io_context ioc{thread_count};
+        tcp::acceptor acceptor{ioc};
+        tcp::endpoint endpoint(tcp::v4(), port);
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(net::socket_base::reuse_address(true));
+        acceptor.bind(endpoint);
+        acceptor.listen(net::socket_base::max_listen_connections);
         std::cout << "TestBackend listening on port " << port << std::endl;
 
-        for (;;) {
-            tcp::socket socket{ioc};
-            boost::system::error_code ec;
-            acceptor.accept(socket, ec);
-            if (ec) {
-                if (ec == boost::asio::error::operation_aborted) {
-                    break;
-                }
-                std::cerr << "Backend accept error: " << ec.message() << std::endl;
-                continue;
-            }
-            std::thread(handle_session, std::move(socket)).detach();
+        accept(acceptor);
+        std::vector<std::thread> threads;
+        for (int i = 1; i < thread_count; ++i) {
+            threads.emplace_back([&ioc] { ioc.run(); });
+        }
+        ioc.run();
+        for (auto& thread : threads) {
+            thread.join();
         }
     } catch (const std::exception& e) {
         std::cerr << "TestBackend fatal error: " << e.what() << std::endl;
@@ -56,4 +186,3 @@ int main(int argc, char* argv[]) {
     }
     return 0;
 }
-
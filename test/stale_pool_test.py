@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+"""A request sent on a pooled backend connection that the backend has
+dropped is retried on a fresh connection, and the retried request carries
+the same rewritten header: one X-Forwarded-For entry, not two. Run by ctest:
+
+    stale_pool_test.py <path to ReverseProxy>
+
+The backend answers the first request on every connection with keep-alive,
+then closes the connection without a response when a second request comes,
+which is what a backend that timed the connection out looks like to the
+proxy.
+"""
+
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def read_header(conn):
+    data = b""
+    while b"\r\n\r\n" not in data:
+        chunk = conn.recv(4096)
+        if not chunk:
+            return None
+        data += chunk
+    return data.split(b"\r\n\r\n", 1)[0].decode()
+
+
+class Backend(threading.Thread):
+    def __init__(self, port):
+        super().__init__(daemon=True)
+        self.listener = socket.create_server(("127.0.0.1", port))
+        self.dropped = 0
+
+    def run(self):
+        while True:
+            conn, _ = self.listener.accept()
+            threading.Thread(target=self.serve, args=(conn,), daemon=True).start()
+
+    def serve(self, conn):
+        with conn:
+            header = read_header(conn)
+            if header is None:
+                return
+            forwarded = [line.split(":", 1)[1].strip() for line in header.split("\r\n")[1:]
+                         if line.lower().startswith("x-forwarded-for:")]
+            body = "|".join(forwarded).encode()
+            conn.sendall(b"HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n%s" % (len(body), body))
+            if read_header(conn) is not None:
+                self.dropped += 1
+
+
+def get(port):
+    with socket.create_connection(("127.0.0.1", port), timeout=5) as conn:
+        conn.sendall(b"GET / HTTP/1.1\r\nHost: stale.test\r\nX-Forwarded-For: 198.51.100.23\r\n"
+                     b"Connection: close\r\n\r\n")
+        response = b""
+        while chunk := conn.recv(4096):
+            response += chunk
+    header, body = response.split(b"\r\n\r\n", 1)
+    return header.split(b"\r\n", 1)[0].decode(), body.decode()
+
+
+def main():
+    proxy_binary = sys.argv[1]
+    http_port, https_port, backend_port = free_port(), free_port(), free_port()
+    backend = Backend(backend_port)
+    backend.start()
+
+    with tempfile.TemporaryDirectory(prefix="pristine-test-") as directory:
+        config = os.path.join(directory, "proxy.yaml")
+        with open(config, "w") as f:
+            f.write(f"""http_port: {http_port}
+https_port: {https_port}
+worker_threads: 1
+cert_dir: "{directory}/certs"
+sites:
+  - domain: "stale.test"
+    backend: "127.0.0.1:{backend_port}"
+    tls: off
+""")
+        proxy = subprocess.Popen([proxy_binary, config], stdout=subprocess.DEVNULL,
+                                 env=dict(os.environ, PRISTINE_LOG_LEVEL="error"))
+        try:
+            deadline = time.monotonic() + 10
+            while True:
+                try:
+                    socket.create_connection(("127.0.0.1", http_port), timeout=0.2).close()
+                    break
+                except OSError:
+                    if time.monotonic() > deadline or proxy.poll() is not None:
+                        print("proxy did not start", file=sys.stderr)
+                        return 1
+                    time.sleep(0.05)
+
+            expected = "198.51.100.23, 127.0.0.1"
+            failures = []
+            for attempt in ("first", "retried"):
+                status, forwarded = get(http_port)
+                if status != "HTTP/1.1 200 OK" or forwarded != expected:
+                    failures.append(f"{attempt} request: {status}, X-Forwarded-For {forwarded!r}, "
+                                    f"expected {expected!r}")
+            if backend.dropped != 1:
+                failures.append(f"the pooled connection was not reused and dropped ({backend.dropped} dropped)")
+        finally:
+            proxy.terminate()
+            proxy.wait(timeout=10)
+
+    for failure in failures:
+        print(failure, file=sys.stderr)
+    if not failures:
+        print("retried request on a fresh connection with the header rewritten once")
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())